@@ -17,9 +17,20 @@
 #include <thread>
 #include <mutex>
 #include <regex>
+#include <cstring>
+#include <optional>
+#include <random>
+#include <atomic>
+#include <condition_variable>
+#include <charconv>
+#include <functional>
+#include <variant>
+#include <deque>
 #include <shellapi.h>
 #include <shlobj.h>
 #include <tlhelp32.h> // <--- THE FIX IS HERE
+#include <psapi.h>
+#include <bcrypt.h>
 
 namespace fs = std::filesystem;
 
@@ -28,7 +39,12 @@ namespace jshell {
 // --- Constants ---
 constexpr size_t JSHELL_HISTORY_SIZE = 1000;
 constexpr size_t MAX_PIPE_BUFFER = 65536;
+constexpr size_t IO_BLOCK_SIZE = 65536;
 constexpr DWORD PROCESS_TIMEOUT = 30000; // 30 seconds
+constexpr size_t MAX_TEMPLATE_POSITION = 1024;  // Highest {N} a template may use
+constexpr const char* COMMANDS_LOG_FILE = ".jshell_commands.log";
+constexpr const char* COMMANDS_LOCK_FILE = ".jshell_commands.lock";
+constexpr const char* LEGACY_COMMANDS_FILE = ".jshell_commands";
 
 // --- Core Types ---
 struct Theme {
@@ -39,6 +55,8 @@ struct Theme {
     WORD help_command_color = FOREGROUND_BLUE | FOREGROUND_GREEN | FOREGROUND_INTENSITY;
     WORD success_color = FOREGROUND_GREEN | FOREGROUND_INTENSITY;
     WORD warning_color = FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_INTENSITY;
+    WORD highlight_color = BACKGROUND_RED | BACKGROUND_GREEN;
+    WORD status_color = BACKGROUND_BLUE | BACKGROUND_GREEN | BACKGROUND_RED;
 };
 
 struct Configuration {
@@ -48,6 +66,23 @@ struct Configuration {
     bool save_history = true;
     size_t max_history = JSHELL_HISTORY_SIZE;
     std::string history_file = ".jshell_history";
+    
+    // Performance tuning
+    size_t max_workers = 0;                   // Worker pool size; 0 = one per hardware thread
+    size_t pipe_buffer_size = MAX_PIPE_BUFFER;
+    size_t completion_cache_size = 256;       // Cached PATH completion prefixes; 0 disables
+    size_t command_hash_ttl = 30;             // Seconds a PATH lookup is reused; 0 disables
+    size_t io_block_size = IO_BLOCK_SIZE;
+    size_t parallel_copy_threshold = 64;      // Files in a cp -r before it goes parallel; 0 disables
+    bool profile = false;                     // Report the time taken by every command line
+    bool sync_on_save = false;                // Flush editor saves to disk before reporting them
+    bool terminate_upstream = false;          // A pipeline stage that exits ends the processes feeding it
+    bool auto_pager = false;                  // Page builtin output longer than the screen
+    size_t output_history_size = 8 << 20;     // Bytes of recent command output kept for `out`; 0 disables
+    bool capture_external_output = false;     // Read programs' output through the shell so `out` has it too
+    bool transcript = false;                  // Log commands and their output to transcript.jslog
+    size_t transcript_max_size = 16 << 20;    // Bytes before the transcript is rotated
+    size_t transcript_files = 4;              // Rotated transcripts kept
 };
 
 struct Job {
@@ -63,25 +98,82 @@ struct Job {
           is_running(true), is_stopped(false), job_id(id) {}
 };
 
+// One piece of a compiled command template: literal text or a placeholder
+struct TemplateSegment {
+    enum class Kind { Literal, Positional, Named, AllArgs, Each };
+    
+    Kind kind;
+    std::string text;          // Literal text or parameter name
+    size_t index = 0;          // Argument index for {0}, {1}, ...
+    bool has_variables = false; // Literal needs $VAR substitution at expansion time
+};
+
+// A template argument; its segments are concatenated into one argv entry
+using TemplateToken = std::vector<TemplateSegment>;
+
+// A pre-parsed pipeline stage of a template
+struct TemplateStage {
+    std::vector<TemplateToken> args;
+    TemplateToken input_file;
+    TemplateToken output_file;
+    TemplateToken error_file;
+    bool append_output = false;
+    bool append_error = false;
+    bool background = false;
+};
+
 struct RegisteredCommand {
     std::string name;
     std::string template_cmd;
     std::string description;
+    std::string options;  // Persisted register flags, e.g. "--cache --inputs={0}"
     std::vector<std::string> param_names;
     std::map<std::string, std::string> default_values;
+    std::vector<TemplateStage> stages;
+    bool fan_out = false;  // Template uses {each}: one invocation per argument
+    std::string error;     // Why the template is invalid, or empty
+    
+    // Memoization (register --cache)
+    bool cache = false;
+    std::vector<TemplateToken> cache_inputs;
+    std::vector<TemplateToken> cache_outputs;
     
     // Default constructor
     RegisteredCommand() = default;
     
     // Parameterized constructor
-    RegisteredCommand(const std::string& n, const std::string& tmpl, const std::string& desc)
-        : name(n), template_cmd(tmpl), description(desc) {}
+    RegisteredCommand(const std::string& n, const std::string& tmpl, const std::string& desc,
+                      const std::string& opts = "")
+        : name(n), template_cmd(tmpl), description(desc), options(opts) {
+        compile_template();
+    }
+    
+    // Parse the template and options once into stages of placeholder tokens
+    void compile_template();
+};
+
+struct Command {
+    std::vector<std::string> args;
+    std::string input_file;
+    std::string output_file;
+    std::string error_file;
+    bool append_output = false;
+    bool append_error = false;
+    bool background = false;
+};
+
+// An alias, parsed once into pipeline stages when it is defined
+struct Alias {
+    std::string text;               // As typed, for display
+    std::vector<Command> pipeline;
+    size_t id = 0;                  // Bit in the cycle check during expansion
 };
 
 struct ShellState {
     std::vector<std::string> history;
     size_t history_index = 0;
-    std::map<std::string, std::string> aliases;
+    std::map<std::string, Alias> aliases;
+    size_t next_alias_id = 0;
     std::map<std::string, std::string> variables;
     std::vector<std::unique_ptr<Job>> jobs;
     int next_job_id = 1;
@@ -92,6 +184,27 @@ struct ShellState {
     std::string previous_directory;
     std::map<std::string, RegisteredCommand> registered_commands;
     
+    // How far this shell has replayed the registered-command log
+    bool commands_loaded = false;
+    uint64_t commands_log_generation = 0;
+    uint64_t commands_log_offset = 0;
+    uint64_t commands_log_size = 0;
+    uint64_t commands_log_mtime = 0;
+    size_t commands_log_records = 0;
+    bool commands_log_damaged = false;  // Present but unreadable or not a log
+    std::thread compaction_thread;
+    
+    // PATH executables matching a completion prefix, and when they were listed
+    std::map<std::string, std::pair<std::vector<std::string>, std::chrono::steady_clock::time_point>> completion_cache;
+    
+    // Change notification on shell_directory and the last seen stamps of the
+    // files it reloads between prompts
+    HANDLE config_watch = INVALID_HANDLE_VALUE;
+    uint64_t config_size = 0;
+    uint64_t config_mtime = 0;
+    uint64_t rc_size = 0;
+    uint64_t rc_mtime = 0;
+    
     ShellState() {
         char* appdata = nullptr;
         size_t len;
@@ -108,16 +221,11 @@ struct ShellState {
             shell_directory = fs::current_path();
         }
     }
-};
-
-struct Command {
-    std::vector<std::string> args;
-    std::string input_file;
-    std::string output_file;
-    std::string error_file;
-    bool append_output = false;
-    bool append_error = false;
-    bool background = false;
+    
+    ~ShellState() {
+        if (compaction_thread.joinable()) compaction_thread.join();
+        if (config_watch != INVALID_HANDLE_VALUE) FindCloseChangeNotification(config_watch);
+    }
 };
 
 struct Builtin {
@@ -125,8 +233,34 @@ struct Builtin {
     int (*func)(ShellState&, std::span<const char*>);
     const char* description;
     const char* usage;
+    unsigned flags = 0;
 };
 
+// Builtin flags: whether a builtin reads and writes records (see Record Pipelines)
+constexpr unsigned RECORDS_IN = 1;
+constexpr unsigned RECORDS_OUT = 2;
+constexpr unsigned PAGEABLE = 4;  // Output may be long and needs no keyboard; see auto_pager
+constexpr unsigned CHANGES_STATE = 8;  // Writes ShellState, so never runs as a stage of a longer pipeline
+
+class RecordChannel;
+class ConsoleWriter;
+
+// Read end of the pipe feeding the builtin running on this thread, if any
+thread_local HANDLE builtin_stdin = INVALID_HANDLE_VALUE;
+// Where std::cout goes for a builtin writing into a pipeline stage, if not the console
+thread_local ConsoleWriter* builtin_stdout = nullptr;
+// Record channels joining this thread's builtin to its neighbours, if any
+thread_local RecordChannel* record_input = nullptr;
+thread_local RecordChannel* record_output = nullptr;
+// Console color last set on this thread (see ConsoleOutput::color)
+thread_local std::optional<WORD> thread_color;
+// Set while the server runs a call: background jobs get NUL rather than the
+// call's pipes, which they would otherwise hold open after it ends
+bool detach_background_jobs = false;
+// Set on the threads of a multi-stage pipeline, whose builtins run side by
+// side and may only read ShellState (see CHANGES_STATE)
+thread_local bool pipeline_stage = false;
+
 // --- Utility Classes ---
 class ScopedHandle {
 private:
@@ -170,2099 +304,6606 @@ public:
     operator bool() const { return handle_ != INVALID_HANDLE_VALUE; }
 };
 
-class ColorGuard {
-private:
-    HANDLE console_;
-    WORD original_attrs_;
+// --- Output History ---
+// What interactive commands wrote to the console, for `out`. The newest entry
+// is kept as captured; older ones are LZ-compressed when the next command
+// starts, so capture itself is a copy into a string. A command that writes
+// more than the configured size keeps its last bytes in a ring of that size,
+// and entries are dropped oldest first as the total passes it.
+
+// LZ77 in the LZ4 block layout: a token holding the literal count (high
+// nibble) and match length - 4 (low nibble), each extended by 255-bytes
+// when 15, the literals, then a 16-bit match offset. The last sequence has
+// literals only.
+std::string lz_compress(std::string_view input) {
+    constexpr int HASH_BITS = 14;
+    constexpr size_t MIN_MATCH = 4;
+    
+    std::string output;
+    output.reserve(input.size() / 2 + 16);
+    std::vector<uint32_t> table(size_t(1) << HASH_BITS, 0);
+    
+    auto read32 = [&](size_t pos) {
+        uint32_t value;
+        std::memcpy(&value, input.data() + pos, sizeof(value));
+        return value;
+    };
+    auto put_length = [&](size_t length) {
+        for (; length >= 255; length -= 255) output += static_cast<char>(255);
+        output += static_cast<char>(length);
+    };
+    auto put_sequence = [&](size_t anchor, size_t literals, size_t match, size_t offset) {
+        size_t match_code = match ? match - MIN_MATCH : 0;
+        output += static_cast<char>((std::min<size_t>(literals, 15) << 4) | std::min<size_t>(match_code, 15));
+        if (literals >= 15) put_length(literals - 15);
+        output.append(input.data() + anchor, literals);
+        if (!match) return;
+        output += static_cast<char>(offset & 0xff);
+        output += static_cast<char>(offset >> 8);
+        if (match_code >= 15) put_length(match_code - 15);
+    };
     
-public:
-    ColorGuard(WORD new_attrs) : console_(GetStdHandle(STD_OUTPUT_HANDLE)) {
-        CONSOLE_SCREEN_BUFFER_INFO info;
-        if (GetConsoleScreenBufferInfo(console_, &info)) {
-            original_attrs_ = info.wAttributes;
-            SetConsoleTextAttribute(console_, new_attrs);
+    size_t anchor = 0;
+    size_t pos = 0;
+    if (input.size() > MIN_MATCH) {
+        size_t limit = input.size() - MIN_MATCH;
+        while (pos < limit) {
+            uint32_t sequence = read32(pos);
+            uint32_t slot = (sequence * 2654435761u) >> (32 - HASH_BITS);
+            size_t candidate = table[slot];
+            table[slot] = static_cast<uint32_t>(pos);
+            
+            if (candidate < pos && pos - candidate <= 0xffff && read32(candidate) == sequence) {
+                size_t match = MIN_MATCH;
+                while (pos + match < input.size() && input[candidate + match] == input[pos + match]) match++;
+                put_sequence(anchor, pos - anchor, match, pos - candidate);
+                pos += match;
+                anchor = pos;
+            } else {
+                // Skip faster through data that does not compress
+                pos += 1 + ((pos - anchor) >> 6);
+            }
         }
     }
-    
-    ~ColorGuard() {
-        SetConsoleTextAttribute(console_, original_attrs_);
-    }
-};
-
-// --- Forward Declarations ---
-int cd(ShellState&, std::span<const char*>);
-int help(ShellState&, std::span<const char*>);
-int exit_shell(ShellState&, std::span<const char*>);
-int pwd(ShellState&, std::span<const char*>);
-int env(ShellState&, std::span<const char*>);
-int set_var(ShellState&, std::span<const char*>);
-int unset_var(ShellState&, std::span<const char*>);
-int history(ShellState&, std::span<const char*>);
-int source(ShellState&, std::span<const char*>);
-int ls(ShellState&, std::span<const char*>);
-int cat(ShellState&, std::span<const char*>);
-int echo(ShellState&, std::span<const char*>);
-int mkdir(ShellState&, std::span<const char*>);
-int rm(ShellState&, std::span<const char*>);
-int cls(ShellState&, std::span<const char*>);
-int alias(ShellState&, std::span<const char*>);
-int unalias(ShellState&, std::span<const char*>);
-int touch(ShellState&, std::span<const char*>);
-int cp(ShellState&, std::span<const char*>);
-int mv(ShellState&, std::span<const char*>);
-int grep(ShellState&, std::span<const char*>);
-int find_files(ShellState&, std::span<const char*>);
-int which(ShellState&, std::span<const char*>);
-int ps(ShellState&, std::span<const char*>);
-int kill_proc(ShellState&, std::span<const char*>);
-int jobs(ShellState&, std::span<const char*>);
-int fg(ShellState&, std::span<const char*>);
-int bg(ShellState&, std::span<const char*>);
-int code(ShellState&, std::span<const char*>);
-int edit(ShellState&, std::span<const char*>);
-int vi(ShellState&, std::span<const char*>);
-int register_cmd(ShellState&, std::span<const char*>);
-int unregister_cmd(ShellState&, std::span<const char*>);
-int list_registered(ShellState&, std::span<const char*>);
-int version(ShellState&, std::span<const char*>);
-
-// --- Built-ins Table ---
-const std::vector<Builtin> builtins = {
-    {"cd",      cd,         "Change directory", "cd [directory|~|..|/]"},
-    {"help",    help,       "Display help message", "help [command]"},
-    {"exit",    exit_shell, "Exit the shell", "exit [code]"},
-    {"pwd",     pwd,        "Print working directory", "pwd"},
-    {"env",     env,        "List environment variables", "env [variable]"},
-    {"set",     set_var,    "Set variable", "set <name> <value>"},
-    {"unset",   unset_var,  "Unset variable", "unset <name>"},
-    {"history", history,    "Show command history", "history [count]"},
-    {"source",  source,     "Execute script file", "source <file>"},
-    {"ls",      ls,         "List directory contents", "ls [-la] [path]"},
-    {"dir",     ls,         "Alias for ls", "dir [-la] [path]"},
-    {"cat",     cat,        "Display file contents", "cat <file> [files...]"},
-    {"echo",    echo,       "Display text", "echo [text...]"},
-    {"mkdir",   mkdir,      "Create directory", "mkdir <directory>"},
-    {"rm",      rm,         "Remove files/directories", "rm [-rf] <path>"},
-    {"del",     rm,         "Alias for rm", "del [-rf] <path>"},
-    {"cls",     cls,        "Clear screen", "cls"},
-    {"clear",   cls,        "Alias for cls", "clear"},
-    {"alias",   alias,      "Create command alias", "alias [name='command']"},
-    {"unalias", unalias,    "Remove alias", "unalias <name>"},
-    {"touch",   touch,      "Create empty file", "touch <file>"},
-    {"cp",      cp,         "Copy files", "cp <source> <destination>"},
-    {"copy",    cp,         "Alias for cp", "copy <source> <destination>"},
-    {"mv",      mv,         "Move/rename files", "mv <source> <destination>"},
-    {"move",    mv,         "Alias for mv", "move <source> <destination>"},
-    {"grep",    grep,       "Search text patterns", "grep <pattern> <file>"},
-    {"find",    find_files, "Find files", "find <path> <pattern>"},
-    {"which",   which,      "Locate command", "which <command>"},
-    {"ps",      ps,         "List processes", "ps"},
-    {"kill",    kill_proc,  "Kill process", "kill <pid>"},
-    {"jobs",    jobs,       "List active jobs", "jobs"},
-    {"fg",      fg,         "Bring job to foreground", "fg [job_id]"},
-    {"bg",      bg,         "Send job to background", "bg [job_id]"},
-    {"open",    code,       "Open applications/editors", "open [app] [path]"},
-    {"edit",    edit,       "Edit file with external editor", "edit <file>"},
-    {"vi",      vi,         "Vim-like built-in editor", "vi <file>"},
-    {"nano",    vi,         "Alias for vi", "nano <file>"},
-    {"register", register_cmd, "Register custom command", "register <name> <template> [description]"},
-    {"unreg",   unregister_cmd, "Unregister command", "unreg <name>"},
-    {"reglist", list_registered, "List registered commands", "reglist"},
-    {"version", version,    "Show shell version", "version"},
-};
-
-// --- Utility Functions ---
-std::string get_home_directory() {
-    char* path = nullptr;
-    size_t len;
-    if (_dupenv_s(&path, &len, "USERPROFILE") == 0 && path) {
-        std::string home = path;
-        free(path);
-        return home;
-    }
-    return "";
+    put_sequence(anchor, input.size() - anchor, 0, 0);
+    return output;
 }
 
-std::string expand_path(const std::string& path) {
-    if (path.empty()) return path;
+// Inverse of lz_compress; nullopt if the data is damaged
+std::optional<std::string> lz_decompress(std::string_view input, size_t size) {
+    std::string output;
+    output.reserve(size);
+    size_t pos = 0;
+    
+    auto get_length = [&](size_t length) -> std::optional<size_t> {
+        if (length < 15) return length;
+        while (true) {
+            if (pos >= input.size()) return std::nullopt;
+            unsigned char extra = static_cast<unsigned char>(input[pos++]);
+            length += extra;
+            if (extra != 255) return length;
+        }
+    };
     
-    if (path[0] == '~') {
-        std::string home = get_home_directory();
-        if (!home.empty()) {
-            return home + (path.length() > 1 ? path.substr(1) : "");
+    while (pos < input.size()) {
+        unsigned char token = static_cast<unsigned char>(input[pos++]);
+        auto literals = get_length(token >> 4);
+        if (!literals || *literals > input.size() - pos) return std::nullopt;
+        output.append(input.data() + pos, *literals);
+        pos += *literals;
+        if (pos == input.size()) break;
+        
+        if (input.size() - pos < 2) return std::nullopt;
+        size_t offset = static_cast<unsigned char>(input[pos]) | (static_cast<unsigned char>(input[pos + 1]) << 8);
+        pos += 2;
+        auto match = get_length(token & 15);
+        if (!match || offset == 0 || offset > output.size()) return std::nullopt;
+        
+        // A match closer than its length overlaps the text it produces
+        size_t from = output.size() - offset;
+        size_t length = *match + 4;
+        if (offset >= length) {
+            output.append(output, from, length);
+        } else {
+            for (size_t i = 0; i < length; ++i) output += output[from + i];
         }
     }
     
-    return path;
+    if (output.size() != size) return std::nullopt;
+    return output;
 }
 
-std::string get_current_directory_prompt() {
-    try {
-        std::string home = get_home_directory();
-        std::string current = fs::current_path().string();
-        if (!home.empty() && current.starts_with(home)) {
-            return "~" + current.substr(home.length());
+class OutputHistory {
+public:
+    struct Entry {
+        std::string command;
+        std::string data;       // Compressed unless it is the newest entry
+        size_t size = 0;        // Bytes captured
+        size_t stored = 0;      // Bytes held in memory
+        bool compressed = false;
+        bool truncated = false; // Only the end of the output was kept
+    };
+    
+private:
+    std::deque<Entry> entries_;
+    Entry current_;
+    size_t head_ = 0;    // Once current_ is truncated, its data is a ring starting here
+    size_t capacity_ = 0;
+    size_t stored_ = 0;  // Bytes held by entries_
+    std::atomic<bool> capturing_{false};
+    mutable std::mutex mutex_;
+    
+    // Drop the oldest entries until they and reserve more bytes fit
+    void evict(size_t reserve = 0) {
+        while (!entries_.empty() && stored_ + reserve > capacity_) {
+            stored_ -= entries_.front().stored;
+            entries_.pop_front();
         }
-        return current;
-    } catch (const fs::filesystem_error&) {
-        return "unknown";
     }
-}
-
-std::vector<std::string> get_path_directories() {
-    std::vector<std::string> paths;
-    char* path_env = nullptr;
-    size_t len;
     
-    if (_dupenv_s(&path_env, &len, "PATH") == 0 && path_env) {
-        std::string path_str = path_env;
-        free(path_env);
+public:
+    // Total bytes kept; 0 turns capture off and forgets what was kept
+    void set_capacity(size_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        capacity_ = bytes;
         
-        std::stringstream ss(path_str);
-        std::string path;
-        while (std::getline(ss, path, ';')) {
-            if (!path.empty()) {
-                paths.push_back(path);
-            }
+        // Restart a running capture's ring at the new size
+        std::string& data = current_.data;
+        if (head_ != 0) std::rotate(data.begin(), data.begin() + head_, data.end());
+        head_ = 0;
+        if (data.size() > capacity_) {
+            data.erase(0, data.size() - capacity_);
+            current_.truncated = true;
         }
+        evict();
     }
     
-    return paths;
-}
-
-std::string find_executable(const std::string& name) {
-    if (name.empty()) return "";
-    
-    // If it contains path separators, check as-is
-    if (name.find('/') != std::string::npos || name.find('\\') != std::string::npos) {
-        if (fs::exists(name) && fs::is_regular_file(name)) {
-            return name;
+    void begin(const std::string& command) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (capacity_ == 0) return;
+        
+        // Pack the last entry before a new one starts filling memory
+        if (!entries_.empty() && !entries_.back().compressed) {
+            Entry& previous = entries_.back();
+            std::string packed = lz_compress(previous.data);
+            stored_ -= previous.data.size();
+            if (packed.size() < previous.data.size()) {
+                previous.data = std::move(packed);
+                previous.compressed = true;
+            }
+            previous.data.shrink_to_fit();
+            previous.stored = previous.data.size();
+            stored_ += previous.stored;
         }
-        return "";
+        current_ = Entry{command};
+        head_ = 0;
+        capturing_ = true;
     }
     
-    // Common executable extensions on Windows
-    std::vector<std::string> extensions = {"", ".exe", ".bat", ".cmd", ".com"};
+    bool capturing() const { return capturing_; }
     
-    // Check current directory first
-    for (const auto& ext : extensions) {
-        std::string full_path = name + ext;
-        if (fs::exists(full_path) && fs::is_regular_file(full_path)) {
-            return fs::absolute(full_path).string();
+    void append(const char* text, size_t count) {
+        if (!capturing_.load(std::memory_order_relaxed)) return;
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!capturing_) return;
+        
+        std::string& data = current_.data;
+        if (data.size() < capacity_) {
+            size_t take = std::min(count, capacity_ - data.size());
+            if (data.size() + take > data.capacity()) {  // Grow as usual, but never past capacity_
+                data.reserve(std::min(capacity_, std::max(data.capacity() * 2, data.size() + take)));
+            }
+            data.append(text, take);
+            text += take;
+            count -= take;
+            evict(data.size());
+        }
+        if (count == 0) return;
+        
+        // Full: keep the last capacity_ bytes by overwriting the oldest in place
+        current_.truncated = true;
+        if (count >= capacity_) {
+            data.assign(text + count - capacity_, capacity_);
+            head_ = 0;
+            return;
         }
+        size_t first = std::min(count, capacity_ - head_);
+        std::memcpy(data.data() + head_, text, first);
+        std::memcpy(data.data(), text + first, count - first);
+        head_ = (head_ + count) % capacity_;
     }
     
-    // Check PATH directories
-    auto paths = get_path_directories();
-    for (const auto& dir : paths) {
-        for (const auto& ext : extensions) {
-            fs::path full_path = fs::path(dir) / (name + ext);
-            if (fs::exists(full_path) && fs::is_regular_file(full_path)) {
-                return full_path.string();
-            }
+    void end() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!capturing_) return;
+        capturing_ = false;
+        
+        std::string& data = current_.data;
+        if (head_ != 0) std::rotate(data.begin(), data.begin() + head_, data.end());
+        head_ = 0;
+        evict(data.size());
+        current_.size = current_.data.size();
+        current_.data.shrink_to_fit();
+        current_.stored = current_.data.size();
+        stored_ += current_.stored;
+        entries_.push_back(std::move(current_));
+        current_ = Entry{};
+        evict();
+    }
+    
+    // Command and output of the back-th most recent entry, 1 being the last
+    std::optional<std::pair<Entry, std::string>> get(size_t back) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (back == 0 || back > entries_.size()) return std::nullopt;
+        const Entry& entry = entries_[entries_.size() - back];
+        Entry info{entry.command, {}, entry.size, entry.stored, entry.compressed, entry.truncated};
+        if (!entry.compressed) return std::pair{info, entry.data};
+        auto text = lz_decompress(entry.data, entry.size);
+        if (!text) return std::nullopt;
+        return std::pair{info, std::move(*text)};
+    }
+    
+    // Commands, sizes and stored sizes, oldest first
+    std::vector<Entry> list() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::vector<Entry> result;
+        for (const auto& entry : entries_) {
+            result.push_back({entry.command, {}, entry.size, entry.stored, entry.compressed, entry.truncated});
         }
+        return result;
     }
     
-    return "";
-}
+    size_t stored() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return stored_;
+    }
+};
 
-std::string substitute_variables(const std::string& text, const ShellState& state) {
-    std::string result = text;
+OutputHistory output_history;
+
+// Records console text in the session transcript; see Session Transcript
+void log_output(bool error_stream, const char* text, size_t count);
+
+// std::cout and std::cerr each write through a ConsoleWriter, which buffers
+// according to where the output goes. On a console, text goes out at a line
+// end once OUTPUT_FLUSH_LINES lines are waiting, so slow output still shows
+// line by line (see below) while bursts are batched. Pipes and files get
+// OUTPUT_BLOCK_SIZE blocks. In both cases a background flusher writes out
+// anything older than OUTPUT_FLUSH_INTERVAL, which keeps progress output
+// moving, and explicit flushes (the prompt, reads from std::cin, process
+// launches) write everything at once.
+// A color change is not a console call but state: it goes out as an ANSI SGR
+// sequence in front of the next text, so a colored listing still costs one
+// write per block. Consoles without VT support get SetConsoleTextAttribute
+// at the same points, and files and pipes never get color.
+constexpr size_t OUTPUT_BUFFER_SIZE = 64 * 1024;
+constexpr size_t OUTPUT_BLOCK_SIZE = 256 * 1024;
+constexpr size_t OUTPUT_FLUSH_LINES = 64;
+constexpr auto OUTPUT_FLUSH_INTERVAL = std::chrono::milliseconds(50);
+
+// SGR sequence selecting console attributes
+std::string sgr_sequence(WORD attributes) {
+    if (attributes == Theme().default_color) return "\x1b[0m";
     
-    // Replace ${VAR} and $VAR patterns
-    std::regex var_pattern(R"(\$\{([^}]+)\}|\$([A-Za-z_][A-Za-z0-9_]*))");
-    std::smatch match;
+    // Console bits are BGR, ANSI color numbers are RGB-ordered from the low bit
+    auto ansi = [](bool red, bool green, bool blue) { return (red ? 1 : 0) | (green ? 2 : 0) | (blue ? 4 : 0); };
+    int foreground = ansi(attributes & FOREGROUND_RED, attributes & FOREGROUND_GREEN, attributes & FOREGROUND_BLUE);
+    int background = ansi(attributes & BACKGROUND_RED, attributes & BACKGROUND_GREEN, attributes & BACKGROUND_BLUE);
     
-    std::string temp_result;
-    auto search_start = result.cbegin();
+    std::string sequence = std::format("\x1b[0;{}", (attributes & FOREGROUND_INTENSITY ? 90 : 30) + foreground);
+    if (attributes & (BACKGROUND_RED | BACKGROUND_GREEN | BACKGROUND_BLUE | BACKGROUND_INTENSITY)) {
+        sequence += std::format(";{}", (attributes & BACKGROUND_INTENSITY ? 100 : 40) + background);
+    }
+    return sequence + "m";
+}
 
-    while (std::regex_search(search_start, result.cend(), match, var_pattern)) {
-        temp_result.append(match.prefix().first, match.prefix().second);
-        
-        std::string var_name = match[1].str();
-        if (var_name.empty()) var_name = match[2].str();
-        
-        std::string value;
-        
-        // Check shell variables first
-        if (state.variables.contains(var_name)) {
-            value = state.variables.at(var_name);
-        } else {
-            // Check environment variables
-            char* env_val = nullptr;
-            size_t len;
-            if (_dupenv_s(&env_val, &len, var_name.c_str()) == 0 && env_val) {
-                value = env_val;
-                free(env_val);
+class ConsoleWriter : public std::streambuf {
+public:
+    enum class Mode { Plain, Ansi, Attributes };
+    
+private:
+    HANDLE handle_ = INVALID_HANDLE_VALUE;
+    Mode mode_ = Mode::Plain;
+    bool line_batches_ = false;  // Console: flush at line ends; otherwise whole blocks
+    size_t capacity_ = OUTPUT_BLOCK_SIZE;
+    std::chrono::steady_clock::time_point pending_since_;
+    bool colors_ = true;
+    WORD wanted_ = Theme().default_color;
+    WORD own_shown_ = Theme().default_color;
+    WORD* shown_ = &own_shown_;  // Colors last sent; shared by writers on the same console
+    std::string buffer_;
+    size_t lines_ = 0;
+    bool routed_ = false;  // Honours builtin_stdout
+    bool broken_ = false;  // The reader of the pipe has gone; output is dropped
+    bool captured_ = false;  // Text is also recorded in output_history and the transcript
+    bool error_stream_ = false;
+    
+    // Auto-pager: output is held back until it fills hold_rows_ screen rows
+    int hold_rows_ = 0;
+    int hold_cols_ = 0;
+    int held_rows_ = 0;
+    int held_column_ = 0;
+    std::function<HANDLE()> handoff_;
+    mutable std::recursive_mutex mutex_;
+    
+    void write_out() {
+        size_t done = 0;
+        while (done < buffer_.size()) {
+            DWORD written = 0;
+            if (!WriteFile(handle_, buffer_.data() + done, static_cast<DWORD>(buffer_.size() - done), &written, nullptr) ||
+                written == 0) {
+                DWORD error = GetLastError();
+                broken_ = error == ERROR_NO_DATA || error == ERROR_BROKEN_PIPE;
+                break;
             }
+            done += written;
+        }
+        buffer_.clear();
+        lines_ = 0;
+    }
+    
+    // Output outgrew the screen: send it, and everything after it, to the
+    // pipe handoff_ returns. Without one it goes to the console after all.
+    void hand_off() {
+        hold_rows_ = 0;
+        HANDLE pipe = handoff_();
+        if (pipe == INVALID_HANDLE_VALUE) {
+            write_out();
+            return;
         }
         
-        temp_result.append(value);
-        search_start = match.suffix().first;
+        if (mode_ == Mode::Ansi) {
+            // The pager shows text, not escape sequences
+            std::string text;
+            for (size_t i = 0; i < buffer_.size(); ++i) {
+                if (buffer_[i] == '\x1b' && i + 1 < buffer_.size() && buffer_[i + 1] == '[') {
+                    i = std::min(buffer_.find('m', i), buffer_.size() - 1);
+                } else {
+                    text += buffer_[i];
+                }
+            }
+            buffer_ = std::move(text);
+        }
+        handle_ = pipe;
+        mode_ = Mode::Plain;
+        line_batches_ = false;
+        capacity_ = OUTPUT_BLOCK_SIZE;
+        write_out();
     }
-    temp_result.append(search_start, result.cend());
     
-    return temp_result;
-}
-
-std::vector<std::string> get_completions(const std::string& prefix, const ShellState& state) {
-    std::vector<std::string> completions;
-    fs::path current_path = ".";
-    std::string search_prefix = prefix;
-
-    // Handle path completion
-    if (auto pos = prefix.find_last_of("/\\"); pos != std::string::npos) {
-        current_path = prefix.substr(0, pos + 1);
-        search_prefix = prefix.substr(pos + 1);
+    void send_color() {
+        if (!colors_ || mode_ == Mode::Plain || wanted_ == *shown_) return;
+        if (mode_ == Mode::Ansi) {
+            buffer_ += sgr_sequence(wanted_);
+        } else {
+            write_out();
+            SetConsoleTextAttribute(handle_, wanted_);
+        }
+        *shown_ = wanted_;
     }
     
-    try {
-        current_path = expand_path(current_path.string());
-        if (fs::exists(current_path) && fs::is_directory(current_path)) {
-            for (const auto& entry : fs::directory_iterator(current_path)) {
-                std::string filename = entry.path().filename().string();
-                if (filename.starts_with(search_prefix)) {
-                    std::string completion = (current_path.string() == "." ? "" : current_path.string()) + filename;
-                    if (entry.is_directory()) completion += "\\"; // Use backslash for Windows
-                    completions.push_back(completion);
+protected:
+    int_type overflow(int_type ch) override {
+        if (traits_type::eq_int_type(ch, traits_type::eof())) return traits_type::not_eof(ch);
+        char c = traits_type::to_char_type(ch);
+        xsputn(&c, 1);
+        return ch;
+    }
+    
+    std::streamsize xsputn(const char* text, std::streamsize count) override {
+        if (routed_ && builtin_stdout) return builtin_stdout->sputn(text, count);
+        if (captured_) {
+            output_history.append(text, static_cast<size_t>(count));
+            log_output(error_stream_, text, static_cast<size_t>(count));
+        }
+        std::lock_guard<std::recursive_mutex> lock(mutex_);
+        if (broken_) return count;
+        send_color();
+        if (buffer_.empty()) pending_since_ = std::chrono::steady_clock::now();
+        buffer_.append(text, static_cast<size_t>(count));
+        
+        if (hold_rows_ > 0) {
+            for (std::streamsize i = 0; i < count; ++i) {
+                if (text[i] == '\n' || ++held_column_ == hold_cols_) {
+                    held_rows_++;
+                    held_column_ = 0;
                 }
             }
+            if (held_rows_ >= hold_rows_) hand_off();
+            return count;
         }
-    } catch (...) {
-        // Ignore filesystem errors
-    }
-
-    // Add builtin commands
-    for (const auto& builtin : builtins) {
-        if (std::string(builtin.name).starts_with(prefix)) {
-            completions.push_back(builtin.name);
+        
+        bool flush = buffer_.size() >= capacity_;
+        if (line_batches_ && !flush) {
+            lines_ += std::count(text, text + count, '\n');
+            flush = lines_ >= OUTPUT_FLUSH_LINES && buffer_.back() == '\n';
         }
+        if (flush) write_out();
+        return count;
     }
     
-    // Add aliases
-    for (const auto& [name, _] : state.aliases) {
-        if (name.starts_with(prefix)) {
-            completions.push_back(name);
+    int sync() override {
+        if (routed_ && builtin_stdout) return builtin_stdout->pubsync();
+        std::lock_guard<std::recursive_mutex> lock(mutex_);
+        if (hold_rows_ > 0) return 0;
+        send_color();  // Whatever runs next (a child process, the prompt) sees the current color
+        write_out();
+        return 0;
+    }
+    
+public:
+    // Write to handle; consoles get VT processing switched on where supported
+    Mode attach(HANDLE handle) {
+        std::lock_guard<std::recursive_mutex> lock(mutex_);
+        handle_ = handle;
+        broken_ = false;
+        line_batches_ = GetFileType(handle) == FILE_TYPE_CHAR;
+        capacity_ = line_batches_ ? OUTPUT_BUFFER_SIZE : OUTPUT_BLOCK_SIZE;
+        buffer_.reserve(capacity_);
+        
+        DWORD console_mode = 0;
+        if (!GetConsoleMode(handle, &console_mode)) {
+            mode_ = Mode::Plain;
+            return mode_;
         }
+        mode_ = SetConsoleMode(handle, console_mode | ENABLE_VIRTUAL_TERMINAL_PROCESSING) ? Mode::Ansi : Mode::Attributes;
+        CONSOLE_SCREEN_BUFFER_INFO info;
+        if (GetConsoleScreenBufferInfo(handle, &info)) own_shown_ = wanted_ = info.wAttributes;
+        return mode_;
     }
     
-    // Add executables from PATH (only for first word)
-    if (prefix.find(' ') == std::string::npos) {
-        auto paths = get_path_directories();
-        for (const auto& dir : paths) {
-            try {
-                if (fs::exists(dir) && fs::is_directory(dir)) {
-                    for (const auto& entry : fs::directory_iterator(dir)) {
-                        if (entry.is_regular_file()) {
-                            std::string filename = entry.path().stem().string();
-                            if (filename.starts_with(prefix)) {
-                                completions.push_back(filename);
-                            }
-                        }
-                    }
-                }
-            } catch (...) {
-                // Ignore errors
-            }
+    bool broken() const { return broken_; }
+    
+    // Hold output back until it passes rows rows of cols columns, then hand
+    // it to handoff. Color changes on a legacy console would have to be
+    // written out as they happen, so there they are dropped.
+    void hold(int rows, int cols, std::function<HANDLE()> handoff) {
+        std::lock_guard<std::recursive_mutex> lock(mutex_);
+        hold_rows_ = std::max(1, rows);
+        hold_cols_ = std::max(1, cols);
+        handoff_ = std::move(handoff);
+        if (mode_ == Mode::Attributes) colors_ = false;
+    }
+    
+    // Write held output to the console, or the rest to the pager's pipe
+    void release() {
+        std::lock_guard<std::recursive_mutex> lock(mutex_);
+        hold_rows_ = 0;
+        send_color();
+        write_out();
+    }
+    
+    // Write out text that has waited longer than the flush interval
+    void flush_if_stale(std::chrono::steady_clock::time_point now) {
+        std::lock_guard<std::recursive_mutex> lock(mutex_);
+        if (!buffer_.empty() && now - pending_since_ >= OUTPUT_FLUSH_INTERVAL) write_out();
+    }
+    
+    void share_color_state(ConsoleWriter& other) {
+        shown_ = other.shown_;
+    }
+    
+    // Send a builtin pipeline stage's output to its pipe instead
+    void route_builtin_output() {
+        routed_ = true;
+    }
+    
+    // Record what reaches the console for `out` and the transcript
+    void capture_output(bool error_stream = false) {
+        captured_ = true;
+        error_stream_ = error_stream;
+    }
+    
+    // With colors off, color changes are dropped before they reach the buffer
+    void set_colors(bool enabled) {
+        std::lock_guard<std::recursive_mutex> lock(mutex_);
+        if (!enabled && colors_) {
+            wanted_ = Theme().default_color;
+            send_color();
         }
+        colors_ = enabled;
     }
     
-    // Remove duplicates and sort
-    std::sort(completions.begin(), completions.end());
-    completions.erase(std::unique(completions.begin(), completions.end()), completions.end());
+    bool colors() const { return colors_; }
     
-    return completions;
-}
-
-std::string find_longest_common_prefix(const std::vector<std::string>& strs) {
-    if (strs.empty()) return "";
+    WORD color() const {
+        std::lock_guard<std::recursive_mutex> lock(mutex_);
+        return wanted_;
+    }
     
-    return std::accumulate(strs.begin() + 1, strs.end(), strs[0],
-        [](const std::string& prefix, const std::string& s) {
-            auto mismatch_pair = std::mismatch(prefix.begin(), prefix.end(), s.begin(), s.end());
-            return std::string(prefix.begin(), mismatch_pair.first);
-        });
-}
+    void set_color(WORD attributes) {
+        std::lock_guard<std::recursive_mutex> lock(mutex_);
+        wanted_ = attributes;
+    }
+};
 
-void save_history(const ShellState& state) {
-    if (!state.config.save_history) return;
+// The writers behind std::cout and std::cerr. std::cerr stays tied to
+// std::cout, so whatever std::cout buffered is written before an error.
+class ConsoleOutput {
+private:
+    ConsoleWriter out_;
+    ConsoleWriter err_;
+    std::streambuf* previous_out_ = nullptr;
+    std::streambuf* previous_err_ = nullptr;
+    
+    std::thread flusher_;
+    std::mutex flusher_mutex_;
+    std::condition_variable flusher_wake_;
+    bool stopping_ = false;
+    
+    void flush_stale_output() {
+        std::unique_lock<std::mutex> lock(flusher_mutex_);
+        while (!flusher_wake_.wait_for(lock, OUTPUT_FLUSH_INTERVAL, [&] { return stopping_; })) {
+            out_.flush_if_stale(std::chrono::steady_clock::now());
+        }
+    }
     
-    try {
-        fs::path history_path = state.shell_directory / state.config.history_file;
-        std::ofstream file(history_path);
-        if (file) {
-            for (const auto& cmd : state.history) {
-                file << cmd << '\n';
-            }
+public:
+    ~ConsoleOutput() {
+        if (!previous_out_) return;
+        {
+            std::lock_guard<std::mutex> lock(flusher_mutex_);
+            stopping_ = true;
         }
-    } catch (...) {
-        // Ignore save errors
+        flusher_wake_.notify_one();
+        if (flusher_.joinable()) flusher_.join();
+        std::cout.flush();
+        std::cerr.flush();
+        std::cout.rdbuf(previous_out_);
+        std::cerr.rdbuf(previous_err_);
+    }
+    
+    void install() {
+        if (previous_out_) return;
+        auto out_mode = out_.attach(GetStdHandle(STD_OUTPUT_HANDLE));
+        auto err_mode = err_.attach(GetStdHandle(STD_ERROR_HANDLE));
+        out_.route_builtin_output();
+        out_.capture_output();
+        err_.capture_output(true);
+        if (out_mode != ConsoleWriter::Mode::Plain && err_mode != ConsoleWriter::Mode::Plain) {
+            err_.share_color_state(out_);
+        }
+        previous_out_ = std::cout.rdbuf(&out_);
+        previous_err_ = std::cerr.rdbuf(&err_);
+        flusher_ = std::thread(&ConsoleOutput::flush_stale_output, this);
     }
-}
+    
+    void set_colors(bool enabled) {
+        std::cout.flush();
+        out_.set_colors(enabled);
+        err_.set_colors(enabled);
+    }
+    
+    // The color this thread last chose. Pipeline stages print side by side,
+    // so each restores its own color rather than whatever another stage
+    // left in the shared writers.
+    WORD color() const { return thread_color ? *thread_color : out_.color(); }
+    
+    // A stage writing into a pipe colors only that pipe and std::cerr
+    void set_color(WORD attributes) {
+        thread_color = attributes;
+        if (builtin_stdout) builtin_stdout->set_color(attributes);
+        else out_.set_color(attributes);
+        err_.set_color(attributes);
+    }
+    
+    // Follow the standard handles after they were switched (see Server Mode)
+    void reattach() {
+        std::cout.flush();
+        std::cerr.flush();
+        out_.attach(GetStdHandle(STD_OUTPUT_HANDLE));
+        err_.attach(GetStdHandle(STD_ERROR_HANDLE));
+    }
+    
+    // Another writer on the console, sharing the colors shown on it
+    void attach_writer(ConsoleWriter& writer) {
+        std::cout.flush();
+        writer.attach(GetStdHandle(STD_OUTPUT_HANDLE));
+        writer.share_color_state(out_);
+        writer.set_colors(out_.colors());
+        writer.set_color(out_.color());
+        writer.capture_output();
+    }
+};
 
-void load_history(ShellState& state) {
-    if (!state.config.save_history) return;
+ConsoleOutput console_output;
+
+class ColorGuard {
+private:
+    WORD original_attrs_;
     
-    try {
-        fs::path history_path = state.shell_directory / state.config.history_file;
-        if (fs::exists(history_path)) {
-            std::ifstream file(history_path);
-            std::string line;
-            while (std::getline(file, line) && state.history.size() < state.config.max_history) {
-                if (!line.empty()) {
-                    state.history.push_back(line);
-                }
-            }
-            state.history_index = state.history.size();
-        }
-    } catch (...) {
-        // Ignore load errors
+public:
+    ColorGuard(WORD new_attrs) : original_attrs_(console_output.color()) {
+        console_output.set_color(new_attrs);
     }
-}
+    
+    ~ColorGuard() {
+        console_output.set_color(original_attrs_);
+    }
+};
 
-void save_registered_commands(const ShellState& state) {
-    try {
-        fs::path commands_path = state.shell_directory / ".jshell_commands";
-        std::ofstream file(commands_path);
-        if (file) {
-            for (const auto& [name, cmd] : state.registered_commands) {
-                file << name << "|" << cmd.template_cmd << "|" << cmd.description << '\n';
-            }
+// PATH lookups of bare command names, reused until they are older than the TTL.
+// Shared by every thread that launches processes.
+class CommandHash {
+private:
+    struct Entry {
+        std::string path;
+        std::chrono::steady_clock::time_point expires;
+    };
+    
+    std::map<std::string, Entry> entries_;
+    std::chrono::seconds ttl_{30};
+    std::mutex mutex_;
+    
+public:
+    void set_ttl(std::chrono::seconds ttl) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ttl_ = ttl;
+        entries_.clear();
+    }
+    
+    std::optional<std::string> find(const std::string& name) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = entries_.find(name);
+        if (it == entries_.end()) return std::nullopt;
+        if (std::chrono::steady_clock::now() >= it->second.expires) {
+            entries_.erase(it);
+            return std::nullopt;
         }
-    } catch (...) {
-        // Ignore save errors
+        return it->second.path;
+    }
+    
+    void store(const std::string& name, const std::string& path) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (ttl_.count() == 0) return;
+        entries_[name] = {path, std::chrono::steady_clock::now() + ttl_};
     }
+    
+    void forget(const std::string& name) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        entries_.erase(name);
+    }
+    
+    // Drop every lookup, e.g. after PATH changed
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        entries_.clear();
+    }
+};
+
+CommandHash command_hash;
+
+// Environment names are case-insensitive on Windows
+bool is_path_variable(const std::string& name) {
+    return name.size() == 4 && std::equal(name.begin(), name.end(), "PATH", [](char a, char b) {
+        return std::toupper(static_cast<unsigned char>(a)) == b;
+    });
 }
 
-void load_registered_commands(ShellState& state) {
-    try {
-        fs::path commands_path = state.shell_directory / ".jshell_commands";
-        if (fs::exists(commands_path)) {
-            std::ifstream file(commands_path);
-            std::string line;
-            while (std::getline(file, line)) {
-                if (line.empty()) continue;
-                
-                auto first_pipe = line.find('|');
-                auto second_pipe = line.find('|', first_pipe + 1);
-                
-                if (first_pipe != std::string::npos && second_pipe != std::string::npos) {
-                    std::string name = line.substr(0, first_pipe);
-                    std::string template_cmd = line.substr(first_pipe + 1, second_pipe - first_pipe - 1);
-                    std::string description = line.substr(second_pipe + 1);
-                    
-                    RegisteredCommand reg_cmd(name, template_cmd, description);
-                    
-                    // Parse template to find parameters
-                    std::regex param_regex(R"(\{([^}]+)\})");
-                    std::sregex_iterator iter(template_cmd.begin(), template_cmd.end(), param_regex);
-                    std::sregex_iterator end;
-                    
-                    for (; iter != end; ++iter) {
-                        std::string param = (*iter)[1].str();
-                        if (!param.empty() && param != "all" && !std::isdigit(param[0])) {
-                            reg_cmd.param_names.push_back(param);
-                        }
-                    }
-                    
-                    state.registered_commands[name] = reg_cmd;
-                }
-            }
+// Read-only view of a whole file; empty files have an empty view and no mapping
+class MappedFile {
+private:
+    ScopedHandle file_;
+    ScopedHandle mapping_;
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+    
+public:
+    MappedFile() = default;
+    ~MappedFile() { close(); }
+    
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    
+    bool open(const std::string& path) {
+        close();
+        file_.reset(CreateFileA(
+            path.c_str(),
+            GENERIC_READ,
+            FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+            nullptr,
+            OPEN_EXISTING,
+            FILE_ATTRIBUTE_NORMAL,
+            nullptr
+        ));
+        if (!file_) return false;
+        
+        LARGE_INTEGER file_size;
+        if (!GetFileSizeEx(file_.get(), &file_size)) {
+            close();
+            return false;
         }
-    } catch (...) {
-        // Ignore load errors
+        size_ = static_cast<size_t>(file_size.QuadPart);
+        if (size_ == 0) return true;
+        
+        HANDLE mapping = CreateFileMappingA(file_.get(), nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!mapping) {
+            close();
+            return false;
+        }
+        mapping_.reset(mapping);
+        
+        data_ = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+        if (!data_) {
+            close();
+            return false;
+        }
+        return true;
     }
-}
+    
+    void close() {
+        if (data_) UnmapViewOfFile(data_);
+        data_ = nullptr;
+        size_ = 0;
+        mapping_.reset();
+        file_.reset();
+    }
+    
+    const char* data() const { return data_; }
+    size_t size() const { return size_; }
+    std::string_view view() const { return data_ ? std::string_view(data_, size_) : std::string_view(); }
+};
 
-void redraw_line(const std::string& prompt, const std::string& line) {
-    std::cout << "\r" << std::string(120, ' ') << "\r";
+// Redirects std::cout into a string for the lifetime of the object
+class OutputCapture {
+private:
+    std::stringbuf buffer_;
+    std::streambuf* original_;
     
-    const Theme theme;
-    ColorGuard guard(theme.prompt_color);
-    std::cout << prompt;
+public:
+    OutputCapture() : original_(std::cout.rdbuf(&buffer_)) {}
+    ~OutputCapture() { std::cout.rdbuf(original_); }
     
-    SetConsoleTextAttribute(GetStdHandle(STD_OUTPUT_HANDLE), theme.default_color);
-    std::cout << line;
-    std::cout.flush();
-}
+    OutputCapture(const OutputCapture&) = delete;
+    OutputCapture& operator=(const OutputCapture&) = delete;
+    
+    std::string str() const { return buffer_.str(); }
+};
 
-std::string read_line(ShellState& state) {
-    std::string prompt_template = state.config.prompt_format;
-    std::string cwd = get_current_directory_prompt();
+// Exclusive lock on a side file, held for the lifetime of the object. Used to
+// serialize writers across shell processes.
+class FileLock {
+private:
+    ScopedHandle file_;
     
-    // Simple variable substitution for prompt
-    size_t pos = prompt_template.find("{cwd}");
-    if (pos != std::string::npos) {
-        prompt_template.replace(pos, 5, cwd);
+public:
+    explicit FileLock(const fs::path& path)
+        : file_(CreateFileA(path.string().c_str(), GENERIC_READ | GENERIC_WRITE,
+                            FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                            nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr)) {
+        if (file_) {
+            OVERLAPPED overlapped = {};
+            LockFileEx(file_.get(), LOCKFILE_EXCLUSIVE_LOCK, 0, 1, 0, &overlapped);
+        }
     }
     
-    std::string line;
-    size_t cursor_pos = 0;
-    int last_char = 0;
+    ~FileLock() {
+        if (file_) {
+            OVERLAPPED overlapped = {};
+            UnlockFileEx(file_.get(), 0, 1, 0, &overlapped);
+        }
+    }
+};
+
+// Pattern search shared by grep, the pager and vi. Matches never span lines.
+// A pattern without regex metacharacters is a plain substring search. For a
+// real regex, the longest literal every match must contain is searched for
+// first, and std::regex only runs on the lines that contain it.
+class Matcher {
+private:
+    std::string pattern_;
+    std::string literal_;  // Required substring; empty if none could be derived
+    bool pure_literal_ = false;
+    bool icase_ = false;
+    std::optional<std::regex> regex_;
     
-    auto redraw_with_cursor = [&]() {
-        // Move to beginning of line
-        std::cout << "\r";
+    static bool equal_icase(char a, char b) {
+        return std::tolower(static_cast<unsigned char>(a)) == std::tolower(static_cast<unsigned char>(b));
+    }
+    
+    // Longest run of characters outside groups, classes and quantifiers.
+    // Alternation makes nothing required.
+    static std::string required_literal(const std::string& pattern) {
+        if (pattern.find('|') != std::string::npos) return "";
         
-        // Draw prompt
-        const Theme theme;
-        ColorGuard guard(theme.prompt_color);
-        std::cout << prompt_template;
+        std::string best, run;
+        int depth = 0;
+        auto end_run = [&]() {
+            if (run.size() > best.size()) best = run;
+            run.clear();
+        };
         
-        // Draw line content
-        SetConsoleTextAttribute(GetStdHandle(STD_OUTPUT_HANDLE), theme.default_color);
-        std::cout << line;
+        for (size_t i = 0; i < pattern.size(); ++i) {
+            char c = pattern[i];
+            char next = i + 1 < pattern.size() ? pattern[i + 1] : '\0';
+            bool optional = next == '*' || next == '?' || next == '{';
+            
+            if (c == '\\' && i + 1 < pattern.size()) {
+                // \. \* ... are literal; \d \w \b ... are classes or assertions
+                char escaped = pattern[++i];
+                next = i + 1 < pattern.size() ? pattern[i + 1] : '\0';
+                optional = next == '*' || next == '?' || next == '{';
+                if (depth == 0 && std::ispunct(static_cast<unsigned char>(escaped)) && !optional) {
+                    run += escaped;
+                    if (next == '+') end_run();
+                } else {
+                    end_run();
+                }
+            } else if (c == '[') {
+                end_run();
+                size_t close = pattern.find(']', i + 2);
+                i = close == std::string::npos ? pattern.size() : close;
+            } else if (c == '{') {
+                end_run();
+                size_t close = pattern.find('}', i + 1);
+                i = close == std::string::npos ? pattern.size() : close;
+            } else if (c == '(') {
+                end_run();
+                depth++;
+            } else if (c == ')') {
+                depth = std::max(0, depth - 1);
+            } else if (std::string_view(".^$*+?{}").find(c) != std::string_view::npos) {
+                end_run();
+            } else if (depth == 0 && !optional) {
+                run += c;
+                if (next == '+') end_run();
+            } else {
+                end_run();
+            }
+        }
+        end_run();
+        return best;
+    }
+    
+    size_t find_literal(std::string_view text, size_t from, std::string_view literal) const {
+        if (!icase_) return text.find(literal, from);
+        if (from > text.size()) return std::string_view::npos;
+        auto it = std::search(text.begin() + from, text.end(), literal.begin(), literal.end(), equal_icase);
+        return it == text.end() ? std::string_view::npos : static_cast<size_t>(it - text.begin());
+    }
+    
+public:
+    // Literal-only patterns are never compiled as regexes. Returns false with
+    // an error message for an invalid regex.
+    bool compile(const std::string& pattern, bool icase, bool literal_only = false, std::string* error = nullptr) {
+        pattern_ = pattern;
+        icase_ = icase;
+        regex_.reset();
+        pure_literal_ = literal_only ||
+                        pattern.find_first_of(".^$*+?()[]{}|\\") == std::string::npos;
         
-        // Add a few spaces to clear any leftover characters, then backspace
-        std::cout << "  \b\b";
+        if (pure_literal_) {
+            literal_ = pattern;
+            return true;
+        }
         
-        // Position cursor correctly
-        if (cursor_pos < line.length()) {
-            // Move cursor back to correct position
-            for (size_t i = cursor_pos; i < line.length(); ++i) {
-                std::cout << '\b';
-            }
+        try {
+            auto flags = std::regex::ECMAScript | std::regex::optimize;
+            if (icase) flags |= std::regex::icase;
+            regex_.emplace(pattern, flags);
+        } catch (const std::regex_error& e) {
+            if (error) *error = e.what();
+            return false;
         }
-        std::cout.flush();
-    };
+        literal_ = required_literal(pattern);
+        return true;
+    }
     
-    redraw_with_cursor();
-
-    while (true) {
-        int ch = _getch();
+    const std::string& pattern() const { return pattern_; }
+    
+    // First match at or after from; the match lies within a single line. For
+    // a regex, groups receives the match for expand().
+    bool find(std::string_view text, size_t from, size_t& match_pos, size_t& match_len,
+              std::cmatch* groups = nullptr) const {
+        if (pure_literal_) {
+            if (literal_.empty()) return false;
+            match_pos = find_literal(text, from, literal_);
+            match_len = literal_.size();
+            return match_pos != std::string_view::npos;
+        }
         
-        if (ch == 13) { // Enter
-            std::cout << "\n";
-            break;
-        } else if (ch == 224 || ch == 0) { // Extended keys (handle both 224 and 0)
-            ch = _getch();
-            if (ch == 72 && !state.history.empty()) { // Up arrow
-                if (state.history_index > 0) {
-                    state.history_index--;
-                    line = state.history[state.history_index];
-                    cursor_pos = line.length();
-                    redraw_with_cursor();
-                }
-            } else if (ch == 80) { // Down arrow
-                if (state.history_index < state.history.size()) {
-                    state.history_index++;
-                    line = (state.history_index < state.history.size()) ? 
-                           state.history[state.history_index] : "";
-                    cursor_pos = line.length();
-                    redraw_with_cursor();
-                }
-            } else if (ch == 75) { // Left arrow
-                if (cursor_pos > 0) {
-                    cursor_pos--;
-                    std::cout << '\b';
-                    std::cout.flush();
-                }
-            } else if (ch == 77) { // Right arrow
-                if (cursor_pos < line.length()) {
-                    std::cout << line[cursor_pos];
-                    cursor_pos++;
-                    std::cout.flush();
-                }
-            } else if (ch == 71) { // Home
-                while (cursor_pos > 0) {
-                    cursor_pos--;
-                    std::cout << '\b';
-                }
-                std::cout.flush();
-            } else if (ch == 79) { // End
-                while (cursor_pos < line.length()) {
-                    std::cout << line[cursor_pos];
-                    cursor_pos++;
+        // After a final newline there is no further, empty line to match
+        size_t last_from = text.ends_with('\n') ? text.size() - 1 : text.size();
+        while (from <= last_from) {
+            size_t candidate = literal_.empty() ? from : find_literal(text, from, literal_);
+            if (candidate == std::string_view::npos) return false;
+            
+            size_t line_begin = 0;
+            if (candidate > 0) {
+                size_t newline = text.rfind('\n', candidate - 1);
+                line_begin = newline == std::string_view::npos ? 0 : newline + 1;
+            }
+            bool mid_line = line_begin < from;
+            line_begin = std::max(line_begin, from);
+            
+            size_t line_end = text.find('\n', candidate);
+            if (line_end == std::string_view::npos) line_end = text.size();
+            // The \r of a CRLF line is not part of it, so $ matches before it
+            size_t search_end = line_end > line_begin && text[line_end - 1] == '\r' ? line_end - 1 : line_end;
+            
+            std::cmatch match;
+            auto flags = mid_line ? std::regex_constants::match_not_bol : std::regex_constants::match_default;
+            if (std::regex_search(text.data() + line_begin, text.data() + search_end, match, *regex_, flags)) {
+                match_pos = line_begin + match.position(0);
+                match_len = match.length(0);
+                if (groups) *groups = std::move(match);
+                return true;
+            }
+            from = line_end + 1;
+        }
+        return false;
+    }
+    
+    bool matches(std::string_view line) const {
+        size_t pos, len;
+        return find(line, 0, pos, len);
+    }
+    
+    // Replacement text for a match found with groups. Regex replacements may
+    // use $1 and $&; literal ones only $& and $$.
+    std::string expand(std::string_view match, const std::cmatch& groups, const std::string& replacement) const {
+        if (!pure_literal_) return groups.format(replacement);
+        
+        std::string result;
+        for (size_t i = 0; i < replacement.size(); ++i) {
+            char next = i + 1 < replacement.size() ? replacement[i + 1] : '\0';
+            if (replacement[i] == '$' && next == '&') {
+                result += match;
+                i++;
+            } else if (replacement[i] == '$' && next == '$') {
+                result += '$';
+                i++;
+            } else {
+                result += replacement[i];
+            }
+        }
+        return result;
+    }
+};
+
+// --- Forward Declarations ---
+int cd(ShellState&, std::span<const char*>);
+int help(ShellState&, std::span<const char*>);
+int exit_shell(ShellState&, std::span<const char*>);
+int pwd(ShellState&, std::span<const char*>);
+int env(ShellState&, std::span<const char*>);
+int set_var(ShellState&, std::span<const char*>);
+int unset_var(ShellState&, std::span<const char*>);
+int history(ShellState&, std::span<const char*>);
+int source(ShellState&, std::span<const char*>);
+int ls(ShellState&, std::span<const char*>);
+int cat(ShellState&, std::span<const char*>);
+int echo(ShellState&, std::span<const char*>);
+int mkdir(ShellState&, std::span<const char*>);
+int rm(ShellState&, std::span<const char*>);
+int cls(ShellState&, std::span<const char*>);
+int alias(ShellState&, std::span<const char*>);
+int unalias(ShellState&, std::span<const char*>);
+int touch(ShellState&, std::span<const char*>);
+int cp(ShellState&, std::span<const char*>);
+int mv(ShellState&, std::span<const char*>);
+int grep(ShellState&, std::span<const char*>);
+int wc(ShellState&, std::span<const char*>);
+int head(ShellState&, std::span<const char*>);
+int find_files(ShellState&, std::span<const char*>);
+int which(ShellState&, std::span<const char*>);
+int ps(ShellState&, std::span<const char*>);
+int kill_proc(ShellState&, std::span<const char*>);
+int jobs(ShellState&, std::span<const char*>);
+int where(ShellState&, std::span<const char*>);
+int select_fields(ShellState&, std::span<const char*>);
+int sort_by(ShellState&, std::span<const char*>);
+int out(ShellState&, std::span<const char*>);
+int transcript(ShellState&, std::span<const char*>);
+int fg(ShellState&, std::span<const char*>);
+int bg(ShellState&, std::span<const char*>);
+int code(ShellState&, std::span<const char*>);
+int edit(ShellState&, std::span<const char*>);
+int vi(ShellState&, std::span<const char*>);
+int less(ShellState&, std::span<const char*>);
+int register_cmd(ShellState&, std::span<const char*>);
+int unregister_cmd(ShellState&, std::span<const char*>);
+int list_registered(ShellState&, std::span<const char*>);
+int version(ShellState&, std::span<const char*>);
+int config_cmd(ShellState&, std::span<const char*>);
+
+// --- Built-ins Table ---
+const std::vector<Builtin> builtins = {
+    {"cd",      cd,         "Change directory", "cd [directory|~|..|/]", CHANGES_STATE},
+    {"help",    help,       "Display help message", "help [command]", PAGEABLE},
+    {"exit",    exit_shell, "Exit the shell", "exit [code]", CHANGES_STATE},
+    {"pwd",     pwd,        "Print working directory", "pwd"},
+    {"env",     env,        "List environment variables", "env [variable]", PAGEABLE},
+    {"set",     set_var,    "Set variable", "set <name> <value>", CHANGES_STATE},
+    {"unset",   unset_var,  "Unset variable", "unset <name>", CHANGES_STATE},
+    {"history", history,    "Show command history", "history [count]", PAGEABLE},
+    {"source",  source,     "Execute script file", "source <file>", CHANGES_STATE},
+    {"ls",      ls,         "List directory contents", "ls [-la] [--json] [path]", RECORDS_OUT | PAGEABLE},
+    {"dir",     ls,         "Alias for ls", "dir [-la] [path]", RECORDS_OUT | PAGEABLE},
+    {"cat",     cat,        "Display file contents", "cat <file> [files...]", PAGEABLE},
+    {"echo",    echo,       "Display text", "echo [text...]"},
+    {"mkdir",   mkdir,      "Create directory", "mkdir <directory>"},
+    {"rm",      rm,         "Remove files/directories", "rm [-rf] <path>"},
+    {"del",     rm,         "Alias for rm", "del [-rf] <path>"},
+    {"cls",     cls,        "Clear screen", "cls"},
+    {"clear",   cls,        "Alias for cls", "clear"},
+    {"alias",   alias,      "Create command alias", "alias [name='command']", CHANGES_STATE},
+    {"unalias", unalias,    "Remove alias", "unalias <name>", CHANGES_STATE},
+    {"touch",   touch,      "Create empty file", "touch <file>"},
+    {"cp",      cp,         "Copy files", "cp <source> <destination>"},
+    {"copy",    cp,         "Alias for cp", "copy <source> <destination>"},
+    {"mv",      mv,         "Move/rename files", "mv <source> <destination>"},
+    {"move",    mv,         "Alias for mv", "move <source> <destination>"},
+    {"grep",    grep,       "Search text patterns", "grep <pattern> [file]", PAGEABLE},
+    {"wc",      wc,         "Count lines, words and bytes", "wc [-lwc] [files...]"},
+    {"head",    head,       "Print the first lines", "head [-n count] [file]", PAGEABLE},
+    {"find",    find_files, "Find files", "find [--json] <path> <pattern>", RECORDS_OUT | PAGEABLE},
+    {"which",   which,      "Locate command", "which <command>"},
+    {"ps",      ps,         "List processes", "ps [--json]", RECORDS_OUT | PAGEABLE},
+    {"kill",    kill_proc,  "Kill process", "kill <pid>"},
+    {"jobs",    jobs,       "List active jobs", "jobs [--json]", RECORDS_OUT | PAGEABLE},
+    {"where",   where,      "Filter records", "where [--json] <field> <==|!=|-eq|-ne|-lt|-le|-gt|-ge|~> <value>",
+        RECORDS_IN | RECORDS_OUT | PAGEABLE},
+    {"select",  select_fields, "Keep record fields", "select [--json] <field> [fields...]", RECORDS_IN | RECORDS_OUT | PAGEABLE},
+    {"sort-by", sort_by,    "Sort records", "sort-by [-r] [--json] <field> [fields...]", RECORDS_IN | RECORDS_OUT | PAGEABLE},
+    {"out",     out,        "Show the output of a recent command", "out [-N]", PAGEABLE},
+    {"transcript", transcript, "Show the session transcript", "transcript [file]", PAGEABLE},
+    {"fg",      fg,         "Bring job to foreground", "fg [job_id]", CHANGES_STATE},
+    {"bg",      bg,         "Send job to background", "bg [job_id]", CHANGES_STATE},
+    {"open",    code,       "Open applications/editors", "open [app] [path]"},
+    {"edit",    edit,       "Edit file with external editor", "edit <file>"},
+    {"vi",      vi,         "Vim-like built-in editor", "vi <file>"},
+    {"less",    less,       "Page through a file or piped output", "less [file]"},
+    {"more",    less,       "Alias for less", "more [file]"},
+    {"nano",    vi,         "Alias for vi", "nano <file>"},
+    {"register", register_cmd, "Register custom command", "register <name> <template> [description]", CHANGES_STATE},
+    {"unreg",   unregister_cmd, "Unregister command", "unreg <name>", CHANGES_STATE},
+    {"reglist", list_registered, "List registered commands", "reglist", PAGEABLE},
+    {"version", version,    "Show shell version", "version"},
+    {"config",  config_cmd, "Show configuration", "config show [--effective]", PAGEABLE},
+};
+
+// --- Configuration Options Table ---
+// Every config.ini key, with a parser that validates the value and a printer
+// for `config show`. Parsers return an error message, or "" on success.
+struct ConfigOption {
+    const char* key;
+    const char* description;
+    std::string (*parse)(Configuration&, const std::string&);
+    std::string (*print)(const Configuration&);
+};
+
+// Parse a count or byte size, allowing a K/M/G suffix; nothing if it overflows
+std::optional<size_t> parse_size(const std::string& value) {
+    size_t number = 0;
+    auto [end, ec] = std::from_chars(value.data(), value.data() + value.size(), number);
+    if (ec != std::errc() || end == value.data()) return std::nullopt;
+    
+    std::string_view suffix(end, value.data() + value.size());
+    int shift = 0;
+    if (suffix == "K" || suffix == "k") shift = 10;
+    else if (suffix == "M" || suffix == "m") shift = 20;
+    else if (suffix == "G" || suffix == "g") shift = 30;
+    else if (!suffix.empty()) return std::nullopt;
+    
+    if (number > (SIZE_MAX >> shift)) return std::nullopt;
+    return number << shift;
+}
+
+template <std::string Configuration::*Field>
+std::string parse_string_option(Configuration& config, const std::string& value) {
+    config.*Field = value;
+    return "";
+}
+
+template <bool Configuration::*Field>
+std::string parse_bool_option(Configuration& config, const std::string& value) {
+    if (value == "true" || value == "1") config.*Field = true;
+    else if (value == "false" || value == "0") config.*Field = false;
+    else return "expected true or false";
+    return "";
+}
+
+template <size_t Configuration::*Field, size_t Min, size_t Max>
+std::string parse_size_option(Configuration& config, const std::string& value) {
+    auto size = parse_size(value);
+    if (!size) return "expected a number";
+    if (*size < Min || *size > Max) return std::format("must be between {} and {}", Min, Max);
+    config.*Field = *size;
+    return "";
+}
+
+template <auto Field>
+std::string print_option(const Configuration& config) {
+    return std::format("{}", config.*Field);
+}
+
+const std::vector<ConfigOption> config_options = {
+    {"prompt_format", "Prompt text; {cwd} is the current directory",
+     parse_string_option<&Configuration::prompt_format>, print_option<&Configuration::prompt_format>},
+    {"enable_colors", "Colored output",
+     parse_bool_option<&Configuration::enable_colors>, print_option<&Configuration::enable_colors>},
+    {"auto_complete", "Tab completion",
+     parse_bool_option<&Configuration::auto_complete>, print_option<&Configuration::auto_complete>},
+    {"save_history", "Persist history between sessions",
+     parse_bool_option<&Configuration::save_history>, print_option<&Configuration::save_history>},
+    {"max_history", "History entries kept",
+     parse_size_option<&Configuration::max_history, 1, 1000000>, print_option<&Configuration::max_history>},
+    {"max_workers", "Worker threads for fan-out and parallel copy (0 = auto)",
+     parse_size_option<&Configuration::max_workers, 0, 1024>, print_option<&Configuration::max_workers>},
+    {"pipe_buffer_size", "Pipe buffer between pipeline stages, in bytes",
+     parse_size_option<&Configuration::pipe_buffer_size, 4096, (64 << 20)>, print_option<&Configuration::pipe_buffer_size>},
+    {"completion_cache_size", "PATH completion prefixes cached (0 = off)",
+     parse_size_option<&Configuration::completion_cache_size, 0, 65536>, print_option<&Configuration::completion_cache_size>},
+    {"command_hash_ttl", "Seconds a PATH lookup is reused (0 = off)",
+     parse_size_option<&Configuration::command_hash_ttl, 0, 86400>, print_option<&Configuration::command_hash_ttl>},
+    {"io_block_size", "Read/write block size of file builtins, in bytes",
+     parse_size_option<&Configuration::io_block_size, 4096, (64 << 20)>, print_option<&Configuration::io_block_size>},
+    {"parallel_copy_threshold", "Files in a cp -r before it copies in parallel (0 = never)",
+     parse_size_option<&Configuration::parallel_copy_threshold, 0, 100000000>, print_option<&Configuration::parallel_copy_threshold>},
+    {"profile", "Report the time taken by every command line",
+     parse_bool_option<&Configuration::profile>, print_option<&Configuration::profile>},
+    {"sync_on_save", "Flush vi/edit saves through to disk",
+     parse_bool_option<&Configuration::sync_on_save>, print_option<&Configuration::sync_on_save>},
+    {"terminate_upstream", "End the external processes feeding a pipeline stage once it exits",
+     parse_bool_option<&Configuration::terminate_upstream>, print_option<&Configuration::terminate_upstream>},
+    {"auto_pager", "Page builtin output longer than the screen",
+     parse_bool_option<&Configuration::auto_pager>, print_option<&Configuration::auto_pager>},
+    {"output_history_size", "Bytes of recent command output kept for out (0 = off)",
+     parse_size_option<&Configuration::output_history_size, 0, (1ull << 30)>, print_option<&Configuration::output_history_size>},
+    {"capture_external_output", "Pass program output through the shell so out records it",
+     parse_bool_option<&Configuration::capture_external_output>, print_option<&Configuration::capture_external_output>},
+    {"transcript", "Log every command and its output to transcript.jslog",
+     parse_bool_option<&Configuration::transcript>, print_option<&Configuration::transcript>},
+    {"transcript_max_size", "Transcript size, in bytes, at which it is rotated",
+     parse_size_option<&Configuration::transcript_max_size, (64 << 10), (1ull << 30)>, print_option<&Configuration::transcript_max_size>},
+    {"transcript_files", "Rotated transcripts kept",
+     parse_size_option<&Configuration::transcript_files, 0, 100>, print_option<&Configuration::transcript_files>},
+};
+
+// Worker count after resolving max_workers=0
+size_t effective_workers(const Configuration& config) {
+    if (config.max_workers != 0) return config.max_workers;
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// --- Utility Functions ---
+std::string get_home_directory() {
+    char* path = nullptr;
+    size_t len;
+    if (_dupenv_s(&path, &len, "USERPROFILE") == 0 && path) {
+        std::string home = path;
+        free(path);
+        return home;
+    }
+    return "";
+}
+
+std::string expand_path(const std::string& path) {
+    if (path.empty()) return path;
+    
+    if (path[0] == '~') {
+        std::string home = get_home_directory();
+        if (!home.empty()) {
+            return home + (path.length() > 1 ? path.substr(1) : "");
+        }
+    }
+    
+    return path;
+}
+
+std::string get_current_directory_prompt() {
+    try {
+        std::string home = get_home_directory();
+        std::string current = fs::current_path().string();
+        if (!home.empty() && current.starts_with(home)) {
+            return "~" + current.substr(home.length());
+        }
+        return current;
+    } catch (const fs::filesystem_error&) {
+        return "unknown";
+    }
+}
+
+std::vector<std::string> get_path_directories() {
+    std::vector<std::string> paths;
+    char* path_env = nullptr;
+    size_t len;
+    
+    if (_dupenv_s(&path_env, &len, "PATH") == 0 && path_env) {
+        std::string path_str = path_env;
+        free(path_env);
+        
+        std::stringstream ss(path_str);
+        std::string path;
+        while (std::getline(ss, path, ';')) {
+            if (!path.empty()) {
+                paths.push_back(path);
+            }
+        }
+    }
+    
+    return paths;
+}
+
+std::string find_executable(const std::string& name) {
+    if (name.empty()) return "";
+    
+    // If it contains path separators, check as-is
+    if (name.find('/') != std::string::npos || name.find('\\') != std::string::npos) {
+        if (fs::exists(name) && fs::is_regular_file(name)) {
+            return name;
+        }
+        return "";
+    }
+    
+    // Common executable extensions on Windows
+    std::vector<std::string> extensions = {"", ".exe", ".bat", ".cmd", ".com"};
+    
+    // Check current directory first
+    for (const auto& ext : extensions) {
+        std::string full_path = name + ext;
+        if (fs::exists(full_path) && fs::is_regular_file(full_path)) {
+            return fs::absolute(full_path).string();
+        }
+    }
+    
+    // A program moved or deleted since it was looked up is searched for again
+    if (auto cached = command_hash.find(name)) {
+        std::error_code ec;
+        if (fs::is_regular_file(*cached, ec)) return *cached;
+        command_hash.forget(name);
+    }
+    
+    // Check PATH directories
+    auto paths = get_path_directories();
+    for (const auto& dir : paths) {
+        for (const auto& ext : extensions) {
+            fs::path full_path = fs::path(dir) / (name + ext);
+            if (fs::exists(full_path) && fs::is_regular_file(full_path)) {
+                command_hash.store(name, full_path.string());
+                return full_path.string();
+            }
+        }
+    }
+    
+    return "";
+}
+
+std::string substitute_variables(const std::string& text, const ShellState& state) {
+    std::string result = text;
+    
+    // Replace ${VAR} and $VAR patterns
+    std::regex var_pattern(R"(\$\{([^}]+)\}|\$([A-Za-z_][A-Za-z0-9_]*))");
+    std::smatch match;
+    
+    std::string temp_result;
+    auto search_start = result.cbegin();
+
+    while (std::regex_search(search_start, result.cend(), match, var_pattern)) {
+        temp_result.append(match.prefix().first, match.prefix().second);
+        
+        std::string var_name = match[1].str();
+        if (var_name.empty()) var_name = match[2].str();
+        
+        std::string value;
+        
+        // Check shell variables first
+        if (state.variables.contains(var_name)) {
+            value = state.variables.at(var_name);
+        } else {
+            // Check environment variables
+            char* env_val = nullptr;
+            size_t len;
+            if (_dupenv_s(&env_val, &len, var_name.c_str()) == 0 && env_val) {
+                value = env_val;
+                free(env_val);
+            }
+        }
+        
+        temp_result.append(value);
+        search_start = match.suffix().first;
+    }
+    temp_result.append(search_start, result.cend());
+    
+    return temp_result;
+}
+
+std::vector<std::string> get_path_completions(const std::string& prefix) {
+    std::vector<std::string> completions;
+    auto paths = get_path_directories();
+    for (const auto& dir : paths) {
+        try {
+            if (fs::exists(dir) && fs::is_directory(dir)) {
+                for (const auto& entry : fs::directory_iterator(dir)) {
+                    if (entry.is_regular_file()) {
+                        std::string filename = entry.path().stem().string();
+                        if (filename.starts_with(prefix)) {
+                            completions.push_back(filename);
+                        }
+                    }
                 }
-                std::cout.flush();
             }
-            // Ignore any other extended keys to prevent weird characters
-            continue;
-        } else if (ch == 9 && state.config.auto_complete) { // Tab
-            std::string prefix = line.substr(0, cursor_pos);
-            auto completions = get_completions(prefix, state);
-            if (completions.empty()) continue;
+        } catch (...) {
+            // Ignore errors
+        }
+    }
+    return completions;
+}
+
+std::vector<std::string> get_completions(const std::string& prefix, ShellState& state) {
+    std::vector<std::string> completions;
+    fs::path current_path = ".";
+    std::string search_prefix = prefix;
+
+    // Handle path completion
+    if (auto pos = prefix.find_last_of("/\\"); pos != std::string::npos) {
+        current_path = prefix.substr(0, pos + 1);
+        search_prefix = prefix.substr(pos + 1);
+    }
+    
+    try {
+        current_path = expand_path(current_path.string());
+        if (fs::exists(current_path) && fs::is_directory(current_path)) {
+            for (const auto& entry : fs::directory_iterator(current_path)) {
+                std::string filename = entry.path().filename().string();
+                if (filename.starts_with(search_prefix)) {
+                    std::string completion = (current_path.string() == "." ? "" : current_path.string()) + filename;
+                    if (entry.is_directory()) completion += "\\"; // Use backslash for Windows
+                    completions.push_back(completion);
+                }
+            }
+        }
+    } catch (...) {
+        // Ignore filesystem errors
+    }
+
+    // Add builtin commands
+    for (const auto& builtin : builtins) {
+        if (std::string(builtin.name).starts_with(prefix)) {
+            completions.push_back(builtin.name);
+        }
+    }
+    
+    // Add aliases
+    for (const auto& [name, _] : state.aliases) {
+        if (name.starts_with(prefix)) {
+            completions.push_back(name);
+        }
+    }
+    
+    // Add executables from PATH (only for first word). Scanning PATH is slow,
+    // so results are cached per prefix for command_hash_ttl seconds.
+    if (prefix.find(' ') == std::string::npos) {
+        auto now = std::chrono::steady_clock::now();
+        auto ttl = std::chrono::seconds(state.config.command_hash_ttl);
+        auto& cache = state.completion_cache;
+        
+        auto it = cache.find(prefix);
+        if (it == cache.end() || now - it->second.second >= ttl) {
+            auto found = get_path_completions(prefix);
+            if (state.config.completion_cache_size == 0 || ttl.count() == 0) {
+                completions.insert(completions.end(), found.begin(), found.end());
+                it = cache.end();
+            } else {
+                if (it == cache.end() && cache.size() >= state.config.completion_cache_size) {
+                    cache.erase(std::min_element(cache.begin(), cache.end(), [](const auto& a, const auto& b) {
+                        return a.second.second < b.second.second;
+                    }));
+                }
+                it = cache.insert_or_assign(prefix, std::make_pair(std::move(found), now)).first;
+            }
+        }
+        if (it != cache.end()) {
+            completions.insert(completions.end(), it->second.first.begin(), it->second.first.end());
+        }
+    }
+    
+    // Remove duplicates and sort
+    std::sort(completions.begin(), completions.end());
+    completions.erase(std::unique(completions.begin(), completions.end()), completions.end());
+    
+    return completions;
+}
+
+std::string find_longest_common_prefix(const std::vector<std::string>& strs) {
+    if (strs.empty()) return "";
+    
+    return std::accumulate(strs.begin() + 1, strs.end(), strs[0],
+        [](const std::string& prefix, const std::string& s) {
+            auto mismatch_pair = std::mismatch(prefix.begin(), prefix.end(), s.begin(), s.end());
+            return std::string(prefix.begin(), mismatch_pair.first);
+        });
+}
+
+// Case-insensitive match of a file name against a pattern with * and ?
+bool wildcard_match(std::string_view pattern, std::string_view name) {
+    size_t p = 0, n = 0;
+    size_t star = std::string_view::npos, resume = 0;
+    
+    while (n < name.size()) {
+        if (p < pattern.size() && (pattern[p] == '?' ||
+            std::tolower(static_cast<unsigned char>(pattern[p])) == std::tolower(static_cast<unsigned char>(name[n])))) {
+            p++;
+            n++;
+        } else if (p < pattern.size() && pattern[p] == '*') {
+            star = p++;
+            resume = n;
+        } else if (star != std::string_view::npos) {
+            p = star + 1;
+            n = ++resume;
+        } else {
+            return false;
+        }
+    }
+    while (p < pattern.size() && pattern[p] == '*') p++;
+    return p == pattern.size();
+}
+
+// Expand wildcards in the last path component; other arguments pass through.
+// Matches are sorted so that expansions are deterministic.
+std::vector<std::string> expand_wildcards(const std::string& arg) {
+    fs::path path(arg);
+    std::string pattern = path.filename().string();
+    if (pattern.find_first_of("*?") == std::string::npos) return {arg};
+    
+    std::vector<std::string> matches;
+    fs::path dir = path.parent_path();
+    std::error_code ec;
+    
+    for (const auto& entry : fs::directory_iterator(dir.empty() ? fs::path(".") : dir, ec)) {
+        std::string name = entry.path().filename().string();
+        if (name.starts_with('.') && !pattern.starts_with('.')) continue;
+        if (wildcard_match(pattern, name)) {
+            matches.push_back(dir.empty() ? name : (dir / name).string());
+        }
+    }
+    
+    std::sort(matches.begin(), matches.end());
+    return matches;
+}
+
+void save_history(const ShellState& state) {
+    if (!state.config.save_history) return;
+    
+    try {
+        fs::path history_path = state.shell_directory / state.config.history_file;
+        std::ofstream file(history_path);
+        if (file) {
+            for (const auto& cmd : state.history) {
+                file << cmd << '\n';
+            }
+        }
+    } catch (...) {
+        // Ignore save errors
+    }
+}
+
+void load_history(ShellState& state) {
+    if (!state.config.save_history) return;
+    
+    try {
+        fs::path history_path = state.shell_directory / state.config.history_file;
+        if (fs::exists(history_path)) {
+            std::ifstream file(history_path);
+            std::string line;
+            while (std::getline(file, line) && state.history.size() < state.config.max_history) {
+                if (!line.empty()) {
+                    state.history.push_back(line);
+                }
+            }
+            state.history_index = state.history.size();
+        }
+    } catch (...) {
+        // Ignore load errors
+    }
+}
+
+uint64_t fnv1a_64(const void* data, size_t size, uint64_t hash = 14695981039346656037ULL) {
+    const auto* bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+bool get_file_stamp(const fs::path& path, uint64_t& size, uint64_t& mtime) {
+    WIN32_FILE_ATTRIBUTE_DATA info;
+    if (!GetFileAttributesExA(path.string().c_str(), GetFileExInfoStandard, &info)) {
+        size = mtime = 0;
+        return false;
+    }
+    size = (static_cast<uint64_t>(info.nFileSizeHigh) << 32) | info.nFileSizeLow;
+    mtime = (static_cast<uint64_t>(info.ftLastWriteTime.dwHighDateTime) << 32) | info.ftLastWriteTime.dwLowDateTime;
+    return true;
+}
+
+// Write a whole file next to its destination, flush it and rename it into place
+bool replace_file_atomically(const fs::path& path, std::string_view data, bool allow_replace = true) {
+    std::string temp_path = std::format("{}.{}.tmp", path.string(), GetCurrentProcessId());
+    
+    {
+        ScopedHandle file(CreateFileA(temp_path.c_str(), GENERIC_WRITE, 0, nullptr,
+                                      CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr));
+        if (!file) return false;
+        
+        DWORD written = 0;
+        if ((!data.empty() && (!WriteFile(file.get(), data.data(), static_cast<DWORD>(data.size()), &written, nullptr) ||
+                               written != data.size())) ||
+            !FlushFileBuffers(file.get())) {
+            file.reset();
+            DeleteFileA(temp_path.c_str());
+            return false;
+        }
+    }
+    
+    DWORD flags = MOVEFILE_WRITE_THROUGH | (allow_replace ? MOVEFILE_REPLACE_EXISTING : 0);
+    if (!MoveFileExA(temp_path.c_str(), path.string().c_str(), flags)) {
+        DeleteFileA(temp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+// --- Registered Command Store ---
+// .jshell_commands.log is an append-only log. A 16-byte header holds a magic
+// string and a generation number that changes whenever the log is compacted.
+// Each record is [u32 payload length][u32 payload checksum][payload], and a
+// payload is an op byte followed by length-prefixed name, template,
+// description and options. A torn record at the tail fails its checksum, is ignored by
+// readers and is cut off by the next writer.
+constexpr std::string_view COMMANDS_LOG_MAGIC = "JSHCMD01";
+constexpr size_t COMMANDS_LOG_HEADER = 16;
+constexpr size_t COMMANDS_LOG_COMPACT_MIN = 256;
+
+enum class CommandLogOp : uint8_t { Put = 1, Remove = 2 };
+
+struct CommandLogRecord {
+    CommandLogOp op;
+    std::string_view name;
+    std::string_view template_cmd;
+    std::string_view description;
+    std::string_view options;
+};
+
+void append_u32(std::string& out, uint32_t value) {
+    for (int i = 0; i < 4; ++i) out += static_cast<char>((value >> (8 * i)) & 0xFF);
+}
+
+uint32_t read_u32(const char* p) {
+    uint32_t value = 0;
+    for (int i = 3; i >= 0; --i) value = (value << 8) | static_cast<unsigned char>(p[i]);
+    return value;
+}
+
+uint64_t read_u64(const char* p) {
+    return (static_cast<uint64_t>(read_u32(p + 4)) << 32) | read_u32(p);
+}
+
+std::string encode_command_log_header(uint64_t generation) {
+    std::string header(COMMANDS_LOG_MAGIC);
+    append_u32(header, static_cast<uint32_t>(generation));
+    append_u32(header, static_cast<uint32_t>(generation >> 32));
+    return header;
+}
+
+uint64_t new_command_log_generation() {
+    uint64_t generation = 0;
+    while (generation == 0) {
+        generation = (static_cast<uint64_t>(std::random_device{}()) << 32) ^ std::random_device{}() ^
+                     static_cast<uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+    }
+    return generation;
+}
+
+std::string encode_command_record(const CommandLogRecord& record) {
+    std::string payload;
+    payload += static_cast<char>(record.op);
+    for (std::string_view field : {record.name, record.template_cmd, record.description, record.options}) {
+        append_u32(payload, static_cast<uint32_t>(field.size()));
+        payload += field;
+    }
+    
+    std::string out;
+    out.reserve(payload.size() + 8);
+    append_u32(out, static_cast<uint32_t>(payload.size()));
+    append_u32(out, static_cast<uint32_t>(fnv1a_64(payload.data(), payload.size())));
+    out += payload;
+    return out;
+}
+
+bool decode_command_record(std::string_view payload, CommandLogRecord& record) {
+    if (payload.empty()) return false;
+    record.op = static_cast<CommandLogOp>(payload[0]);
+    if (record.op != CommandLogOp::Put && record.op != CommandLogOp::Remove) return false;
+    
+    // Options were added after the first format and may be absent
+    size_t pos = 1;
+    record.options = {};
+    for (std::string_view* field : {&record.name, &record.template_cmd, &record.description, &record.options}) {
+        if (field == &record.options && pos == payload.size()) break;
+        if (payload.size() - pos < 4) return false;
+        uint32_t length = read_u32(payload.data() + pos);
+        pos += 4;
+        if (payload.size() - pos < length) return false;
+        *field = payload.substr(pos, length);
+        pos += length;
+    }
+    return !record.name.empty();
+}
+
+// Replay records starting at offset; returns the offset just past the last intact record
+template <typename Apply>
+size_t read_command_log(std::string_view data, size_t offset, Apply&& apply) {
+    while (data.size() - offset >= 8) {
+        uint32_t length = read_u32(data.data() + offset);
+        uint32_t checksum = read_u32(data.data() + offset + 4);
+        if (data.size() - offset - 8 < length) break;
+        
+        std::string_view payload = data.substr(offset + 8, length);
+        CommandLogRecord record;
+        if (static_cast<uint32_t>(fnv1a_64(payload.data(), payload.size())) != checksum ||
+            !decode_command_record(payload, record)) {
+            break;
+        }
+        
+        apply(record);
+        offset += 8 + length;
+    }
+    return offset;
+}
+
+void register_default_commands(ShellState& state) {
+    state.registered_commands["cpp"] = RegisteredCommand("cpp", 
+        "g++ -std=c++20 -Wall -Wextra {0} -o {1}", 
+        "Compile C++ file with modern standards");
+    
+    state.registered_commands["cpprun"] = RegisteredCommand("cpprun", 
+        "g++ -std=c++20 -Wall -Wextra {0} -o temp_exe && temp_exe && del temp_exe.exe", 
+        "Compile and run C++ file");
+    
+    state.registered_commands["py"] = RegisteredCommand("py", 
+        "python {0}", 
+        "Run Python script");
+    
+    state.registered_commands["node"] = RegisteredCommand("node", 
+        "node {0}", 
+        "Run Node.js script");
+    
+    state.registered_commands["backup"] = RegisteredCommand("backup", 
+        "cp {0} {0}.bak", 
+        "Create backup of file");
+    
+    state.registered_commands["restore"] = RegisteredCommand("restore", 
+        "cp {0}.bak {0}", 
+        "Restore file from backup");
+    
+    state.registered_commands["mkexe"] = RegisteredCommand("mkexe", 
+        "chmod +x {0}", 
+        "Make file executable");
+    
+    state.registered_commands["webget"] = RegisteredCommand("webget", 
+        "curl -O {0}", 
+        "Download file from URL");
+    
+    state.registered_commands["extract"] = RegisteredCommand("extract", 
+        "tar -xzf {0}", 
+        "Extract tar.gz archive");
+}
+
+// Convert a pre-log name|template|description file into a new log. Renaming
+// without replace makes this a no-op if another shell created the log first.
+void import_legacy_commands(const fs::path& directory) {
+    try {
+        fs::path legacy_path = directory / LEGACY_COMMANDS_FILE;
+        if (!fs::exists(legacy_path)) return;
+        
+        std::string log = encode_command_log_header(new_command_log_generation());
+        std::ifstream file(legacy_path);
+        std::string line;
+        
+        while (std::getline(file, line)) {
+            // Templates may contain '|', descriptions practically never do
+            auto first_pipe = line.find('|');
+            auto last_pipe = line.rfind('|');
+            if (first_pipe == std::string::npos || last_pipe == first_pipe) continue;
+            
+            std::string_view view(line);
+            log += encode_command_record({CommandLogOp::Put, view.substr(0, first_pipe),
+                                          view.substr(first_pipe + 1, last_pipe - first_pipe - 1),
+                                          view.substr(last_pipe + 1), {}});
+        }
+        
+        replace_file_atomically(directory / COMMANDS_LOG_FILE, log, false);
+    } catch (...) {
+        // Ignore import errors
+    }
+}
+
+// Bring registered_commands up to date with the log. Cheap when nothing
+// changed: one stat call. Records appended by other shells are replayed
+// incrementally; a new generation means the log was compacted and is replayed
+// from the start.
+void sync_registered_commands(ShellState& state) {
+    fs::path log_path = state.shell_directory / COMMANDS_LOG_FILE;
+    uint64_t size = 0, mtime = 0;
+    bool exists = get_file_stamp(log_path, size, mtime);
+    
+    if (!state.commands_loaded) {
+        register_default_commands(state);
+        state.commands_loaded = true;
+        if (!exists) {
+            import_legacy_commands(state.shell_directory);
+            exists = get_file_stamp(log_path, size, mtime);
+        }
+    } else if (size == state.commands_log_size && mtime == state.commands_log_mtime) {
+        return;
+    }
+    
+    state.commands_log_size = size;
+    state.commands_log_mtime = mtime;
+    
+    state.commands_log_damaged = false;
+    if (!exists || size == 0) {
+        // The next writer starts a fresh log
+        state.commands_log_offset = 0;
+        return;
+    }
+    
+    MappedFile log;
+    std::string_view data;
+    if (log.open(log_path.string())) data = log.view();
+    
+    if (data.size() < COMMANDS_LOG_HEADER || !data.starts_with(COMMANDS_LOG_MAGIC)) {
+        // Keep what was replayed and look again next time; writers refuse to
+        // touch it (see append_command_record)
+        state.commands_log_damaged = true;
+        state.commands_log_size = UINT64_MAX;
+        return;
+    }
+    
+    uint64_t generation = read_u64(data.data() + COMMANDS_LOG_MAGIC.size());
+    if (generation != state.commands_log_generation || data.size() < state.commands_log_offset) {
+        state.registered_commands.clear();
+        register_default_commands(state);
+        state.commands_log_generation = generation;
+        state.commands_log_offset = COMMANDS_LOG_HEADER;
+        state.commands_log_records = 0;
+    }
+    
+    state.commands_log_offset = read_command_log(data, state.commands_log_offset, [&](const CommandLogRecord& record) {
+        std::string name(record.name);
+        if (record.op == CommandLogOp::Put) {
+            state.registered_commands[name] = RegisteredCommand(name, std::string(record.template_cmd),
+                                                                std::string(record.description),
+                                                                std::string(record.options));
+        } else {
+            state.registered_commands.erase(name);
+        }
+        state.commands_log_records++;
+    });
+}
+
+// Rewrite the log keeping only the last record per name. Runs on a background
+// thread and touches nothing but files, so it never races with the shell.
+void compact_command_log(fs::path directory) {
+    try {
+        FileLock lock(directory / COMMANDS_LOCK_FILE);
+        std::map<std::string, std::string> latest;
+        
+        {
+            MappedFile log;
+            if (!log.open((directory / COMMANDS_LOG_FILE).string())) return;
+            std::string_view data = log.view();
+            if (data.size() < COMMANDS_LOG_HEADER || !data.starts_with(COMMANDS_LOG_MAGIC)) return;
+            
+            read_command_log(data, COMMANDS_LOG_HEADER, [&](const CommandLogRecord& record) {
+                latest[std::string(record.name)] = encode_command_record(record);
+            });
+        }
+        
+        std::string compacted = encode_command_log_header(new_command_log_generation());
+        for (const auto& [name, record] : latest) compacted += record;
+        replace_file_atomically(directory / COMMANDS_LOG_FILE, compacted);
+    } catch (...) {
+        // Compaction is an optimization; the uncompacted log stays valid
+    }
+}
+
+bool append_command_record(ShellState& state, CommandLogOp op, const RegisteredCommand& cmd) {
+    FileLock lock(state.shell_directory / COMMANDS_LOCK_FILE);
+    
+    // Replay anything other shells appended so our offset is the true end of the log
+    state.commands_log_size = UINT64_MAX;
+    sync_registered_commands(state);
+    
+    fs::path log_path = state.shell_directory / COMMANDS_LOG_FILE;
+    if (state.commands_log_damaged) {
+        // A log that cannot be opened may only be locked for a moment (a virus
+        // scanner, say); starting over would drop every command in it
+        MappedFile damaged;
+        if (!damaged.open(log_path.string())) {
+            const Theme theme;
+            ColorGuard guard(theme.error_color);
+            std::cerr << std::format("jshell: Cannot read {}; registered commands left unchanged\n", log_path.string());
+            return false;
+        }
+        damaged.close();
+        
+        // It reads but is not a log: keep it for inspection and start over
+        fs::path aside = log_path;
+        aside += ".corrupt";
+        if (!MoveFileExA(log_path.string().c_str(), aside.string().c_str(), MOVEFILE_REPLACE_EXISTING)) {
+            const Theme theme;
+            ColorGuard guard(theme.error_color);
+            std::cerr << std::format("jshell: {} is damaged and cannot be moved aside: {}\n", log_path.string(),
+                                     std::system_category().message(GetLastError()));
+            return false;
+        }
+        const Theme theme;
+        ColorGuard guard(theme.warning_color);
+        std::cerr << std::format("jshell: {} is damaged; moved it to {} and started a new log\n", log_path.string(),
+                                 aside.string());
+        state.commands_log_damaged = false;
+        state.commands_log_offset = 0;
+    }
+    
+    ScopedHandle file(CreateFileA(log_path.string().c_str(), GENERIC_READ | GENERIC_WRITE,
+                                  FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                  nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr));
+    if (!file) return false;
+    
+    std::string out;
+    if (state.commands_log_offset < COMMANDS_LOG_HEADER) {
+        state.commands_log_generation = new_command_log_generation();
+        state.commands_log_offset = 0;
+        state.commands_log_records = 0;
+        out = encode_command_log_header(state.commands_log_generation);
+    }
+    out += encode_command_record({op, cmd.name, cmd.template_cmd, cmd.description, cmd.options});
+    
+    // Writing at the last intact record also drops a torn tail left by a crash
+    LARGE_INTEGER position;
+    position.QuadPart = static_cast<LONGLONG>(state.commands_log_offset);
+    DWORD written = 0;
+    if (!SetFilePointerEx(file.get(), position, nullptr, FILE_BEGIN) || !SetEndOfFile(file.get()) ||
+        !WriteFile(file.get(), out.data(), static_cast<DWORD>(out.size()), &written, nullptr) ||
+        written != out.size()) {
+        return false;
+    }
+    file.reset();
+    
+    state.commands_log_offset += out.size();
+    state.commands_log_records++;
+    get_file_stamp(log_path, state.commands_log_size, state.commands_log_mtime);
+    
+    if (op == CommandLogOp::Put) {
+        state.registered_commands[cmd.name] = cmd;
+    } else {
+        state.registered_commands.erase(cmd.name);
+    }
+    
+    if (state.commands_log_records > COMMANDS_LOG_COMPACT_MIN &&
+        state.commands_log_records > 4 * state.registered_commands.size()) {
+        if (state.compaction_thread.joinable()) state.compaction_thread.join();
+        state.compaction_thread = std::thread(compact_command_log, state.shell_directory);
+        state.commands_log_records = state.registered_commands.size();
+    }
+    return true;
+}
+
+// A decoded console key. _getch() reports special keys as a 0 or 224 prefix
+// followed by a scan code; read_key() folds both into one value so that every
+// interactive reader (read_line, the pager, vi) decodes keys the same way.
+enum class KeyCode {
+    Char, Enter, Tab, Backspace, Delete, Escape, CtrlC,
+    Up, Down, Left, Right, Home, End, PageUp, PageDown, Other
+};
+
+struct Key {
+    KeyCode code;
+    int ch = 0;  // The character for KeyCode::Char
+};
+
+Key read_key() {
+    std::cout.flush();  // Show everything written so far before waiting
+    int ch = _getch();
+    switch (ch) {
+        case 13: return {KeyCode::Enter};
+        case 9: return {KeyCode::Tab};
+        case 8: return {KeyCode::Backspace};
+        case 127: return {KeyCode::Delete};
+        case 27: return {KeyCode::Escape};
+        case 3: return {KeyCode::CtrlC};
+        case 0:
+        case 224:
+            switch (_getch()) {
+                case 72: return {KeyCode::Up};
+                case 80: return {KeyCode::Down};
+                case 75: return {KeyCode::Left};
+                case 77: return {KeyCode::Right};
+                case 71: return {KeyCode::Home};
+                case 79: return {KeyCode::End};
+                case 73: return {KeyCode::PageUp};
+                case 81: return {KeyCode::PageDown};
+                case 83: return {KeyCode::Delete};
+                default: return {KeyCode::Other};
+            }
+        default:
+            return {KeyCode::Char, ch};
+    }
+}
+
+// True when stdout is an interactive console rather than a file or pipe
+bool stdout_is_console() {
+    if (builtin_stdout) return false;
+    HANDLE console = GetStdHandle(STD_OUTPUT_HANDLE);
+    CONSOLE_SCREEN_BUFFER_INFO info;
+    return GetFileType(console) == FILE_TYPE_CHAR && GetConsoleScreenBufferInfo(console, &info);
+}
+
+// A full-screen view on an alternate console buffer, so the shell's own
+// screen and scrollback come back untouched when it closes. Callers fill a
+// frame row by row; present() compares it with what is already on screen
+// and writes only the changed span of each row.
+class ConsoleScreen {
+private:
+    HANDLE previous_ = INVALID_HANDLE_VALUE;
+    ScopedHandle screen_;
+    int rows_ = 0;
+    int cols_ = 0;
+    std::vector<CHAR_INFO> frame_;
+    std::vector<CHAR_INFO> shown_;
+    
+    static bool same(const CHAR_INFO& a, const CHAR_INFO& b) {
+        return a.Char.AsciiChar == b.Char.AsciiChar && a.Attributes == b.Attributes;
+    }
+    
+    // Pick up the window size; a resize forces a full repaint
+    void measure() {
+        CONSOLE_SCREEN_BUFFER_INFO info;
+        if (!GetConsoleScreenBufferInfo(screen_.get(), &info)) return;
+        int rows = std::max(2, info.srWindow.Bottom - info.srWindow.Top + 1);
+        int cols = std::max(10, info.srWindow.Right - info.srWindow.Left + 1);
+        if (rows == rows_ && cols == cols_) return;
+        
+        rows_ = rows;
+        cols_ = cols;
+        frame_.assign(static_cast<size_t>(rows_) * cols_, CHAR_INFO{});
+        shown_.assign(frame_.size(), CHAR_INFO{});
+        for (auto& cell : shown_) cell.Attributes = 0xFFFF;  // Matches nothing
+    }
+    
+public:
+    ConsoleScreen() = default;
+    ConsoleScreen(const ConsoleScreen&) = delete;
+    ConsoleScreen& operator=(const ConsoleScreen&) = delete;
+    
+    ~ConsoleScreen() {
+        if (screen_) SetConsoleActiveScreenBuffer(previous_);
+    }
+    
+    bool open() {
+        std::cout.flush();
+        previous_ = GetStdHandle(STD_OUTPUT_HANDLE);
+        screen_.reset(CreateConsoleScreenBuffer(GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                                                nullptr, CONSOLE_TEXTMODE_BUFFER, nullptr));
+        if (!screen_ || !SetConsoleActiveScreenBuffer(screen_.get())) {
+            screen_.reset();
+            return false;
+        }
+        measure();
+        return rows_ > 0;
+    }
+    
+    HANDLE handle() const { return screen_.get(); }
+    int rows() const { return rows_; }
+    int cols() const { return cols_; }
+    
+    // Start a new frame, picking up any change of window size
+    void begin() {
+        measure();
+    }
+    
+    // Fill a row of the frame from column `col` on, expanding tabs and
+    // padding with blanks to the right edge
+    void put(int row, int col, std::string_view text, WORD attributes) {
+        if (row < 0 || row >= rows_) return;
+        CHAR_INFO* cells = frame_.data() + static_cast<size_t>(row) * cols_;
+        
+        for (size_t i = 0; i < text.size() && col < cols_; ++i) {
+            char c = text[i];
+            int repeat = c == '\t' ? 8 - col % 8 : 1;
+            if (c == '\t') c = ' ';
+            else if (c == '\r' || c == '\n' || (c >= 0 && !std::isprint(static_cast<unsigned char>(c)))) c = '?';
+            for (; repeat > 0 && col < cols_; --repeat, ++col) {
+                cells[col].Char.AsciiChar = c;
+                cells[col].Attributes = attributes;
+            }
+        }
+        for (; col < cols_; ++col) {
+            cells[col].Char.AsciiChar = ' ';
+            cells[col].Attributes = attributes;
+        }
+    }
+    
+    // Write each row's changed span and place the cursor
+    void present(int cursor_row, int cursor_col) {
+        for (int row = 0; row < rows_; ++row) {
+            size_t base = static_cast<size_t>(row) * cols_;
+            int first = 0, last = cols_ - 1;
+            while (first < cols_ && same(frame_[base + first], shown_[base + first])) first++;
+            if (first == cols_) continue;
+            while (last > first && same(frame_[base + last], shown_[base + last])) last--;
+            
+            SMALL_RECT region = {static_cast<SHORT>(first), static_cast<SHORT>(row),
+                                 static_cast<SHORT>(last), static_cast<SHORT>(row)};
+            WriteConsoleOutputA(screen_.get(), frame_.data() + base,
+                                {static_cast<SHORT>(cols_), 1}, {static_cast<SHORT>(first), 0}, &region);
+            std::copy(frame_.begin() + base + first, frame_.begin() + base + last + 1, shown_.begin() + base + first);
+        }
+        SetConsoleCursorPosition(screen_.get(), {static_cast<SHORT>(std::min(cursor_col, cols_ - 1)),
+                                                 static_cast<SHORT>(std::min(cursor_row, rows_ - 1))});
+    }
+};
+
+void redraw_line(const std::string& prompt, const std::string& line) {
+    std::cout << "\r" << std::string(120, ' ') << "\r";
+    
+    const Theme theme;
+    ColorGuard guard(theme.prompt_color);
+    std::cout << prompt;
+    
+    console_output.set_color(theme.default_color);
+    std::cout << line;
+    std::cout.flush();
+}
+
+std::string read_line(ShellState& state) {
+    std::string prompt_template = state.config.prompt_format;
+    std::string cwd = get_current_directory_prompt();
+    
+    // Simple variable substitution for prompt
+    size_t pos = prompt_template.find("{cwd}");
+    if (pos != std::string::npos) {
+        prompt_template.replace(pos, 5, cwd);
+    }
+    
+    std::string line;
+    size_t cursor_pos = 0;
+    
+    auto redraw_with_cursor = [&]() {
+        // Move to beginning of line
+        std::cout << "\r";
+        
+        // Draw prompt
+        const Theme theme;
+        ColorGuard guard(theme.prompt_color);
+        std::cout << prompt_template;
+        
+        // Draw line content
+        console_output.set_color(theme.default_color);
+        std::cout << line;
+        
+        // Add a few spaces to clear any leftover characters, then backspace
+        std::cout << "  \b\b";
+        
+        // Position cursor correctly
+        if (cursor_pos < line.length()) {
+            // Move cursor back to correct position
+            for (size_t i = cursor_pos; i < line.length(); ++i) {
+                std::cout << '\b';
+            }
+        }
+        std::cout.flush();
+    };
+    
+    redraw_with_cursor();
+    KeyCode last_key = KeyCode::Other;
+
+    while (true) {
+        Key key = read_key();
+        
+        if (key.code == KeyCode::Enter) {
+            std::cout << "\n";
+            break;
+        } else if (key.code == KeyCode::Up) {
+            if (state.history_index > 0 && !state.history.empty()) {
+                state.history_index--;
+                line = state.history[state.history_index];
+                cursor_pos = line.length();
+                redraw_with_cursor();
+            }
+        } else if (key.code == KeyCode::Down) {
+            if (state.history_index < state.history.size()) {
+                state.history_index++;
+                line = (state.history_index < state.history.size()) ? 
+                       state.history[state.history_index] : "";
+                cursor_pos = line.length();
+                redraw_with_cursor();
+            }
+        } else if (key.code == KeyCode::Left) {
+            if (cursor_pos > 0) {
+                cursor_pos--;
+                std::cout << '\b';
+                std::cout.flush();
+            }
+        } else if (key.code == KeyCode::Right) {
+            if (cursor_pos < line.length()) {
+                std::cout << line[cursor_pos];
+                cursor_pos++;
+                std::cout.flush();
+            }
+        } else if (key.code == KeyCode::Home) {
+            while (cursor_pos > 0) {
+                cursor_pos--;
+                std::cout << '\b';
+            }
+            std::cout.flush();
+        } else if (key.code == KeyCode::End) {
+            while (cursor_pos < line.length()) {
+                std::cout << line[cursor_pos];
+                cursor_pos++;
+            }
+            std::cout.flush();
+        } else if (key.code == KeyCode::Tab && state.config.auto_complete) {
+            std::string prefix = line.substr(0, cursor_pos);
+            auto completions = get_completions(prefix, state);
+            if (completions.empty()) continue;
+
+            if (completions.size() == 1) {
+                line = completions[0] + line.substr(cursor_pos);
+                cursor_pos = completions[0].length();
+            } else {
+                std::string lcp = find_longest_common_prefix(completions);
+                if (!lcp.empty() && lcp.length() > prefix.length()) {
+                    line = lcp + line.substr(cursor_pos);
+                    cursor_pos = lcp.length();
+                } else if (last_key == KeyCode::Tab) { // Double tab
+                    std::cout << "\n";
+                    for (size_t i = 0; i < completions.size(); ++i) {
+                        std::cout << std::format("{:<20}", completions[i]);
+                        if ((i + 1) % 4 == 0) std::cout << "\n";
+                    }
+                    if (completions.size() % 4 != 0) std::cout << "\n";
+                }
+            }
+            redraw_with_cursor();
+        } else if (key.code == KeyCode::Backspace) {
+            if (cursor_pos > 0) {
+                line.erase(cursor_pos - 1, 1);
+                cursor_pos--;
+                redraw_with_cursor();
+            }
+        } else if (key.code == KeyCode::Delete) {
+            if (cursor_pos < line.length()) {
+                line.erase(cursor_pos, 1);
+                redraw_with_cursor();
+            }
+        } else if (key.code == KeyCode::CtrlC) {
+            std::cout << "^C\n";
+            line.clear();
+            cursor_pos = 0;
+            redraw_with_cursor();
+        } else if (key.code == KeyCode::Char && isprint(key.ch)) { // Printable characters
+            char c = static_cast<char>(key.ch);
+            
+            if (cursor_pos == line.length()) {
+                // Simple case: adding to end of line
+                line += c;
+                cursor_pos++;
+                std::cout << c;
+                std::cout.flush();
+            } else {
+                // Complex case: inserting in middle
+                line.insert(cursor_pos, 1, c);
+                cursor_pos++;
+                redraw_with_cursor();
+            }
+        }
+        
+        last_key = key.code;
+    }
+
+    // Add to history
+    if (!line.empty() && (state.history.empty() || state.history.back() != line)) {
+        if (state.history.size() >= state.config.max_history) {
+            state.history.erase(state.history.begin());
+        }
+        state.history.push_back(line);
+    }
+    state.history_index = state.history.size();
+    
+    return line;
+}
+
+std::vector<std::string> tokenize(std::string_view str) {
+    std::vector<std::string> tokens;
+    std::string current_token;
+    bool in_quotes = false;
+    char quote_char = '\0';
+    
+    for (char c : str) {
+        if ((c == '"' || c == '\'') && !in_quotes) {
+            in_quotes = true;
+            quote_char = c;
+        } else if (c == quote_char && in_quotes) {
+            in_quotes = false;
+            quote_char = '\0';
+        } else if (std::isspace(c) && !in_quotes) {
+            if (!current_token.empty()) {
+                tokens.push_back(current_token);
+                current_token.clear();
+            }
+        } else {
+            current_token += c;
+        }
+    }
+    
+    if (!current_token.empty()) {
+        tokens.push_back(current_token);
+    }
+    
+    return tokens;
+}
+
+// Split background marker, redirections and arguments out of a command
+// string whose variables have already been substituted
+Command split_command(std::string temp_str) {
+    Command cmd;
+    
+    // Check for background execution
+    if (temp_str.ends_with('&')) {
+        cmd.background = true;
+        temp_str.pop_back(); // Remove the '&'
+        // Trim trailing whitespace
+        size_t last = temp_str.find_last_not_of(" \t");
+        if(std::string::npos != last) temp_str = temp_str.substr(0, last + 1);
+    }
+    
+    // Parse stderr redirection (2>> and 2>)
+    size_t pos_err_append = temp_str.find("2>>");
+    size_t pos_err = (pos_err_append != std::string::npos) ? std::string::npos : temp_str.find("2>");
+    
+    if (pos_err_append != std::string::npos) {
+        auto tokens = tokenize(temp_str.substr(pos_err_append + 3));
+        if (!tokens.empty()) {
+            cmd.error_file = tokens[0];
+            cmd.append_error = true;
+        }
+        temp_str = temp_str.substr(0, pos_err_append);
+    } else if (pos_err != std::string::npos) {
+        auto tokens = tokenize(temp_str.substr(pos_err + 2));
+        if (!tokens.empty()) {
+            cmd.error_file = tokens[0];
+        }
+        temp_str = temp_str.substr(0, pos_err);
+    }
+    
+    // Parse output redirection (>> and >)
+    size_t pos_append = temp_str.find(">>");
+    size_t pos_out = (pos_append != std::string::npos) ? std::string::npos : temp_str.find('>');
+    
+    if (pos_append != std::string::npos) {
+        auto tokens = tokenize(temp_str.substr(pos_append + 2));
+        if (!tokens.empty()) {
+            cmd.output_file = tokens[0];
+            cmd.append_output = true;
+        }
+        temp_str = temp_str.substr(0, pos_append);
+    } else if (pos_out != std::string::npos) {
+        auto tokens = tokenize(temp_str.substr(pos_out + 1));
+        if (!tokens.empty()) {
+            cmd.output_file = tokens[0];
+        }
+        temp_str = temp_str.substr(0, pos_out);
+    }
+    
+    // Parse input redirection (<)
+    size_t pos_in = temp_str.find('<');
+    if (pos_in != std::string::npos) {
+        auto tokens = tokenize(temp_str.substr(pos_in + 1));
+        if (!tokens.empty()) {
+            cmd.input_file = tokens[0];
+        }
+        temp_str = temp_str.substr(0, pos_in);
+    }
+    
+    cmd.args = tokenize(temp_str);
+    
+    // Expand paths in arguments
+    for (auto& arg : cmd.args) {
+        arg = expand_path(arg);
+    }
+    
+    return cmd;
+}
+
+Command parse_command(std::string_view command_str, const ShellState& state) {
+    return split_command(substitute_variables(std::string(command_str), state));
+}
+
+// Split a pipeline without substituting variables; used for stored command text
+std::vector<Command> split_pipeline(const std::string& line) {
+    std::vector<Command> commands;
+    std::stringstream ss(line);
+    std::string segment;
+    
+    while (std::getline(ss, segment, '|')) {
+        commands.push_back(split_command(segment));
+    }
+    
+    return commands;
+}
+
+std::vector<Command> parse_pipeline(const std::string& line, const ShellState& state) {
+    if (line.empty()) return {};
+    
+    std::vector<Command> commands;
+    std::stringstream ss(line);
+    std::string segment;
+    
+    while (std::getline(ss, segment, '|')) {
+        commands.push_back(parse_command(segment, state));
+    }
+    
+    return commands;
+}
+
+// A positional placeholder past MAX_TEMPLATE_POSITION is kept as literal text
+// and reported through error
+TemplateToken compile_template_token(const std::string& text, std::vector<std::string>& param_names,
+                                     std::string& error) {
+    TemplateToken token;
+    std::string literal;
+    
+    auto flush_literal = [&]() {
+        if (!literal.empty()) {
+            bool has_variables = literal.find('$') != std::string::npos;
+            token.push_back({TemplateSegment::Kind::Literal, std::move(literal), 0, has_variables});
+            literal.clear();
+        }
+    };
+    
+    size_t pos = 0;
+    while (pos < text.length()) {
+        size_t open = text.find('{', pos);
+        size_t close = open == std::string::npos ? std::string::npos : text.find('}', open + 1);
+        if (close == std::string::npos) {
+            literal.append(text, pos, std::string::npos);
+            break;
+        }
+        
+        // ${VAR} belongs to variable substitution, not to the template
+        std::string param = text.substr(open + 1, close - open - 1);
+        if (param.empty() || (open > 0 && text[open - 1] == '$')) {
+            literal.append(text, pos, close + 1 - pos);
+            pos = close + 1;
+            continue;
+        }
+        
+        literal.append(text, pos, open - pos);
+        flush_literal();
+        
+        if (param == "all") {
+            token.push_back({TemplateSegment::Kind::AllArgs, ""});
+        } else if (param == "each") {
+            token.push_back({TemplateSegment::Kind::Each, ""});
+        } else if (std::all_of(param.begin(), param.end(), [](unsigned char c) { return std::isdigit(c); })) {
+            size_t index = 0;
+            auto [end, ec] = std::from_chars(param.data(), param.data() + param.size(), index);
+            if (ec != std::errc() || index > MAX_TEMPLATE_POSITION) {
+                if (error.empty()) {
+                    error = std::format("placeholder {{{}}} is out of range (highest is {{{}}})", param, MAX_TEMPLATE_POSITION);
+                }
+                literal.append(text, open, close + 1 - open);
+                pos = close + 1;
+                continue;
+            }
+            token.push_back({TemplateSegment::Kind::Positional, "", index});
+        } else {
+            if (std::find(param_names.begin(), param_names.end(), param) == param_names.end()) {
+                param_names.push_back(param);
+            }
+            token.push_back({TemplateSegment::Kind::Named, std::move(param)});
+        }
+        pos = close + 1;
+    }
+    flush_literal();
+    
+    return token;
+}
+
+void RegisteredCommand::compile_template() {
+    stages.clear();
+    param_names.clear();
+    error.clear();
+    
+    // Placeholders survive tokenizing and redirection parsing untouched, so the
+    // template goes through the same parser as a typed command line
+    std::stringstream ss(template_cmd);
+    std::string segment;
+    
+    while (std::getline(ss, segment, '|')) {
+        Command raw = split_command(segment);
+        TemplateStage stage;
+        
+        for (const auto& arg : raw.args) {
+            stage.args.push_back(compile_template_token(arg, param_names, error));
+        }
+        stage.input_file = compile_template_token(raw.input_file, param_names, error);
+        stage.output_file = compile_template_token(raw.output_file, param_names, error);
+        stage.error_file = compile_template_token(raw.error_file, param_names, error);
+        stage.append_output = raw.append_output;
+        stage.append_error = raw.append_error;
+        stage.background = raw.background;
+        
+        stages.push_back(std::move(stage));
+    }
+    
+    auto uses_each = [](const TemplateToken& token) {
+        return std::any_of(token.begin(), token.end(),
+                           [](const TemplateSegment& seg) { return seg.kind == TemplateSegment::Kind::Each; });
+    };
+    fan_out = std::any_of(stages.begin(), stages.end(), [&](const TemplateStage& stage) {
+        return std::any_of(stage.args.begin(), stage.args.end(), uses_each) || uses_each(stage.input_file) ||
+               uses_each(stage.output_file) || uses_each(stage.error_file);
+    });
+    
+    cache = false;
+    cache_inputs.clear();
+    cache_outputs.clear();
+    
+    for (const auto& option : tokenize(options)) {
+        std::vector<TemplateToken>* files = nullptr;
+        if (option == "--cache") {
+            cache = true;
+        } else if (option.starts_with("--inputs=")) {
+            files = &cache_inputs;
+        } else if (option.starts_with("--outputs=")) {
+            files = &cache_outputs;
+        }
+        if (!files) continue;
+        
+        cache = true;
+        std::stringstream list(option.substr(option.find('=') + 1));
+        std::string file;
+        while (std::getline(list, file, ',')) {
+            if (!file.empty()) files->push_back(compile_template_token(file, param_names, error));
+        }
+    }
+}
+
+struct ParsedArgs {
+    std::map<char, bool> flags;
+    std::map<std::string, std::string> long_flags;
+    std::vector<std::string> non_flag_args;
+};
+
+ParsedArgs parse_args(std::span<const char*> args) {
+    ParsedArgs result;
+    
+    for (size_t i = 1; i < args.size(); ++i) {
+        std::string arg = args[i];
+        
+        if (arg.starts_with("--")) {
+            // Long flag
+            auto eq_pos = arg.find('=');
+            if (eq_pos != std::string::npos) {
+                std::string key = arg.substr(2, eq_pos - 2);
+                std::string value = arg.substr(eq_pos + 1);
+                result.long_flags[key] = value;
+            } else {
+                result.long_flags[arg.substr(2)] = "";
+            }
+        } else if (arg.starts_with('-') && arg.length() > 1) {
+            // Short flags
+            for (size_t j = 1; j < arg.length(); ++j) {
+                result.flags[arg[j]] = true;
+            }
+        } else {
+            result.non_flag_args.push_back(arg);
+        }
+    }
+    
+    return result;
+}
+
+// --- JSON Lines Output ---
+// ls, ps, jobs and find print one JSON object per entry when given --json or
+// when JSHELL_OUTPUT=jsonl is set (as a shell or environment variable).
+// Records are serialized straight from the entry values into one reused
+// buffer: numbers with std::to_chars, strings escaped in place, so a record
+// costs no allocations once the buffer has grown to fit.
+class JsonWriter {
+private:
+    std::string& out_;
+    bool first_ = true;
+    
+    void key(std::string_view name) {
+        out_ += first_ ? "{\"" : ",\"";
+        first_ = false;
+        out_ += name;
+        out_ += "\":";
+    }
+    
+public:
+    // Starts a record at the end of out
+    explicit JsonWriter(std::string& out) : out_(out) {}
+    
+    JsonWriter& field(std::string_view name, std::string_view value) {
+        key(name);
+        out_ += '"';
+        for (char c : value) {
+            switch (c) {
+                case '"': out_ += "\\\""; break;
+                case '\\': out_ += "\\\\"; break;
+                case '\n': out_ += "\\n"; break;
+                case '\r': out_ += "\\r"; break;
+                case '\t': out_ += "\\t"; break;
+                default:
+                    if (static_cast<unsigned char>(c) < 0x20) {
+                        constexpr const char* hex = "0123456789abcdef";
+                        out_ += "\\u00";
+                        out_ += hex[(c >> 4) & 0xF];
+                        out_ += hex[c & 0xF];
+                    } else {
+                        out_ += c;
+                    }
+            }
+        }
+        out_ += '"';
+        return *this;
+    }
+    
+    JsonWriter& field(std::string_view name, const char* value) {
+        return field(name, std::string_view(value));
+    }
+    
+    JsonWriter& field(std::string_view name, bool value) {
+        key(name);
+        out_ += value ? "true" : "false";
+        return *this;
+    }
+    
+    template <std::integral T>
+    JsonWriter& field(std::string_view name, T value) {
+        key(name);
+        char digits[24];
+        auto result = std::to_chars(digits, digits + sizeof(digits), value);
+        out_.append(digits, result.ptr);
+        return *this;
+    }
+    
+    JsonWriter& null_field(std::string_view name) {
+        key(name);
+        out_ += "null";
+        return *this;
+    }
+    
+    void end() {
+        out_ += first_ ? "{}\n" : "}\n";
+    }
+};
+
+// True if the builtin should emit records: JSON Lines, or typed records when
+// it feeds another record builtin. A --json argument is removed from args so
+// the builtin parses the rest as usual.
+bool emit_records(const ShellState& state, std::span<const char*>& args) {
+    auto flag = std::find_if(args.begin(), args.end(), [](const char* arg) { return std::strcmp(arg, "--json") == 0; });
+    if (flag != args.end()) {
+        std::rotate(flag, flag + 1, args.end());
+        args = args.first(args.size() - 1);
+        return true;
+    }
+    if (record_output) return true;
+    
+    if (auto it = state.variables.find("JSHELL_OUTPUT"); it != state.variables.end()) {
+        return it->second == "jsonl";
+    }
+    char* value = nullptr;
+    size_t len;
+    bool jsonl = false;
+    if (_dupenv_s(&value, &len, "JSHELL_OUTPUT") == 0 && value) {
+        jsonl = std::strcmp(value, "jsonl") == 0;
+        free(value);
+    }
+    return jsonl;
+}
+
+// Write a finished batch of records and start the next
+void flush_records(std::string& records) {
+    std::cout.write(records.data(), static_cast<std::streamsize>(records.size()));
+    records.clear();
+}
+
+// Seconds since the Unix epoch
+int64_t unix_time(fs::file_time_type file_time) {
+    auto system_time = std::chrono::time_point_cast<std::chrono::system_clock::duration>(
+        file_time - fs::file_time_type::clock::now() + std::chrono::system_clock::now());
+    return std::chrono::duration_cast<std::chrono::seconds>(system_time.time_since_epoch()).count();
+}
+
+// Paths in records are always UTF-8, whatever the console code page
+std::string utf8_path(const fs::path& path) {
+    std::u8string text = path.u8string();
+    return std::string(text.begin(), text.end());
+}
+
+// Wide text from the system in a narrow code page: UTF-8 for records, the
+// ANSI code page for console text
+std::string narrow_text(std::wstring_view text, UINT code_page = CP_UTF8) {
+    if (text.empty()) return {};
+    int length = WideCharToMultiByte(code_page, 0, text.data(), static_cast<int>(text.size()), nullptr, 0, nullptr,
+                                     nullptr);
+    std::string out(std::max(length, 0), '\0');
+    WideCharToMultiByte(code_page, 0, text.data(), static_cast<int>(text.size()), out.data(), length, nullptr, nullptr);
+    return out;
+}
+
+// Text in the ANSI code page, such as a typed command line, as UTF-8
+std::string utf8_from_ansi(std::string_view text) {
+    if (text.empty()) return {};
+    int length = MultiByteToWideChar(CP_ACP, 0, text.data(), static_cast<int>(text.size()), nullptr, 0);
+    std::wstring wide(std::max(length, 0), L'\0');
+    MultiByteToWideChar(CP_ACP, 0, text.data(), static_cast<int>(text.size()), wide.data(), length);
+    return narrow_text(wide);
+}
+
+// --- Session Transcript ---
+// With transcript set, every interactive command line, the console output
+// it produces and its exit code are logged to transcript.jslog in the shell
+// directory. Producers only allocate a record and push it onto a lock-free
+// stack; a writer thread takes the whole stack every TRANSCRIPT_FLUSH_INTERVAL,
+// turns it into JSON Lines, and appends them as one compressed frame:
+// [magic][u32 text size][u32 compressed size][lz_compress'd text]. When the
+// file passes transcript_max_size it becomes transcript.jslog.1, shifting
+// older files up and dropping those past transcript_files.
+constexpr std::string_view TRANSCRIPT_MAGIC = "JSL1";
+constexpr const char* TRANSCRIPT_FILE = "transcript.jslog";
+constexpr auto TRANSCRIPT_FLUSH_INTERVAL = std::chrono::milliseconds(200);
+constexpr size_t TRANSCRIPT_FRAME_SIZE = 1 << 20;  // Text per frame, at most about
+
+struct TranscriptRecord {
+    enum class Kind { Command, Stdout, Stderr, Exit };
+    
+    Kind kind;
+    uint64_t sequence;  // Command number within the session
+    int64_t time_ms;    // Unix time
+    int exit_code = 0;
+    std::string text;
+    TranscriptRecord* next = nullptr;
+};
+
+class SessionLog {
+private:
+    std::atomic<TranscriptRecord*> pending_{nullptr};  // Newest first
+    std::atomic<bool> enabled_{false};
+    std::atomic<uint64_t> running_{0};  // Command whose output is logged; 0 for none
+    uint64_t sequence_ = 0;
+    uint64_t open_ = 0;  // Command started and not yet finished
+    
+    std::mutex write_mutex_;  // The file and its settings
+    fs::path path_;
+    size_t max_size_ = 0;
+    size_t keep_ = 0;
+    ScopedHandle file_;
+    
+    std::thread writer_;
+    std::mutex wake_mutex_;
+    std::condition_variable wake_;
+    bool stopping_ = false;
+    
+    static int64_t now_ms() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+    
+    void push(TranscriptRecord* record) {
+        record->next = pending_.load(std::memory_order_relaxed);
+        while (!pending_.compare_exchange_weak(record->next, record, std::memory_order_release,
+                                               std::memory_order_relaxed)) {}
+    }
+    
+    // Everything pushed so far, oldest first
+    TranscriptRecord* take_all() {
+        TranscriptRecord* list = pending_.exchange(nullptr, std::memory_order_acquire);
+        TranscriptRecord* ordered = nullptr;
+        while (list) {
+            TranscriptRecord* next = list->next;
+            list->next = ordered;
+            ordered = list;
+            list = next;
+        }
+        return ordered;
+    }
+    
+    void open_file() {
+        file_.reset(CreateFileA(path_.string().c_str(), FILE_APPEND_DATA, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr));
+    }
+    
+    // Another shell may have rotated the file already; only rotate what is
+    // still too large once reopened
+    void rotate_if_full() {
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(file_.get(), &size) || static_cast<size_t>(size.QuadPart) < max_size_) return;
+        open_file();
+        if (file_ && GetFileSizeEx(file_.get(), &size) && static_cast<size_t>(size.QuadPart) < max_size_) return;
+        file_.reset();
+        
+        std::error_code ec;
+        auto numbered = [&](size_t n) { return fs::path(path_.string() + "." + std::to_string(n)); };
+        fs::remove(numbered(keep_), ec);
+        for (size_t n = keep_; n > 1; --n) fs::rename(numbered(n - 1), numbered(n), ec);
+        if (keep_ > 0) fs::rename(path_, numbered(1), ec);
+        else fs::remove(path_, ec);
+        open_file();
+    }
+    
+    void write_frame(const std::string& text) {
+        if (!file_) open_file();
+        if (!file_) return;
+        std::string packed = lz_compress(text);
+        std::string frame(TRANSCRIPT_MAGIC);
+        append_u32(frame, static_cast<uint32_t>(text.size()));
+        append_u32(frame, static_cast<uint32_t>(packed.size()));
+        frame += packed;
+        
+        // One write per frame, so frames from several shells never interleave
+        DWORD written = 0;
+        WriteFile(file_.get(), frame.data(), static_cast<DWORD>(frame.size()), &written, nullptr);
+        rotate_if_full();
+    }
+    
+    void write_pending() {
+        std::lock_guard<std::mutex> lock(write_mutex_);
+        TranscriptRecord* records = take_all();
+        if (!records) return;
+        
+        std::string text;
+        while (records) {
+            std::unique_ptr<TranscriptRecord> record(records);
+            records = record->next;
+            
+            // Output arrives in whatever pieces it was written; join runs of it
+            while (record->kind == TranscriptRecord::Kind::Stdout || record->kind == TranscriptRecord::Kind::Stderr) {
+                if (!records || records->kind != record->kind || records->sequence != record->sequence) break;
+                std::unique_ptr<TranscriptRecord> next(records);
+                records = next->next;
+                record->text += next->text;
+            }
+            
+            JsonWriter json(text);
+            json.field("pid", GetCurrentProcessId()).field("seq", record->sequence).field("time_ms", record->time_ms);
+            switch (record->kind) {
+                case TranscriptRecord::Kind::Command: json.field("type", "command").field("text", record->text); break;
+                case TranscriptRecord::Kind::Stdout: json.field("type", "stdout").field("text", record->text); break;
+                case TranscriptRecord::Kind::Stderr: json.field("type", "stderr").field("text", record->text); break;
+                case TranscriptRecord::Kind::Exit: json.field("type", "exit").field("code", record->exit_code); break;
+            }
+            json.end();
+            
+            if (text.size() >= TRANSCRIPT_FRAME_SIZE) {
+                write_frame(text);
+                text.clear();
+            }
+        }
+        if (!text.empty()) write_frame(text);
+    }
+    
+    void run() {
+        std::unique_lock<std::mutex> lock(wake_mutex_);
+        while (true) {
+            bool stopping = wake_.wait_for(lock, TRANSCRIPT_FLUSH_INTERVAL, [&] { return stopping_; });
+            lock.unlock();
+            write_pending();
+            lock.lock();
+            if (stopping) return;
+        }
+    }
+    
+public:
+    ~SessionLog() {
+        stop();
+    }
+    
+    // Start or stop logging to path; called before every command so config
+    // changes take effect
+    void configure(bool enabled, const fs::path& path, size_t max_size, size_t keep) {
+        if (!enabled) {
+            stop();
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(write_mutex_);
+            max_size_ = max_size;
+            keep_ = keep;
+            if (writer_.joinable() && path == path_) return;
+        }
+        
+        stop();
+        path_ = path;
+        stopping_ = false;
+        enabled_ = true;
+        writer_ = std::thread(&SessionLog::run, this);
+    }
+    
+    // Write out everything logged and end the writer thread
+    void stop() {
+        enabled_ = false;
+        running_ = 0;
+        if (writer_.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(wake_mutex_);
+                stopping_ = true;
+            }
+            wake_.notify_one();
+            writer_.join();
+        }
+        write_pending();  // Records pushed while the writer was finishing
+        std::lock_guard<std::mutex> lock(write_mutex_);
+        file_.reset();
+    }
+    
+    // Write out what is queued now rather than at the next interval
+    void flush() {
+        if (enabled_) write_pending();
+    }
+    
+    void command_started(const std::string& line) {
+        if (!enabled_) return;
+        open_ = running_ = ++sequence_;
+        push(new TranscriptRecord{TranscriptRecord::Kind::Command, open_, now_ms(), 0, line});
+    }
+    
+    void command_finished(int exit_code) {
+        if (!enabled_ || open_ == 0) return;
+        running_ = 0;
+        push(new TranscriptRecord{TranscriptRecord::Kind::Exit, open_, now_ms(), exit_code});
+        open_ = 0;
+    }
+    
+    // Leave the rest of the current command's output out of the transcript
+    void omit_output() {
+        running_ = 0;
+    }
+    
+    void output(bool error_stream, const char* text, size_t count) {
+        uint64_t sequence = running_.load(std::memory_order_relaxed);
+        if (sequence == 0 || count == 0) return;
+        auto kind = error_stream ? TranscriptRecord::Kind::Stderr : TranscriptRecord::Kind::Stdout;
+        push(new TranscriptRecord{kind, sequence, now_ms(), 0, std::string(text, count)});
+    }
+};
+
+SessionLog session_log;
+
+void log_output(bool error_stream, const char* text, size_t count) {
+    session_log.output(error_stream, text, count);
+}
+
+// Decompress a transcript file and pass each frame's JSON Lines to visit.
+// A frame cut short by a crash ends the file; false if it cannot be read.
+bool read_transcript(const fs::path& path, const std::function<void(std::string_view)>& visit) {
+    MappedFile file;
+    if (!file.open(path.string())) return false;
+    std::string_view data = file.view();
+    
+    size_t pos = 0;
+    const size_t header = TRANSCRIPT_MAGIC.size() + 8;
+    while (data.size() - pos >= header && data.substr(pos, TRANSCRIPT_MAGIC.size()) == TRANSCRIPT_MAGIC) {
+        uint32_t size = read_u32(data.data() + pos + 4);
+        uint32_t packed = read_u32(data.data() + pos + 8);
+        if (data.size() - pos - header < packed) break;
+        auto text = lz_decompress(data.substr(pos + header, packed), size);
+        if (!text) break;
+        visit(*text);
+        pos += header + packed;
+    }
+    return true;
+}
+
+// --- Record Pipelines ---
+// Builtins piped into each other exchange typed records instead of text:
+// ls, ps, jobs and find produce them, and where, select and sort-by
+// transform them. Adjacent record stages are joined by a RecordChannel, so
+// a consumer compares sizes and pids as numbers without reparsing them.
+// Text is only rendered by the last builtin stage, or by the one feeding an
+// external process.
+using FieldValue = std::variant<std::monostate, bool, int64_t, std::string>;
+
+struct Record {
+    std::vector<std::pair<std::string, FieldValue>> fields;
+    
+    const FieldValue* find(std::string_view name) const {
+        for (const auto& [field, value] : fields) {
+            if (field == name) return &value;
+        }
+        return nullptr;
+    }
+};
+
+// Single-producer single-consumer ring. The producer only advances tail_ and
+// the consumer only advances head_, so neither side takes a lock; a side that
+// finds the ring full or empty yields until the other catches up. Slots are
+// swapped rather than moved, so record buffers circulate between the two
+// stages instead of being reallocated for every record.
+class RecordChannel {
+private:
+    static constexpr size_t CAPACITY = 1024;  // Power of two
+    std::unique_ptr<Record[]> slots_ = std::make_unique<Record[]>(CAPACITY);
+    alignas(64) std::atomic<size_t> head_{0};  // Next slot to read
+    alignas(64) std::atomic<size_t> tail_{0};  // Next slot to write
+    std::atomic<bool> closed_{false};          // Producer finished
+    std::atomic<bool> abandoned_{false};       // Consumer stopped reading
+    
+    static void pause(unsigned& spins) {
+        if (++spins < 64) std::this_thread::yield();
+        else Sleep(1);
+    }
+    
+public:
+    // Hands record to the consumer and takes back an old one; false once
+    // the consumer has stopped reading
+    bool push(Record& record) {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        unsigned spins = 0;
+        while (tail - head_.load(std::memory_order_acquire) == CAPACITY) {
+            if (abandoned_.load(std::memory_order_acquire)) return false;
+            pause(spins);
+        }
+        if (abandoned_.load(std::memory_order_acquire)) return false;
+        std::swap(slots_[tail & (CAPACITY - 1)], record);
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+    
+    // False at the end of the stream
+    bool pop(Record& record) {
+        size_t head = head_.load(std::memory_order_relaxed);
+        unsigned spins = 0;
+        while (head == tail_.load(std::memory_order_acquire)) {
+            // closed_ is read before tail_, so records pushed before close() aren't missed
+            if (closed_.load(std::memory_order_acquire) && head == tail_.load(std::memory_order_acquire)) {
+                return false;
+            }
+            pause(spins);
+        }
+        std::swap(slots_[head & (CAPACITY - 1)], record);
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+    
+    void close() { closed_.store(true, std::memory_order_release); }
+    void abandon() { abandoned_.store(true, std::memory_order_release); }
+    bool abandoned() const { return abandoned_.load(std::memory_order_acquire); }
+};
+
+// True once the next stage of this builtin's pipeline has stopped reading
+// (head has its lines, or a consumer failed). The builtin should then stop
+// as if it had finished: that's a clean stop, not an error.
+bool downstream_closed() {
+    return (builtin_stdout && builtin_stdout->broken()) || (record_output && record_output->abandoned());
+}
+
+// A producer's output: typed records into the next builtin's channel when
+// there is one, otherwise JSON Lines appended to out. Has JsonWriter's
+// interface, so a producer builds one per entry the same way.
+class RecordWriter {
+private:
+    static inline thread_local Record scratch_;  // Refilled in place for each record
+    JsonWriter json_;
+    RecordChannel* channel_ = record_output;
+    size_t count_ = 0;
+    
+    FieldValue& slot(std::string_view name) {
+        auto& fields = scratch_.fields;
+        if (count_ == fields.size()) fields.emplace_back();
+        fields[count_].first.assign(name);
+        return fields[count_++].second;
+    }
+    
+public:
+    explicit RecordWriter(std::string& out) : json_(out) {}
+    
+    RecordWriter& field(std::string_view name, std::string_view value) {
+        if (!channel_) {
+            json_.field(name, value);
+            return *this;
+        }
+        FieldValue& target = slot(name);
+        if (auto* text = std::get_if<std::string>(&target)) text->assign(value);
+        else target.emplace<std::string>(value);
+        return *this;
+    }
+    
+    RecordWriter& field(std::string_view name, const char* value) {
+        return field(name, std::string_view(value));
+    }
+    
+    RecordWriter& field(std::string_view name, bool value) {
+        if (channel_) slot(name) = value;
+        else json_.field(name, value);
+        return *this;
+    }
+    
+    template <std::integral T>
+    RecordWriter& field(std::string_view name, T value) {
+        if (channel_) slot(name) = static_cast<int64_t>(value);
+        else json_.field(name, value);
+        return *this;
+    }
+    
+    RecordWriter& null_field(std::string_view name) {
+        if (channel_) slot(name) = std::monostate{};
+        else json_.null_field(name);
+        return *this;
+    }
+    
+    // False if the next stage has stopped reading
+    bool end() {
+        if (!channel_) {
+            json_.end();
+            return true;
+        }
+        scratch_.fields.resize(count_);
+        return channel_->push(scratch_);
+    }
+};
+
+std::string field_text(const FieldValue& value) {
+    if (auto* number = std::get_if<int64_t>(&value)) return std::to_string(*number);
+    if (auto* text = std::get_if<std::string>(&value)) return *text;
+    if (auto* flag = std::get_if<bool>(&value)) return *flag ? "true" : "false";
+    return {};
+}
+
+// Null first, then by type; numbers compare as numbers
+std::weak_ordering compare_fields(const FieldValue& a, const FieldValue& b) {
+    if (a.index() != b.index()) return a.index() <=> b.index();
+    if (auto* number = std::get_if<int64_t>(&a)) return *number <=> std::get<int64_t>(b);
+    if (auto* text = std::get_if<std::string>(&a)) return text->compare(std::get<std::string>(b)) <=> 0;
+    if (auto* flag = std::get_if<bool>(&a)) return *flag <=> std::get<bool>(b);
+    return std::weak_ordering::equivalent;
+}
+
+// Parse one flat JSON object. Nested objects and arrays are kept as their
+// JSON text; anything that isn't an object returns false.
+bool parse_json_record(std::string_view line, Record& record) {
+    size_t pos = 0;
+    auto skip_space = [&]() {
+        while (pos < line.size() && std::isspace(static_cast<unsigned char>(line[pos]))) pos++;
+    };
+    auto parse_string = [&](std::string& out) {
+        out.clear();
+        pos++;  // Opening quote
+        while (pos < line.size() && line[pos] != '"') {
+            char c = line[pos++];
+            if (c != '\\' || pos >= line.size()) {
+                out += c;
+                continue;
+            }
+            char escape = line[pos++];
+            switch (escape) {
+                case 'n': out += '\n'; break;
+                case 'r': out += '\r'; break;
+                case 't': out += '\t'; break;
+                case 'b': out += '\b'; break;
+                case 'f': out += '\f'; break;
+                case 'u': {
+                    unsigned code = 0;
+                    if (pos + 4 > line.size() ||
+                        std::from_chars(line.data() + pos, line.data() + pos + 4, code, 16).ptr != line.data() + pos + 4) {
+                        return false;
+                    }
+                    pos += 4;
+                    if (code < 0x80) {
+                        out += static_cast<char>(code);
+                    } else if (code < 0x800) {
+                        out += static_cast<char>(0xC0 | (code >> 6));
+                        out += static_cast<char>(0x80 | (code & 0x3F));
+                    } else {
+                        out += static_cast<char>(0xE0 | (code >> 12));
+                        out += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+                        out += static_cast<char>(0x80 | (code & 0x3F));
+                    }
+                    break;
+                }
+                default: out += escape;
+            }
+        }
+        if (pos >= line.size()) return false;
+        pos++;  // Closing quote
+        return true;
+    };
+    
+    record.fields.clear();
+    skip_space();
+    if (pos >= line.size() || line[pos] != '{') return false;
+    pos++;
+    skip_space();
+    if (pos < line.size() && line[pos] == '}') return true;
+    
+    while (pos < line.size()) {
+        skip_space();
+        if (pos >= line.size() || line[pos] != '"') return false;
+        auto& [name, value] = record.fields.emplace_back();
+        if (!parse_string(name)) return false;
+        skip_space();
+        if (pos >= line.size() || line[pos] != ':') return false;
+        pos++;
+        skip_space();
+        if (pos >= line.size()) return false;
+        
+        if (line[pos] == '"') {
+            if (!parse_string(value.emplace<std::string>())) return false;
+        } else if (line[pos] == '{' || line[pos] == '[') {
+            size_t start = pos;
+            int depth = 0;
+            bool quoted = false;
+            for (; pos < line.size(); ++pos) {
+                char c = line[pos];
+                if (quoted) {
+                    if (c == '\\') pos++;
+                    else if (c == '"') quoted = false;
+                } else if (c == '"') {
+                    quoted = true;
+                } else if (c == '{' || c == '[') {
+                    depth++;
+                } else if ((c == '}' || c == ']') && --depth == 0) {
+                    pos++;
+                    break;
+                }
+            }
+            value = std::string(line.substr(start, pos - start));
+        } else {
+            size_t start = pos;
+            while (pos < line.size() && line[pos] != ',' && line[pos] != '}' &&
+                   !std::isspace(static_cast<unsigned char>(line[pos]))) {
+                pos++;
+            }
+            std::string_view token = line.substr(start, pos - start);
+            int64_t number = 0;
+            if (token == "null") value = std::monostate{};
+            else if (token == "true") value = true;
+            else if (token == "false") value = false;
+            else if (std::from_chars(token.data(), token.data() + token.size(), number).ptr == token.data() + token.size()) {
+                value = number;
+            } else {
+                value = std::string(token);  // Fractions and exponents stay text
+            }
+        }
+        
+        skip_space();
+        if (pos < line.size() && line[pos] == ',') {
+            pos++;
+            continue;
+        }
+        return pos < line.size() && line[pos] == '}';
+    }
+    return false;
+}
+
+// A consumer's input: the previous builtin's channel, or JSON Lines read
+// from a pipe. A line that isn't a JSON object becomes {"line": text}, so
+// plain text can be filtered too.
+class RecordReader {
+private:
+    RecordChannel* channel_ = record_input;
+    HANDLE pipe_ = builtin_stdin;
+    std::string pending_;
+    size_t consumed_ = 0;
+    std::vector<char> block_;
+    
+public:
+    explicit RecordReader(size_t block_size) : block_(block_size) {}
+    
+    bool connected() const { return channel_ || pipe_ != INVALID_HANDLE_VALUE; }
+    
+    bool next(Record& record) {
+        if (channel_) return channel_->pop(record);
+        if (pipe_ == INVALID_HANDLE_VALUE) return false;
+        
+        while (true) {
+            size_t line_end = pending_.find('\n', consumed_);
+            if (line_end == std::string::npos) {
+                pending_.erase(0, consumed_);
+                consumed_ = 0;
+                DWORD got = 0;
+                if (ReadFile(pipe_, block_.data(), static_cast<DWORD>(block_.size()), &got, nullptr) && got > 0) {
+                    pending_.append(block_.data(), got);
+                    continue;
+                }
+                if (pending_.empty()) return false;
+                line_end = pending_.size();  // Last line without a newline
+            }
+            
+            std::string_view line(pending_.data() + consumed_, line_end - consumed_);
+            consumed_ = std::min(line_end + 1, pending_.size());
+            if (line.ends_with('\r')) line.remove_suffix(1);
+            if (line.empty()) continue;
+            if (!parse_json_record(line, record)) {
+                record.fields.clear();
+                record.fields.emplace_back("line", std::string(line));
+            }
+            return true;
+        }
+    }
+};
+
+// Columns in order of first appearance; numbers right-aligned, nulls blank
+void print_record_table(const std::vector<Record>& records) {
+    std::vector<std::string> columns;
+    std::vector<size_t> widths;
+    for (const auto& record : records) {
+        for (const auto& [name, value] : record.fields) {
+            if (std::find(columns.begin(), columns.end(), name) == columns.end()) {
+                columns.push_back(name);
+                widths.push_back(name.size());
+            }
+        }
+    }
+    if (columns.empty()) return;
+    
+    std::vector<std::vector<std::string>> cells(records.size(), std::vector<std::string>(columns.size()));
+    std::vector<bool> numeric(columns.size(), true);
+    for (size_t row = 0; row < records.size(); ++row) {
+        for (size_t column = 0; column < columns.size(); ++column) {
+            const FieldValue* value = records[row].find(columns[column]);
+            if (!value) continue;
+            cells[row][column] = field_text(*value);
+            widths[column] = std::max(widths[column], cells[row][column].size());
+            if (!std::holds_alternative<int64_t>(*value) && !std::holds_alternative<std::monostate>(*value)) {
+                numeric[column] = false;
+            }
+        }
+    }
+    
+    auto print_row = [&](const std::vector<std::string>& row) {
+        std::string line;
+        for (size_t column = 0; column < columns.size(); ++column) {
+            if (column > 0) line += "  ";
+            std::string padding(widths[column] - row[column].size(), ' ');
+            if (numeric[column]) line += padding + row[column];
+            else if (column + 1 < columns.size()) line += row[column] + padding;
+            else line += row[column];
+        }
+        std::cout << line << '\n';
+    };
+    
+    print_row(columns);
+    std::vector<std::string> rules;
+    for (size_t width : widths) rules.push_back(std::string(width, '-'));
+    print_row(rules);
+    for (const auto& row : cells) print_row(row);
+}
+
+// A transforming builtin's output: the next builtin's channel, JSON Lines,
+// or a table printed once the input is exhausted
+class RecordOutput {
+private:
+    RecordChannel* channel_ = record_output;
+    bool json_;
+    std::string text_;
+    std::vector<Record> table_;
+    
+public:
+    explicit RecordOutput(bool json) : json_(json) {}
+    
+    // Takes the record's contents; false if the next stage has stopped reading
+    bool write(Record& record) {
+        if (channel_) return channel_->push(record);
+        if (!json_) {
+            table_.push_back(std::move(record));
+            return true;
+        }
+        JsonWriter json(text_);
+        for (const auto& [name, value] : record.fields) {
+            if (auto* number = std::get_if<int64_t>(&value)) json.field(name, *number);
+            else if (auto* text = std::get_if<std::string>(&value)) json.field(name, std::string_view(*text));
+            else if (auto* flag = std::get_if<bool>(&value)) json.field(name, *flag);
+            else json.null_field(name);
+        }
+        json.end();
+        if (text_.size() >= IO_BLOCK_SIZE) flush_records(text_);
+        return true;
+    }
+    
+    void finish() {
+        flush_records(text_);
+        print_record_table(table_);
+        table_.clear();
+    }
+};
+
+// Shared start of where, select and sort-by
+bool open_record_input(const RecordReader& reader, const char* name) {
+    if (reader.connected()) return true;
+    const Theme theme;
+    ColorGuard guard(theme.error_color);
+    std::cerr << std::format("jshell: {}: expects records from a pipeline, e.g. ls | {} ...\n", name, name);
+    return false;
+}
+
+// The process of an external pipeline stage, which another stage's thread
+// may end while it runs
+class StageProcess {
+private:
+    std::mutex mutex_;
+    HANDLE process_ = nullptr;
+    bool terminated_ = false;
+    
+public:
+    void started(HANDLE process) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        process_ = process;
+        if (terminated_) TerminateProcess(process_, 1);
+    }
+    
+    // Before the handle is closed
+    void finished() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        process_ = nullptr;
+    }
+    
+    void terminate() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        terminated_ = true;
+        if (process_) TerminateProcess(process_, 1);
+    }
+};
+
+int launch_process(Command& cmd, HANDLE hInput, HANDLE hOutput, HANDLE hError, ShellState* state = nullptr, bool wait = true,
+                   StageProcess* stage = nullptr) {
+    if (cmd.args.empty()) return 1;
+
+    STARTUPINFOA si = { sizeof(si) };
+    PROCESS_INFORMATION pi = { 0 };
+    
+    si.dwFlags |= STARTF_USESTDHANDLES;
+    si.hStdInput = hInput != INVALID_HANDLE_VALUE ? hInput : GetStdHandle(STD_INPUT_HANDLE);
+    si.hStdOutput = hOutput != INVALID_HANDLE_VALUE ? hOutput : GetStdHandle(STD_OUTPUT_HANDLE);
+    si.hStdError = hError != INVALID_HANDLE_VALUE ? hError : GetStdHandle(STD_ERROR_HANDLE);
+
+    ScopedHandle input_file, output_file, error_file;
+    
+    // A job outliving a server call must not hold the call's pipes open
+    ScopedHandle null_input, null_output;
+    if (cmd.background && detach_background_jobs) {
+        null_input.reset(CreateFileA("NUL", GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING,
+                                     FILE_ATTRIBUTE_NORMAL, nullptr));
+        null_output.reset(CreateFileA("NUL", GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING,
+                                      FILE_ATTRIBUTE_NORMAL, nullptr));
+        if (hInput == INVALID_HANDLE_VALUE) si.hStdInput = null_input.get();
+        if (hOutput == INVALID_HANDLE_VALUE) si.hStdOutput = null_output.get();
+        if (hError == INVALID_HANDLE_VALUE) si.hStdError = null_output.get();
+    }
+    
+    // Handle input redirection
+    if (!cmd.input_file.empty()) {
+        input_file.reset(CreateFileA(
+            cmd.input_file.c_str(),
+            GENERIC_READ,
+            FILE_SHARE_READ,
+            nullptr,
+            OPEN_EXISTING,
+            FILE_ATTRIBUTE_NORMAL,
+            nullptr
+        ));
+        
+        if (!input_file) {
+            const Theme theme;
+            ColorGuard guard(theme.error_color);
+            std::cerr << std::format("jshell: Cannot open input file '{}': {}\n", 
+                                    cmd.input_file, std::system_category().message(GetLastError()));
+            return 1;
+        }
+        si.hStdInput = input_file.get();
+    }
+    
+    // Handle output redirection
+    if (!cmd.output_file.empty()) {
+        DWORD creation = cmd.append_output ? OPEN_ALWAYS : CREATE_ALWAYS;
+        output_file.reset(CreateFileA(
+            cmd.output_file.c_str(),
+            GENERIC_WRITE,
+            0,
+            nullptr,
+            creation,
+            FILE_ATTRIBUTE_NORMAL,
+            nullptr
+        ));
+        
+        if (!output_file) {
+            const Theme theme;
+            ColorGuard guard(theme.error_color);
+            std::cerr << std::format("jshell: Cannot open output file '{}': {}\n",
+                                    cmd.output_file, std::system_category().message(GetLastError()));
+            return 1;
+        }
+        
+        if (cmd.append_output) {
+            SetFilePointer(output_file.get(), 0, nullptr, FILE_END);
+        }
+        
+        si.hStdOutput = output_file.get();
+    }
+    
+    // Handle stderr redirection
+    if (!cmd.error_file.empty()) {
+        DWORD creation = cmd.append_error ? OPEN_ALWAYS : CREATE_ALWAYS;
+        error_file.reset(CreateFileA(
+            cmd.error_file.c_str(),
+            GENERIC_WRITE,
+            0,
+            nullptr,
+            creation,
+            FILE_ATTRIBUTE_NORMAL,
+            nullptr
+        ));
+        
+        if (!error_file) {
+            const Theme theme;
+            ColorGuard guard(theme.error_color);
+            std::cerr << std::format("jshell: Cannot open error file '{}': {}\n",
+                                    cmd.error_file, std::system_category().message(GetLastError()));
+            return 1;
+        }
+        
+        if (cmd.append_error) {
+            SetFilePointer(error_file.get(), 0, nullptr, FILE_END);
+        }
+        
+        si.hStdError = error_file.get();
+    }
+
+    // Find executable
+    std::string executable = find_executable(cmd.args[0]);
+    if (executable.empty()) {
+        const Theme theme;
+        ColorGuard guard(theme.error_color);
+        std::cerr << std::format("jshell: Command not found: '{}'\n", cmd.args[0]);
+        return 127;
+    }
+
+    // Build command line
+    std::string cmd_line;
+    for (size_t i = 1; i < cmd.args.size(); ++i) { // Start from 1 as executable is handled separately
+        if (cmd.args[i].find(' ') != std::string::npos) {
+            cmd_line += "\"" + cmd.args[i] + "\" ";
+        } else {
+            cmd_line += cmd.args[i] + " ";
+        }
+    }
+    if(!cmd_line.empty()) cmd_line.pop_back();
+
+    DWORD creation_flags = 0;
+    if (cmd.background) {
+        creation_flags = DETACHED_PROCESS;
+    }
+    
+    std::cout.flush();  // The child writes to the console directly
+
+    // Pipeline pipes are not inheritable, or a child would also inherit the
+    // write end of its own input and never see end of file. The child gets
+    // inheritable copies of just its three handles, named in a handle list so
+    // it inherits nothing else: stages launching at the same time can't pick
+    // up each other's copies, and no lock is held across CreateProcess. If the
+    // list is refused (consoles before Windows 8 have no real handles), every
+    // launch falls back to making its copies and spawning under spawn_mutex.
+    static std::mutex spawn_mutex;
+    static std::atomic<bool> use_handle_lists{true};
+    ScopedHandle inherited[3];
+    std::vector<HANDLE> handle_list;
+    auto inherit_std_handles = [&]() {
+        HANDLE* std_handles[3] = { &si.hStdInput, &si.hStdOutput, &si.hStdError };
+        for (int i = 0; i < 3; ++i) {
+            HANDLE copy;
+            if (!inherited[i] && DuplicateHandle(GetCurrentProcess(), *std_handles[i], GetCurrentProcess(), &copy,
+                                                 0, TRUE, DUPLICATE_SAME_ACCESS)) {
+                inherited[i].reset(copy);
+                *std_handles[i] = copy;
+                handle_list.push_back(copy);
+            }
+        }
+    };
+    auto create = [&](LPSTARTUPINFOA startup, DWORD flags) {
+        return CreateProcessA(
+            executable.c_str(),
+            cmd_line.empty() ? nullptr : cmd_line.data(), // Pass nullptr if no args
+            nullptr,
+            nullptr,
+            TRUE,
+            flags,
+            nullptr,
+            nullptr,
+            startup,
+            &pi
+        );
+    };
+    
+    BOOL created = FALSE;
+    DWORD error = 0;
+    bool listed = false;
+    if (use_handle_lists) {
+        inherit_std_handles();
+        SIZE_T size = 0;
+        InitializeProcThreadAttributeList(nullptr, 1, 0, &size);
+        std::vector<char> attributes(size);
+        STARTUPINFOEXA extended = {};
+        extended.StartupInfo = si;
+        extended.StartupInfo.cb = sizeof(extended);
+        extended.lpAttributeList = reinterpret_cast<LPPROC_THREAD_ATTRIBUTE_LIST>(attributes.data());
+        if (!handle_list.empty() && InitializeProcThreadAttributeList(extended.lpAttributeList, 1, 0, &size)) {
+            if (UpdateProcThreadAttribute(extended.lpAttributeList, 0, PROC_THREAD_ATTRIBUTE_HANDLE_LIST, handle_list.data(),
+                                          handle_list.size() * sizeof(HANDLE), nullptr, nullptr)) {
+                listed = true;
+                created = create(&extended.StartupInfo, creation_flags | EXTENDED_STARTUPINFO_PRESENT);
+                if (!created) error = GetLastError();
+            }
+            DeleteProcThreadAttributeList(extended.lpAttributeList);
+        }
+        if (!handle_list.empty() && (!listed || (!created && error == ERROR_INVALID_PARAMETER))) {
+            use_handle_lists = false;
+            listed = false;
+        }
+    }
+    if (!listed) {
+        std::lock_guard<std::mutex> lock(spawn_mutex);
+        inherit_std_handles();
+        created = create(&si, creation_flags);
+        if (!created) error = GetLastError();
+    }
+    
+    if (!created) {
+        const Theme theme;
+        ColorGuard guard(theme.error_color);
+        std::cerr << std::format("jshell: Failed to execute '{}': {}\n",
+                                cmd.args[0], std::system_category().message(error));
+        return 1;
+    }
+    
+    ScopedHandle hThread(pi.hThread);
+    DWORD exit_code = 0;
+    
+    if (wait && !cmd.background) {
+        if (stage) stage->started(pi.hProcess);
+        WaitForSingleObject(pi.hProcess, INFINITE);
+        GetExitCodeProcess(pi.hProcess, &exit_code);
+        if (stage) stage->finished();
+        CloseHandle(pi.hProcess);
+    } else if (cmd.background && state) {
+        // Add to job list
+        std::string cmd_str;
+        for (const auto& arg : cmd.args) {
+            cmd_str += arg + " ";
+        }
+        if (!cmd_str.empty()) cmd_str.pop_back();
+        
+        auto job = std::make_unique<Job>(pi.dwProcessId, pi.hProcess, cmd_str, state->next_job_id++);
+        std::cout << std::format("[{}] {} {}\n", job->job_id, pi.dwProcessId, cmd_str);
+        state->jobs.push_back(std::move(job));
+    } else {
+        CloseHandle(pi.hProcess);
+    }
+    
+    return static_cast<int>(exit_code);
+}
+
+// Programs write to the console directly, past the output history, unless
+// capture_external_output passes their output through the shell. They then
+// see a pipe rather than the console, so it is off by default.
+bool capture_external(const ShellState& state, const Command& cmd) {
+    return state.config.capture_external_output && !cmd.background && output_history.capturing();
+}
+
+// Run the last stage of an interactive command with its output and errors
+// read back through std::cout and std::cerr, so they reach the output
+// history too. Each has its own pipe, so errors stay errors.
+int launch_captured(Command& cmd, HANDLE hInput, ShellState& state, StageProcess* stage = nullptr) {
+    HANDLE out_read, out_write, err_read, err_write;
+    DWORD pipe_size = static_cast<DWORD>(state.config.pipe_buffer_size);
+    if (!CreatePipe(&out_read, &out_write, nullptr, pipe_size)) {
+        return launch_process(cmd, hInput, INVALID_HANDLE_VALUE, INVALID_HANDLE_VALUE, &state, true, stage);
+    }
+    ScopedHandle stdout_read(out_read), stdout_write(out_write);
+    if (!CreatePipe(&err_read, &err_write, nullptr, pipe_size)) {
+        return launch_process(cmd, hInput, INVALID_HANDLE_VALUE, INVALID_HANDLE_VALUE, &state, true, stage);
+    }
+    ScopedHandle stderr_read(err_read), stderr_write(err_write);
+    
+    auto forward = [](HANDLE pipe, std::ostream& out) {
+        std::vector<char> block(IO_BLOCK_SIZE);
+        DWORD got = 0;
+        while (ReadFile(pipe, block.data(), static_cast<DWORD>(block.size()), &got, nullptr) && got > 0) {
+            out.write(block.data(), got);
+            out.flush();
+        }
+    };
+    std::thread out_reader(forward, stdout_read.get(), std::ref(std::cout));
+    std::thread err_reader(forward, stderr_read.get(), std::ref(std::cerr));
+    
+    int result = launch_process(cmd, hInput, stdout_write.get(), stderr_write.get(), &state, true, stage);
+    stdout_write.reset();
+    stderr_write.reset();
+    out_reader.join();
+    err_reader.join();
+    return result;
+}
+
+// Forward declare execute function
+int execute(ShellState& state, std::vector<Command>& commands);
+
+int cd(ShellState& state, std::span<const char*> args) {
+    std::string target_dir;
+    
+    if (args.size() < 2) {
+        target_dir = get_home_directory();
+    } else if(args.size() < 2) {
+        target_dir = get_home_directory();
+    } else {
+        std::string arg = args[1];
+        if (arg == "~") {
+            target_dir = get_home_directory();
+        } else if (arg == "-") {
+            // Implement previous directory tracking
+            if (state.previous_directory.empty()) {
+                const Theme theme;
+                ColorGuard guard(theme.warning_color);
+                std::cerr << "jshell: cd: OLDPWD not set\n";
+                return 1;
+            }
+            target_dir = state.previous_directory;
+            
+            // Show where we're going (like bash does)
+            const Theme theme;
+            ColorGuard guard(theme.success_color);
+            std::cout << target_dir << '\n';
+        } else {
+            target_dir = expand_path(arg);
+        }
+    }
+    
+    if (target_dir.empty()) {
+        const Theme theme;
+        ColorGuard guard(theme.error_color);
+        std::cerr << "jshell: HOME directory not found\n";
+        return 1;
+    }
+    
+    try {
+        // Store current directory as previous before changing
+        std::string current_dir = fs::current_path().string();
+        
+        // Change to target directory
+        fs::current_path(target_dir);
+        
+        // Update previous directory (but not if we're going to the same place)
+        if (current_dir != fs::current_path().string()) {
+            state.previous_directory = current_dir;
+        }
+        
+        return 0;
+    } catch (const fs::filesystem_error& e) {
+        const Theme theme;
+        ColorGuard guard(theme.error_color);
+        std::cerr << std::format("jshell: cd: {}\n", e.what());
+        return 1;
+    }
+}
+int help(ShellState&, std::span<const char*> args) {
+    const Theme theme;
+    
+    if (args.size() > 1) {
+        // Show help for specific command
+        std::string cmd_name = args[1];
+        auto it = std::find_if(builtins.begin(), builtins.end(),
+                              [&](const Builtin& b) { return b.name == cmd_name; });
+        
+        if (it != builtins.end()) {
+            ColorGuard header_guard(theme.prompt_color);
+            std::cout << std::format("{} - {}\n", it->name, it->description);
+            
+            console_output.set_color(theme.default_color);
+            std::cout << std::format("Usage: {}\n", it->usage);
+        } else {
+            ColorGuard guard(theme.error_color);
+            std::cerr << std::format("jshell: No help available for '{}'\n", cmd_name);
+            return 1;
+        }
+    } else {
+        // Show general help
+        ColorGuard header_guard(theme.prompt_color);
+        std::cout << "jshell - Enhanced C++ Shell for Windows v2.0\n\n";
+        
+        console_output.set_color(theme.default_color);
+        std::cout << "Built-in commands:\n";
+
+        for (const auto& builtin : builtins) {
+            ColorGuard cmd_guard(theme.help_command_color);
+            std::cout << std::format("  {:12}", builtin.name);
+            
+            console_output.set_color(theme.default_color);
+            std::cout << std::format(" - {}\n", builtin.description);
+        }
+        
+        std::cout << "\nUse 'help <command>' for detailed usage information.\n";
+    }
+    
+    return 0;
+}
+
+int exit_shell(ShellState& state, std::span<const char*> args) {
+    int exit_code = 0;
+    if (args.size() > 1) {
+        try {
+            exit_code = std::stoi(args[1]);
+        } catch (...) {
+            exit_code = 1;
+        }
+    }
+    
+    save_history(state);
+    state.running = false;
+    state.last_exit_code = exit_code;
+    return exit_code;
+}
+
+int pwd(ShellState&, std::span<const char*>) {
+    try {
+        std::cout << fs::current_path().string() << '\n';
+        return 0;
+    } catch (const fs::filesystem_error& e) {
+        const Theme theme;
+        ColorGuard guard(theme.error_color);
+        std::cerr << std::format("jshell: pwd: {}\n", e.what());
+        return 1;
+    }
+}
+
+int env(ShellState& state, std::span<const char*> args) {
+    if (args.size() > 1) {
+        // Show specific variable
+        std::string var_name = args[1];
+        
+        if (state.variables.contains(var_name)) {
+            std::cout << std::format("{}={}\n", var_name, state.variables[var_name]);
+        } else {
+            char* env_val = nullptr;
+            size_t len;
+            if (_dupenv_s(&env_val, &len, var_name.c_str()) == 0 && env_val) {
+                std::cout << std::format("{}={}\n", var_name, env_val);
+                free(env_val);
+            } else {
+                const Theme theme;
+                ColorGuard guard(theme.error_color);
+                std::cerr << std::format("jshell: Variable '{}' not found\n", var_name);
+                return 1;
+            }
+        }
+    } else {
+        // Show all environment variables
+        for (char** env_var = _environ; *env_var; ++env_var) {
+            std::cout << *env_var << '\n';
+        }
+        
+        // Show shell variables
+        if (!state.variables.empty()) {
+            const Theme theme;
+            ColorGuard guard(theme.help_command_color);
+            std::cout << "\nShell variables:\n";
+            
+            console_output.set_color(theme.default_color);
+            for (const auto& [name, value] : state.variables) {
+                std::cout << std::format("{}={}\n", name, value);
+            }
+        }
+    }
+    
+    return 0;
+}
 
-            if (completions.size() == 1) {
-                line = completions[0] + line.substr(cursor_pos);
-                cursor_pos = completions[0].length();
+int set_var(ShellState& state, std::span<const char*> args) {
+    if (args.size() < 3) {
+        const Theme theme;
+        ColorGuard guard(theme.error_color);
+        std::cerr << "jshell: Usage: set <NAME> <VALUE>\n";
+        return 1;
+    }
+    
+    std::string name = args[1];
+    std::string value = args[2];
+    
+    // Join remaining arguments as value
+    for (size_t i = 3; i < args.size(); ++i) {
+        value += " " + std::string(args[i]);
+    }
+    
+    // Set both shell variable and environment variable
+    state.variables[name] = value;
+    if (!SetEnvironmentVariableA(name.c_str(), value.c_str())) {
+        const Theme theme;
+        ColorGuard guard(theme.warning_color);
+        std::cerr << "jshell: Warning: Failed to set environment variable\n";
+    }
+    if (is_path_variable(name)) command_hash.clear();
+    
+    return 0;
+}
+
+int unset_var(ShellState& state, std::span<const char*> args) {
+    if (args.size() < 2) {
+        const Theme theme;
+        ColorGuard guard(theme.error_color);
+        std::cerr << "jshell: Usage: unset <NAME>\n";
+        return 1;
+    }
+    
+    std::string name = args[1];
+    state.variables.erase(name);
+    
+    if (!SetEnvironmentVariableA(name.c_str(), nullptr)) {
+        const Theme theme;
+        ColorGuard guard(theme.warning_color);
+        std::cerr << "jshell: Warning: Failed to unset environment variable\n";
+    }
+    if (is_path_variable(name)) command_hash.clear();
+    
+    return 0;
+}
+
+int history(ShellState& state, std::span<const char*> args) {
+    size_t count = state.history.size();
+    
+    if (args.size() > 1) {
+        try {
+            count = std::min(count, static_cast<size_t>(std::stoi(args[1])));
+        } catch (...) {
+            const Theme theme;
+            ColorGuard guard(theme.error_color);
+            std::cerr << "jshell: Invalid number\n";
+            return 1;
+        }
+    }
+    
+    size_t start = state.history.size() > count ? state.history.size() - count : 0;
+    
+    for (size_t i = start; i < state.history.size(); ++i) {
+        std::cout << std::format("{:5}: {}\n", i + 1, state.history[i]);
+    }
+    
+    return 0;
+}
+
+int source(ShellState& state, std::span<const char*> args) {
+    if (args.size() < 2) {
+        const Theme theme;
+        ColorGuard guard(theme.error_color);
+        std::cerr << "jshell: Usage: source <script_file>\n";
+        return 1;
+    }
+    
+    std::string filepath = expand_path(args[1]);
+    std::ifstream file(filepath);
+    
+    if (!file) {
+        const Theme theme;
+        ColorGuard guard(theme.error_color);
+        std::cerr << std::format("jshell: Failed to open script '{}'\n", filepath);
+        return 1;
+    }
+    
+    std::string line;
+    int line_number = 0;
+    
+    while (std::getline(file, line)) {
+        line_number++;
+        
+        // Skip empty lines and comments
+        if (line.empty() || line.starts_with('#')) continue;
+        
+        try {
+            auto commands = parse_pipeline(line, state);
+            if (!commands.empty()) {
+                execute(state, commands);
+            }
+        } catch (const std::exception& e) {
+            const Theme theme;
+            ColorGuard guard(theme.error_color);
+            std::cerr << std::format("jshell: Error at line {}: {}\n", line_number, e.what());
+        }
+        
+        if (!state.running) break;
+    }
+    
+    return 0;
+}
+
+int ls(ShellState& state, std::span<const char*> args) {
+    bool json = emit_records(state, args);
+    ParsedArgs parsed = parse_args(args);
+    bool long_format = parsed.flags['l'];
+    bool show_all = parsed.flags['a'];
+    
+    fs::path path = parsed.non_flag_args.empty() ? "." : expand_path(parsed.non_flag_args[0]);
+    const Theme theme;
+
+    try {
+        if (!fs::exists(path)) {
+            throw fs::filesystem_error("Path does not exist", path, 
+                                     std::make_error_code(std::errc::no_such_file_or_directory));
+        }
+        
+        // One record per entry: name, path, type, size in bytes, mtime in Unix seconds
+        std::string records;
+        auto write_record = [&](const fs::directory_entry& entry) {
+            // Each query gets its own error, so one failing cannot blank the others
+            std::error_code type_ec, size_ec, time_ec;
+            bool directory = entry.is_directory(type_ec);
+            bool regular = !directory && entry.is_regular_file(type_ec);
+            uintmax_t size = directory ? 0 : entry.file_size(size_ec);
+            auto mtime = entry.last_write_time(time_ec);
+            RecordWriter record(records);
+            record.field("name", utf8_path(entry.path().filename()))
+                  .field("path", utf8_path(entry.path()))
+                  .field("type", directory ? "dir" : regular ? "file" : "other")
+                  .field("size", size_ec ? uintmax_t{0} : size);
+            if (time_ec) record.null_field("mtime");
+            else record.field("mtime", unix_time(mtime));
+            record.end();
+            if (records.size() >= IO_BLOCK_SIZE) flush_records(records);
+        };
+        
+        if (json && fs::is_regular_file(path)) {
+            write_record(fs::directory_entry(path));
+            flush_records(records);
+            return 0;
+        }
+        
+        if (fs::is_regular_file(path)) {
+            auto ftime = fs::last_write_time(path);
+            auto sctp = std::chrono::time_point_cast<std::chrono::system_clock::duration>(
+                ftime - fs::file_time_type::clock::now() + std::chrono::system_clock::now());
+            std::time_t cftime = std::chrono::system_clock::to_time_t(sctp);
+            
+            char time_buf[20];
+            std::strftime(time_buf, sizeof(time_buf), "%b %d %H:%M", std::localtime(&cftime));
+            
+            if (long_format) {
+                uintmax_t size = fs::file_size(path);
+                std::cout << std::format("-rwx------ {:>10} {} {}\n", 
+                                       size, time_buf, path.filename().string());
             } else {
-                std::string lcp = find_longest_common_prefix(completions);
-                if (!lcp.empty() && lcp.length() > prefix.length()) {
-                    line = lcp + line.substr(cursor_pos);
-                    cursor_pos = lcp.length();
-                } else if (last_char == 9) { // Double tab
-                    std::cout << "\n";
-                    for (size_t i = 0; i < completions.size(); ++i) {
-                        std::cout << std::format("{:<20}", completions[i]);
-                        if ((i + 1) % 4 == 0) std::cout << "\n";
-                    }
-                    if (completions.size() % 4 != 0) std::cout << "\n";
+                std::cout << path.filename().string() << '\n';
+            }
+            return 0;
+        }
+        
+        if (!fs::is_directory(path)) {
+            throw fs::filesystem_error("Not a directory", path,
+                                     std::make_error_code(std::errc::not_a_directory));
+        }
+
+        for (const auto& entry : fs::directory_iterator(path)) {
+            if (downstream_closed()) break;
+            std::string filename = entry.path().filename().string();
+            
+            if (!show_all && filename.starts_with('.')) continue;
+            
+            if (json) {
+                write_record(entry);
+                continue;
+            }
+
+            if (long_format) {
+                auto ftime = entry.last_write_time();
+                auto sctp = std::chrono::time_point_cast<std::chrono::system_clock::duration>(
+                    ftime - fs::file_time_type::clock::now() + std::chrono::system_clock::now());
+                std::time_t cftime = std::chrono::system_clock::to_time_t(sctp);
+                
+                char time_buf[20];
+                std::strftime(time_buf, sizeof(time_buf), "%b %d %H:%M", std::localtime(&cftime));
+                
+                std::cout << (entry.is_directory() ? 'd' : '-');
+                std::cout << "rwx------ ";
+                
+                uintmax_t size = 0;
+                try {
+                    size = entry.is_directory() ? 0 : fs::file_size(entry);
+                } catch (...) {
+                    size = 0;
                 }
+                
+                std::cout << std::format("{:>10} {} ", size, time_buf);
             }
-            redraw_with_cursor();
-        } else if (ch == 8) { // Backspace
-            if (cursor_pos > 0) {
-                line.erase(cursor_pos - 1, 1);
-                cursor_pos--;
-                redraw_with_cursor();
-            }
-        } else if (ch == 127) { // Delete
-            if (cursor_pos < line.length()) {
-                line.erase(cursor_pos, 1);
-                redraw_with_cursor();
-            }
-        } else if (ch == 3) { // Ctrl+C
-            std::cout << "^C\n";
-            line.clear();
-            cursor_pos = 0;
-            redraw_with_cursor();
-        } else if (isprint(ch)) { // Printable characters
-            char c = static_cast<char>(ch);
             
-            if (cursor_pos == line.length()) {
-                // Simple case: adding to end of line
-                line += c;
-                cursor_pos++;
-                std::cout << c;
-                std::cout.flush();
+            if (entry.is_directory()) {
+                ColorGuard guard(theme.dir_color);
+                std::cout << filename;
             } else {
-                // Complex case: inserting in middle
-                line.insert(cursor_pos, 1, c);
-                cursor_pos++;
-                redraw_with_cursor();
+                std::cout << filename;
             }
+            
+            if (entry.is_directory()) std::cout << '/';
+            std::cout << '\n';
         }
+        flush_records(records);
         
-        last_char = ch;
+    } catch (const fs::filesystem_error& e) {
+        ColorGuard guard(theme.error_color);
+        std::cerr << std::format("jshell: ls: {}\n", e.what());
+        return 1;
     }
+    
+    return 0;
+}
 
-    // Add to history
-    if (!line.empty() && (state.history.empty() || state.history.back() != line)) {
-        if (state.history.size() >= state.config.max_history) {
-            state.history.erase(state.history.begin());
+int cat(ShellState& state, std::span<const char*> args) {
+    if (args.size() < 2) {
+        const Theme theme;
+        ColorGuard guard(theme.error_color);
+        std::cerr << "jshell: Usage: cat <file> [files...]\n";
+        return 1;
+    }
+    
+    int exit_code = 0;
+    std::vector<char> block(state.config.io_block_size);
+    
+    for (size_t i = 1; i < args.size(); ++i) {
+        std::string filepath = expand_path(args[i]);
+        std::ifstream file(filepath, std::ios::binary);
+        
+        if (!file) {
+            const Theme theme;
+            ColorGuard guard(theme.error_color);
+            std::cerr << std::format("jshell: cat: Cannot open file '{}'\n", filepath);
+            exit_code = 1;
+            continue;
+        }
+        
+        while (file.read(block.data(), block.size()) || file.gcount() > 0) {
+            std::cout.write(block.data(), file.gcount());
+            if (downstream_closed()) return exit_code;
         }
-        state.history.push_back(line);
     }
-    state.history_index = state.history.size();
     
-    return line;
+    return exit_code;
 }
 
-std::vector<std::string> tokenize(std::string_view str) {
-    std::vector<std::string> tokens;
-    std::string current_token;
-    bool in_quotes = false;
-    char quote_char = '\0';
+int echo(ShellState&, std::span<const char*> args) {
+    bool no_newline = false;
+    size_t start_idx = 1;
     
-    for (char c : str) {
-        if ((c == '"' || c == '\'') && !in_quotes) {
-            in_quotes = true;
-            quote_char = c;
-        } else if (c == quote_char && in_quotes) {
-            in_quotes = false;
-            quote_char = '\0';
-        } else if (std::isspace(c) && !in_quotes) {
-            if (!current_token.empty()) {
-                tokens.push_back(current_token);
-                current_token.clear();
-            }
-        } else {
-            current_token += c;
-        }
+    // Check for -n flag
+    if (args.size() > 1 && std::string(args[1]) == "-n") {
+        no_newline = true;
+        start_idx = 2;
     }
     
-    if (!current_token.empty()) {
-        tokens.push_back(current_token);
+    for (size_t i = start_idx; i < args.size(); ++i) {
+        std::cout << args[i];
+        if (i < args.size() - 1) std::cout << ' ';
     }
     
-    return tokens;
+    if (!no_newline) std::cout << '\n';
+    
+    return 0;
 }
 
-Command parse_command(std::string_view command_str, const ShellState& state) {
-    Command cmd;
-    std::string temp_str = substitute_variables(std::string(command_str), state);
+int mkdir(ShellState&, std::span<const char*> args) {
+    ParsedArgs parsed = parse_args(args);
+    bool parents = parsed.flags['p'];
     
-    // Check for background execution
-    if (temp_str.ends_with('&')) {
-        cmd.background = true;
-        temp_str.pop_back(); // Remove the '&'
-        // Trim trailing whitespace
-        size_t last = temp_str.find_last_not_of(" \t");
-        if(std::string::npos != last) temp_str = temp_str.substr(0, last + 1);
+    if (parsed.non_flag_args.empty()) {
+        const Theme theme;
+        ColorGuard guard(theme.error_color);
+        std::cerr << "jshell: Usage: mkdir [-p] <directory>\n";
+        return 1;
     }
     
-    // Parse stderr redirection (2>> and 2>)
-    size_t pos_err_append = temp_str.find("2>>");
-    size_t pos_err = (pos_err_append != std::string::npos) ? std::string::npos : temp_str.find("2>");
+    int exit_code = 0;
     
-    if (pos_err_append != std::string::npos) {
-        auto tokens = tokenize(temp_str.substr(pos_err_append + 3));
-        if (!tokens.empty()) {
-            cmd.error_file = tokens[0];
-            cmd.append_error = true;
-        }
-        temp_str = temp_str.substr(0, pos_err_append);
-    } else if (pos_err != std::string::npos) {
-        auto tokens = tokenize(temp_str.substr(pos_err + 2));
-        if (!tokens.empty()) {
-            cmd.error_file = tokens[0];
+    for (const auto& dir_name : parsed.non_flag_args) {
+        std::string dir_path = expand_path(dir_name);
+        
+        try {
+            if (parents) {
+                fs::create_directories(dir_path);
+            } else {
+                fs::create_directory(dir_path);
+            }
+        } catch (const fs::filesystem_error& e) {
+            const Theme theme;
+            ColorGuard guard(theme.error_color);
+            std::cerr << std::format("jshell: mkdir: {}\n", e.what());
+            exit_code = 1;
         }
-        temp_str = temp_str.substr(0, pos_err);
     }
     
-    // Parse output redirection (>> and >)
-    size_t pos_append = temp_str.find(">>");
-    size_t pos_out = (pos_append != std::string::npos) ? std::string::npos : temp_str.find('>');
+    return exit_code;
+}
+
+int rm(ShellState&, std::span<const char*> args) {
+    ParsedArgs parsed = parse_args(args);
+    bool recursive = parsed.flags['r'];
+    bool force = parsed.flags['f'];
     
-    if (pos_append != std::string::npos) {
-        auto tokens = tokenize(temp_str.substr(pos_append + 2));
-        if (!tokens.empty()) {
-            cmd.output_file = tokens[0];
-            cmd.append_output = true;
-        }
-        temp_str = temp_str.substr(0, pos_append);
-    } else if (pos_out != std::string::npos) {
-        auto tokens = tokenize(temp_str.substr(pos_out + 1));
-        if (!tokens.empty()) {
-            cmd.output_file = tokens[0];
+    if (parsed.non_flag_args.empty()) {
+        const Theme theme;
+        ColorGuard guard(theme.error_color);
+        std::cerr << "jshell: Usage: rm [-rf] <path>\n";
+        return 1;
+    }
+    
+    int exit_code = 0;
+    
+    for (const auto& path_name : parsed.non_flag_args) {
+        std::string path_str = expand_path(path_name);
+        
+        try {
+            if (!fs::exists(path_str)) {
+                if (!force) {
+                    const Theme theme;
+                    ColorGuard guard(theme.error_color);
+                    std::cerr << std::format("jshell: rm: '{}' does not exist\n", path_str);
+                    exit_code = 1;
+                }
+                continue;
+            }
+            
+            if (fs::is_directory(path_str) && !recursive) {
+                const Theme theme;
+                ColorGuard guard(theme.error_color);
+                std::cerr << std::format("jshell: rm: '{}' is a directory (use -r for recursive removal)\n", path_str);
+                exit_code = 1;
+                continue;
+            }
+            
+            if (recursive) {
+                fs::remove_all(path_str);
+            } else {
+                fs::remove(path_str);
+            }
+            
+        } catch (const fs::filesystem_error& e) {
+            if (!force) {
+                const Theme theme;
+                ColorGuard guard(theme.error_color);
+                std::cerr << std::format("jshell: rm: {}\n", e.what());
+                exit_code = 1;
+            }
         }
-        temp_str = temp_str.substr(0, pos_out);
     }
     
-    // Parse input redirection (<)
-    size_t pos_in = temp_str.find('<');
-    if (pos_in != std::string::npos) {
-        auto tokens = tokenize(temp_str.substr(pos_in + 1));
-        if (!tokens.empty()) {
-            cmd.input_file = tokens[0];
+    return exit_code;
+}
+
+int cls(ShellState&, std::span<const char*>) {
+    std::cout.flush();
+    HANDLE console = GetStdHandle(STD_OUTPUT_HANDLE);
+    CONSOLE_SCREEN_BUFFER_INFO info;
+    DWORD written;
+    
+    if (GetConsoleScreenBufferInfo(console, &info)) {
+        DWORD size = info.dwSize.X * info.dwSize.Y;
+        COORD coord = {0, 0};
+        
+        FillConsoleOutputCharacterA(console, ' ', size, coord, &written);
+        FillConsoleOutputAttribute(console, info.wAttributes, size, coord, &written);
+        SetConsoleCursorPosition(console, coord);
+    }
+    
+    return 0;
+}
+
+int alias(ShellState& state, std::span<const char*> args) {
+    if (args.size() == 1) {
+        // Show all aliases
+        if (state.aliases.empty()) {
+            std::cout << "No aliases defined.\n";
+        } else {
+            for (const auto& [name, entry] : state.aliases) {
+                std::cout << std::format("{}='{}'\n", name, entry.text);
+            }
         }
-        temp_str = temp_str.substr(0, pos_in);
+        return 0;
     }
     
-    cmd.args = tokenize(temp_str);
+    // Join all arguments after 'alias'
+    std::string arg_str;
+    for (size_t i = 1; i < args.size(); ++i) {
+        if (i > 1) arg_str += ' ';
+        arg_str += args[i];
+    }
     
-    // Expand paths in arguments
-    for (auto& arg : cmd.args) {
-        arg = expand_path(arg);
+    auto eq_pos = arg_str.find('=');
+    if (eq_pos == std::string::npos) {
+        // Show specific alias
+        if (state.aliases.contains(arg_str)) {
+            std::cout << std::format("{}='{}'\n", arg_str, state.aliases[arg_str].text);
+        } else {
+            const Theme theme;
+            ColorGuard guard(theme.error_color);
+            std::cerr << std::format("jshell: alias '{}' not found\n", arg_str);
+            return 1;
+        }
+    } else {
+        // Set alias
+        std::string name = arg_str.substr(0, eq_pos);
+        std::string command = arg_str.substr(eq_pos + 1);
+        
+        // Remove quotes if present
+        if ((command.starts_with('\'') && command.ends_with('\'')) ||
+            (command.starts_with('"') && command.ends_with('"'))) {
+            command = command.substr(1, command.length() - 2);
+        }
+        
+        auto [it, inserted] = state.aliases.try_emplace(name);
+        if (inserted) it->second.id = state.next_alias_id++;
+        it->second.pipeline = split_pipeline(command);
+        std::erase_if(it->second.pipeline, [](const Command& c) { return c.args.empty(); });
+        it->second.text = std::move(command);
     }
     
-    return cmd;
+    return 0;
 }
 
-std::vector<Command> parse_pipeline(const std::string& line, const ShellState& state) {
-    if (line.empty()) return {};
-    
-    std::vector<Command> commands;
-    std::stringstream ss(line);
-    std::string segment;
+int unalias(ShellState& state, std::span<const char*> args) {
+    if (args.size() < 2) {
+        const Theme theme;
+        ColorGuard guard(theme.error_color);
+        std::cerr << "jshell: Usage: unalias <name>\n";
+        return 1;
+    }
     
-    while (std::getline(ss, segment, '|')) {
-        commands.push_back(parse_command(segment, state));
+    std::string name = args[1];
+    if (state.aliases.erase(name) == 0) {
+        const Theme theme;
+        ColorGuard guard(theme.error_color);
+        std::cerr << std::format("jshell: alias '{}' not found\n", name);
+        return 1;
     }
     
-    return commands;
+    return 0;
 }
 
-struct ParsedArgs {
-    std::map<char, bool> flags;
-    std::map<std::string, std::string> long_flags;
-    std::vector<std::string> non_flag_args;
-};
-
-ParsedArgs parse_args(std::span<const char*> args) {
-    ParsedArgs result;
+int touch(ShellState&, std::span<const char*> args) {
+    if (args.size() < 2) {
+        const Theme theme;
+        ColorGuard guard(theme.error_color);
+        std::cerr << "jshell: Usage: touch <filename>\n";
+        return 1;
+    }
+    
+    int exit_code = 0;
     
     for (size_t i = 1; i < args.size(); ++i) {
-        std::string arg = args[i];
+        std::string filepath = expand_path(args[i]);
         
-        if (arg.starts_with("--")) {
-            // Long flag
-            auto eq_pos = arg.find('=');
-            if (eq_pos != std::string::npos) {
-                std::string key = arg.substr(2, eq_pos - 2);
-                std::string value = arg.substr(eq_pos + 1);
-                result.long_flags[key] = value;
+        try {
+            if (fs::exists(filepath)) {
+                // Update timestamp
+                fs::last_write_time(filepath, fs::file_time_type::clock::now());
             } else {
-                result.long_flags[arg.substr(2)] = "";
-            }
-        } else if (arg.starts_with('-') && arg.length() > 1) {
-            // Short flags
-            for (size_t j = 1; j < arg.length(); ++j) {
-                result.flags[arg[j]] = true;
+                // Create file
+                std::ofstream file(filepath);
+                if (!file) {
+                    const Theme theme;
+                    ColorGuard guard(theme.error_color);
+                    std::cerr << std::format("jshell: touch: Cannot create file '{}'\n", filepath);
+                    exit_code = 1;
+                }
             }
-        } else {
-            result.non_flag_args.push_back(arg);
+        } catch (const fs::filesystem_error& e) {
+            const Theme theme;
+            ColorGuard guard(theme.error_color);
+            std::cerr << std::format("jshell: touch: {}\n", e.what());
+            exit_code = 1;
         }
     }
     
-    return result;
+    return exit_code;
 }
 
-int launch_process(Command& cmd, HANDLE hInput, HANDLE hOutput, HANDLE hError, ShellState* state = nullptr, bool wait = true) {
-    if (cmd.args.empty()) return 1;
-
-    STARTUPINFOA si = { sizeof(si) };
-    PROCESS_INFORMATION pi = { 0 };
-    
-    si.dwFlags |= STARTF_USESTDHANDLES;
-    si.hStdInput = hInput != INVALID_HANDLE_VALUE ? hInput : GetStdHandle(STD_INPUT_HANDLE);
-    si.hStdOutput = hOutput != INVALID_HANDLE_VALUE ? hOutput : GetStdHandle(STD_OUTPUT_HANDLE);
-    si.hStdError = hError != INVALID_HANDLE_VALUE ? hError : GetStdHandle(STD_ERROR_HANDLE);
-
-    ScopedHandle input_file, output_file, error_file;
-    
-    // Handle input redirection
-    if (!cmd.input_file.empty()) {
-        input_file.reset(CreateFileA(
-            cmd.input_file.c_str(),
-            GENERIC_READ,
-            FILE_SHARE_READ,
-            nullptr,
-            OPEN_EXISTING,
-            FILE_ATTRIBUTE_NORMAL,
-            nullptr
-        ));
-        
-        if (!input_file) {
-            const Theme theme;
-            ColorGuard guard(theme.error_color);
-            std::cerr << std::format("jshell: Cannot open input file '{}': {}\n", 
-                                    cmd.input_file, std::system_category().message(GetLastError()));
-            return 1;
+// Copy a directory tree. Once it holds parallel_copy_threshold files or more,
+// the files are copied by a worker pool; directories are always created first.
+void copy_tree(const fs::path& src, const fs::path& dst, const Configuration& config) {
+    std::vector<std::pair<fs::path, fs::path>> files;
+    fs::create_directories(dst);
+    
+    for (const auto& entry : fs::recursive_directory_iterator(src)) {
+        fs::path target = dst / fs::relative(entry.path(), src);
+        if (entry.is_directory()) {
+            fs::create_directories(target);
+        } else {
+            files.emplace_back(entry.path(), std::move(target));
         }
-        si.hStdInput = input_file.get();
     }
     
-    // Handle output redirection
-    if (!cmd.output_file.empty()) {
-        DWORD creation = cmd.append_output ? OPEN_ALWAYS : CREATE_ALWAYS;
-        output_file.reset(CreateFileA(
-            cmd.output_file.c_str(),
-            GENERIC_WRITE,
-            0,
-            nullptr,
-            creation,
-            FILE_ATTRIBUTE_NORMAL,
-            nullptr
-        ));
-        
-        if (!output_file) {
-            const Theme theme;
-            ColorGuard guard(theme.error_color);
-            std::cerr << std::format("jshell: Cannot open output file '{}': {}\n",
-                                    cmd.output_file, std::system_category().message(GetLastError()));
-            return 1;
-        }
-        
-        if (cmd.append_output) {
-            SetFilePointer(output_file.get(), 0, nullptr, FILE_END);
+    size_t worker_count = std::min(effective_workers(config), files.size());
+    if (config.parallel_copy_threshold == 0 || files.size() < config.parallel_copy_threshold || worker_count < 2) {
+        for (const auto& [from, to] : files) {
+            fs::copy_file(from, to, fs::copy_options::overwrite_existing);
         }
-        
-        si.hStdOutput = output_file.get();
+        return;
+    }
+    
+    std::atomic<size_t> next_file{0};
+    std::mutex error_mutex;
+    std::optional<fs::filesystem_error> first_error;
+    std::vector<std::thread> workers;
+    
+    for (size_t w = 0; w < worker_count; ++w) {
+        workers.emplace_back([&]() {
+            for (size_t i = next_file++; i < files.size(); i = next_file++) {
+                std::error_code ec;
+                fs::copy_file(files[i].first, files[i].second, fs::copy_options::overwrite_existing, ec);
+                if (ec) {
+                    std::lock_guard<std::mutex> lock(error_mutex);
+                    if (!first_error) first_error.emplace("copy_file", files[i].first, files[i].second, ec);
+                }
+            }
+        });
     }
+    for (auto& worker : workers) worker.join();
     
-    // Handle stderr redirection
-    if (!cmd.error_file.empty()) {
-        DWORD creation = cmd.append_error ? OPEN_ALWAYS : CREATE_ALWAYS;
-        error_file.reset(CreateFileA(
-            cmd.error_file.c_str(),
-            GENERIC_WRITE,
-            0,
-            nullptr,
-            creation,
-            FILE_ATTRIBUTE_NORMAL,
-            nullptr
-        ));
-        
-        if (!error_file) {
+    if (first_error) throw *first_error;
+}
+
+int cp(ShellState& state, std::span<const char*> args) {
+    ParsedArgs parsed = parse_args(args);
+    bool recursive = parsed.flags['r'];
+    
+    if (parsed.non_flag_args.size() < 2) {
+        const Theme theme;
+        ColorGuard guard(theme.error_color);
+        std::cerr << "jshell: Usage: cp [-r] <source> <destination>\n";
+        return 1;
+    }
+    
+    std::string src = expand_path(parsed.non_flag_args[0]);
+    std::string dst = expand_path(parsed.non_flag_args[1]);
+    
+    try {
+        if (!fs::exists(src)) {
             const Theme theme;
             ColorGuard guard(theme.error_color);
-            std::cerr << std::format("jshell: Cannot open error file '{}': {}\n",
-                                    cmd.error_file, std::system_category().message(GetLastError()));
+            std::cerr << std::format("jshell: cp: Source '{}' does not exist\n", src);
             return 1;
         }
         
-        if (cmd.append_error) {
-            SetFilePointer(error_file.get(), 0, nullptr, FILE_END);
+        if (fs::is_directory(src)) {
+            if (!recursive) {
+                const Theme theme;
+                ColorGuard guard(theme.error_color);
+                std::cerr << "jshell: cp: Source is a directory (use -r for recursive copy)\n";
+                return 1;
+            }
+            copy_tree(src, dst, state.config);
+        } else {
+            fs::copy_file(src, dst, fs::copy_options::overwrite_existing);
         }
         
-        si.hStdError = error_file.get();
+        return 0;
+        
+    } catch (const fs::filesystem_error& e) {
+        const Theme theme;
+        ColorGuard guard(theme.error_color);
+        std::cerr << std::format("jshell: cp: {}\n", e.what());
+        return 1;
     }
+}
 
-    // Find executable
-    std::string executable = find_executable(cmd.args[0]);
-    if (executable.empty()) {
+int mv(ShellState&, std::span<const char*> args) {
+    if (args.size() < 3) {
         const Theme theme;
         ColorGuard guard(theme.error_color);
-        std::cerr << std::format("jshell: Command not found: '{}'\n", cmd.args[0]);
-        return 127;
+        std::cerr << "jshell: Usage: mv <source> <destination>\n";
+        return 1;
     }
-
-    // Build command line
-    std::string cmd_line;
-    for (size_t i = 1; i < cmd.args.size(); ++i) { // Start from 1 as executable is handled separately
-        if (cmd.args[i].find(' ') != std::string::npos) {
-            cmd_line += "\"" + cmd.args[i] + "\" ";
-        } else {
-            cmd_line += cmd.args[i] + " ";
-        }
+    
+    std::string src = expand_path(args[1]);
+    std::string dst = expand_path(args[2]);
+    
+    try {
+        fs::rename(src, dst);
+        return 0;
+    } catch (const fs::filesystem_error& e) {
+        const Theme theme;
+        ColorGuard guard(theme.error_color);
+        std::cerr << std::format("jshell: mv: {}\n", e.what());
+        return 1;
     }
-    if(!cmd_line.empty()) cmd_line.pop_back();
+}
 
-    DWORD creation_flags = 0;
-    if (cmd.background) {
-        creation_flags = DETACHED_PROCESS;
+// Line, word and byte counts of wc
+struct TextCounts {
+    uint64_t lines = 0;
+    uint64_t words = 0;
+    uint64_t bytes = 0;
+    
+    // text must end at a line end (or the end of the input), so no word is split
+    void add(std::string_view text) {
+        bytes += text.size();
+        lines += std::count(text.begin(), text.end(), '\n');
+        bool in_word = false;
+        for (char c : text) {
+            bool space = std::isspace(static_cast<unsigned char>(c));
+            if (!space && !in_word) words++;
+            in_word = !space;
+        }
     }
+};
 
-    if (!CreateProcessA(
-        executable.c_str(),
-        cmd_line.empty() ? nullptr : cmd_line.data(), // Pass nullptr if no args
-        nullptr,
-        nullptr,
-        TRUE,
-        creation_flags,
-        nullptr,
-        nullptr,
-        &si,
-        &pi
-    )) {
-        const Theme theme;
-        ColorGuard guard(theme.error_color);
-        std::cerr << std::format("jshell: Failed to execute '{}': {}\n",
-                                cmd.args[0], std::system_category().message(GetLastError()));
-        return 1;
+// Prints all three counts unless some are selected
+void print_counts(const TextCounts& counts, bool lines, bool words, bool bytes, std::string_view name) {
+    if (!lines && !words && !bytes) lines = words = bytes = true;
+    std::string text;
+    if (lines) text += std::format("{:>8}", counts.lines);
+    if (words) text += std::format("{:>8}", counts.words);
+    if (bytes) text += std::format("{:>8}", counts.bytes);
+    if (!name.empty()) text += std::format(" {}", name);
+    std::cout << text << '\n';
+}
+
+// grep patterns are case-insensitive regexes, or case-sensitive substrings
+// when they don't compile
+void compile_grep_pattern(Matcher& matcher, const std::string& pattern) {
+    if (!matcher.compile(pattern, true)) {
+        matcher.compile(pattern, false, true);
     }
+}
+
+// Call visit(block) with runs of whole lines read from a pipe; a line cut
+// off by the end of a read is carried over to the next. Only the last line
+// of the input may lack its newline. visit returns false to stop reading.
+template <typename Visit>
+void read_line_blocks(HANDLE input, size_t block_size, Visit visit) {
+    std::vector<char> buffer(block_size);
+    size_t kept = 0;
+    DWORD got = 0;
     
-    ScopedHandle hThread(pi.hThread);
-    DWORD exit_code = 0;
-    
-    if (wait && !cmd.background) {
-        WaitForSingleObject(pi.hProcess, INFINITE);
-        GetExitCodeProcess(pi.hProcess, &exit_code);
-        CloseHandle(pi.hProcess);
-    } else if (cmd.background && state) {
-        // Add to job list
-        std::string cmd_str;
-        for (const auto& arg : cmd.args) {
-            cmd_str += arg + " ";
+    while (true) {
+        if (kept == buffer.size()) buffer.resize(buffer.size() * 2);  // A line longer than the buffer
+        if (!ReadFile(input, buffer.data() + kept, static_cast<DWORD>(buffer.size() - kept), &got, nullptr) || got == 0) {
+            break;
         }
-        if (!cmd_str.empty()) cmd_str.pop_back();
-        
-        auto job = std::make_unique<Job>(pi.dwProcessId, pi.hProcess, cmd_str, state->next_job_id++);
-        std::cout << std::format("[{}] {} {}\n", job->job_id, pi.dwProcessId, cmd_str);
-        state->jobs.push_back(std::move(job));
-    } else {
-        CloseHandle(pi.hProcess);
+        size_t filled = kept + got;
+        size_t last_newline = std::string_view(buffer.data() + kept, got).rfind('\n');
+        if (last_newline == std::string_view::npos) {
+            kept = filled;
+            continue;
+        }
+        size_t complete = kept + last_newline + 1;
+        if (!visit(std::string_view(buffer.data(), complete))) return;
+        kept = filled - complete;
+        std::memmove(buffer.data(), buffer.data() + complete, kept);
     }
     
-    return static_cast<int>(exit_code);
+    if (kept > 0) visit(std::string_view(buffer.data(), kept));
 }
 
-// Forward declare execute function
-int execute(ShellState& state, std::vector<Command>& commands);
-
-int cd(ShellState& state, std::span<const char*> args) {
-    std::string target_dir;
-    
-    if (args.size() < 2) {
-        target_dir = get_home_directory();
-    } else if(args.size() < 2) {
-        target_dir = get_home_directory();
-    } else {
-        std::string arg = args[1];
-        if (arg == "~") {
-            target_dir = get_home_directory();
-        } else if (arg == "-") {
-            // Implement previous directory tracking
-            if (state.previous_directory.empty()) {
-                const Theme theme;
-                ColorGuard guard(theme.warning_color);
-                std::cerr << "jshell: cd: OLDPWD not set\n";
-                return 1;
-            }
-            target_dir = state.previous_directory;
-            
-            // Show where we're going (like bash does)
-            const Theme theme;
-            ColorGuard guard(theme.success_color);
-            std::cout << target_dir << '\n';
-        } else {
-            target_dir = expand_path(arg);
+// Call emit(line) for each line of text that every filter matches. The line
+// keeps its newline, if it has one. The first filter scans the whole text,
+// so lines it rejects are never split out.
+template <typename Emit>
+void filter_lines(std::string_view text, std::span<const Matcher> filters, Emit emit) {
+    size_t from = 0, pos = 0, len = 0;
+    while (from < text.size() && filters[0].find(text, from, pos, len)) {
+        size_t line_begin = pos == 0 ? std::string_view::npos : text.rfind('\n', pos - 1);
+        line_begin = line_begin == std::string_view::npos ? 0 : line_begin + 1;
+        size_t line_end = text.find('\n', pos);
+        line_end = line_end == std::string_view::npos ? text.size() : line_end + 1;
+        
+        std::string_view line = text.substr(line_begin, line_end - line_begin);
+        if (std::all_of(filters.begin() + 1, filters.end(), [&](const Matcher& filter) { return filter.matches(line); })) {
+            emit(line);
         }
+        from = line_end;
+    }
+}
+
+// Lines printed by grep reading a pipe always end in a newline
+void print_line(std::string_view line) {
+    std::cout << line;
+    if (!line.ends_with('\n')) std::cout << '\n';
+}
+
+int grep(ShellState& state, std::span<const char*> args) {
+    if (args.size() == 2 && builtin_stdin != INVALID_HANDLE_VALUE) {
+        Matcher matcher;
+        compile_grep_pattern(matcher, args[1]);
+        bool found = false;
+        read_line_blocks(builtin_stdin, state.config.io_block_size, [&](std::string_view block) {
+            filter_lines(block, std::span(&matcher, 1), [&](std::string_view line) {
+                print_line(line);
+                found = true;
+            });
+            return !downstream_closed();
+        });
+        return found ? 0 : 1;
     }
     
-    if (target_dir.empty()) {
+    if (args.size() < 3) {
         const Theme theme;
         ColorGuard guard(theme.error_color);
-        std::cerr << "jshell: HOME directory not found\n";
+        std::cerr << "jshell: Usage: grep <pattern> <file>  (or: command | grep <pattern>)\n";
         return 1;
     }
     
-    try {
-        // Store current directory as previous before changing
-        std::string current_dir = fs::current_path().string();
-        
-        // Change to target directory
-        fs::current_path(target_dir);
-        
-        // Update previous directory (but not if we're going to the same place)
-        if (current_dir != fs::current_path().string()) {
-            state.previous_directory = current_dir;
-        }
-        
-        return 0;
-    } catch (const fs::filesystem_error& e) {
+    std::string pattern = args[1];
+    std::string filepath = expand_path(args[2]);
+    
+    MappedFile file;
+    if (!file.open(filepath)) {
         const Theme theme;
         ColorGuard guard(theme.error_color);
-        std::cerr << std::format("jshell: cd: {}\n", e.what());
+        std::cerr << std::format("jshell: grep: Cannot open file '{}'\n", filepath);
         return 1;
     }
-}
-int help(ShellState&, std::span<const char*> args) {
-    const Theme theme;
     
-    if (args.size() > 1) {
-        // Show help for specific command
-        std::string cmd_name = args[1];
-        auto it = std::find_if(builtins.begin(), builtins.end(),
-                              [&](const Builtin& b) { return b.name == cmd_name; });
-        
-        if (it != builtins.end()) {
-            ColorGuard header_guard(theme.prompt_color);
-            std::cout << std::format("{} - {}\n", it->name, it->description);
-            
-            SetConsoleTextAttribute(GetStdHandle(STD_OUTPUT_HANDLE), theme.default_color);
-            std::cout << std::format("Usage: {}\n", it->usage);
-        } else {
-            ColorGuard guard(theme.error_color);
-            std::cerr << std::format("jshell: No help available for '{}'\n", cmd_name);
-            return 1;
-        }
-    } else {
-        // Show general help
-        ColorGuard header_guard(theme.prompt_color);
-        std::cout << "jshell - Enhanced C++ Shell for Windows v2.0\n\n";
+    Matcher matcher;
+    compile_grep_pattern(matcher, pattern);
+    
+    std::string_view text = file.view();
+    size_t line_number = 1;
+    size_t counted_to = 0;
+    size_t pos = 0, len = 0;
+    bool found = false;
+    
+    // An empty file has no lines, so not even ^ matches
+    while (!text.empty() && matcher.find(text, counted_to, pos, len)) {
+        size_t line_begin = pos == 0 ? std::string_view::npos : text.rfind('\n', pos - 1);
+        line_begin = line_begin == std::string_view::npos ? 0 : line_begin + 1;
+        size_t line_end = text.find('\n', pos);
+        if (line_end == std::string_view::npos) line_end = text.size();
         
-        SetConsoleTextAttribute(GetStdHandle(STD_OUTPUT_HANDLE), theme.default_color);
-        std::cout << "Built-in commands:\n";
-
-        for (const auto& builtin : builtins) {
-            ColorGuard cmd_guard(theme.help_command_color);
-            std::cout << std::format("  {:12}", builtin.name);
-            
-            SetConsoleTextAttribute(GetStdHandle(STD_OUTPUT_HANDLE), theme.default_color);
-            std::cout << std::format(" - {}\n", builtin.description);
-        }
+        line_number += std::count(text.begin() + counted_to, text.begin() + line_begin, '\n');
+        std::string_view line = text.substr(line_begin, line_end - line_begin);
+        if (line.ends_with('\r')) line.remove_suffix(1);
+        std::cout << std::format("{}:{}: {}\n", filepath, line_number, line);
+        found = true;
         
-        std::cout << "\nUse 'help <command>' for detailed usage information.\n";
+        if (line_end == text.size() || downstream_closed()) break;
+        counted_to = line_end + 1;
+        if (counted_to == text.size()) break;
+        line_number++;
     }
     
-    return 0;
+    return found ? 0 : 1;
 }
 
-int exit_shell(ShellState& state, std::span<const char*> args) {
+int wc(ShellState& state, std::span<const char*> args) {
+    ParsedArgs parsed = parse_args(args);
+    bool lines = parsed.flags['l'];
+    bool words = parsed.flags['w'];
+    bool bytes = parsed.flags['c'];
+    
+    if (parsed.non_flag_args.empty()) {
+        if (builtin_stdin == INVALID_HANDLE_VALUE) {
+            const Theme theme;
+            ColorGuard guard(theme.error_color);
+            std::cerr << "jshell: Usage: wc [-lwc] <file> [files...]  (or: command | wc)\n";
+            return 1;
+        }
+        TextCounts counts;
+        read_line_blocks(builtin_stdin, state.config.io_block_size, [&](std::string_view block) {
+            counts.add(block);
+            return true;
+        });
+        print_counts(counts, lines, words, bytes, "");
+        return 0;
+    }
+    
     int exit_code = 0;
-    if (args.size() > 1) {
-        try {
-            exit_code = std::stoi(args[1]);
-        } catch (...) {
+    TextCounts total;
+    for (const auto& arg : parsed.non_flag_args) {
+        std::string filepath = expand_path(arg);
+        MappedFile file;
+        if (!file.open(filepath)) {
+            const Theme theme;
+            ColorGuard guard(theme.error_color);
+            std::cerr << std::format("jshell: wc: Cannot open file '{}'\n", filepath);
             exit_code = 1;
+            continue;
         }
+        TextCounts counts;
+        counts.add(file.view());
+        print_counts(counts, lines, words, bytes, arg);
+        total.lines += counts.lines;
+        total.words += counts.words;
+        total.bytes += counts.bytes;
     }
+    if (parsed.non_flag_args.size() > 1) print_counts(total, lines, words, bytes, "total");
     
-    save_history(state);
-    state.running = false;
-    state.last_exit_code = exit_code;
     return exit_code;
 }
 
-int pwd(ShellState&, std::span<const char*>) {
-    try {
-        std::cout << fs::current_path().string() << '\n';
+int head(ShellState& state, std::span<const char*> args) {
+    size_t count = 10;
+    std::string filepath;
+    bool valid = true;
+    
+    for (size_t i = 1; i < args.size() && valid; ++i) {
+        std::string_view arg = args[i];
+        if (!arg.starts_with('-')) {
+            valid = filepath.empty();
+            filepath = expand_path(args[i]);
+            continue;
+        }
+        // -n 5, -n5 or -5
+        std::string_view number = arg == "-n" && i + 1 < args.size() ? args[++i] : arg.substr(arg.starts_with("-n") ? 2 : 1);
+        auto result = std::from_chars(number.data(), number.data() + number.size(), count);
+        valid = !number.empty() && result.ptr == number.data() + number.size();
+    }
+    
+    if (!valid || (filepath.empty() && builtin_stdin == INVALID_HANDLE_VALUE)) {
+        const Theme theme;
+        ColorGuard guard(theme.error_color);
+        std::cerr << "jshell: Usage: head [-n count] <file>  (or: command | head [-n count])\n";
+        return 1;
+    }
+    
+    // Print whole lines of text until count is reached; false once it has been
+    size_t printed = 0;
+    auto print_lines = [&](std::string_view text) {
+        size_t pos = 0;
+        while (printed < count && pos < text.size()) {
+            size_t line_end = text.find('\n', pos);
+            line_end = line_end == std::string_view::npos ? text.size() : line_end + 1;
+            print_line(text.substr(pos, line_end - pos));
+            printed++;
+            pos = line_end;
+        }
+        return printed < count;
+    };
+    
+    if (filepath.empty()) {
+        // Returning closes the pipe, which stops the stages feeding it
+        if (count > 0) read_line_blocks(builtin_stdin, state.config.io_block_size, print_lines);
         return 0;
-    } catch (const fs::filesystem_error& e) {
+    }
+    
+    MappedFile file;
+    if (!file.open(filepath)) {
         const Theme theme;
         ColorGuard guard(theme.error_color);
-        std::cerr << std::format("jshell: pwd: {}\n", e.what());
+        std::cerr << std::format("jshell: head: Cannot open file '{}'\n", filepath);
         return 1;
     }
+    
+    // A file goes out byte for byte up to the end of its count-th line, so a
+    // last line without a newline stays without one
+    std::string_view text = file.view();
+    size_t end = 0;
+    for (size_t i = 0; i < count && end < text.size(); ++i) {
+        size_t newline = text.find('\n', end);
+        end = newline == std::string_view::npos ? text.size() : newline + 1;
+    }
+    std::cout.write(text.data(), static_cast<std::streamsize>(end));
+    return 0;
 }
 
-int env(ShellState& state, std::span<const char*> args) {
-    if (args.size() > 1) {
-        // Show specific variable
-        std::string var_name = args[1];
-        
-        if (state.variables.contains(var_name)) {
-            std::cout << std::format("{}={}\n", var_name, state.variables[var_name]);
-        } else {
-            char* env_val = nullptr;
-            size_t len;
-            if (_dupenv_s(&env_val, &len, var_name.c_str()) == 0 && env_val) {
-                std::cout << std::format("{}={}\n", var_name, env_val);
-                free(env_val);
-            } else {
-                const Theme theme;
-                ColorGuard guard(theme.error_color);
-                std::cerr << std::format("jshell: Variable '{}' not found\n", var_name);
-                return 1;
-            }
+int find_files(ShellState& state, std::span<const char*> args) {
+    bool json = emit_records(state, args);
+    if (args.size() < 3) {
+        const Theme theme;
+        ColorGuard guard(theme.error_color);
+        std::cerr << "jshell: Usage: find <path> <pattern>\n";
+        return 1;
+    }
+    
+    std::string search_path = expand_path(args[1]);
+    std::string pattern = args[2];
+    
+    // Records: path, size in bytes, mtime in Unix seconds
+    std::string records;
+    auto report = [&](const fs::directory_entry& entry) {
+        if (!json) {
+            std::cout << entry.path().string() << '\n';
+            return;
         }
-    } else {
-        // Show all environment variables
-        for (char** env_var = _environ; *env_var; ++env_var) {
-            std::cout << *env_var << '\n';
+        std::error_code ec;
+        RecordWriter record(records);
+        record.field("path", utf8_path(entry.path()));
+        uintmax_t size = entry.file_size(ec);
+        if (ec) record.null_field("size");
+        else record.field("size", size);
+        auto mtime = entry.last_write_time(ec);
+        if (ec) record.null_field("mtime");
+        else record.field("mtime", unix_time(mtime));
+        record.end();
+        if (records.size() >= IO_BLOCK_SIZE) flush_records(records);
+    };
+    
+    try {
+        std::regex regex_pattern(pattern, std::regex::icase);
+        bool found = false;
+        
+        for (const auto& entry : fs::recursive_directory_iterator(search_path, fs::directory_options::skip_permission_denied)) {
+            if (downstream_closed()) break;
+            try {
+                if (entry.is_regular_file()) {
+                    std::string filename = entry.path().filename().string();
+                    if (std::regex_search(filename, regex_pattern)) {
+                        report(entry);
+                        found = true;
+                    }
+                }
+            } catch(const fs::filesystem_error&) { continue; }
         }
         
-        // Show shell variables
-        if (!state.variables.empty()) {
-            const Theme theme;
-            ColorGuard guard(theme.help_command_color);
-            std::cout << "\nShell variables:\n";
-            
-            SetConsoleTextAttribute(GetStdHandle(STD_OUTPUT_HANDLE), theme.default_color);
-            for (const auto& [name, value] : state.variables) {
-                std::cout << std::format("{}={}\n", name, value);
+        flush_records(records);
+        return found ? 0 : 1;
+        
+    } catch (const std::regex_error&) {
+        // Fall back to simple string search
+        bool found = false;
+        
+        try {
+            for (const auto& entry : fs::recursive_directory_iterator(search_path, fs::directory_options::skip_permission_denied)) {
+                if (downstream_closed()) break;
+                try {
+                    if (entry.is_regular_file()) {
+                        std::string filename = entry.path().filename().string();
+                        if (filename.find(pattern) != std::string::npos) {
+                            report(entry);
+                            found = true;
+                        }
+                    }
+                } catch(const fs::filesystem_error&) { continue; }
             }
+            flush_records(records);
+        } catch (const fs::filesystem_error& e) {
+            const Theme theme;
+            ColorGuard guard(theme.error_color);
+            std::cerr << std::format("jshell: find: {}\n", e.what());
+            return 1;
         }
+        
+        return found ? 0 : 1;
+    } catch (const fs::filesystem_error& e) {
+        const Theme theme;
+        ColorGuard guard(theme.error_color);
+        std::cerr << std::format("jshell: find: {}\n", e.what());
+        return 1;
     }
-    
-    return 0;
 }
 
-int set_var(ShellState& state, std::span<const char*> args) {
-    if (args.size() < 3) {
+int which(ShellState& state, std::span<const char*> args) {
+    if (args.size() < 2) {
         const Theme theme;
         ColorGuard guard(theme.error_color);
-        std::cerr << "jshell: Usage: set <NAME> <VALUE>\n";
+        std::cerr << "jshell: Usage: which <command>\n";
         return 1;
     }
     
-    std::string name = args[1];
-    std::string value = args[2];
+    std::string cmd_name = args[1];
     
-    // Join remaining arguments as value
-    for (size_t i = 3; i < args.size(); ++i) {
-        value += " " + std::string(args[i]);
+    // Check aliases
+    if (state.aliases.contains(cmd_name)) {
+        std::cout << std::format("{}: aliased to '{}'\n", cmd_name, state.aliases[cmd_name].text);
+        return 0;
     }
     
-    // Set both shell variable and environment variable
-    state.variables[name] = value;
-    if (!SetEnvironmentVariableA(name.c_str(), value.c_str())) {
-        const Theme theme;
-        ColorGuard guard(theme.warning_color);
-        std::cerr << "jshell: Warning: Failed to set environment variable\n";
+    // Check builtins
+    for (const auto& builtin : builtins) {
+        if (builtin.name == cmd_name) {
+            std::cout << std::format("{}: shell builtin\n", cmd_name);
+            return 0;
+        }
     }
     
-    return 0;
+    // Find executable
+    std::string path = find_executable(cmd_name);
+    if (!path.empty()) {
+        std::cout << path << '\n';
+        return 0;
+    }
+    
+    const Theme theme;
+    ColorGuard guard(theme.error_color);
+    std::cerr << std::format("jshell: which: '{}' not found\n", cmd_name);
+    return 1;
 }
 
-int unset_var(ShellState& state, std::span<const char*> args) {
-    if (args.size() < 2) {
+int ps(ShellState& state, std::span<const char*> args) {
+    bool json = emit_records(state, args);
+    ScopedHandle snapshot(CreateToolhelp32Snapshot(TH32CS_SNAPPROCESS, 0));
+    if (!snapshot) {
         const Theme theme;
         ColorGuard guard(theme.error_color);
-        std::cerr << "jshell: Usage: unset <NAME>\n";
+        std::cerr << "jshell: ps: Cannot create process snapshot\n";
         return 1;
     }
     
-    std::string name = args[1];
-    state.variables.erase(name);
-    
-    if (!SetEnvironmentVariableA(name.c_str(), nullptr)) {
-        const Theme theme;
-        ColorGuard guard(theme.warning_color);
-        std::cerr << "jshell: Warning: Failed to unset environment variable\n";
-    }
-    
-    return 0;
-}
-
-int history(ShellState& state, std::span<const char*> args) {
-    size_t count = state.history.size();
+    PROCESSENTRY32W pe = { sizeof(pe) };
     
-    if (args.size() > 1) {
-        try {
-            count = std::min(count, static_cast<size_t>(std::stoi(args[1])));
-        } catch (...) {
-            const Theme theme;
-            ColorGuard guard(theme.error_color);
-            std::cerr << "jshell: Invalid number\n";
-            return 1;
+    // Records: pid, ppid, name, threads, and rss in bytes (null if the process can't be opened)
+    if (json) {
+        std::string records;
+        if (Process32FirstW(snapshot.get(), &pe)) {
+            do {
+                RecordWriter record(records);
+                record.field("pid", pe.th32ProcessID)
+                      .field("ppid", pe.th32ParentProcessID)
+                      .field("name", narrow_text(pe.szExeFile))
+                      .field("threads", pe.cntThreads);
+                
+                PROCESS_MEMORY_COUNTERS memory = { sizeof(memory) };
+                ScopedHandle process(OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, pe.th32ProcessID));
+                if (process && GetProcessMemoryInfo(process.get(), &memory, sizeof(memory))) {
+                    record.field("rss", static_cast<uint64_t>(memory.WorkingSetSize));
+                } else {
+                    record.null_field("rss");
+                }
+                record.end();
+                if (records.size() >= IO_BLOCK_SIZE) flush_records(records);
+            } while (!downstream_closed() && Process32NextW(snapshot.get(), &pe));
         }
+        flush_records(records);
+        return 0;
     }
     
-    size_t start = state.history.size() > count ? state.history.size() - count : 0;
+    std::cout << std::format("{:>8} {:>8} {}\n", "PID", "PPID", "NAME");
+    std::cout << std::string(40, '-') << '\n';
     
-    for (size_t i = start; i < state.history.size(); ++i) {
-        std::cout << std::format("{:5}: {}\n", i + 1, state.history[i]);
+    if (Process32FirstW(snapshot.get(), &pe)) {
+        do {
+            std::cout << std::format("{:>8} {:>8} {}\n", 
+                                   pe.th32ProcessID, 
+                                   pe.th32ParentProcessID, 
+                                   narrow_text(pe.szExeFile, CP_ACP));
+        } while (!downstream_closed() && Process32NextW(snapshot.get(), &pe));
     }
     
     return 0;
 }
 
-int source(ShellState& state, std::span<const char*> args) {
+int kill_proc(ShellState&, std::span<const char*> args) {
     if (args.size() < 2) {
         const Theme theme;
         ColorGuard guard(theme.error_color);
-        std::cerr << "jshell: Usage: source <script_file>\n";
+        std::cerr << "jshell: Usage: kill <pid>\n";
         return 1;
     }
     
-    std::string filepath = expand_path(args[1]);
-    std::ifstream file(filepath);
-    
-    if (!file) {
+    DWORD pid;
+    try {
+        pid = std::stoul(args[1]);
+    } catch (...) {
         const Theme theme;
         ColorGuard guard(theme.error_color);
-        std::cerr << std::format("jshell: Failed to open script '{}'\n", filepath);
+        std::cerr << "jshell: kill: Invalid process ID\n";
         return 1;
     }
     
-    std::string line;
-    int line_number = 0;
+    ScopedHandle process(OpenProcess(PROCESS_TERMINATE, FALSE, pid));
+    if (!process) {
+        const Theme theme;
+        ColorGuard guard(theme.error_color);
+        std::cerr << std::format("jshell: kill: Cannot open process {}: {}\n", pid, std::system_category().message(GetLastError()));
+        return 1;
+    }
     
-    while (std::getline(file, line)) {
-        line_number++;
-        
-        // Skip empty lines and comments
-        if (line.empty() || line.starts_with('#')) continue;
-        
-        try {
-            auto commands = parse_pipeline(line, state);
-            if (!commands.empty()) {
-                execute(state, commands);
-            }
-        } catch (const std::exception& e) {
-            const Theme theme;
-            ColorGuard guard(theme.error_color);
-            std::cerr << std::format("jshell: Error at line {}: {}\n", line_number, e.what());
-        }
-        
-        if (!state.running) break;
+    if (!TerminateProcess(process.get(), 1)) {
+        const Theme theme;
+        ColorGuard guard(theme.error_color);
+        std::cerr << std::format("jshell: kill: Cannot terminate process {}: {}\n", pid, std::system_category().message(GetLastError()));
+        return 1;
     }
     
+    const Theme theme;
+    ColorGuard guard(theme.success_color);
+    std::cout << std::format("Process {} terminated\n", pid);
     return 0;
 }
 
-int ls(ShellState&, std::span<const char*> args) {
-    ParsedArgs parsed = parse_args(args);
-    bool long_format = parsed.flags['l'];
-    bool show_all = parsed.flags['a'];
-    
-    fs::path path = parsed.non_flag_args.empty() ? "." : expand_path(parsed.non_flag_args[0]);
-    const Theme theme;
-
-    try {
-        if (!fs::exists(path)) {
-            throw fs::filesystem_error("Path does not exist", path, 
-                                     std::make_error_code(std::errc::no_such_file_or_directory));
-        }
-        
-        if (fs::is_regular_file(path)) {
-            auto ftime = fs::last_write_time(path);
-            auto sctp = std::chrono::time_point_cast<std::chrono::system_clock::duration>(
-                ftime - fs::file_time_type::clock::now() + std::chrono::system_clock::now());
-            std::time_t cftime = std::chrono::system_clock::to_time_t(sctp);
-            
-            char time_buf[20];
-            std::strftime(time_buf, sizeof(time_buf), "%b %d %H:%M", std::localtime(&cftime));
+int jobs(ShellState& state, std::span<const char*> args) {
+    // Records: id, pid, state (running, stopped or done), exit_code when done, command
+    if (emit_records(state, args)) {
+        std::string records;
+        for (auto it = state.jobs.begin(); it != state.jobs.end();) {
+            DWORD exit_code;
+            bool done = GetExitCodeProcess((*it)->process_handle, &exit_code) && exit_code != STILL_ACTIVE;
+            RecordWriter record(records);
+            record.field("id", (*it)->job_id)
+                  .field("pid", (*it)->process_id)
+                  .field("state", done ? "done" : (*it)->is_stopped ? "stopped" : "running");
+            if (done) record.field("exit_code", exit_code);
+            record.field("command", utf8_from_ansi((*it)->command_line)).end();
             
-            if (long_format) {
-                uintmax_t size = fs::file_size(path);
-                std::cout << std::format("-rwx------ {:>10} {} {}\n", 
-                                       size, time_buf, path.filename().string());
+            // A pipeline stage only reads ShellState; the next jobs at the prompt reaps
+            if (done && !pipeline_stage) {
+                CloseHandle((*it)->process_handle);
+                it = state.jobs.erase(it);
             } else {
-                std::cout << path.filename().string() << '\n';
+                ++it;
             }
-            return 0;
         }
-        
-        if (!fs::is_directory(path)) {
-            throw fs::filesystem_error("Not a directory", path,
-                                     std::make_error_code(std::errc::not_a_directory));
+        flush_records(records);
+        return 0;
+    }
+    
+    if (state.jobs.empty()) {
+        std::cout << "No active jobs.\n";
+        return 0;
+    }
+    
+    // Clean up finished jobs first, unless this is a pipeline stage
+    for (auto it = state.jobs.begin(); it != state.jobs.end();) {
+        DWORD exit_code;
+        if (!pipeline_stage && GetExitCodeProcess((*it)->process_handle, &exit_code) && exit_code != STILL_ACTIVE) {
+            const Theme theme;
+            ColorGuard guard(theme.success_color);
+            std::cout << std::format("[{}]+ Done                    {}\n", (*it)->job_id, (*it)->command_line);
+            CloseHandle((*it)->process_handle);
+            it = state.jobs.erase(it);
+        } else {
+            ++it;
         }
+    }
+    
+    // Show remaining jobs
+    for (const auto& job : state.jobs) {
+        DWORD exit_code;
+        bool done = GetExitCodeProcess(job->process_handle, &exit_code) && exit_code != STILL_ACTIVE;
+        std::string status = done ? "Done" : job->is_stopped ? "Stopped" : "Running";
+        std::cout << std::format("[{}]  {} {:>8}     {}\n", 
+                                job->job_id, status, job->process_id, job->command_line);
+    }
+    
+    return 0;
+}
 
-        for (const auto& entry : fs::directory_iterator(path)) {
-            std::string filename = entry.path().filename().string();
-            
-            if (!show_all && filename.starts_with('.')) continue;
-
-            if (long_format) {
-                auto ftime = entry.last_write_time();
-                auto sctp = std::chrono::time_point_cast<std::chrono::system_clock::duration>(
-                    ftime - fs::file_time_type::clock::now() + std::chrono::system_clock::now());
-                std::time_t cftime = std::chrono::system_clock::to_time_t(sctp);
-                
-                char time_buf[20];
-                std::strftime(time_buf, sizeof(time_buf), "%b %d %H:%M", std::localtime(&cftime));
-                
-                std::cout << (entry.is_directory() ? 'd' : '-');
-                std::cout << "rwx------ ";
-                
-                uintmax_t size = 0;
-                try {
-                    size = entry.is_directory() ? 0 : fs::file_size(entry);
-                } catch (...) {
-                    size = 0;
-                }
-                
-                std::cout << std::format("{:>10} {} ", size, time_buf);
-            }
-            
-            if (entry.is_directory()) {
-                ColorGuard guard(theme.dir_color);
-                std::cout << filename;
-            } else {
-                std::cout << filename;
-            }
-            
-            if (entry.is_directory()) std::cout << '/';
-            std::cout << '\n';
+int where(ShellState& state, std::span<const char*> args) {
+    bool json = emit_records(state, args);
+    static const std::vector<std::string_view> operators = {"==", "!=", "-eq", "-ne", "-lt", "-le", "-gt", "-ge", "~"};
+    if (args.size() != 4 || std::find(operators.begin(), operators.end(), args[2]) == operators.end()) {
+        const Theme theme;
+        ColorGuard guard(theme.error_color);
+        std::cerr << "jshell: Usage: where <field> <==|!=|-eq|-ne|-lt|-le|-gt|-ge|~> <value>\n";
+        return 1;
+    }
+    
+    RecordReader reader(state.config.io_block_size);
+    if (!open_record_input(reader, "where")) return 1;
+    
+    std::string_view field = args[1];
+    std::string_view op = args[2];
+    std::string operand = args[3];
+    
+    // A numeric operand (sizes may carry K/M/G) compares numerically with
+    // number fields; everything else compares as text
+    std::optional<int64_t> number;
+    if (auto size = parse_size(operand); size && *size <= static_cast<size_t>(INT64_MAX)) {
+        number = static_cast<int64_t>(*size);
+    } else if (int64_t value = 0; std::from_chars(operand.data(), operand.data() + operand.size(), value).ptr ==
+                                operand.data() + operand.size()) {
+        number = value;
+    }
+    
+    auto matches = [&](const Record& record) {
+        const FieldValue* value = record.find(field);
+        if (!value) return false;
+        if (op == "~") return field_text(*value).find(operand) != std::string::npos;
+        
+        std::weak_ordering order = std::weak_ordering::equivalent;
+        if (auto* field_number = std::get_if<int64_t>(value); field_number && number) {
+            order = *field_number <=> *number;
+        } else if (std::holds_alternative<std::monostate>(*value)) {
+            order = operand == "null" ? std::weak_ordering::equivalent : std::weak_ordering::less;
+        } else {
+            order = field_text(*value).compare(operand) <=> 0;
         }
         
-    } catch (const fs::filesystem_error& e) {
+        if (op == "==" || op == "-eq") return order == 0;
+        if (op == "!=" || op == "-ne") return order != 0;
+        if (op == "-lt") return order < 0;
+        if (op == "-le") return order <= 0;
+        if (op == "-gt") return order > 0;
+        return order >= 0;
+    };
+    
+    RecordOutput output(json);
+    Record record;
+    bool found = false;
+    while (reader.next(record)) {
+        if (!matches(record)) continue;
+        found = true;
+        if (!output.write(record)) break;
+    }
+    output.finish();
+    return found ? 0 : 1;
+}
+
+int select_fields(ShellState& state, std::span<const char*> args) {
+    bool json = emit_records(state, args);
+    if (args.size() < 2) {
+        const Theme theme;
         ColorGuard guard(theme.error_color);
-        std::cerr << std::format("jshell: ls: {}\n", e.what());
+        std::cerr << "jshell: Usage: select <field> [fields...]\n";
         return 1;
     }
     
+    RecordReader reader(state.config.io_block_size);
+    if (!open_record_input(reader, "select")) return 1;
+    
+    RecordOutput output(json);
+    Record record;
+    Record selected;
+    while (reader.next(record)) {
+        selected.fields.resize(args.size() - 1);
+        for (size_t i = 1; i < args.size(); ++i) {
+            auto& [name, value] = selected.fields[i - 1];
+            name.assign(args[i]);
+            auto it = std::find_if(record.fields.begin(), record.fields.end(),
+                                   [&](const auto& field) { return field.first == name; });
+            if (it != record.fields.end()) value = std::move(it->second);
+            else value = std::monostate{};
+        }
+        if (!output.write(selected)) break;
+    }
+    output.finish();
     return 0;
 }
 
-int cat(ShellState&, std::span<const char*> args) {
-    if (args.size() < 2) {
+int sort_by(ShellState& state, std::span<const char*> args) {
+    bool json = emit_records(state, args);
+    ParsedArgs parsed = parse_args(args);
+    if (parsed.non_flag_args.empty()) {
         const Theme theme;
         ColorGuard guard(theme.error_color);
-        std::cerr << "jshell: Usage: cat <file> [files...]\n";
+        std::cerr << "jshell: Usage: sort-by [-r] <field> [fields...]\n";
         return 1;
     }
     
-    int exit_code = 0;
+    RecordReader reader(state.config.io_block_size);
+    if (!open_record_input(reader, "sort-by")) return 1;
     
-    for (size_t i = 1; i < args.size(); ++i) {
-        std::string filepath = expand_path(args[i]);
-        std::ifstream file(filepath, std::ios::binary);
-        
-        if (!file) {
-            const Theme theme;
-            ColorGuard guard(theme.error_color);
-            std::cerr << std::format("jshell: cat: Cannot open file '{}'\n", filepath);
-            exit_code = 1;
-            continue;
+    std::vector<Record> records;
+    Record record;
+    while (reader.next(record)) records.push_back(std::move(record));
+    
+    // Records missing a field sort with nulls
+    const FieldValue null_value;
+    bool reverse = parsed.flags['r'];
+    std::stable_sort(records.begin(), records.end(), [&](const Record& a, const Record& b) {
+        for (const auto& field : parsed.non_flag_args) {
+            const FieldValue* left = a.find(field);
+            const FieldValue* right = b.find(field);
+            auto order = compare_fields(left ? *left : null_value, right ? *right : null_value);
+            if (order != 0) return reverse ? order > 0 : order < 0;
         }
-        
-        std::cout << file.rdbuf();
-    }
+        return false;
+    });
     
-    return exit_code;
+    RecordOutput output(json);
+    for (auto& sorted : records) {
+        if (!output.write(sorted)) break;
+    }
+    output.finish();
+    return 0;
 }
 
-int echo(ShellState&, std::span<const char*> args) {
-    bool no_newline = false;
-    size_t start_idx = 1;
+// out [-N]: output of the Nth most recent command; a list without arguments
+int out(ShellState& state, std::span<const char*> args) {
+    const Theme theme;
     
-    // Check for -n flag
-    if (args.size() > 1 && std::string(args[1]) == "-n") {
-        no_newline = true;
-        start_idx = 2;
+    if (args.size() < 2) {
+        auto entries = output_history.list();
+        if (entries.empty()) {
+            std::cout << (state.config.output_history_size ? "No command output recorded\n"
+                                                           : "Output history is off (output_history_size = 0)\n");
+            return 0;
+        }
+        for (size_t i = 0; i < entries.size(); ++i) {
+            const auto& entry = entries[i];
+            std::string index = std::format("-{}", entries.size() - i);
+            std::string sizes = entry.compressed ? std::format("{} bytes, {} stored", entry.size, entry.stored)
+                                                 : std::format("{} bytes", entry.size);
+            std::cout << std::string(index.size() < 4 ? 4 - index.size() : 0, ' ') << index << "  ";
+            {
+                ColorGuard guard(theme.help_command_color);
+                std::cout << entry.command;
+            }
+            std::cout << std::format("  ({}{})\n", sizes, entry.truncated ? ", truncated" : "");
+        }
+        return 0;
     }
     
-    for (size_t i = start_idx; i < args.size(); ++i) {
-        std::cout << args[i];
-        if (i < args.size() - 1) std::cout << ' ';
+    std::string spec = args[1];
+    size_t back = 0;
+    auto [end, ec] = std::from_chars(spec.data() + 1, spec.data() + spec.size(), back);
+    if (spec.size() < 2 || spec[0] != '-' || ec != std::errc() || end != spec.data() + spec.size() || back == 0) {
+        ColorGuard guard(theme.error_color);
+        std::cerr << "jshell: out: usage: out [-N]\n";
+        return 1;
     }
     
-    if (!no_newline) std::cout << '\n';
-    
+    auto entry = output_history.get(back);
+    if (!entry) {
+        ColorGuard guard(theme.error_color);
+        std::cerr << std::format("jshell: out: no output recorded for command -{}\n", back);
+        return 1;
+    }
+    std::cout << entry->second;
     return 0;
 }
 
-int mkdir(ShellState&, std::span<const char*> args) {
-    ParsedArgs parsed = parse_args(args);
-    bool parents = parsed.flags['p'];
+// transcript [file]: the logged sessions as JSON Lines, oldest first
+int transcript(ShellState& state, std::span<const char*> args) {
+    fs::path path = args.size() > 1 ? fs::path(args[1]) : state.shell_directory / TRANSCRIPT_FILE;
+    session_log.flush();
+    session_log.omit_output();  // Logging the transcript would copy it into itself
     
-    if (parsed.non_flag_args.empty()) {
+    if (!read_transcript(path, [](std::string_view text) { std::cout << text; })) {
         const Theme theme;
         ColorGuard guard(theme.error_color);
-        std::cerr << "jshell: Usage: mkdir [-p] <directory>\n";
+        std::cerr << std::format("jshell: transcript: cannot read '{}'{}\n", path.string(),
+                                 state.config.transcript ? "" : " (transcript logging is off)");
+        return 1;
+    }
+    return 0;
+}
+
+int fg(ShellState& state, std::span<const char*> args) {
+    if (state.jobs.empty()) {
+        const Theme theme;
+        ColorGuard guard(theme.error_color);
+        std::cerr << "jshell: fg: no current job\n";
         return 1;
     }
     
-    int exit_code = 0;
+    std::unique_ptr<Job> job;
     
-    for (const auto& dir_name : parsed.non_flag_args) {
-        std::string dir_path = expand_path(dir_name);
+    if (args.size() > 1) {
+        // Find job by ID
+        int job_id = std::stoi(args[1]);
+        auto it = std::find_if(state.jobs.begin(), state.jobs.end(),
+                              [job_id](const auto& j) { return j->job_id == job_id; });
         
-        try {
-            if (parents) {
-                fs::create_directories(dir_path);
-            } else {
-                fs::create_directory(dir_path);
-            }
-        } catch (const fs::filesystem_error& e) {
+        if (it == state.jobs.end()) {
             const Theme theme;
             ColorGuard guard(theme.error_color);
-            std::cerr << std::format("jshell: mkdir: {}\n", e.what());
-            exit_code = 1;
+            std::cerr << std::format("jshell: fg: job {} not found\n", job_id);
+            return 1;
         }
+        
+        job = std::move(*it);
+        state.jobs.erase(it);
+    } else {
+        // Use most recent job
+        job = std::move(state.jobs.back());
+        state.jobs.pop_back();
     }
     
-    return exit_code;
+    std::cout << job->command_line << "\n";
+    
+    // Wait for the job to complete
+    DWORD exit_code;
+    WaitForSingleObject(job->process_handle, INFINITE);
+    GetExitCodeProcess(job->process_handle, &exit_code);
+    CloseHandle(job->process_handle);
+    
+    return static_cast<int>(exit_code);
 }
 
-int rm(ShellState&, std::span<const char*> args) {
-    ParsedArgs parsed = parse_args(args);
-    bool recursive = parsed.flags['r'];
-    bool force = parsed.flags['f'];
-    
-    if (parsed.non_flag_args.empty()) {
+int bg(ShellState& state, std::span<const char*> args) {
+    if (state.jobs.empty()) {
         const Theme theme;
         ColorGuard guard(theme.error_color);
-        std::cerr << "jshell: Usage: rm [-rf] <path>\n";
+        std::cerr << "jshell: bg: no current job\n";
         return 1;
     }
     
-    int exit_code = 0;
+    Job* target_job = nullptr;
     
-    for (const auto& path_name : parsed.non_flag_args) {
-        std::string path_str = expand_path(path_name);
+    if (args.size() > 1) {
+        // Find job by ID
+        int job_id = std::stoi(args[1]);
+        auto it = std::find_if(state.jobs.begin(), state.jobs.end(),
+                              [job_id](const auto& j) { return j->job_id == job_id; });
         
-        try {
-            if (!fs::exists(path_str)) {
-                if (!force) {
-                    const Theme theme;
-                    ColorGuard guard(theme.error_color);
-                    std::cerr << std::format("jshell: rm: '{}' does not exist\n", path_str);
-                    exit_code = 1;
-                }
-                continue;
-            }
-            
-            if (fs::is_directory(path_str) && !recursive) {
-                const Theme theme;
-                ColorGuard guard(theme.error_color);
-                std::cerr << std::format("jshell: rm: '{}' is a directory (use -r for recursive removal)\n", path_str);
-                exit_code = 1;
-                continue;
-            }
-            
-            if (recursive) {
-                fs::remove_all(path_str);
-            } else {
-                fs::remove(path_str);
-            }
-            
-        } catch (const fs::filesystem_error& e) {
-            if (!force) {
-                const Theme theme;
-                ColorGuard guard(theme.error_color);
-                std::cerr << std::format("jshell: rm: {}\n", e.what());
-                exit_code = 1;
-            }
+        if (it == state.jobs.end()) {
+            const Theme theme;
+            ColorGuard guard(theme.error_color);
+            std::cerr << std::format("jshell: bg: job {} not found\n", job_id);
+            return 1;
         }
+        
+        target_job = it->get();
+    } else {
+        // Use most recent job
+        target_job = state.jobs.back().get();
     }
     
-    return exit_code;
-}
-
-int cls(ShellState&, std::span<const char*>) {
-    HANDLE console = GetStdHandle(STD_OUTPUT_HANDLE);
-    CONSOLE_SCREEN_BUFFER_INFO info;
-    DWORD written;
-    
-    if (GetConsoleScreenBufferInfo(console, &info)) {
-        DWORD size = info.dwSize.X * info.dwSize.Y;
-        COORD coord = {0, 0};
-        
-        FillConsoleOutputCharacterA(console, ' ', size, coord, &written);
-        FillConsoleOutputAttribute(console, info.wAttributes, size, coord, &written);
-        SetConsoleCursorPosition(console, coord);
+    if (!target_job->is_stopped) {
+        const Theme theme;
+        ColorGuard guard(theme.warning_color);
+        std::cerr << std::format("jshell: bg: job {} is already running\n", target_job->job_id);
+        return 1;
     }
     
+    target_job->is_stopped = false;
+    target_job->is_running = true;
+    
+    std::cout << std::format("[{}]+ {} &\n", target_job->job_id, target_job->command_line);
+    
     return 0;
 }
 
-int alias(ShellState& state, std::span<const char*> args) {
-    if (args.size() == 1) {
-        // Show all aliases
-        if (state.aliases.empty()) {
-            std::cout << "No aliases defined.\n";
-        } else {
-            for (const auto& [name, command] : state.aliases) {
-                std::cout << std::format("{}='{}'\n", name, command);
-            }
-        }
-        return 0;
-    }
+int code(ShellState&, std::span<const char*> args) {
+    const Theme theme;
+    
+    // Application shortcuts and their common executable names
+    std::map<std::string, std::vector<std::string>> app_shortcuts = {
+        // Editors
+        {"vscode", {"code", "code-insiders"}},
+        {"vs", {"code", "code-insiders"}},
+        {"code", {"code"}},
+        {"code-insiders", {"code-insiders"}},
+        {"kiro", {"kiro", "Kiro"}},
+        {"notepad++", {"notepad++", "notepad++.exe"}},
+        {"npp", {"notepad++", "notepad++.exe"}},
+        {"sublime", {"sublime_text", "subl"}},
+        {"atom", {"atom"}},
+        {"vim", {"vim", "nvim", "gvim"}},
+        {"nano", {"nano"}},
+        {"notepad", {"notepad", "notepad.exe"}},
+        
+        // Browsers
+        {"chrome", {"chrome", "google-chrome", "chrome.exe"}},
+        {"firefox", {"firefox", "firefox.exe"}},
+        {"edge", {"msedge", "microsoftedge", "edge"}},
+        {"brave", {"brave", "brave-browser"}},
+        
+        // Development Tools
+        {"git", {"git"}},
+        {"node", {"node", "nodejs"}},
+        {"python", {"python", "python3", "py"}},
+        {"java", {"java"}},
+        {"javac", {"javac"}},
+        {"gcc", {"gcc", "g++"}},
+        {"make", {"make", "mingw32-make"}},
+        {"cmake", {"cmake"}},
+        
+        // System Tools
+        {"explorer", {"explorer", "explorer.exe"}},
+        {"cmd", {"cmd", "cmd.exe"}},
+        {"powershell", {"powershell", "pwsh"}},
+        {"pwsh", {"pwsh"}},
+        {"regedit", {"regedit", "regedit.exe"}},
+        {"taskmgr", {"taskmgr", "taskmgr.exe"}},
+        {"calc", {"calc", "calc.exe"}},
+        {"mspaint", {"mspaint", "mspaint.exe"}},
+        
+        // Media
+        {"vlc", {"vlc"}},
+        {"spotify", {"spotify"}},
+        {"discord", {"discord"}},
+        
+        // Office
+        {"word", {"winword", "word"}},
+        {"excel", {"excel"}},
+        {"powerpoint", {"powerpnt"}},
+        
+        // IDEs
+        {"visual-studio", {"devenv"}},
+        {"intellij", {"idea", "idea64"}},
+        {"eclipse", {"eclipse"}},
+        {"android-studio", {"studio", "studio64"}},
+    };
     
-    // Join all arguments after 'alias'
-    std::string arg_str;
-    for (size_t i = 1; i < args.size(); ++i) {
-        if (i > 1) arg_str += ' ';
-        arg_str += args[i];
-    }
+    std::string app_name;
+    std::string path = ".";
     
-    auto eq_pos = arg_str.find('=');
-    if (eq_pos == std::string::npos) {
-        // Show specific alias
-        if (state.aliases.contains(arg_str)) {
-            std::cout << std::format("{}='{}'\n", arg_str, state.aliases[arg_str]);
+    if (args.size() == 1) {
+        // No arguments - try to open current directory in default editor
+        app_name = "vscode";  // Default to VS Code
+    } else if (args.size() == 2) {
+        // One argument - could be app name or path
+        std::string arg = args[1];
+        if (app_shortcuts.contains(arg)) {
+            app_name = arg;
         } else {
-            const Theme theme;
-            ColorGuard guard(theme.error_color);
-            std::cerr << std::format("jshell: alias '{}' not found\n", arg_str);
-            return 1;
+            // Assume it's a path, use default editor
+            app_name = "vscode";
+            path = expand_path(arg);
         }
     } else {
-        // Set alias
-        std::string name = arg_str.substr(0, eq_pos);
-        std::string command = arg_str.substr(eq_pos + 1);
-        
-        // Remove quotes if present
-        if ((command.starts_with('\'') && command.ends_with('\'')) ||
-            (command.starts_with('"') && command.ends_with('"'))) {
-            command = command.substr(1, command.length() - 2);
+        // Two or more arguments - first is app, rest is path/args
+        app_name = args[1];
+        if (args.size() > 2) {
+            path = expand_path(args[2]);
         }
-        
-        state.aliases[name] = command;
-    }
-    
-    return 0;
-}
-
-int unalias(ShellState& state, std::span<const char*> args) {
-    if (args.size() < 2) {
-        const Theme theme;
-        ColorGuard guard(theme.error_color);
-        std::cerr << "jshell: Usage: unalias <name>\n";
-        return 1;
-    }
-    
-    std::string name = args[1];
-    if (state.aliases.erase(name) == 0) {
-        const Theme theme;
-        ColorGuard guard(theme.error_color);
-        std::cerr << std::format("jshell: alias '{}' not found\n", name);
-        return 1;
     }
     
-    return 0;
-}
-
-int touch(ShellState&, std::span<const char*> args) {
-    if (args.size() < 2) {
-        const Theme theme;
-        ColorGuard guard(theme.error_color);
-        std::cerr << "jshell: Usage: touch <filename>\n";
-        return 1;
+    // Special case: if path is "." and app is a system tool, don't pass path
+    bool pass_path = true;
+    std::vector<std::string> no_path_apps = {"taskmgr", "calc", "regedit", "mspaint", "cmd", "powershell", "pwsh"};
+    if (path == "." && std::find(no_path_apps.begin(), no_path_apps.end(), app_name) != no_path_apps.end()) {
+        pass_path = false;
     }
     
-    int exit_code = 0;
+    // Determine if app should be detached or visible
+    std::vector<std::string> interactive_apps = {"cmd", "powershell", "pwsh", "python", "node", "java"};
+    bool is_interactive = std::find(interactive_apps.begin(), interactive_apps.end(), app_name) != interactive_apps.end();
     
-    for (size_t i = 1; i < args.size(); ++i) {
-        std::string filepath = expand_path(args[i]);
-        
-        try {
-            if (fs::exists(filepath)) {
-                // Update timestamp
-                fs::last_write_time(filepath, fs::file_time_type::clock::now());
-            } else {
-                // Create file
-                std::ofstream file(filepath);
-                if (!file) {
-                    const Theme theme;
-                    ColorGuard guard(theme.error_color);
-                    std::cerr << std::format("jshell: touch: Cannot create file '{}'\n", filepath);
-                    exit_code = 1;
+    // Try to find and launch the application
+    if (app_shortcuts.contains(app_name)) {
+        for (const auto& executable_name : app_shortcuts[app_name]) {
+            std::string executable = find_executable(executable_name);
+            if (!executable.empty()) {
+                std::string command;
+                if (pass_path && path != ".") {
+                    command = std::format("\"{}\" \"{}\"", executable, path);
+                } else if (pass_path) {
+                    command = std::format("\"{}\" .", executable);
+                } else {
+                    command = std::format("\"{}\"", executable);
+                }
+                
+                STARTUPINFOA si = { sizeof(si) };
+                PROCESS_INFORMATION pi = { 0 };
+                
+                DWORD creation_flags = is_interactive ? CREATE_NEW_CONSOLE : DETACHED_PROCESS;
+                
+                if (CreateProcessA(nullptr, command.data(), nullptr, nullptr, FALSE, 
+                                 creation_flags, nullptr, nullptr, &si, &pi)) {
+                    CloseHandle(pi.hProcess);
+                    CloseHandle(pi.hThread);
+                    
+                    ColorGuard guard(theme.success_color);
+                    if (pass_path) {
+                        std::cout << std::format("Opened {} in {}\n", path, executable_name);
+                    } else {
+                        std::cout << std::format("Launched {}\n", executable_name);
+                    }
+                    return 0;
                 }
             }
-        } catch (const fs::filesystem_error& e) {
-            const Theme theme;
-            ColorGuard guard(theme.error_color);
-            std::cerr << std::format("jshell: touch: {}\n", e.what());
-            exit_code = 1;
         }
-    }
-    
-    return exit_code;
-}
-
-int cp(ShellState&, std::span<const char*> args) {
-    ParsedArgs parsed = parse_args(args);
-    bool recursive = parsed.flags['r'];
-    
-    if (parsed.non_flag_args.size() < 2) {
-        const Theme theme;
+        
         ColorGuard guard(theme.error_color);
-        std::cerr << "jshell: Usage: cp [-r] <source> <destination>\n";
+        std::cerr << std::format("jshell: {} not found. Make sure it's installed and in PATH.\n", app_name);
         return 1;
-    }
-    
-    std::string src = expand_path(parsed.non_flag_args[0]);
-    std::string dst = expand_path(parsed.non_flag_args[1]);
-    
-    try {
-        if (!fs::exists(src)) {
-            const Theme theme;
-            ColorGuard guard(theme.error_color);
-            std::cerr << std::format("jshell: cp: Source '{}' does not exist\n", src);
-            return 1;
-        }
-        
-        if (fs::is_directory(src)) {
-            if (!recursive) {
-                const Theme theme;
-                ColorGuard guard(theme.error_color);
-                std::cerr << "jshell: cp: Source is a directory (use -r for recursive copy)\n";
-                return 1;
+    } else {
+        // Try to launch as direct executable name
+        std::string executable = find_executable(app_name);
+        if (!executable.empty()) {
+            std::string command;
+            if (args.size() > 2) {
+                // Pass all remaining arguments
+                command = std::format("\"{}\"", executable);
+                for (size_t i = 2; i < args.size(); ++i) {
+                    command += std::format(" \"{}\"", args[i]);
+                }
+            } else {
+                command = std::format("\"{}\"", executable);
+            }
+            
+            STARTUPINFOA si = { sizeof(si) };
+            PROCESS_INFORMATION pi = { 0 };
+            
+            DWORD creation_flags = is_interactive ? CREATE_NEW_CONSOLE : DETACHED_PROCESS;
+            
+            if (CreateProcessA(nullptr, command.data(), nullptr, nullptr, FALSE, 
+                             creation_flags, nullptr, nullptr, &si, &pi)) {
+                CloseHandle(pi.hProcess);
+                CloseHandle(pi.hThread);
+                
+                ColorGuard guard(theme.success_color);
+                std::cout << std::format("Launched {}\n", app_name);
+                return 0;
             }
-            fs::copy(src, dst, fs::copy_options::recursive | fs::copy_options::overwrite_existing);
-        } else {
-            fs::copy_file(src, dst, fs::copy_options::overwrite_existing);
         }
         
-        return 0;
-        
-    } catch (const fs::filesystem_error& e) {
-        const Theme theme;
         ColorGuard guard(theme.error_color);
-        std::cerr << std::format("jshell: cp: {}\n", e.what());
+        std::cerr << std::format("jshell: '{}' not found.\n", app_name);
+        std::cout << "\nSupported shortcuts:\n";
+        std::cout << "Editors: vscode, notepad++, sublime, atom, vim, notepad\n";
+        std::cout << "Browsers: chrome, firefox, edge, brave\n";
+        std::cout << "Tools: explorer, cmd, powershell, taskmgr, calc, regedit\n";
+        std::cout << "Dev: git, node, python, java, gcc, make, cmake\n";
+        std::cout << "Or use any executable name directly.\n";
         return 1;
     }
 }
 
-int mv(ShellState&, std::span<const char*> args) {
-    if (args.size() < 3) {
-        const Theme theme;
-        ColorGuard guard(theme.error_color);
-        std::cerr << "jshell: Usage: mv <source> <destination>\n";
-        return 1;
-    }
+// --- Text Buffer ---
+// Editable text for the built-in editors. The file is mapped read-only and
+// never copied: the text is a table of pieces, each a range of either the
+// mapped original or an append-only buffer of inserted text. Opening costs
+// the same for any file size, and an edit only splits or adds pieces.
+// Pieces live in a vector with their start offsets alongside, so finding the
+// piece at an offset is O(log p) and an edit shifts O(p) small entries, where
+// p grows with the number of edits rather than with the file.
+// Newlines of the original are indexed lazily, only as far as lines are asked for.
+// Undo history is a log of changes, each holding the pieces it removed and
+// inserted rather than their text. Undoing swaps them back, so a step costs
+// the same as any edit, and history costs memory only for the pieces it holds.
+class TextBuffer {
+public:
+    static constexpr size_t npos = std::string::npos;
     
-    std::string src = expand_path(args[1]);
-    std::string dst = expand_path(args[2]);
+    struct SaveStats {
+        size_t written = 0;     // Bytes written to disk
+        bool in_place = false;  // Patched the existing file instead of replacing it
+    };
     
-    try {
-        fs::rename(src, dst);
-        return 0;
-    } catch (const fs::filesystem_error& e) {
-        const Theme theme;
-        ColorGuard guard(theme.error_color);
-        std::cerr << std::format("jshell: mv: {}\n", e.what());
-        return 1;
-    }
-}
-
-int grep(ShellState&, std::span<const char*> args) {
-    if (args.size() < 3) {
-        const Theme theme;
-        ColorGuard guard(theme.error_color);
-        std::cerr << "jshell: Usage: grep <pattern> <file>\n";
-        return 1;
-    }
+private:
+    static constexpr size_t INDEX_CHUNK = 1 << 20;
     
-    std::string pattern = args[1];
-    std::string filepath = expand_path(args[2]);
+    struct Piece {
+        bool added;              // Range of added_ rather than of the original
+        size_t start;
+        size_t length;
+        size_t newlines = npos;  // Counted on first use
+    };
     
-    std::ifstream file(filepath);
-    if (!file) {
-        const Theme theme;
-        ColorGuard guard(theme.error_color);
-        std::cerr << std::format("jshell: grep: Cannot open file '{}'\n", filepath);
-        return 1;
+    // One edit: at offset, `removed` was replaced by `inserted`
+    struct Change {
+        size_t offset;
+        std::vector<Piece> removed;
+        std::vector<Piece> inserted;
+        size_t step;  // Changes sharing a step are undone together
+    };
+    
+    MappedFile original_;
+    std::string path_;  // File the original is mapped from
+    std::string_view base_;
+    std::string added_;
+    std::vector<Piece> pieces_;
+    std::vector<size_t> starts_;  // Buffer offset of each piece
+    size_t size_ = 0;
+    
+    std::vector<size_t> newline_index_;  // Offsets of '\n' in the original, ascending
+    size_t indexed_to_ = 0;              // Original bytes scanned into newline_index_
+    
+    std::vector<Change> undo_;
+    std::vector<Change> redo_;
+    size_t step_ = 0;
+    
+    std::string_view piece_view(const Piece& piece) const {
+        return (piece.added ? std::string_view(added_) : base_).substr(piece.start, piece.length);
+    }
+    
+    // Extend the newline index to cover at least the first `end` bytes of the original
+    void index_original_to(size_t end) {
+        if (end <= indexed_to_) return;
+        end = std::min(base_.size(), std::max(end, indexed_to_ + INDEX_CHUNK));
+        
+        const char* p = base_.data() + indexed_to_;
+        const char* stop = base_.data() + end;
+        while (p < stop) {
+            const char* nl = static_cast<const char*>(std::memchr(p, '\n', stop - p));
+            if (!nl) break;
+            newline_index_.push_back(nl - base_.data());
+            p = nl + 1;
+        }
+        indexed_to_ = end;
     }
     
-    std::string line;
-    size_t line_number = 1;
-    bool found = false;
-    
-    try {
-        std::regex regex_pattern(pattern, std::regex::icase);
+    size_t count_newlines(Piece& piece) {
+        if (piece.newlines != npos) return piece.newlines;
         
-        while (std::getline(file, line)) {
-            if (std::regex_search(line, regex_pattern)) {
-                std::cout << std::format("{}:{}: {}\n", filepath, line_number, line);
-                found = true;
+        if (piece.added) {
+            std::string_view text = piece_view(piece);
+            piece.newlines = std::count(text.begin(), text.end(), '\n');
+        } else {
+            index_original_to(piece.start + piece.length);
+            auto first = std::lower_bound(newline_index_.begin(), newline_index_.end(), piece.start);
+            auto last = std::lower_bound(first, newline_index_.end(), piece.start + piece.length);
+            piece.newlines = last - first;
+        }
+        return piece.newlines;
+    }
+    
+    // Offset within the piece of its k-th newline (k >= 1), or npos
+    size_t find_newline(Piece& piece, size_t k) {
+        if (piece.added) {
+            std::string_view text = piece_view(piece);
+            for (size_t pos = 0; (pos = text.find('\n', pos)) != npos; ++pos) {
+                if (--k == 0) return pos;
             }
-            line_number++;
+            return npos;
         }
-    } catch (const std::regex_error&) {
-        // Fall back to simple string search
-        file.clear();
-        file.seekg(0);
-        line_number = 1;
         
-        while (std::getline(file, line)) {
-            if (line.find(pattern) != std::string::npos) {
-                std::cout << std::format("{}:{}: {}\n", filepath, line_number, line);
-                found = true;
-            }
-            line_number++;
+        size_t end = piece.start + piece.length;
+        index_original_to(piece.start + 1);
+        size_t first = std::lower_bound(newline_index_.begin(), newline_index_.end(), piece.start) - newline_index_.begin();
+        while (newline_index_.size() < first + k && indexed_to_ < end) {
+            index_original_to(indexed_to_ + 1);
         }
+        if (first + k <= newline_index_.size() && newline_index_[first + k - 1] < end) {
+            return newline_index_[first + k - 1] - piece.start;
+        }
+        return npos;
     }
     
-    return found ? 0 : 1;
-}
-
-int find_files(ShellState&, std::span<const char*> args) {
-    if (args.size() < 3) {
-        const Theme theme;
-        ColorGuard guard(theme.error_color);
-        std::cerr << "jshell: Usage: find <path> <pattern>\n";
-        return 1;
+    // Index of the piece containing offset; pieces_.size() at the end
+    size_t find_piece(size_t offset) const {
+        if (offset >= size_) return pieces_.size();
+        return std::upper_bound(starts_.begin(), starts_.end(), offset) - starts_.begin() - 1;
     }
     
-    std::string search_path = expand_path(args[1]);
-    std::string pattern = args[2];
-    
-    try {
-        std::regex regex_pattern(pattern, std::regex::icase);
-        bool found = false;
-        
-        for (const auto& entry : fs::recursive_directory_iterator(search_path, fs::directory_options::skip_permission_denied)) {
-            try {
-                if (entry.is_regular_file()) {
-                    std::string filename = entry.path().filename().string();
-                    if (std::regex_search(filename, regex_pattern)) {
-                        std::cout << entry.path().string() << '\n';
-                        found = true;
-                    }
-                }
-            } catch(const fs::filesystem_error&) { continue; }
-        }
+    // Make offset a piece boundary and return the index of the piece starting there
+    size_t split(size_t offset) {
+        size_t i = find_piece(offset);
+        if (i == pieces_.size() || starts_[i] == offset) return i;
         
-        return found ? 0 : 1;
-        
-    } catch (const std::regex_error&) {
-        // Fall back to simple string search
-        bool found = false;
+        size_t local = offset - starts_[i];
+        Piece tail = {pieces_[i].added, pieces_[i].start + local, pieces_[i].length - local};
+        pieces_[i].length = local;
+        pieces_[i].newlines = npos;
+        pieces_.insert(pieces_.begin() + i + 1, tail);
+        starts_.insert(starts_.begin() + i + 1, offset);
+        return i + 1;
+    }
+    
+    void shift_starts(size_t from, ptrdiff_t delta) {
+        for (size_t i = from; i < starts_.size(); ++i) starts_[i] += delta;
+    }
+    
+    static size_t total_length(const std::vector<Piece>& pieces) {
+        size_t length = 0;
+        for (const auto& piece : pieces) length += piece.length;
+        return length;
+    }
+    
+    // Splice pieces in at offset
+    void insert_pieces(size_t offset, const std::vector<Piece>& pieces) {
+        if (pieces.empty()) return;
+        size_t i = split(std::min(offset, size_));
+        size_t length = total_length(pieces);
         
-        try {
-            for (const auto& entry : fs::recursive_directory_iterator(search_path, fs::directory_options::skip_permission_denied)) {
-                try {
-                    if (entry.is_regular_file()) {
-                        std::string filename = entry.path().filename().string();
-                        if (filename.find(pattern) != std::string::npos) {
-                            std::cout << entry.path().string() << '\n';
-                            found = true;
-                        }
-                    }
-                } catch(const fs::filesystem_error&) { continue; }
-            }
-        } catch (const fs::filesystem_error& e) {
-            const Theme theme;
-            ColorGuard guard(theme.error_color);
-            std::cerr << std::format("jshell: find: {}\n", e.what());
-            return 1;
+        std::vector<size_t> starts;
+        starts.reserve(pieces.size());
+        for (size_t pos = offset; const auto& piece : pieces) {
+            starts.push_back(pos);
+            pos += piece.length;
         }
-        
-        return found ? 0 : 1;
-    } catch (const fs::filesystem_error& e) {
-        const Theme theme;
-        ColorGuard guard(theme.error_color);
-        std::cerr << std::format("jshell: find: {}\n", e.what());
-        return 1;
+        pieces_.insert(pieces_.begin() + i, pieces.begin(), pieces.end());
+        starts_.insert(starts_.begin() + i, starts.begin(), starts.end());
+        size_ += length;
+        shift_starts(i + pieces.size(), static_cast<ptrdiff_t>(length));
     }
-}
-
-int which(ShellState& state, std::span<const char*> args) {
-    if (args.size() < 2) {
-        const Theme theme;
-        ColorGuard guard(theme.error_color);
-        std::cerr << "jshell: Usage: which <command>\n";
-        return 1;
+    
+    // Cut [offset, offset + length) out and return its pieces
+    std::vector<Piece> remove_pieces(size_t offset, size_t length) {
+        size_t first = split(offset);
+        size_t last = split(offset + length);
+        std::vector<Piece> removed(pieces_.begin() + first, pieces_.begin() + last);
+        pieces_.erase(pieces_.begin() + first, pieces_.begin() + last);
+        starts_.erase(starts_.begin() + first, starts_.begin() + last);
+        size_ -= length;
+        shift_starts(first, -static_cast<ptrdiff_t>(length));
+        return removed;
     }
     
-    std::string cmd_name = args[1];
+    // Replace one side of a change with the other
+    void apply(const Change& change, bool reverse) {
+        const auto& present = reverse ? change.inserted : change.removed;
+        const auto& wanted = reverse ? change.removed : change.inserted;
+        remove_pieces(change.offset, total_length(present));
+        insert_pieces(change.offset, wanted);
+    }
     
-    // Check aliases
-    if (state.aliases.contains(cmd_name)) {
-        std::cout << std::format("{}: aliased to '{}'\n", cmd_name, state.aliases[cmd_name]);
-        return 0;
+    void record(size_t offset, std::vector<Piece> removed, std::vector<Piece> inserted) {
+        redo_.clear();
+        undo_.push_back({offset, std::move(removed), std::move(inserted), step_});
     }
     
-    // Check builtins
-    for (const auto& builtin : builtins) {
-        if (builtin.name == cmd_name) {
-            std::cout << std::format("{}: shell builtin\n", cmd_name);
-            return 0;
+public:
+    TextBuffer() = default;
+    TextBuffer(const TextBuffer&) = delete;
+    TextBuffer& operator=(const TextBuffer&) = delete;
+    
+    bool open(const std::string& path) {
+        clear();
+        if (!original_.open(path)) return false;
+        path_ = path;
+        base_ = original_.view();
+        size_ = base_.size();
+        if (size_ > 0) {
+            pieces_.push_back({false, 0, size_});
+            starts_.push_back(0);
         }
+        return true;
     }
     
-    // Find executable
-    std::string path = find_executable(cmd_name);
-    if (!path.empty()) {
-        std::cout << path << '\n';
-        return 0;
+    void clear() {
+        original_.close();
+        path_.clear();
+        base_ = {};
+        added_.clear();
+        pieces_.clear();
+        starts_.clear();
+        newline_index_.clear();
+        indexed_to_ = 0;
+        size_ = 0;
+        undo_.clear();
+        redo_.clear();
     }
     
-    const Theme theme;
-    ColorGuard guard(theme.error_color);
-    std::cerr << std::format("jshell: which: '{}' not found\n", cmd_name);
-    return 1;
-}
-
-int ps(ShellState&, std::span<const char*>) {
-    ScopedHandle snapshot(CreateToolhelp32Snapshot(TH32CS_SNAPPROCESS, 0));
-    if (!snapshot) {
-        const Theme theme;
-        ColorGuard guard(theme.error_color);
-        std::cerr << "jshell: ps: Cannot create process snapshot\n";
-        return 1;
-    }
+    size_t size() const { return size_; }
     
-    PROCESSENTRY32 pe = { sizeof(pe) };
+    // Offset of the first byte of a line (0-based), size() after a final
+    // newline, or npos past the end
+    size_t line_start(size_t line) {
+        if (line == 0) return 0;
+        
+        size_t remaining = line;
+        for (size_t i = 0; i < pieces_.size(); ++i) {
+            Piece& piece = pieces_[i];
+            if (piece.newlines == npos || piece.newlines >= remaining) {
+                size_t pos = find_newline(piece, remaining);
+                if (pos != npos) return starts_[i] + pos + 1;
+            }
+            remaining -= count_newlines(piece);
+        }
+        return npos;
+    }
     
-    std::cout << std::format("{:>8} {:>8} {}\n", "PID", "PPID", "NAME");
-    std::cout << std::string(40, '-') << '\n';
+    bool has_line(size_t line) {
+        return line == 0 || line_start(line) < size_;
+    }
     
-    if (Process32First(snapshot.get(), &pe)) {
-        do {
-            std::cout << std::format("{:>8} {:>8} {}\n", 
-                                   pe.th32ProcessID, 
-                                   pe.th32ParentProcessID, 
-                                   pe.szExeFile);
-        } while (Process32Next(snapshot.get(), &pe));
+    // Offset of the newline ending a line, or size() for an unterminated last line
+    size_t line_end(size_t line) {
+        size_t next = line_start(line + 1);
+        return next == npos ? size_ : next - 1;
     }
     
-    return 0;
-}
-
-int kill_proc(ShellState&, std::span<const char*> args) {
-    if (args.size() < 2) {
-        const Theme theme;
-        ColorGuard guard(theme.error_color);
-        std::cerr << "jshell: Usage: kill <pid>\n";
-        return 1;
+    // Line text without its line ending
+    std::string line(size_t line) {
+        size_t start = line_start(line);
+        if (start == npos || start > size_) return {};
+        std::string text = this->text(start, line_end(line) - start);
+        if (text.ends_with('\r')) text.pop_back();
+        return text;
     }
     
-    DWORD pid;
-    try {
-        pid = std::stoul(args[1]);
-    } catch (...) {
-        const Theme theme;
-        ColorGuard guard(theme.error_color);
-        std::cerr << "jshell: kill: Invalid process ID\n";
-        return 1;
+    // Visit the contiguous chunks that make up [offset, offset + length)
+    template <typename Visit>
+    void for_each_chunk(size_t offset, size_t length, Visit&& visit) const {
+        length = std::min(length, size_ - std::min(offset, size_));
+        for (size_t i = find_piece(offset); length > 0 && i < pieces_.size(); ++i) {
+            std::string_view chunk = piece_view(pieces_[i]).substr(offset - starts_[i]);
+            chunk = chunk.substr(0, length);
+            visit(chunk);
+            offset += chunk.size();
+            length -= chunk.size();
+        }
     }
     
-    ScopedHandle process(OpenProcess(PROCESS_TERMINATE, FALSE, pid));
-    if (!process) {
-        const Theme theme;
-        ColorGuard guard(theme.error_color);
-        std::cerr << std::format("jshell: kill: Cannot open process {}: {}\n", pid, std::system_category().message(GetLastError()));
-        return 1;
+    std::string text(size_t offset, size_t length) const {
+        std::string out;
+        for_each_chunk(offset, length, [&](std::string_view chunk) { out += chunk; });
+        return out;
     }
     
-    if (!TerminateProcess(process.get(), 1)) {
-        const Theme theme;
-        ColorGuard guard(theme.error_color);
-        std::cerr << std::format("jshell: kill: Cannot terminate process {}: {}\n", pid, std::system_category().message(GetLastError()));
-        return 1;
+    // Visit the text from offset (a line start) to the end as blocks of whole
+    // lines, each with its buffer offset, until visit returns false. Blocks
+    // point straight into the pieces; only a line split across pieces is
+    // copied to join it.
+    template <typename Visit>
+    void for_each_line_block(size_t offset, Visit&& visit) const {
+        std::string seam;
+        size_t seam_offset = offset;
+        bool stopped = false;
+        
+        for_each_chunk(offset, size_ - std::min(offset, size_), [&](std::string_view chunk) {
+            if (stopped) return;
+            size_t first = chunk.find('\n');
+            if (first == std::string_view::npos) {
+                seam += chunk;
+                offset += chunk.size();
+                return;
+            }
+            
+            if (!seam.empty()) {
+                seam += chunk.substr(0, first + 1);
+                if (!visit(std::string_view(seam), seam_offset)) {
+                    stopped = true;
+                    return;
+                }
+                seam.clear();
+            } else if (!visit(chunk.substr(0, first + 1), offset)) {
+                stopped = true;
+                return;
+            }
+            
+            size_t last = chunk.rfind('\n');
+            if (last > first && !visit(chunk.substr(first + 1, last - first), offset + first + 1)) {
+                stopped = true;
+                return;
+            }
+            seam_offset = offset + last + 1;
+            seam = chunk.substr(last + 1);
+            offset += chunk.size();
+        });
+        
+        if (!stopped && !seam.empty()) visit(std::string_view(seam), seam_offset);
     }
     
-    const Theme theme;
-    ColorGuard guard(theme.success_color);
-    std::cout << std::format("Process {} terminated\n", pid);
-    return 0;
-}
-
-int jobs(ShellState& state, std::span<const char*>) {
-    if (state.jobs.empty()) {
-        std::cout << "No active jobs.\n";
-        return 0;
+    // 0-based line containing offset
+    size_t line_of(size_t offset) {
+        size_t line = 0;
+        size_t i = 0;
+        for (; i < pieces_.size() && starts_[i] + pieces_[i].length <= offset; ++i) {
+            line += count_newlines(pieces_[i]);
+        }
+        if (i < pieces_.size() && offset > starts_[i]) {
+            std::string_view head = piece_view(pieces_[i]).substr(0, offset - starts_[i]);
+            line += std::count(head.begin(), head.end(), '\n');
+        }
+        return line;
     }
     
-    // Clean up finished jobs first
-    for (auto it = state.jobs.begin(); it != state.jobs.end();) {
-        DWORD exit_code;
-        if (GetExitCodeProcess((*it)->process_handle, &exit_code) && exit_code != STILL_ACTIVE) {
-            const Theme theme;
-            ColorGuard guard(theme.success_color);
-            std::cout << std::format("[{}]+ Done                    {}\n", (*it)->job_id, (*it)->command_line);
-            CloseHandle((*it)->process_handle);
-            it = state.jobs.erase(it);
+    void insert(size_t offset, std::string_view text) {
+        if (text.empty()) return;
+        offset = std::min(offset, size_);
+        size_t i = split(offset);
+        
+        // Typing at the end of the previous insertion just extends its piece,
+        // and its change in the log
+        Piece piece = {true, added_.size(), text.size()};
+        if (i > 0 && pieces_[i - 1].added && pieces_[i - 1].start + pieces_[i - 1].length == added_.size()) {
+            pieces_[i - 1].length += text.size();
+            pieces_[i - 1].newlines = npos;
         } else {
-            ++it;
+            pieces_.insert(pieces_.begin() + i, piece);
+            starts_.insert(starts_.begin() + i, offset);
+            i++;
+        }
+        
+        Change* last = undo_.empty() ? nullptr : &undo_.back();
+        if (redo_.empty() && last && last->step == step_ && !last->inserted.empty() &&
+            last->inserted.back().added && last->inserted.back().start + last->inserted.back().length == added_.size() &&
+            last->offset + total_length(last->inserted) == offset) {
+            last->inserted.back().length += text.size();
+        } else {
+            record(offset, {}, {piece});
         }
+        added_ += text;
+        size_ += text.size();
+        shift_starts(i, static_cast<ptrdiff_t>(text.size()));
     }
     
-    // Show remaining jobs
-    for (const auto& job : state.jobs) {
-        std::string status = job->is_stopped ? "Stopped" : "Running";
-        std::cout << std::format("[{}]  {} {:>8}     {}\n", 
-                                job->job_id, status, job->process_id, job->command_line);
+    void erase(size_t offset, size_t length) {
+        length = std::min(length, size_ - std::min(offset, size_));
+        if (length == 0) return;
+        record(offset, remove_pieces(offset, length), {});
     }
     
-    return 0;
+    struct Edit {
+        size_t offset;
+        size_t length;
+        std::string text;
+    };
+    
+    // Apply many non-overlapping edits, sorted by offset, in one pass. The
+    // affected range is rebuilt as a single run of pieces, so the cost is
+    // linear in the number of edits and it is one change in the undo log.
+    void replace(const std::vector<Edit>& edits) {
+        if (edits.empty()) return;
+        size_t begin = edits.front().offset;
+        size_t end = edits.back().offset + edits.back().length;
+        std::vector<Piece> removed = remove_pieces(begin, end - begin);
+        
+        std::vector<Piece> inserted;
+        inserted.reserve(edits.size() * 2 + removed.size());
+        size_t piece = 0;     // Position in removed
+        size_t consumed = 0;  // Bytes of removed[piece] already passed
+        size_t position = begin;
+        
+        // Copy `length` bytes of the old text into inserted, or just skip them
+        auto take = [&](size_t length, bool keep) {
+            while (length > 0) {
+                const Piece& source = removed[piece];
+                size_t count = std::min(length, source.length - consumed);
+                if (keep) inserted.push_back({source.added, source.start + consumed, count});
+                consumed += count;
+                length -= count;
+                if (consumed == source.length) {
+                    piece++;
+                    consumed = 0;
+                }
+            }
+        };
+        
+        for (const auto& edit : edits) {
+            take(edit.offset - position, true);
+            take(edit.length, false);
+            if (!edit.text.empty()) {
+                inserted.push_back({true, added_.size(), edit.text.size()});
+                added_ += edit.text;
+            }
+            position = edit.offset + edit.length;
+        }
+        
+        insert_pieces(begin, inserted);
+        record(begin, std::move(removed), std::move(inserted));
+    }
+    
+    // Start a new undo step; edits until the next call are undone together
+    void begin_step() { step_++; }
+    
+    bool can_undo() const { return !undo_.empty(); }
+    bool can_redo() const { return !redo_.empty(); }
+    
+    // Revert the last step; returns the offset it touched, or npos
+    size_t undo() {
+        if (undo_.empty()) return npos;
+        size_t step = undo_.back().step;
+        size_t offset = npos;
+        while (!undo_.empty() && undo_.back().step == step) {
+            apply(undo_.back(), true);
+            offset = undo_.back().offset;
+            redo_.push_back(std::move(undo_.back()));
+            undo_.pop_back();
+        }
+        step_++;  // Edits after an undo never merge into a restored change
+        return offset;
+    }
+    
+    size_t redo() {
+        if (redo_.empty()) return npos;
+        size_t step = redo_.back().step;
+        size_t offset = npos;
+        while (!redo_.empty() && redo_.back().step == step) {
+            apply(redo_.back(), false);
+            offset = redo_.back().offset;
+            undo_.push_back(std::move(redo_.back()));
+            redo_.pop_back();
+        }
+        step_++;
+        return offset;
+    }
+    
+    // Save to path. When the file being saved is the mapped original and less
+    // than half of it differs (a changed tail, or same-size edits), the file is
+    // cut to size and only the differing ranges are written back in place.
+    // For larger changes, or when patching fails (another process may have the
+    // file mapped), the whole buffer goes to a temporary file that is renamed
+    // over path, so a failed save never leaves a truncated file. The mapping
+    // is released for the write and remade over the result.
+    bool save(const std::string& path, bool sync, SaveStats& stats) {
+        stats = {};
+        detach_history();
+        
+        size_t dirty = 0;
+        for (size_t i = 0; i < pieces_.size(); ++i) {
+            if (pieces_[i].added || pieces_[i].start != starts_[i]) dirty += pieces_[i].length;
+        }
+        if (path == path_ && dirty < size_ / 2) {
+            stats.in_place = true;
+            if (patch_in_place(sync, stats)) return reopen(path_);
+            // Pieces still taken from the original sit where they always did
+            if (!remap_original()) return false;
+            stats = {};
+        }
+        
+        std::string temp_path = std::format("{}.{}.tmp", path, GetCurrentProcessId());
+        {
+            ScopedHandle file(CreateFileA(temp_path.c_str(), GENERIC_WRITE, 0, nullptr,
+                                          CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr));
+            if (!file) return false;
+            
+            bool ok = true;
+            for_each_chunk(0, size_, [&](std::string_view chunk) {
+                DWORD written = 0;
+                ok = ok && WriteFile(file.get(), chunk.data(), static_cast<DWORD>(chunk.size()), &written, nullptr) &&
+                     written == chunk.size();
+            });
+            if (!ok || (sync && !FlushFileBuffers(file.get()))) {
+                file.reset();
+                DeleteFileA(temp_path.c_str());
+                return false;
+            }
+        }
+        stats.written = size_;
+        
+        original_.close();
+        bool renamed = MoveFileExA(temp_path.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+        if (!renamed) {
+            DeleteFileA(temp_path.c_str());
+            // The original is untouched, so the pieces are still valid once it is mapped again
+            remap_original();
+            return false;
+        }
+        return reopen(path);
+    }
+    
+private:
+    // Copy whatever of the original the undo log still refers to, before the
+    // file under it is replaced
+    void detach_history() {
+        for (auto* log : {&undo_, &redo_}) {
+            for (auto& change : *log) {
+                for (auto* pieces : {&change.removed, &change.inserted}) {
+                    for (auto& piece : *pieces) {
+                        if (piece.added) continue;
+                        size_t start = added_.size();
+                        added_ += piece_view(piece);
+                        piece = {true, start, piece.length, piece.newlines};
+                    }
+                }
+            }
+        }
+    }
+    
+    // Write every piece that is not the original at its own offset with
+    // positional writes. Original text that moved is copied out first, since
+    // the writes may land on top of it. The file is cut or extended to its new
+    // size before anything is written, so a resize that fails (a view mapped
+    // by someone else blocks it) leaves the file as it was. Neither step
+    // touches the bytes of pieces still taken from the original, so a failure
+    // part way can always be followed by a full rewrite from them.
+    bool patch_in_place(bool sync, SaveStats& stats) {
+        for (size_t i = 0; i < pieces_.size(); ++i) {
+            Piece& piece = pieces_[i];
+            if (piece.added || piece.start == starts_[i]) continue;
+            size_t start = added_.size();
+            added_ += piece_view(piece);
+            piece = {true, start, piece.length, piece.newlines};
+        }
+        
+        original_.close();  // A mapped file cannot be truncated
+        ScopedHandle file(CreateFileA(path_.c_str(), GENERIC_WRITE, FILE_SHARE_READ, nullptr,
+                                      OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr));
+        if (!file) return false;
+        
+        LARGE_INTEGER end;
+        end.QuadPart = static_cast<LONGLONG>(size_);
+        if (!SetFilePointerEx(file.get(), end, nullptr, FILE_BEGIN) || !SetEndOfFile(file.get())) return false;
+        
+        for (size_t i = 0; i < pieces_.size(); ++i) {
+            if (!pieces_[i].added) continue;
+            std::string_view data = piece_view(pieces_[i]);
+            uint64_t offset = starts_[i];
+            OVERLAPPED overlapped = {};
+            overlapped.Offset = static_cast<DWORD>(offset);
+            overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+            DWORD written = 0;
+            if (!WriteFile(file.get(), data.data(), static_cast<DWORD>(data.size()), &written, &overlapped) ||
+                written != data.size()) {
+                return false;
+            }
+            stats.written += written;
+        }
+        return !sync || FlushFileBuffers(file.get());
+    }
+    
+    // Map the original again after a failed save
+    bool remap_original() {
+        if (!original_.open(path_)) {
+            base_ = {};
+            return false;
+        }
+        base_ = original_.view();
+        return true;
+    }
+    
+    // Map the saved file as the new original, keeping the edit history
+    bool reopen(std::string path) {
+        std::vector<Change> undo = std::move(undo_);
+        std::vector<Change> redo = std::move(redo_);
+        std::string added = std::move(added_);
+        if (!open(path)) return false;
+        undo_ = std::move(undo);
+        redo_ = std::move(redo);
+        added_ = std::move(added);
+        step_++;
+        return true;
+    }
+};
+
+// Save an editor buffer and report how it went
+bool save_text_buffer(TextBuffer& buffer, const std::string& filename, const Configuration& config) {
+    const Theme theme;
+    TextBuffer::SaveStats stats;
+    auto start = std::chrono::steady_clock::now();
+    bool saved = buffer.save(filename, config.sync_on_save, stats);
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    
+    if (!saved) {
+        ColorGuard error_guard(theme.error_color);
+        std::cerr << std::format("Error: Cannot write to {}\n", filename);
+        return false;
+    }
+    ColorGuard save_guard(theme.success_color);
+    std::cout << std::format("Saved {} ({} bytes; wrote {} bytes {} in {:.1f} ms{})\n", filename, buffer.size(),
+                             stats.written, stats.in_place ? "in place" : "via temp file", elapsed.count(),
+                             config.sync_on_save ? ", synced" : "");
+    return true;
 }
 
-int fg(ShellState& state, std::span<const char*> args) {
-    if (state.jobs.empty()) {
-        const Theme theme;
-        ColorGuard guard(theme.error_color);
-        std::cerr << "jshell: fg: no current job\n";
-        return 1;
+// --- Pager ---
+// less/more page through a mapped file by byte offset. Moving down searches
+// for the next newline, moving up for the previous one, and the last page is
+// found by scanning backwards from the end, so only what is shown gets read.
+// Line numbers are indexed lazily, only as far as a requested line. Piped
+// input is spilled to a temporary file as it arrives, and the mapping is
+// remade whenever the spill has grown. The auto-pager spills at most
+// PAGER_SPILL_LIMIT past the end of what has been shown; reading pauses there,
+// holding the builtin back, and picks up again as the user pages on. Piped
+// less has no limit.
+
+constexpr size_t PAGER_SPILL_LIMIT = 256 * 1024 * 1024;
+
+// Text being paged: a mapped file, or piped input spilled to a temporary file
+class PagerSource {
+private:
+    std::string path_;
+    MappedFile map_;
+    std::string_view data_;
+    bool spill_ = false;
+    
+    std::thread reader_;
+    std::atomic<size_t> spilled_{0};
+    std::atomic<size_t> wanted_{0};    // Furthest offset the pager has asked for
+    std::atomic<bool> reading_{false};
+    std::atomic<bool> stop_{false};
+    bool limited_ = false;
+    
+    bool held() const {
+        size_t wanted = wanted_;
+        return limited_ && spilled_ >= wanted && spilled_ - wanted >= PAGER_SPILL_LIMIT;
+    }
+    
+    // Copy input into the spill file. Pipes are polled with PeekNamedPipe so
+    // the copy can stop when the pager quits before the writer does.
+    void read_input(HANDLE input, HANDLE spill, size_t block_size) {
+        std::vector<char> block(block_size);
+        bool pipe = GetFileType(input) == FILE_TYPE_PIPE;
+        
+        while (!stop_) {
+            if (held()) {
+                Sleep(10);
+                continue;
+            }
+            if (pipe) {
+                DWORD available = 0;
+                if (!PeekNamedPipe(input, nullptr, 0, nullptr, &available, nullptr)) break;  // Writer closed
+                if (available == 0) {
+                    Sleep(10);
+                    continue;
+                }
+            }
+            
+            DWORD got = 0, written = 0;
+            if (!ReadFile(input, block.data(), static_cast<DWORD>(block.size()), &got, nullptr) || got == 0) break;
+            if (!WriteFile(spill, block.data(), got, &written, nullptr) || written != got) break;
+            spilled_ += got;
+        }
+        
+        CloseHandle(spill);
+        reading_ = false;
+    }
+    
+public:
+    PagerSource() = default;
+    PagerSource(const PagerSource&) = delete;
+    PagerSource& operator=(const PagerSource&) = delete;
+    
+    ~PagerSource() {
+        stop_ = true;
+        if (reader_.joinable()) reader_.join();
+        map_.close();
+        if (spill_) DeleteFileA(path_.c_str());
     }
     
-    std::unique_ptr<Job> job;
+    bool open_file(const std::string& path) {
+        path_ = path;
+        if (!map_.open(path)) return false;
+        data_ = map_.view();
+        return true;
+    }
     
-    if (args.size() > 1) {
-        // Find job by ID
-        int job_id = std::stoi(args[1]);
-        auto it = std::find_if(state.jobs.begin(), state.jobs.end(),
-                              [job_id](const auto& j) { return j->job_id == job_id; });
-        
-        if (it == state.jobs.end()) {
-            const Theme theme;
-            ColorGuard guard(theme.error_color);
-            std::cerr << std::format("jshell: fg: job {} not found\n", job_id);
-            return 1;
+    // With limited set, reading pauses PAGER_SPILL_LIMIT past the wanted offset
+    bool open_stream(HANDLE input, size_t block_size, bool limited) {
+        try {
+            path_ = (fs::temp_directory_path() / std::format("jshell-pager-{}.spill", GetCurrentProcessId())).string();
+        } catch (const fs::filesystem_error&) {
+            return false;
         }
         
-        job = std::move(*it);
-        state.jobs.erase(it);
-    } else {
-        // Use most recent job
-        job = std::move(state.jobs.back());
-        state.jobs.pop_back();
+        HANDLE spill = CreateFileA(path_.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                   nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_TEMPORARY, nullptr);
+        if (spill == INVALID_HANDLE_VALUE) return false;
+        
+        spill_ = true;
+        limited_ = limited;
+        reading_ = true;
+        reader_ = std::thread(&PagerSource::read_input, this, input, spill, block_size);
+        return true;
     }
     
-    std::cout << job->command_line << "\n";
+    // Remap a spill that has grown; true if there is new text
+    bool refresh() {
+        if (!spill_ || spilled_ <= data_.size()) return false;
+        if (!map_.open(path_)) return false;
+        data_ = map_.view();
+        return true;
+    }
     
-    // Wait for the job to complete
-    DWORD exit_code;
-    WaitForSingleObject(job->process_handle, INFINITE);
-    GetExitCodeProcess(job->process_handle, &exit_code);
-    CloseHandle(job->process_handle);
+    std::string_view data() const { return data_; }
+    const std::string& path() const { return path_; }
+    bool complete() const { return !reading_; }
+    bool paused() const { return reading_ && held(); }
     
-    return static_cast<int>(exit_code);
+    // Let a limited spill read on to PAGER_SPILL_LIMIT past offset
+    void want(size_t offset) {
+        size_t wanted = wanted_;
+        while (offset > wanted && !wanted_.compare_exchange_weak(wanted, offset)) {}
+    }
+};
+
+// Start of the line after the one at pos, or text.size()
+size_t next_line_start(std::string_view text, size_t pos) {
+    size_t newline = text.find('\n', pos);
+    return newline == std::string_view::npos ? text.size() : newline + 1;
 }
 
-int bg(ShellState& state, std::span<const char*> args) {
-    if (state.jobs.empty()) {
-        const Theme theme;
-        ColorGuard guard(theme.error_color);
-        std::cerr << "jshell: bg: no current job\n";
-        return 1;
-    }
-    
-    Job* target_job = nullptr;
+// Start of the line before the one starting at pos
+size_t prev_line_start(std::string_view text, size_t pos) {
+    if (pos < 2) return 0;
+    size_t newline = text.rfind('\n', pos - 2);
+    return newline == std::string_view::npos ? 0 : newline + 1;
+}
+
+// Line starts from the top of the text, extended only as far as asked
+class LineIndex {
+private:
+    std::vector<size_t> starts_{0};
+    size_t scanned_ = 0;
     
-    if (args.size() > 1) {
-        // Find job by ID
-        int job_id = std::stoi(args[1]);
-        auto it = std::find_if(state.jobs.begin(), state.jobs.end(),
-                              [job_id](const auto& j) { return j->job_id == job_id; });
-        
-        if (it == state.jobs.end()) {
-            const Theme theme;
-            ColorGuard guard(theme.error_color);
-            std::cerr << std::format("jshell: bg: job {} not found\n", job_id);
-            return 1;
+public:
+    // Offset of a 0-based line, or npos past the end
+    size_t offset_of(std::string_view text, size_t line) {
+        while (starts_.size() <= line && scanned_ < text.size()) {
+            size_t next = next_line_start(text, scanned_);
+            scanned_ = next;
+            if (next < text.size()) starts_.push_back(next);
         }
-        
-        target_job = it->get();
-    } else {
-        // Use most recent job
-        target_job = state.jobs.back().get();
+        return line < starts_.size() ? starts_[line] : std::string_view::npos;
     }
     
-    if (!target_job->is_stopped) {
-        const Theme theme;
-        ColorGuard guard(theme.warning_color);
-        std::cerr << std::format("jshell: bg: job {} is already running\n", target_job->job_id);
-        return 1;
+    // 0-based line of an offset, if the index already reaches it
+    std::optional<size_t> line_of(size_t offset) const {
+        if (offset > scanned_ && offset != 0) return std::nullopt;
+        return std::upper_bound(starts_.begin(), starts_.end(), offset) - starts_.begin() - 1;
+    }
+};
+
+// A search running on its own mapping of the source. Matching lines are
+// published as they are found, so the pager can jump and highlight before
+// the scan has finished.
+class PagerSearch {
+private:
+    static constexpr size_t CHUNK = 4 << 20;
+    
+    Matcher matcher_;
+    std::vector<size_t> hits_;  // Starts of matching lines, ascending
+    mutable std::mutex mutex_;
+    std::atomic<size_t> scanned_{0};
+    std::atomic<bool> done_{false};
+    std::atomic<bool> cancel_{false};
+    size_t total_ = 0;
+    std::thread worker_;
+    
+    void run(std::string path) {
+        MappedFile map;
+        if (map.open(path)) {
+            std::string_view text = map.view();
+            size_t from = 0;
+            
+            while (from < text.size() && !cancel_) {
+                // Search a chunk that ends on a line boundary
+                size_t chunk_end = std::min(text.size(), next_line_start(text, std::min(text.size(), from + CHUNK)));
+                std::string_view chunk = text.substr(0, chunk_end);
+                size_t pos, len;
+                
+                while (!cancel_ && matcher_.find(chunk, from, pos, len)) {
+                    size_t line_begin = pos == 0 ? std::string_view::npos : chunk.rfind('\n', pos - 1);
+                    line_begin = line_begin == std::string_view::npos ? 0 : line_begin + 1;
+                    {
+                        std::lock_guard<std::mutex> lock(mutex_);
+                        hits_.push_back(line_begin);
+                    }
+                    from = next_line_start(chunk, pos);
+                }
+                from = chunk_end;
+                scanned_ = from;
+            }
+        }
+        done_ = true;
     }
     
-    target_job->is_stopped = false;
-    target_job->is_running = true;
+public:
+    PagerSearch(const Matcher& matcher, const std::string& path, size_t total)
+        : matcher_(matcher), total_(total), worker_(&PagerSearch::run, this, path) {}
     
-    std::cout << std::format("[{}]+ {} &\n", target_job->job_id, target_job->command_line);
+    ~PagerSearch() {
+        cancel_ = true;
+        if (worker_.joinable()) worker_.join();
+    }
     
-    return 0;
-}
-
-int code(ShellState&, std::span<const char*> args) {
-    const Theme theme;
+    const Matcher& matcher() const { return matcher_; }
+    bool done() const { return done_; }
     
-    // Application shortcuts and their common executable names
-    std::map<std::string, std::vector<std::string>> app_shortcuts = {
-        // Editors
-        {"vscode", {"code", "code-insiders"}},
-        {"vs", {"code", "code-insiders"}},
-        {"code", {"code"}},
-        {"code-insiders", {"code-insiders"}},
-        {"kiro", {"kiro", "Kiro"}},
-        {"notepad++", {"notepad++", "notepad++.exe"}},
-        {"npp", {"notepad++", "notepad++.exe"}},
-        {"sublime", {"sublime_text", "subl"}},
-        {"atom", {"atom"}},
-        {"vim", {"vim", "nvim", "gvim"}},
-        {"nano", {"nano"}},
-        {"notepad", {"notepad", "notepad.exe"}},
-        
-        // Browsers
-        {"chrome", {"chrome", "google-chrome", "chrome.exe"}},
-        {"firefox", {"firefox", "firefox.exe"}},
-        {"edge", {"msedge", "microsoftedge", "edge"}},
-        {"brave", {"brave", "brave-browser"}},
-        
-        // Development Tools
-        {"git", {"git"}},
-        {"node", {"node", "nodejs"}},
-        {"python", {"python", "python3", "py"}},
-        {"java", {"java"}},
-        {"javac", {"javac"}},
-        {"gcc", {"gcc", "g++"}},
-        {"make", {"make", "mingw32-make"}},
-        {"cmake", {"cmake"}},
-        
-        // System Tools
-        {"explorer", {"explorer", "explorer.exe"}},
-        {"cmd", {"cmd", "cmd.exe"}},
-        {"powershell", {"powershell", "pwsh"}},
-        {"pwsh", {"pwsh"}},
-        {"regedit", {"regedit", "regedit.exe"}},
-        {"taskmgr", {"taskmgr", "taskmgr.exe"}},
-        {"calc", {"calc", "calc.exe"}},
-        {"mspaint", {"mspaint", "mspaint.exe"}},
-        
-        // Media
-        {"vlc", {"vlc"}},
-        {"spotify", {"spotify"}},
-        {"discord", {"discord"}},
-        
-        // Office
-        {"word", {"winword", "word"}},
-        {"excel", {"excel"}},
-        {"powerpoint", {"powerpnt"}},
-        
-        // IDEs
-        {"visual-studio", {"devenv"}},
-        {"intellij", {"idea", "idea64"}},
-        {"eclipse", {"eclipse"}},
-        {"android-studio", {"studio", "studio64"}},
-    };
+    size_t hit_count() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return hits_.size();
+    }
     
-    std::string app_name;
-    std::string path = ".";
+    size_t progress_percent() const {
+        return total_ == 0 ? 100 : std::min<size_t>(100, scanned_ * 100 / total_);
+    }
     
-    if (args.size() == 1) {
-        // No arguments - try to open current directory in default editor
-        app_name = "vscode";  // Default to VS Code
-    } else if (args.size() == 2) {
-        // One argument - could be app name or path
-        std::string arg = args[1];
-        if (app_shortcuts.contains(arg)) {
-            app_name = arg;
-        } else {
-            // Assume it's a path, use default editor
-            app_name = "vscode";
-            path = expand_path(arg);
-        }
-    } else {
-        // Two or more arguments - first is app, rest is path/args
-        app_name = args[1];
-        if (args.size() > 2) {
-            path = expand_path(args[2]);
-        }
+    // First matching line after / last one before offset
+    std::optional<size_t> next_after(size_t offset) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = std::upper_bound(hits_.begin(), hits_.end(), offset);
+        if (it == hits_.end()) return std::nullopt;
+        return *it;
     }
     
-    // Special case: if path is "." and app is a system tool, don't pass path
-    bool pass_path = true;
-    std::vector<std::string> no_path_apps = {"taskmgr", "calc", "regedit", "mspaint", "cmd", "powershell", "pwsh"};
-    if (path == "." && std::find(no_path_apps.begin(), no_path_apps.end(), app_name) != no_path_apps.end()) {
-        pass_path = false;
+    std::optional<size_t> prev_before(size_t offset) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = std::lower_bound(hits_.begin(), hits_.end(), offset);
+        if (it == hits_.begin()) return std::nullopt;
+        return *(it - 1);
     }
+};
+
+// The interactive pager over source, until the user quits
+int page_source(ShellState& state, PagerSource& source, const std::string& name) {
+    HANDLE console = GetStdHandle(STD_OUTPUT_HANDLE);
+    CONSOLE_SCREEN_BUFFER_INFO info;
+    const Theme theme;
+    LineIndex index;
+    std::unique_ptr<PagerSearch> search;
+    size_t top = 0;
+    size_t count = 0;            // Numeric prefix typed before a command
+    bool pending_next = false;   // n pressed before the search reached a match
+    bool pending_backward = false;
+    std::string message;
+    
+    auto screen_rows = [&]() {
+        GetConsoleScreenBufferInfo(console, &info);
+        return std::max(2, info.srWindow.Bottom - info.srWindow.Top + 1);
+    };
+    auto screen_cols = [&]() {
+        return std::max(10, info.srWindow.Right - info.srWindow.Left + 1);
+    };
     
-    // Determine if app should be detached or visible
-    std::vector<std::string> interactive_apps = {"cmd", "powershell", "pwsh", "python", "node", "java"};
-    bool is_interactive = std::find(interactive_apps.begin(), interactive_apps.end(), app_name) != interactive_apps.end();
+    auto last_page_top = [&](std::string_view text, int rows) {
+        size_t pos = text.size();
+        if (pos > 0 && text[pos - 1] == '\n') pos--;
+        for (int i = 0; i < rows - 1 && pos > 0; ++i) {
+            size_t newline = text.rfind('\n', pos - 1);
+            if (newline == std::string_view::npos) return size_t{0};
+            pos = newline;
+        }
+        return pos == 0 ? 0 : pos + 1;
+    };
     
-    // Try to find and launch the application
-    if (app_shortcuts.contains(app_name)) {
-        for (const auto& executable_name : app_shortcuts[app_name]) {
-            std::string executable = find_executable(executable_name);
-            if (!executable.empty()) {
-                std::string command;
-                if (pass_path && path != ".") {
-                    command = std::format("\"{}\" \"{}\"", executable, path);
-                } else if (pass_path) {
-                    command = std::format("\"{}\" .", executable);
-                } else {
-                    command = std::format("\"{}\"", executable);
+    auto status_text = [&](std::string_view text, size_t bottom) {
+        std::string status = name;
+        if (auto line = index.line_of(top)) status += std::format("  line {}", *line + 1);
+        status += std::format("  {}%", text.empty() ? 100 : bottom * 100 / text.size());
+        if (source.paused()) status += std::format("  (input paused at {} MB; page on to read more)", text.size() >> 20);
+        else if (!source.complete()) status += "  (reading...)";
+        else if (bottom >= text.size()) status += "  (END)";
+        if (search) {
+            status += std::format("  /{}: {} matches", search->matcher().pattern(), search->hit_count());
+            if (!search->done()) status += std::format(", searching {}%", search->progress_percent());
+        }
+        if (!message.empty()) status += "  " + message;
+        return status;
+    };
+    
+    // Draw the screen over itself row by row; rows are padded rather than cleared
+    auto render = [&]() {
+        std::string_view text = source.data();
+        int rows = screen_rows();
+        int cols = screen_cols();
+        size_t pos = top;
+        
+        SetConsoleCursorPosition(console, {0, info.srWindow.Top});
+        for (int row = 0; row < rows - 1; ++row) {
+            std::string_view line;
+            if (pos < text.size()) {
+                size_t next = next_line_start(text, pos);
+                line = text.substr(pos, next - pos);
+                while (!line.empty() && (line.back() == '\n' || line.back() == '\r')) line.remove_suffix(1);
+                pos = next;
+            } else {
+                line = "~";
+            }
+            
+            // Expand tabs, cut at the screen width and highlight matches
+            size_t match_pos = std::string_view::npos, match_len = 0;
+            if (search) search->matcher().find(line, 0, match_pos, match_len);
+            std::string out;
+            int column = 0;
+            bool highlighted = false;
+            
+            for (size_t i = 0; i < line.size() && column < cols - 1; ++i) {
+                bool in_match = match_pos != std::string_view::npos && i >= match_pos && i < match_pos + match_len;
+                if (in_match != highlighted) {
+                    std::cout << out;
+                    out.clear();
+                    console_output.set_color(in_match ? theme.highlight_color : theme.default_color);
+                    highlighted = in_match;
                 }
-                
-                STARTUPINFOA si = { sizeof(si) };
-                PROCESS_INFORMATION pi = { 0 };
-                
-                DWORD creation_flags = is_interactive ? CREATE_NEW_CONSOLE : DETACHED_PROCESS;
-                
-                if (CreateProcessA(nullptr, command.data(), nullptr, nullptr, FALSE, 
-                                 creation_flags, nullptr, nullptr, &si, &pi)) {
-                    CloseHandle(pi.hProcess);
-                    CloseHandle(pi.hThread);
-                    
-                    ColorGuard guard(theme.success_color);
-                    if (pass_path) {
-                        std::cout << std::format("Opened {} in {}\n", path, executable_name);
-                    } else {
-                        std::cout << std::format("Launched {}\n", executable_name);
+                if (i + 1 == match_pos + match_len && match_len > 0) {
+                    size_t from = i + 1;
+                    if (!search->matcher().find(line, from, match_pos, match_len) || match_len == 0) {
+                        match_pos = std::string_view::npos;
                     }
-                    return 0;
+                }
+                
+                if (line[i] == '\t') {
+                    int spaces = std::min(8 - column % 8, cols - 1 - column);
+                    out.append(spaces, ' ');
+                    column += spaces;
+                } else {
+                    out += std::isprint(static_cast<unsigned char>(line[i])) || line[i] < 0 ? line[i] : '?';
+                    column++;
                 }
             }
+            std::cout << out;
+            console_output.set_color(theme.default_color);
+            std::cout << std::string(cols - 1 - column, ' ') << '\n';
         }
         
-        ColorGuard guard(theme.error_color);
-        std::cerr << std::format("jshell: {} not found. Make sure it's installed and in PATH.\n", app_name);
-        return 1;
-    } else {
-        // Try to launch as direct executable name
-        std::string executable = find_executable(app_name);
-        if (!executable.empty()) {
-            std::string command;
-            if (args.size() > 2) {
-                // Pass all remaining arguments
-                command = std::format("\"{}\"", executable);
-                for (size_t i = 2; i < args.size(); ++i) {
-                    command += std::format(" \"{}\"", args[i]);
+        source.want(pos);
+        std::string status = status_text(text, pos);
+        if (static_cast<int>(status.size()) > cols - 1) status.resize(cols - 1);
+        console_output.set_color(theme.status_color);
+        std::cout << status;
+        console_output.set_color(theme.default_color);
+        std::cout << std::string(cols - 1 - status.size(), ' ') << '\r';
+        std::cout.flush();
+    };
+    
+    auto jump_to_match = [&](bool backward) {
+        if (!search) return;
+        auto hit = backward ? search->prev_before(top) : search->next_after(top);
+        pending_next = pending_backward = false;
+        if (hit) {
+            top = *hit;
+        } else if (!search->done()) {
+            pending_next = true;
+            pending_backward = backward;
+        } else {
+            message = "Pattern not found";
+        }
+    };
+    
+    auto read_pattern = [&]() {
+        int rows = screen_rows();
+        SetConsoleCursorPosition(console, {0, static_cast<SHORT>(info.srWindow.Top + rows - 1)});
+        std::cout << std::string(screen_cols() - 1, ' ') << "\r/";
+        std::cout.flush();
+        
+        std::string pattern;
+        while (true) {
+            Key key = read_key();
+            if (key.code == KeyCode::Enter) return pattern;
+            if (key.code == KeyCode::Escape || key.code == KeyCode::CtrlC) return std::string();
+            if (key.code == KeyCode::Backspace && !pattern.empty()) {
+                pattern.pop_back();
+                std::cout << "\b \b";
+            } else if (key.code == KeyCode::Char && std::isprint(key.ch)) {
+                pattern += static_cast<char>(key.ch);
+                std::cout << static_cast<char>(key.ch);
+            }
+            std::cout.flush();
+        }
+    };
+    
+    render();
+    std::string last_status;
+    
+    while (true) {
+        if (!_kbhit()) {
+            // Idle: follow a growing spill and a running search
+            bool grew = source.refresh();
+            if (pending_next && search) {
+                if (auto hit = pending_backward ? search->prev_before(top) : search->next_after(top)) {
+                    top = *hit;
+                    pending_next = false;
+                    grew = true;
+                } else if (search->done()) {
+                    pending_next = false;
+                    message = "Pattern not found";
+                    grew = true;
                 }
-            } else {
-                command = std::format("\"{}\"", executable);
             }
-            
-            STARTUPINFOA si = { sizeof(si) };
-            PROCESS_INFORMATION pi = { 0 };
-            
-            DWORD creation_flags = is_interactive ? CREATE_NEW_CONSOLE : DETACHED_PROCESS;
-            
-            if (CreateProcessA(nullptr, command.data(), nullptr, nullptr, FALSE, 
-                             creation_flags, nullptr, nullptr, &si, &pi)) {
-                CloseHandle(pi.hProcess);
-                CloseHandle(pi.hThread);
-                
-                ColorGuard guard(theme.success_color);
-                std::cout << std::format("Launched {}\n", app_name);
-                return 0;
+            std::string status = status_text(source.data(), 0);
+            if (grew || status != last_status) {
+                last_status = status;
+                render();
+            }
+            Sleep(30);
+            continue;
+        }
+        
+        Key key = read_key();
+        std::string_view text = source.data();
+        int rows = screen_rows();
+        int page = rows - 1;
+        size_t repeat = count == 0 ? 1 : count;
+        int ch = key.code == KeyCode::Char ? key.ch : 0;
+        message.clear();
+        
+        if (ch >= '0' && ch <= '9') {
+            count = count * 10 + (ch - '0');
+            continue;
+        }
+        
+        if (ch == 'q' || ch == 'Q' || key.code == KeyCode::Escape || key.code == KeyCode::CtrlC) {
+            break;
+        } else if (ch == 'j' || key.code == KeyCode::Enter || key.code == KeyCode::Down) {
+            for (size_t i = 0; i < repeat && next_line_start(text, top) < text.size(); ++i) top = next_line_start(text, top);
+        } else if (ch == 'k' || key.code == KeyCode::Up) {
+            for (size_t i = 0; i < repeat; ++i) top = prev_line_start(text, top);
+        } else if (ch == ' ' || ch == 'f' || ch == 'd' || key.code == KeyCode::PageDown) {
+            size_t lines = (ch == 'd' ? page / 2 : page) * repeat;
+            for (size_t i = 0; i < lines && next_line_start(text, top) < text.size(); ++i) top = next_line_start(text, top);
+        } else if (ch == 'b' || ch == 'u' || key.code == KeyCode::PageUp) {
+            size_t lines = (ch == 'u' ? page / 2 : page) * repeat;
+            for (size_t i = 0; i < lines && top > 0; ++i) top = prev_line_start(text, top);
+        } else if (ch == 'g' || key.code == KeyCode::Home) {
+            size_t offset = count > 0 ? index.offset_of(text, count - 1) : 0;
+            if (offset == std::string_view::npos) message = "Past end of file";
+            else top = offset;
+        } else if (ch == 'G' || key.code == KeyCode::End) {
+            top = last_page_top(text, rows);
+            source.want(SIZE_MAX);  // The end of the input, wherever it turns out to be
+        } else if (ch == '/') {
+            std::string pattern = read_pattern();
+            if (!pattern.empty()) {
+                Matcher matcher;
+                std::string error;
+                if (!matcher.compile(pattern, true, false, &error)) {
+                    matcher.compile(pattern, false, true);
+                }
+                search = std::make_unique<PagerSearch>(matcher, source.path(), text.size());
+                jump_to_match(false);
             }
+        } else if (ch == 'n') {
+            jump_to_match(false);
+        } else if (ch == 'N') {
+            jump_to_match(true);
+        } else if (ch == 'h') {
+            message = "q quit  j/k line  space/b page  d/u half  g/G top/end  Ng line N  /re search  n/N next/prev";
         }
         
+        count = 0;
+        render();
+        last_status = status_text(source.data(), 0);
+    }
+    
+    // Leave a clean screen for the prompt
+    std::vector<const char*> cls_args = {"cls"};
+    cls(state, cls_args);
+    return 0;
+}
+
+int less(ShellState& state, std::span<const char*> args) {
+    PagerSource source;
+    std::string name;
+    HANDLE input = builtin_stdin;
+    if (input == INVALID_HANDLE_VALUE && GetFileType(GetStdHandle(STD_INPUT_HANDLE)) != FILE_TYPE_CHAR) {
+        input = GetStdHandle(STD_INPUT_HANDLE);
+    }
+    
+    if (args.size() >= 2) {
+        name = expand_path(args[1]);
+        if (!source.open_file(name)) {
+            const Theme theme;
+            ColorGuard guard(theme.error_color);
+            std::cerr << std::format("jshell: {}: Cannot open file '{}'\n", args[0], name);
+            return 1;
+        }
+    } else if (input == INVALID_HANDLE_VALUE) {
+        const Theme theme;
         ColorGuard guard(theme.error_color);
-        std::cerr << std::format("jshell: '{}' not found.\n", app_name);
-        std::cout << "\nSupported shortcuts:\n";
-        std::cout << "Editors: vscode, notepad++, sublime, atom, vim, notepad\n";
-        std::cout << "Browsers: chrome, firefox, edge, brave\n";
-        std::cout << "Tools: explorer, cmd, powershell, taskmgr, calc, regedit\n";
-        std::cout << "Dev: git, node, python, java, gcc, make, cmake\n";
-        std::cout << "Or use any executable name directly.\n";
+        std::cerr << std::format("jshell: Usage: {} <file>  (or: command | {})\n", args[0], args[0]);
         return 1;
     }
+    
+    // Not on a console: pass the text through like cat
+    if (!stdout_is_console()) {
+        if (!name.empty()) {
+            std::cout << source.data();
+            return 0;
+        }
+        std::vector<char> block(state.config.io_block_size);
+        DWORD got = 0;
+        while (ReadFile(input, block.data(), static_cast<DWORD>(block.size()), &got, nullptr) && got > 0) {
+            std::cout.write(block.data(), got);
+        }
+        return 0;
+    }
+    
+    if (name.empty()) {
+        name = "(stdin)";
+        if (!source.open_stream(input, state.config.io_block_size, false)) {
+            const Theme theme;
+            ColorGuard guard(theme.error_color);
+            std::cerr << std::format("jshell: {}: Cannot create spill file\n", args[0]);
+            return 1;
+        }
+    }
+    
+    return page_source(state, source, name);
+}
+
+// --- Auto Pager ---
+// With auto_pager set, a pageable builtin run at the prompt writes through
+// a ConsoleWriter that holds its output back. Output that fits on the
+// screen is written when the builtin returns. Once it outgrows the screen,
+// it and the rest of the stream go through a pipe to the pager, which runs
+// on its own thread and spills the text as it arrives while the builtin
+// keeps going.
+bool use_auto_pager(const ShellState& state, const Builtin& builtin) {
+    return state.config.auto_pager && (builtin.flags & PAGEABLE) && stdout_is_console();
+}
+
+int run_auto_paged(ShellState& state, const Builtin& builtin, std::span<const char*> args) {
+    HANDLE console = GetStdHandle(STD_OUTPUT_HANDLE);
+    CONSOLE_SCREEN_BUFFER_INFO info;
+    if (!GetConsoleScreenBufferInfo(console, &info)) return builtin.func(state, args);
+    int rows = info.srWindow.Bottom - info.srWindow.Top;  // Keep a row for the next prompt
+    int cols = info.srWindow.Right - info.srWindow.Left + 1;
+    
+    ScopedHandle pager_input;
+    ScopedHandle pager_output;
+    std::thread pager;
+    std::string name = std::format("({})", args[0]);
+    
+    ConsoleWriter output;
+    console_output.attach_writer(output);
+    output.hold(rows, cols, [&]() -> HANDLE {
+        HANDLE read_handle, write_handle;
+        if (!CreatePipe(&read_handle, &write_handle, nullptr, static_cast<DWORD>(state.config.pipe_buffer_size))) {
+            return INVALID_HANDLE_VALUE;
+        }
+        pager_input.reset(read_handle);
+        pager_output.reset(write_handle);
+        pager = std::thread([&]() {
+            {
+                PagerSource source;
+                if (source.open_stream(pager_input.get(), state.config.io_block_size, true)) {
+                    page_source(state, source, name);
+                }
+            }
+            pager_input.reset();  // Quitting early stops the builtin with a broken pipe
+        });
+        return write_handle;
+    });
+    
+    builtin_stdout = &output;
+    int result = builtin.func(state, args);
+    output.release();
+    builtin_stdout = nullptr;
+    
+    pager_output.reset();  // End of input for the pager
+    if (pager.joinable()) pager.join();
+    return result;
 }
 
-int edit(ShellState&, std::span<const char*> args) {
+int edit(ShellState& state, std::span<const char*> args) {
     if (args.size() < 2) {
         const Theme theme;
         ColorGuard guard(theme.error_color);
@@ -2301,6 +6942,7 @@ int edit(ShellState&, std::span<const char*> args) {
             }
             
             // Launch and wait for editor to close
+            std::cout.flush();
             if (CreateProcessA(nullptr, command.data(), nullptr, nullptr, FALSE, 
                              0, nullptr, nullptr, &si, &pi)) {
                 
@@ -2324,21 +6966,28 @@ int edit(ShellState&, std::span<const char*> args) {
     std::cout << "No external editor found. Using simple built-in editor.\n";
     std::cout << std::format("Editing: {}\n", filename);
     
-    std::vector<std::string> lines;
-    bool file_exists = fs::exists(filename);
+    // Lines are only ever appended, so a save writes just the new tail
+    TextBuffer buffer;
+    size_t line_count = 0;
     
     // Load existing file
-    if (file_exists) {
-        std::ifstream file(filename);
-        std::string line;
-        while (std::getline(file, line)) {
-            lines.push_back(line);
+    if (fs::exists(filename)) {
+        if (!buffer.open(filename)) {
+            ColorGuard error_guard(theme.error_color);
+            std::cerr << std::format("Cannot open file: {}\n", filename);
+            return 1;
         }
-        std::cout << std::format("Loaded {} lines\n", lines.size());
+        line_count = buffer.size() == 0 ? 0 : buffer.line_of(buffer.size() - 1) + 1;
+        std::cout << std::format("Loaded {} lines\n", line_count);
     } else {
         std::cout << "Creating new file\n";
     }
     
+    std::string eol = "\n";
+    if (size_t end = buffer.line_end(0); end > 0 && end < buffer.size() && buffer.text(end - 1, 1) == "\r") {
+        eol = "\r\n";
+    }
+    
     std::cout << "\nSimple Editor - Commands:\n";
     std::cout << "  SAVE  - Save file and exit\n";
     std::cout << "  QUIT  - Exit without saving\n";
@@ -2349,7 +6998,7 @@ int edit(ShellState&, std::span<const char*> args) {
     bool modified = false;
     
     while (true) {
-        std::cout << std::format("Line {}: ", lines.size() + 1);
+        std::cout << std::format("Line {}: ", line_count + 1);
         
         // Use simple standard input (no fancy line editing)
         std::string input;
@@ -2358,16 +7007,8 @@ int edit(ShellState&, std::span<const char*> args) {
         }
         
         if (input == "SAVE") {
-            std::ofstream file(filename);
-            if (file) {
-                for (const auto& line : lines) {
-                    file << line << '\n';
-                }
-                ColorGuard save_guard(theme.success_color);
-                std::cout << std::format("Saved {} ({} lines)\n", filename, lines.size());
-            } else {
-                ColorGuard error_guard(theme.error_color);
-                std::cerr << std::format("Error: Cannot write to {}\n", filename);
+            if (save_text_buffer(buffer, filename, state.config)) {
+                std::cout << std::format("{} lines\n", line_count);
             }
             break;
         } else if (input == "QUIT") {
@@ -2379,8 +7020,8 @@ int edit(ShellState&, std::span<const char*> args) {
             break;
         } else if (input == "LIST") {
             std::cout << "\nFile contents:\n";
-            for (size_t i = 0; i < lines.size(); ++i) {
-                std::cout << std::format("{:3}: {}\n", i + 1, lines[i]);
+            for (size_t i = 0; i < line_count; ++i) {
+                std::cout << std::format("{:3}: {}\n", i + 1, buffer.line(i));
             }
             std::cout << '\n';
         } else if (input == "HELP") {
@@ -2390,8 +7031,13 @@ int edit(ShellState&, std::span<const char*> args) {
             std::cout << "  LIST  - Show all lines\n";
             std::cout << "  HELP  - Show this help\n\n";
         } else {
-            // Add line to file
-            lines.push_back(input);
+            // Add line to file, ending an unterminated last line first
+            std::string text;
+            if (buffer.size() > 0 && buffer.text(buffer.size() - 1, 1) != "\n") text += eol;
+            text += input;
+            text += eol;
+            buffer.insert(buffer.size(), text);
+            line_count++;
             modified = true;
         }
     }
@@ -2416,25 +7062,361 @@ int vi(ShellState& state, std::span<const char*> args) {
     
     const Theme theme;
     
-    std::vector<std::string> lines;
+    TextBuffer buffer;
     bool file_exists = fs::exists(filename);
     
-    // Load existing file
-    if (file_exists) {
-        std::ifstream file(filename);
-        if (file.is_open()) {
-            std::string line;
-            while (std::getline(file, line)) {
-                lines.push_back(line);
-            }
-            file.close();
-        }
+    // Map existing file; nothing is read until lines are shown
+    if (file_exists && !buffer.open(filename)) {
+        ColorGuard error_guard(theme.error_color);
+        std::cerr << std::format("jshell: vi: Cannot open '{}'\n", filename);
+        return 1;
     }
     
-    if (lines.empty()) {
-        lines.push_back(""); // At least one empty line
+    // New lines follow the file's line endings
+    std::string eol = "\n";
+    if (size_t end = buffer.line_end(0); end > 0 && end < buffer.size() && buffer.text(end - 1, 1) == "\r") {
+        eol = "\r\n";
     }
     
+    auto print_line = [&](size_t line) {
+        std::cout << std::format("{}: {}\n", line + 1, buffer.line(line));
+    };
+    
+    // Offset just past a line's text, before its line ending
+    auto content_end = [&](size_t line) {
+        size_t start = buffer.line_start(line);
+        size_t end = buffer.line_end(line);
+        if (end > start && buffer.text(end - 1, 1) == "\r") end--;
+        return end;
+    };
+    
+    auto replace_line = [&](size_t line, const std::string& text) {
+        size_t start = buffer.line_start(line);
+        buffer.erase(start, content_end(line) - start);
+        buffer.insert(start, text);
+    };
+    
+    auto insert_lines = [&](size_t line, const std::vector<std::string>& new_lines) {
+        std::string text;
+        size_t offset = buffer.has_line(line) ? buffer.line_start(line) : buffer.size();
+        if (offset == buffer.size() && offset > 0 && buffer.text(offset - 1, 1) != "\n") {
+            text += eol;
+        }
+        for (const auto& new_line : new_lines) {
+            text += new_line;
+            text += eol;
+        }
+        buffer.insert(offset, text);
+    };
+    
+    auto delete_line = [&](size_t line) {
+        size_t start = buffer.line_start(line);
+        size_t next = buffer.line_start(line + 1);
+        if (next != TextBuffer::npos) {
+            buffer.erase(start, next - start);
+        } else if (start > 0) {
+            // Unterminated last line: remove the line ending before it instead
+            size_t from = start - 1;
+            if (from > 0 && buffer.text(from - 1, 1) == "\r") from--;
+            buffer.erase(from, buffer.size() - from);
+        } else {
+            buffer.erase(0, buffer.size());
+        }
+    };
+    
+    bool modified = false;
+    size_t current_line = 0;
+    
+    // First match in [from, to), or npos; from is a line start
+    auto find_match = [&](const Matcher& matcher, size_t from, size_t to) {
+        size_t found = TextBuffer::npos;
+        buffer.for_each_line_block(from, [&](std::string_view block, size_t offset) {
+            if (offset >= to) return false;
+            size_t pos, len;
+            if (matcher.find(block, 0, pos, len) && offset + pos < to) found = offset + pos;
+            return found == TextBuffer::npos;
+        });
+        return found;
+    };
+    
+    // Last match in [0, to), or npos
+    auto find_last_match = [&](const Matcher& matcher, size_t to) {
+        size_t found = TextBuffer::npos;
+        buffer.for_each_line_block(0, [&](std::string_view block, size_t offset) {
+            if (offset >= to) return false;
+            size_t pos = 0, len = 0;
+            for (size_t from = 0; matcher.find(block, from, pos, len) && offset + pos < to;) {
+                found = offset + pos;
+                from = next_line_start(block, pos);  // One hit per line is enough
+            }
+            return true;
+        });
+        return found;
+    };
+    
+    // Next or previous line with a match after `line`, wrapping around the buffer
+    Matcher search;
+    bool have_search = false;
+    auto locate_match = [&](size_t line, bool backward) -> std::optional<size_t> {
+        size_t found;
+        if (backward) {
+            found = find_last_match(search, buffer.line_start(line));
+            if (found == TextBuffer::npos) found = find_last_match(search, buffer.size() + 1);
+        } else {
+            size_t next = buffer.has_line(line + 1) ? buffer.line_start(line + 1) : buffer.size();
+            found = find_match(search, next, buffer.size() + 1);
+            if (found == TextBuffer::npos) found = find_match(search, 0, next);
+        }
+        if (found == TextBuffer::npos) return std::nullopt;
+        return buffer.line_of(found);
+    };
+    
+    auto search_next = [&](bool backward) {
+        if (!have_search) {
+            std::cout << "No previous search.\n";
+            return;
+        }
+        auto line = locate_match(current_line, backward);
+        if (!line) {
+            std::cout << std::format("Pattern not found: {}\n", search.pattern());
+            return;
+        }
+        current_line = *line;
+        print_line(current_line);
+    };
+    
+    // :[range]s/pattern/replacement/[g] where range is %, N,M or N; the
+    // current line by default. Every match is collected in one scan and
+    // applied as a single edit.
+    auto substitute = [&](const std::string& command) {
+        size_t first = current_line, last = current_line;
+        size_t pos = 1;
+        if (pos < command.size() && command[pos] == '%') {
+            first = 0;
+            last = TextBuffer::npos;
+            pos++;
+        } else if (pos < command.size() && std::isdigit(static_cast<unsigned char>(command[pos]))) {
+            size_t used = 0;
+            first = last = std::stoul(command.substr(pos), &used) - 1;
+            pos += used;
+            if (pos < command.size() && command[pos] == ',') {
+                last = std::stoul(command.substr(pos + 1), &used) - 1;
+                pos += used + 1;
+            }
+        }
+        if (command.compare(pos, 2, "s/") != 0) {
+            std::cout << "Usage: :[%|N,M]s/pattern/replacement/[g]\n";
+            return false;
+        }
+        
+        // Split on unescaped '/', turning "\/" into "/"
+        std::vector<std::string> fields(1);
+        for (size_t i = pos + 2; i < command.size(); ++i) {
+            if (command[i] == '\\' && i + 1 < command.size() && command[i + 1] == '/') {
+                fields.back() += '/';
+                i++;
+            } else if (command[i] == '/') {
+                fields.emplace_back();
+            } else {
+                fields.back() += command[i];
+            }
+        }
+        if (fields.size() < 2 || fields[0].empty()) {
+            std::cout << "Usage: :[%|N,M]s/pattern/replacement/[g]\n";
+            return false;
+        }
+        bool global = fields.size() > 2 && fields[2].find('g') != std::string::npos;
+        
+        Matcher matcher;
+        std::string error;
+        if (!matcher.compile(fields[0], false, false, &error)) {
+            std::cout << std::format("Invalid pattern: {}\n", error);
+            return false;
+        }
+        
+        size_t from = buffer.line_start(first);
+        // A final newline ends the last line; no empty line follows it to match
+        size_t end = buffer.size() > 0 && buffer.text(buffer.size() - 1, 1) == "\n" ? buffer.size() : buffer.size() + 1;
+        size_t to = last == TextBuffer::npos || !buffer.has_line(last + 1) ? end : buffer.line_start(last + 1);
+        if (from == TextBuffer::npos || from > buffer.size()) {
+            std::cout << "Invalid line range.\n";
+            return false;
+        }
+        
+        std::vector<TextBuffer::Edit> edits;
+        buffer.for_each_line_block(from, [&](std::string_view block, size_t offset) {
+            if (offset >= to) return false;
+            size_t match_pos = 0, match_len = 0;
+            std::cmatch groups;
+            // Each block holds whole lines, so its end is the start of the next block
+            for (size_t at = 0; at < block.size() && matcher.find(block, at, match_pos, match_len, &groups);) {
+                if (offset + match_pos >= to) return false;
+                edits.push_back({offset + match_pos, match_len,
+                                 matcher.expand(block.substr(match_pos, match_len), groups, fields[1])});
+                // Without g only the first match of each line; never loop on an empty match
+                at = global ? match_pos + std::max<size_t>(match_len, 1) : next_line_start(block, match_pos);
+            }
+            return true;
+        });
+        
+        if (edits.empty()) {
+            std::cout << std::format("Pattern not found: {}\n", fields[0]);
+            return false;
+        }
+        // replace needs sorted edits that neither repeat nor overlap
+        auto clash = std::adjacent_find(edits.begin(), edits.end(), [](const auto& a, const auto& b) {
+            return b.offset <= a.offset || b.offset < a.offset + a.length;
+        });
+        if (clash != edits.end()) {
+            std::cout << std::format("Overlapping substitutions at offset {}; nothing changed.\n", clash->offset);
+            return false;
+        }
+        buffer.replace(edits);
+        std::cout << std::format("{} substitutions.\n", edits.size());
+        return true;
+    };
+    
+    auto save = [&]() {
+        return save_text_buffer(buffer, filename, state.config);
+    };
+    
+    // Full-screen view on an alternate console screen. Each frame fetches only
+    // the visible lines and ConsoleScreen redraws only changed cells, so moving
+    // around costs the same for any file size. False if there is no console.
+    auto visual = [&]() {
+        ConsoleScreen screen;
+        if (!screen.open()) return false;
+        
+        size_t top = current_line;
+        size_t count = 0;        // Numeric prefix, as in "42g"
+        bool pending_d = false;  // First d of dd
+        std::string message = "j/k move  f/b page  [N]g/G go  /re n N search  dd delete  u/r undo/redo  q back";
+        
+        auto last_line = [&]() {
+            return buffer.size() == 0 ? 0 : buffer.line_of(buffer.size() - 1);
+        };
+        
+        auto render = [&]() {
+            screen.begin();
+            size_t rows = static_cast<size_t>(screen.rows() - 1);  // Last row is the status line
+            if (current_line < top) top = current_line;
+            if (current_line >= top + rows) top = current_line - rows + 1;
+            
+            size_t from = buffer.line_start(top);
+            size_t to = buffer.line_start(top + rows);
+            if (to == TextBuffer::npos) to = buffer.size();
+            std::string text = from < buffer.size() ? buffer.text(from, to - from) : "";
+            std::string_view rest = text;
+            
+            for (size_t row = 0; row < rows; ++row) {
+                size_t line = top + row;
+                int r = static_cast<int>(row);
+                if (rest.empty() && line != 0) {
+                    screen.put(r, 0, "~", theme.dir_color);
+                    continue;
+                }
+                size_t end = rest.find('\n');
+                std::string_view content = rest.substr(0, end);
+                if (content.ends_with('\r')) content.remove_suffix(1);
+                rest = end == std::string_view::npos ? std::string_view() : rest.substr(end + 1);
+                
+                bool cursor = line == current_line;
+                screen.put(r, 0, std::format("{:>6} ", line + 1), cursor ? theme.prompt_color : theme.dir_color);
+                screen.put(r, 7, content, theme.default_color);
+            }
+            
+            size_t percent = buffer.size() == 0 ? 100 : std::min<size_t>(100, to * 100 / buffer.size());
+            std::string status = std::format(" {}{}  line {}  {}%  {}", filename, modified ? " [+]" : "",
+                                             current_line + 1, percent, message);
+            screen.put(static_cast<int>(rows), 0, status, theme.status_color);
+            screen.present(static_cast<int>(current_line - top), 7);
+        };
+        
+        // Read a pattern on the status line
+        auto prompt = [&](const std::string& label) {
+            std::string text;
+            while (true) {
+                screen.put(screen.rows() - 1, 0, label + text, theme.status_color);
+                screen.present(screen.rows() - 1, static_cast<int>(label.size() + text.size()));
+                Key key = read_key();
+                if (key.code == KeyCode::Enter) return text;
+                if (key.code == KeyCode::Escape || key.code == KeyCode::CtrlC) return std::string();
+                if (key.code == KeyCode::Backspace && !text.empty()) text.pop_back();
+                else if (key.code == KeyCode::Char && std::isprint(key.ch)) text += static_cast<char>(key.ch);
+            }
+        };
+        
+        auto clamp_cursor = [&]() {
+            while (current_line > 0 && !buffer.has_line(current_line)) current_line--;
+        };
+        
+        while (true) {
+            render();
+            Key key = read_key();
+            int ch = key.code == KeyCode::Char ? key.ch : 0;
+            size_t page = static_cast<size_t>(std::max(1, screen.rows() - 2));
+            if (ch != 'd') pending_d = false;
+            
+            if (ch >= '0' && ch <= '9') {
+                count = count * 10 + (ch - '0');
+                continue;
+            }
+            message.clear();
+            
+            if (ch == 'q' || key.code == KeyCode::Escape || key.code == KeyCode::Enter || key.code == KeyCode::CtrlC) {
+                return true;
+            } else if (ch == 'j' || key.code == KeyCode::Down) {
+                if (buffer.has_line(current_line + 1)) current_line++;
+            } else if (ch == 'k' || key.code == KeyCode::Up) {
+                if (current_line > 0) current_line--;
+            } else if (ch == 'f' || ch == ' ' || key.code == KeyCode::PageDown) {
+                for (size_t i = 0; i < page && buffer.has_line(current_line + 1); ++i) current_line++;
+                top = current_line;
+            } else if (ch == 'b' || key.code == KeyCode::PageUp) {
+                current_line -= std::min(current_line, page);
+                top = current_line;
+            } else if (ch == 'g' || key.code == KeyCode::Home) {
+                if (count == 0) current_line = 0;
+                else if (buffer.has_line(count - 1)) current_line = count - 1;
+                else message = "Invalid line number";
+            } else if (ch == 'G' || key.code == KeyCode::End) {
+                current_line = last_line();
+            } else if (ch == '/') {
+                std::string pattern = prompt("/");
+                std::string error;
+                if (!pattern.empty() && !search.compile(pattern, false, false, &error)) {
+                    message = "Invalid pattern: " + error;
+                    continue;
+                }
+                have_search = have_search || !pattern.empty();
+                ch = 'n';  // Then move like n
+            }
+            
+            if (ch == 'n' || ch == 'N') {
+                if (!have_search) message = "No previous search";
+                else if (auto line = locate_match(current_line, ch == 'N')) current_line = *line;
+                else message = "Pattern not found: " + search.pattern();
+            } else if (ch == 'd') {
+                if (pending_d && buffer.has_line(current_line) && buffer.size() > 0) {
+                    buffer.begin_step();
+                    delete_line(current_line);
+                    modified = true;
+                    clamp_cursor();
+                }
+                pending_d = !pending_d;
+            } else if (ch == 'u' || ch == 'r') {
+                buffer.begin_step();
+                if ((ch == 'u' ? buffer.undo() : buffer.redo()) == TextBuffer::npos) {
+                    message = ch == 'u' ? "Nothing to undo" : "Nothing to redo";
+                } else {
+                    modified = true;
+                    clamp_cursor();
+                }
+            }
+            count = 0;
+        }
+    };
+    
     // Don't clear screen - just show editor inline
     std::cout << "\n";
     ColorGuard header_guard(theme.prompt_color);
@@ -2443,19 +7425,20 @@ int vi(ShellState& state, std::span<const char*> args) {
     ||            VI EDITOR               ||
     ========================================)" << '\n';
     
-    SetConsoleTextAttribute(GetStdHandle(STD_OUTPUT_HANDLE), theme.default_color);
-    std::cout << std::format("    File: {} ({} lines)\n", filename, lines.size());
+    console_output.set_color(theme.default_color);
+    std::cout << std::format("    File: {} ({} bytes)\n", filename, buffer.size());
     
-    // Show file content with line numbers
-    for (size_t i = 0; i < lines.size(); ++i) {
-        std::cout << std::format("{:3}: {}\n", i + 1, lines[i]);
+    // Show the top of the file with line numbers
+    constexpr size_t PREVIEW_LINES = 20;
+    for (size_t i = 0; i < PREVIEW_LINES && buffer.has_line(i); ++i) {
+        std::cout << std::format("{:3}: {}\n", i + 1, buffer.line(i));
+    }
+    if (buffer.has_line(PREVIEW_LINES)) {
+        std::cout << "  ... (l lists every line)\n";
     }
     
     std::cout << std::string(40, '-') << '\n';
-    std::cout << "Commands: (i)nsert, (e)dit line, (d)elete, (s)ave, (q)uit, (l)ist, (h)elp\n";
-    
-    bool modified = false;
-    size_t current_line = 0;
+    std::cout << "Commands: (i)nsert, (e)dit line, (d)elete, (u)ndo, (r)edo, (s)ave, (q)uit, (l)ist, (h)elp\n";
     
     while (true) {
         std::cout << std::format("vi:{} ", current_line + 1);
@@ -2465,6 +7448,27 @@ int vi(ShellState& state, std::span<const char*> args) {
         }
         
         char command = std::tolower(input[0]);
+        buffer.begin_step();  // Each command is one undo step
+        
+        if (command == '/') {
+            std::string error;
+            if (input.size() > 1 && !search.compile(input.substr(1), false, false, &error)) {
+                std::cout << std::format("Invalid pattern: {}\n", error);
+                continue;
+            }
+            have_search = have_search || input.size() > 1;
+            search_next(false);
+            continue;
+        }
+        if (command == ':') {
+            try {
+                if (substitute(input)) modified = true;
+            } catch (const std::exception&) {
+                std::cout << "Usage: :[%|N,M]s/pattern/replacement/[g]\n";
+            }
+            while (current_line > 0 && !buffer.has_line(current_line)) current_line--;
+            continue;
+        }
         
         switch (command) {
             case 'i': { // Insert mode at current position
@@ -2479,9 +7483,11 @@ int vi(ShellState& state, std::span<const char*> args) {
                 }
                 
                 // Insert new lines at current position
-                lines.insert(lines.begin() + current_line, new_lines.begin(), new_lines.end());
+                if (!new_lines.empty()) {
+                    insert_lines(current_line, new_lines);
+                    modified = true;
+                }
                 current_line += new_lines.size();
-                modified = true;
                 
                 std::cout << std::format("Inserted {} lines.\n", new_lines.size());
                 break;
@@ -2491,13 +7497,13 @@ int vi(ShellState& state, std::span<const char*> args) {
                     // Parse line number from command like "e5"
                     try {
                         size_t line_num = std::stoul(input.substr(1)) - 1;
-                        if (line_num < lines.size()) {
+                        if (buffer.has_line(line_num)) {
                             current_line = line_num;
-                            std::cout << std::format("Current: {}: {}\n", current_line + 1, lines[current_line]);
+                            std::cout << std::format("Current: {}: {}\n", current_line + 1, buffer.line(current_line));
                             std::cout << "New text: ";
                             std::string new_text;
                             if (std::getline(std::cin, new_text)) {
-                                lines[current_line] = new_text;
+                                replace_line(current_line, new_text);
                                 modified = true;
                                 std::cout << "Line updated.\n";
                             }
@@ -2508,11 +7514,15 @@ int vi(ShellState& state, std::span<const char*> args) {
                         std::cout << "Usage: e<line_number> (e.g., e5)\n";
                     }
                 } else {
-                    std::cout << std::format("Current: {}: {}\n", current_line + 1, lines[current_line]);
+                    std::cout << std::format("Current: {}: {}\n", current_line + 1, buffer.line(current_line));
                     std::cout << "New text: ";
                     std::string new_text;
                     if (std::getline(std::cin, new_text)) {
-                        lines[current_line] = new_text;
+                        if (buffer.has_line(current_line)) {
+                            replace_line(current_line, new_text);
+                        } else {
+                            insert_lines(current_line, {new_text});
+                        }
                         modified = true;
                         std::cout << "Line updated.\n";
                     }
@@ -2520,45 +7530,38 @@ int vi(ShellState& state, std::span<const char*> args) {
                 break;
             }
             case 'd': { // Delete line
+                size_t line_num = current_line;
                 if (input.length() > 1) {
                     try {
-                        size_t line_num = std::stoul(input.substr(1)) - 1;
-                        if (line_num < lines.size()) {
-                            std::cout << std::format("Deleting: {}: {}\n", line_num + 1, lines[line_num]);
-                            lines.erase(lines.begin() + line_num);
-                            modified = true;
-                            if (current_line >= lines.size() && current_line > 0) {
-                                current_line = lines.size() - 1;
-                            }
-                        } else {
-                            std::cout << "Invalid line number.\n";
-                        }
+                        line_num = std::stoul(input.substr(1)) - 1;
                     } catch (...) {
                         std::cout << "Usage: d<line_number> (e.g., d5)\n";
+                        break;
                     }
-                } else {
-                    if (current_line < lines.size()) {
-                        std::cout << std::format("Deleting: {}: {}\n", current_line + 1, lines[current_line]);
-                        lines.erase(lines.begin() + current_line);
-                        modified = true;
-                        if (current_line >= lines.size() && current_line > 0) {
-                            current_line = lines.size() - 1;
-                        }
+                }
+                if (buffer.has_line(line_num) && buffer.size() > 0) {
+                    std::cout << std::format("Deleting: {}: {}\n", line_num + 1, buffer.line(line_num));
+                    delete_line(line_num);
+                    modified = true;
+                    if (!buffer.has_line(current_line) && current_line > 0) {
+                        current_line--;
                     }
+                } else if (input.length() > 1) {
+                    std::cout << "Invalid line number.\n";
                 }
                 break;
             }
             case 'j': { // Move down
-                if (current_line < lines.size() - 1) {
+                if (buffer.has_line(current_line + 1)) {
                     current_line++;
-                    std::cout << std::format("{}: {}\n", current_line + 1, lines[current_line]);
+                    print_line(current_line);
                 }
                 break;
             }
             case 'k': { // Move up
                 if (current_line > 0) {
                     current_line--;
-                    std::cout << std::format("{}: {}\n", current_line + 1, lines[current_line]);
+                    print_line(current_line);
                 }
                 break;
             }
@@ -2566,9 +7569,9 @@ int vi(ShellState& state, std::span<const char*> args) {
                 if (input.length() > 1) {
                     try {
                         size_t line_num = std::stoul(input.substr(1)) - 1;
-                        if (line_num < lines.size()) {
+                        if (buffer.has_line(line_num)) {
                             current_line = line_num;
-                            std::cout << std::format("{}: {}\n", current_line + 1, lines[current_line]);
+                            print_line(current_line);
                         } else {
                             std::cout << "Invalid line number.\n";
                         }
@@ -2577,49 +7580,57 @@ int vi(ShellState& state, std::span<const char*> args) {
                     }
                 } else {
                     current_line = 0; // Go to first line
-                    std::cout << std::format("{}: {}\n", current_line + 1, lines[current_line]);
+                    print_line(current_line);
                 }
                 break;
             }
+            case 'v':   // Full-screen view
             case 'l': { // List all lines
+                // On a console both open the full-screen view instead of scrolling the whole file past
+                if (stdout_is_console() && visual()) {
+                    print_line(current_line);
+                    break;
+                }
                 std::cout << "\n File contents:\n";
                 std::cout << std::string(50, '-') << '\n';
-                for (size_t i = 0; i < lines.size(); ++i) {
+                size_t i = 0;
+                for (; buffer.has_line(i); ++i) {
                     char marker = (i == current_line) ? '>' : ' ';
                     ColorGuard line_guard(i == current_line ? theme.success_color : theme.default_color);
-                    std::cout << std::format("{}{:3}: {}\n", marker, i + 1, lines[i]);
+                    std::cout << std::format("{}{:3}: {}\n", marker, i + 1, buffer.line(i));
                 }
                 std::cout << std::string(50, '-') << '\n';
-                std::cout << std::format("Current line: {} of {}\n\n", current_line + 1, lines.size());
+                std::cout << std::format("Current line: {} of {}\n\n", current_line + 1, i);
                 break;
             }
-            case 's': { // Save
-                std::ofstream file(filename);
-                if (file) {
-                    for (const auto& line : lines) {
-                        file << line << '\n';
-                    }
-                    ColorGuard save_guard(theme.success_color);
-                    std::cout << std::format("Saved {} ({} lines)\n", filename, lines.size());
-                    modified = false;
-                } else {
-                    ColorGuard error_guard(theme.error_color);
-                    std::cerr << std::format("Error: Cannot write to {}\n", filename);
+            case 'n': { // Next match, N for previous
+                search_next(input[0] == 'N');
+                break;
+            }
+            case 'u':   // Undo
+            case 'r': { // Redo
+                bool undo = command == 'u';
+                if (undo ? buffer.undo() == TextBuffer::npos : buffer.redo() == TextBuffer::npos) {
+                    std::cout << (undo ? "Nothing to undo.\n" : "Nothing to redo.\n");
+                    break;
+                }
+                modified = true;
+                while (current_line > 0 && !buffer.has_line(current_line)) {
+                    current_line--;
                 }
+                std::cout << std::format("{} ({} bytes).\n", undo ? "Undone" : "Redone", buffer.size());
+                break;
+            }
+            case 's': { // Save
+                if (save()) modified = false;
                 break;
             }
             case 'q': { // Quit
                 if (modified) {
                     std::cout << "File has unsaved changes. Save first? (y/n): ";
                     std::string confirm;
-                    if (std::getline(std::cin, confirm) && std::tolower(confirm[0]) == 'y') {
-                        std::ofstream file(filename);
-                        if (file) {
-                            for (const auto& line : lines) {
-                                file << line << '\n';
-                            }
-                            std::cout << "Saved and exiting.\n";
-                        }
+                    if (std::getline(std::cin, confirm) && !confirm.empty() && std::tolower(confirm[0]) == 'y') {
+                        if (save()) std::cout << "Saved and exiting.\n";
                     }
                 }
                 std::cout << "=== Vi Editor Closed ===\n\n";
@@ -2633,7 +7644,13 @@ int vi(ShellState& state, std::span<const char*> args) {
                 std::cout << "  j       - Move down one line\n";
                 std::cout << "  k       - Move up one line\n";
                 std::cout << "  g[N]    - Go to line N (or first line)\n";
-                std::cout << "  l       - List all lines with current position\n";
+                std::cout << "  v / l   - Full-screen view (l lists every line when not on a console)\n";
+                std::cout << "  /re     - Find next line matching re (/ alone repeats)\n";
+                std::cout << "  n / N   - Next / previous match\n";
+                std::cout << "  :s/re/text/[g]  - Replace in current line (:%s all lines, :N,Ms range;\n";
+                std::cout << "                    $1 and $& insert groups)\n";
+                std::cout << "  u       - Undo last change\n";
+                std::cout << "  r       - Redo last undone change\n";
                 std::cout << "  s       - Save file\n";
                 std::cout << "  q       - Quit (prompts to save if modified)\n";
                 std::cout << "  h       - Show this help\n\n";
@@ -2648,69 +7665,211 @@ int vi(ShellState& state, std::span<const char*> args) {
     return 0;
 }
 
-std::string expand_registered_command(const RegisteredCommand& reg_cmd, const std::vector<std::string>& args) {
-    std::string result = reg_cmd.template_cmd;
-    
-    // Replace positional parameters {0}, {1}, {2}, etc.
-    for (size_t i = 0; i < args.size(); ++i) {
-        std::string placeholder = std::format("{{{}}}", i);
-        size_t pos = 0;
-        while ((pos = result.find(placeholder, pos)) != std::string::npos) {
-            result.replace(pos, placeholder.length(), args[i]);
-            pos += args[i].length();
+// Arguments supplied to a registered command, split into positional and --name=value
+struct TemplateArgs {
+    std::vector<const std::string*> positional;
+    std::map<std::string_view, std::string_view> named;
+    const std::string* each = nullptr;  // Current item of a fan-out
+};
+
+void append_template_token(std::string& out, const TemplateToken& token, const RegisteredCommand& reg_cmd,
+                           const TemplateArgs& targs, const ShellState& state) {
+    for (const auto& seg : token) {
+        switch (seg.kind) {
+            case TemplateSegment::Kind::Literal:
+                if (seg.has_variables) {
+                    out += substitute_variables(seg.text, state);
+                } else {
+                    out += seg.text;
+                }
+                break;
+            case TemplateSegment::Kind::Positional:
+                if (seg.index < targs.positional.size()) out += *targs.positional[seg.index];
+                break;
+            case TemplateSegment::Kind::Named:
+                if (auto it = targs.named.find(seg.text); it != targs.named.end()) {
+                    out += it->second;
+                } else if (auto def = reg_cmd.default_values.find(seg.text); def != reg_cmd.default_values.end()) {
+                    out += def->second;
+                }
+                break;
+            case TemplateSegment::Kind::Each:
+                // Outside a fan-out (e.g. inside a pipeline) {each} means {all}
+                if (targs.each) {
+                    out += *targs.each;
+                    break;
+                }
+                [[fallthrough]];
+            case TemplateSegment::Kind::AllArgs:
+                for (size_t i = 0; i < targs.positional.size(); ++i) {
+                    if (i > 0) out += ' ';
+                    out += *targs.positional[i];
+                }
+                break;
         }
     }
-    
-    // Replace named parameters {file}, {output}, etc.
-    for (const auto& param : reg_cmd.param_names) {
-        std::string placeholder = std::format("{{{}}}", param);
-        size_t pos = 0;
-        while ((pos = result.find(placeholder, pos)) != std::string::npos) {
-            // Find corresponding argument or use default
-            std::string value;
-            auto it = reg_cmd.default_values.find(param);
-            if (it != reg_cmd.default_values.end()) {
-                value = it->second;
+}
+
+TemplateArgs split_template_args(const RegisteredCommand& reg_cmd, const std::vector<std::string>& args) {
+    TemplateArgs targs;
+    targs.positional.reserve(args.size());
+    
+    for (const auto& arg : args) {
+        auto eq_pos = arg.find('=');
+        if (arg.starts_with("--") && eq_pos != std::string::npos) {
+            std::string_view key = std::string_view(arg).substr(2, eq_pos - 2);
+            if (std::find(reg_cmd.param_names.begin(), reg_cmd.param_names.end(), key) != reg_cmd.param_names.end()) {
+                targs.named[key] = std::string_view(arg).substr(eq_pos + 1);
+                continue;
             }
-            result.replace(pos, placeholder.length(), value);
-            pos += value.length();
         }
+        targs.positional.push_back(&arg);
     }
     
-    // Replace special placeholders
-    result = std::regex_replace(result, std::regex(R"(\{all\})"), 
-        [&args]() {
-            std::string all_args;
-            for (size_t i = 0; i < args.size(); ++i) {
-                if (i > 0) all_args += " ";
-                all_args += args[i];
+    return targs;
+}
+
+// Expand a registered command directly into pipeline stages. Arguments are
+// substituted per token, so they are never re-tokenized or re-substituted.
+// Stages that expand to nothing are dropped.
+std::vector<Command> expand_registered_command(const RegisteredCommand& reg_cmd, const TemplateArgs& targs,
+                                               const ShellState& state) {
+    std::vector<Command> commands;
+    commands.reserve(reg_cmd.stages.size());
+    
+    for (const auto& stage : reg_cmd.stages) {
+        Command cmd;
+        cmd.args.reserve(stage.args.size() + targs.positional.size());
+        
+        for (const auto& token : stage.args) {
+            // A bare {all} passes every argument through as its own argv entry
+            if (token.size() == 1 && (token[0].kind == TemplateSegment::Kind::AllArgs ||
+                                      (token[0].kind == TemplateSegment::Kind::Each && !targs.each))) {
+                for (const auto* arg : targs.positional) cmd.args.push_back(*arg);
+                continue;
             }
-            return all_args;
-        }());
+            std::string value;
+            append_template_token(value, token, reg_cmd, targs, state);
+            if (!value.empty()) cmd.args.push_back(std::move(value));
+        }
+        
+        append_template_token(cmd.input_file, stage.input_file, reg_cmd, targs, state);
+        append_template_token(cmd.output_file, stage.output_file, reg_cmd, targs, state);
+        append_template_token(cmd.error_file, stage.error_file, reg_cmd, targs, state);
+        cmd.append_output = stage.append_output;
+        cmd.append_error = stage.append_error;
+        cmd.background = stage.background;
+        
+        if (!cmd.args.empty()) commands.push_back(std::move(cmd));
+    }
     
-    return result;
+    return commands;
+}
+
+// Redirections typed by the user apply to the ends of an expansion
+void apply_user_redirections(std::vector<Command>& expanded, const Command& original) {
+    Command& first = expanded.front();
+    Command& last = expanded.back();
+    if (!original.input_file.empty()) first.input_file = original.input_file;
+    if (!original.output_file.empty()) {
+        last.output_file = original.output_file;
+        last.append_output = original.append_output;
+    }
+    if (!original.error_file.empty()) {
+        last.error_file = original.error_file;
+        last.append_error = original.append_error;
+    }
+    last.background = last.background || original.background;
+}
+
+// Replace every registered-command stage of a pipeline with its expansion.
+// Each name is expanded at most once per stage, so templates such as
+// "node {0}" fall through to the real executable instead of recursing.
+// expanded_name is a command the stages were already expanded from.
+void expand_registered_stages(ShellState& state, std::vector<Command>& commands,
+                              const std::string& expanded_name = "") {
+    sync_registered_commands(state);
+    
+    for (size_t i = 0; i < commands.size();) {
+        std::vector<std::string> expanded_names;
+        if (!expanded_name.empty()) expanded_names.push_back(expanded_name);
+        size_t stage_count = 1;
+        
+        while (!commands[i].args.empty()) {
+            const std::string cmd_name = commands[i].args[0];
+            auto it = state.registered_commands.find(cmd_name);
+            if (it == state.registered_commands.end() ||
+                std::find(expanded_names.begin(), expanded_names.end(), cmd_name) != expanded_names.end()) {
+                break;
+            }
+            expanded_names.push_back(cmd_name);
+            
+            Command original = std::move(commands[i]);
+            std::vector<std::string> cmd_args(original.args.begin() + 1, original.args.end());
+            auto expanded = expand_registered_command(it->second, split_template_args(it->second, cmd_args), state);
+            if (expanded.empty()) {
+                commands.erase(commands.begin() + i);
+                stage_count = 0;
+                break;
+            }
+            apply_user_redirections(expanded, original);
+            
+            stage_count = expanded.size();
+            commands.erase(commands.begin() + i);
+            commands.insert(commands.begin() + i,
+                            std::make_move_iterator(expanded.begin()), std::make_move_iterator(expanded.end()));
+            
+            // A multi-stage expansion is not expanded any further
+            if (stage_count > 1) break;
+        }
+        
+        i += stage_count;
+    }
 }
 
 int register_cmd(ShellState& state, std::span<const char*> args) {
-    if (args.size() < 3) {
+    // Leading --options configure the command rather than its template
+    size_t first = 1;
+    std::string options;
+    while (first < args.size() && std::string_view(args[first]).starts_with("--")) {
+        std::string_view option = args[first];
+        if (option != "--cache" && !option.starts_with("--inputs=") && !option.starts_with("--outputs=")) {
+            const Theme theme;
+            ColorGuard guard(theme.error_color);
+            std::cerr << std::format("jshell: register: Unknown option '{}'\n", option);
+            return 1;
+        }
+        if (!options.empty()) options += ' ';
+        options += option;
+        first++;
+    }
+    
+    if (args.size() < first + 2) {
         const Theme theme;
         ColorGuard guard(theme.error_color);
-        std::cerr << "jshell: Usage: register <name> <template> [description]\n";
+        std::cerr << "jshell: Usage: register [--cache [--inputs=...] [--outputs=...]] <name> <template> [description]\n";
         std::cerr << "\nTemplate placeholders:\n";
         std::cerr << "  {0}, {1}, {2}... - Positional arguments\n";
         std::cerr << "  {all}           - All arguments\n";
-        std::cerr << "  {file}          - Named parameter\n";
+        std::cerr << "  {each}          - Run once per argument (wildcards expand to files)\n";
+        std::cerr << "  {file}          - Named parameter (pass as --file=value)\n";
+        std::cerr << "\nCaching:\n";
+        std::cerr << "  --cache         - Skip runs whose command line and input files are unchanged\n";
+        std::cerr << "  --inputs={0},.. - Input files to hash (default: every argument naming a file)\n";
+        std::cerr << "  --outputs={1},..- Output files to store and restore on a cache hit\n";
         std::cerr << "\nExamples:\n";
         std::cerr << "  register cpp \"g++ -std=c++20 {0} -o {1}\" \"Compile C++ file\"\n";
         std::cerr << "  register run \"./{0}\" \"Run executable\"\n";
         std::cerr << "  register backup \"cp {0} {0}.bak\" \"Backup file\"\n";
+        std::cerr << "  register --cache --inputs={0} --outputs={1} cpp \"g++ {0} -o {1}\"\n";
+        std::cerr << "  register bakall \"cp {each} {each}.bak\"   (then: bakall *.conf)\n";
         std::cerr << "\nNote: Use quotes around templates with spaces!\n";
         return 1;
     }
     
-    std::string name = args[1];
-    std::string template_cmd = args[2];
-    std::string description = args.size() > 3 ? args[3] : "Custom registered command";
+    std::string name = args[first];
+    std::string template_cmd = args[first + 1];
+    std::string description = args.size() > first + 2 ? args[first + 2] : "Custom registered command";
     
     // Remove surrounding brackets if present (fix for parsing issue)
     if (template_cmd.starts_with('[') && template_cmd.ends_with(']')) {
@@ -2727,7 +7886,24 @@ int register_cmd(ShellState& state, std::span<const char*> args) {
         }
     }
     
+    RegisteredCommand reg_cmd(name, template_cmd, description, options);
+    if (!reg_cmd.error.empty()) {
+        const Theme theme;
+        ColorGuard guard(theme.error_color);
+        std::cerr << std::format("jshell: register: {}\n", reg_cmd.error);
+        return 1;
+    }
+    
+    // A fan-out runs many invocations, which one cache entry cannot replay
+    if (reg_cmd.cache && reg_cmd.fan_out) {
+        const Theme theme;
+        ColorGuard guard(theme.error_color);
+        std::cerr << "jshell: register: --cache cannot be used with an {each} template\n";
+        return 1;
+    }
+    
     // Check if command already exists and ask for confirmation
+    sync_registered_commands(state);
     if (state.registered_commands.contains(name)) {
         const Theme theme;
         ColorGuard guard(theme.warning_color);
@@ -2739,23 +7915,13 @@ int register_cmd(ShellState& state, std::span<const char*> args) {
         }
     }
     
-    RegisteredCommand reg_cmd(name, template_cmd, description);
-    
-    // Parse template to find parameters
-    std::regex param_regex(R"(\{([^}]+)\})");
-    std::sregex_iterator iter(template_cmd.begin(), template_cmd.end(), param_regex);
-    std::sregex_iterator end;
-    
-    for (; iter != end; ++iter) {
-        std::string param = (*iter)[1].str();
-        if (!param.empty() && param != "all" && !std::isdigit(param[0])) {
-            reg_cmd.param_names.push_back(param);
-        }
+    if (!append_command_record(state, CommandLogOp::Put, reg_cmd)) {
+        state.registered_commands[name] = reg_cmd;
+        const Theme theme;
+        ColorGuard guard(theme.warning_color);
+        std::cerr << std::format("jshell: Warning: Failed to save command '{}'\n", name);
     }
     
-    state.registered_commands[name] = reg_cmd;
-    save_registered_commands(state);  // Save to file
-    
     const Theme theme;
     ColorGuard guard(theme.success_color);
     std::cout << std::format("Registered command '{}': {}\n", name, template_cmd);
@@ -2781,8 +7947,18 @@ int unregister_cmd(ShellState& state, std::span<const char*> args) {
     
     std::string name = args[1];
     
-    if (state.registered_commands.erase(name) > 0) {
-        save_registered_commands(state);  // Save to file
+    sync_registered_commands(state);
+    auto it = state.registered_commands.find(name);
+    
+    if (it != state.registered_commands.end()) {
+        // Appending re-syncs the map, which would leave it->second dangling
+        const RegisteredCommand removed = it->second;
+        if (!append_command_record(state, CommandLogOp::Remove, removed)) {
+            state.registered_commands.erase(name);
+            const Theme theme;
+            ColorGuard guard(theme.warning_color);
+            std::cerr << std::format("jshell: Warning: Failed to save removal of '{}'\n", name);
+        }
         const Theme theme;
         ColorGuard guard(theme.success_color);
         std::cout << std::format("Unregistered command '{}'\n", name);
@@ -2797,6 +7973,7 @@ int unregister_cmd(ShellState& state, std::span<const char*> args) {
 
 int list_registered(ShellState& state, std::span<const char*>) {
     const Theme theme;
+    sync_registered_commands(state);
     
     if (state.registered_commands.empty()) {
         ColorGuard guard(theme.warning_color);
@@ -2812,15 +7989,18 @@ int list_registered(ShellState& state, std::span<const char*>) {
     std::cout << "Registered Commands:\n";
     std::cout << std::string(50, '=') << '\n';
     
-    SetConsoleTextAttribute(GetStdHandle(STD_OUTPUT_HANDLE), theme.default_color);
+    console_output.set_color(theme.default_color);
     
     for (const auto& [name, cmd] : state.registered_commands) {
         ColorGuard name_guard(theme.help_command_color);
         std::cout << std::format("{:<12}", name);
         
-        SetConsoleTextAttribute(GetStdHandle(STD_OUTPUT_HANDLE), theme.default_color);
+        console_output.set_color(theme.default_color);
         std::cout << std::format(" - {}\n", cmd.description);
         std::cout << std::format("             Template: {}\n", cmd.template_cmd);
+        if (cmd.cache) {
+            std::cout << std::format("             Cached: {}\n", cmd.options);
+        }
         
         if (!cmd.param_names.empty()) {
             std::cout << "             Parameters: ";
@@ -2829,7 +8009,7 @@ int list_registered(ShellState& state, std::span<const char*>) {
                 ColorGuard param_guard(theme.success_color);
                 std::cout << cmd.param_names[i];
             }
-            SetConsoleTextAttribute(GetStdHandle(STD_OUTPUT_HANDLE), theme.default_color);
+            console_output.set_color(theme.default_color);
             std::cout << '\n';
         }
         std::cout << '\n';
@@ -2844,7 +8024,7 @@ int version(ShellState&, std::span<const char*>) {
     std::cout << "jshell v0.0 - Enhanced C++ Shell for Windows\n";
     std::cout << "Built with caffeine & C++ by Camresh - CNJMTechnologies INC\n";
     
-    SetConsoleTextAttribute(GetStdHandle(STD_OUTPUT_HANDLE), theme.default_color);
+    console_output.set_color(theme.default_color);
     std::cout << "Built with: g++ (MinGW) C++20\n";
     std::cout << "Copyright (c) future\n";
     std::cout << "Built with caffeine & C++ by Camresh - CNJMTechnologies INC\n";
@@ -2852,65 +8032,263 @@ int version(ShellState&, std::span<const char*>) {
     return 0;
 }
 
+int config_cmd(ShellState& state, std::span<const char*> args) {
+    bool effective = args.size() == 3 && std::string_view(args[2]) == "--effective";
+    if (args.size() < 2 || std::string_view(args[1]) != "show" || (args.size() > 2 && !effective)) {
+        const Theme theme;
+        ColorGuard guard(theme.error_color);
+        std::cerr << "jshell: Usage: config show [--effective]\n";
+        return 1;
+    }
+    
+    // Without --effective, only the values that differ from the defaults
+    const Configuration defaults;
+    for (const auto& option : config_options) {
+        std::string value = option.print(state.config);
+        if (!effective && value == option.print(defaults)) continue;
+        
+        if (effective && std::string_view(option.key) == "max_workers" && state.config.max_workers == 0) {
+            value = std::format("{} (auto)", effective_workers(state.config));
+        }
+        std::cout << std::format("{:<24} = {:<16} # {}\n", option.key, value, option.description);
+    }
+    
+    if (effective) {
+        std::cout << std::format("{:<24} = {}\n", "config_file", (state.shell_directory / "config.ini").string());
+    }
+    return 0;
+}
+
 // --- Main Execution Logic ---
-int execute(ShellState& state, std::vector<Command>& commands) {
-    if (commands.empty() || commands[0].args.empty()) {
-        return 0;
+// Expand one stage into out. An alias may expand to a whole pipeline; each of
+// its stages is expanded in turn. `visited` holds the aliases on the current
+// path, so `alias ls='ls -l'` stops after one step and cycles terminate.
+void expand_alias_stage(const ShellState& state, Command cmd, std::vector<Command>& out, std::vector<bool>& visited) {
+    auto it = cmd.args.empty() ? state.aliases.end() : state.aliases.find(cmd.args[0]);
+    if (it == state.aliases.end() || visited[it->second.id]) {
+        out.push_back(std::move(cmd));
+        return;
+    }
+    
+    const Alias& entry = it->second;
+    if (entry.pipeline.empty()) {
+        cmd.args.erase(cmd.args.begin());
+        if (!cmd.args.empty()) expand_alias_stage(state, std::move(cmd), out, visited);
+        return;
+    }
+    
+    // Arguments after the alias name go to the last stage of its expansion
+    std::vector<Command> expanded = entry.pipeline;
+    expanded.back().args.insert(expanded.back().args.end(),
+                                std::make_move_iterator(cmd.args.begin() + 1), std::make_move_iterator(cmd.args.end()));
+    apply_user_redirections(expanded, cmd);
+    
+    visited[entry.id] = true;
+    for (auto& stage : expanded) {
+        expand_alias_stage(state, std::move(stage), out, visited);
+    }
+    visited[entry.id] = false;
+}
+
+void expand_aliases(const ShellState& state, std::vector<Command>& commands) {
+    auto is_alias = [&](const Command& cmd) { return !cmd.args.empty() && state.aliases.contains(cmd.args[0]); };
+    if (std::none_of(commands.begin(), commands.end(), is_alias)) return;
+    
+    std::vector<bool> visited(state.next_alias_id);
+    std::vector<Command> expanded;
+    expanded.reserve(commands.size());
+    for (auto& cmd : commands) {
+        expand_alias_stage(state, std::move(cmd), expanded, visited);
     }
+    commands = std::move(expanded);
+}
+
+// Run pipeline stages whose aliases and registered commands are already expanded
+// --- Pipeline Fusion ---
+// A pipeline of cat, grep and wc stages (cat files | grep a | grep b | wc -l)
+// runs as one loop on the calling thread. Each file is mapped, its lines go
+// through every grep's matcher in turn, and the survivors are counted or
+// printed. There are no threads, pipes or copies between stages; only a
+// file's unterminated last line is copied, to be joined to the next file's
+// first line as cat would. The output is what the threaded stages would
+// print. Any other pipeline runs threaded.
+struct FusedPipeline {
+    std::vector<std::string> files;
+    std::vector<Matcher> filters;
+    bool count = false;  // Ends in wc rather than grep
+    bool lines = false;
+    bool words = false;
+    bool bytes = false;
+};
 
-    std::string cmd_name = commands[0].args[0];
+// The fused form of a pipeline, or nothing with the reason in why_not
+std::optional<FusedPipeline> plan_fusion(const std::vector<Command>& commands, std::string& why_not) {
+    FusedPipeline plan;
     
-    // Handle aliases first
-    if (state.aliases.contains(cmd_name)) {
-        std::string alias_cmd = state.aliases[cmd_name];
-        std::vector<std::string> original_args(commands[0].args.begin() + 1, commands[0].args.end());
+    for (size_t i = 0; i < commands.size(); ++i) {
+        const Command& cmd = commands[i];
+        const std::string& name = cmd.args[0];
+        if (!cmd.input_file.empty() || !cmd.output_file.empty() || !cmd.error_file.empty() || cmd.background) {
+            why_not = std::format("stage {} ('{}') is redirected", i + 1, name);
+            return std::nullopt;
+        }
         
-        auto alias_tokens = tokenize(alias_cmd);
-        commands[0].args = alias_tokens;
-        commands[0].args.insert(commands[0].args.end(), original_args.begin(), original_args.end());
-        cmd_name = commands[0].args[0]; // Update cmd_name after alias expansion
+        if (i == 0) {
+            if (name != "cat" || cmd.args.size() < 2) {
+                why_not = std::format("stage 1 ('{}') is not cat <files>", name);
+                return std::nullopt;
+            }
+            for (size_t a = 1; a < cmd.args.size(); ++a) plan.files.push_back(expand_path(cmd.args[a]));
+        } else if (name == "grep" && cmd.args.size() == 2) {
+            compile_grep_pattern(plan.filters.emplace_back(), cmd.args[1]);
+        } else if (name == "wc" && i + 1 == commands.size() &&
+                   std::all_of(cmd.args.begin() + 1, cmd.args.end(), [](const std::string& arg) {
+                       return arg.size() > 1 && arg[0] == '-' && arg.find_first_not_of("lwc", 1) == std::string::npos;
+                   })) {
+            plan.count = true;
+            for (size_t a = 1; a < cmd.args.size(); ++a) {
+                plan.lines |= cmd.args[a].find('l') != std::string::npos;
+                plan.words |= cmd.args[a].find('w') != std::string::npos;
+                plan.bytes |= cmd.args[a].find('c') != std::string::npos;
+            }
+        } else {
+            why_not = std::format("stage {} ('{}') is not grep <pattern> or a final wc", i + 1, name);
+            return std::nullopt;
+        }
     }
     
-    // Handle registered commands
-    if (state.registered_commands.contains(cmd_name)) {
-        const auto& reg_cmd = state.registered_commands[cmd_name];
-        std::vector<std::string> cmd_args(commands[0].args.begin() + 1, commands[0].args.end());
-        
-        std::string expanded_cmd = expand_registered_command(reg_cmd, cmd_args);
+    return plan;
+}
+
+int run_fused_pipeline(const FusedPipeline& plan) {
+    TextCounts counts;
+    bool found = false;
+    
+    // Whole lines only, so no line or word is split
+    auto run = [&](std::string_view text) {
+        if (plan.filters.empty()) {
+            counts.add(text);
+            return;
+        }
+        filter_lines(text, plan.filters, [&](std::string_view line) {
+            found = true;
+            if (!plan.count) {
+                print_line(line);
+                return;
+            }
+            counts.add(line);
+            if (!line.ends_with('\n')) {  // grep would have printed one
+                counts.lines++;
+                counts.bytes++;
+            }
+        });
+    };
+    
+    std::string carry;  // Unterminated last line of the files so far
+    for (const auto& path : plan.files) {
+        MappedFile file;
+        if (!file.open(path)) {
+            const Theme theme;
+            ColorGuard guard(theme.error_color);
+            std::cerr << std::format("jshell: cat: Cannot open file '{}'\n", path);
+            continue;
+        }
         
-        // Parse the expanded command and execute it
-        auto expanded_commands = parse_pipeline(expanded_cmd, state);
-        if (!expanded_commands.empty()) {
-            return execute(state, expanded_commands);
+        std::string_view text = file.view();
+        if (!carry.empty()) {
+            size_t newline = text.find('\n');
+            if (newline == std::string_view::npos) {
+                carry += text;
+                continue;
+            }
+            carry += text.substr(0, newline + 1);
+            run(carry);
+            carry.clear();
+            text.remove_prefix(newline + 1);
         }
+        size_t last = text.rfind('\n');
+        size_t complete = last == std::string_view::npos ? 0 : last + 1;
+        run(text.substr(0, complete));
+        carry = text.substr(complete);
+    }
+    if (!carry.empty()) run(carry);
+    
+    if (plan.count) {
+        print_counts(counts, plan.lines, plan.words, plan.bytes, "");
+        return 0;
     }
+    return found ? 0 : 1;
+}
 
+int run_pipeline(ShellState& state, std::vector<Command>& commands) {
     if (commands.size() == 1) {
         for (const auto& builtin : builtins) {
             if (commands[0].args[0] == builtin.name) {
                 std::vector<const char*> c_args;
                 c_args.reserve(commands[0].args.size());
                 for (const auto& s : commands[0].args) c_args.push_back(s.c_str());
-                int result = builtin.func(state, c_args);
+                int result = use_auto_pager(state, builtin) ? run_auto_paged(state, builtin, c_args) : builtin.func(state, c_args);
                 state.last_exit_code = result;
                 return result;
             }
         }
         
-        int result = launch_process(commands[0], INVALID_HANDLE_VALUE, INVALID_HANDLE_VALUE, INVALID_HANDLE_VALUE, &state);
+        int result = capture_external(state, commands[0])
+                         ? launch_captured(commands[0], INVALID_HANDLE_VALUE, state)
+                         : launch_process(commands[0], INVALID_HANDLE_VALUE, INVALID_HANDLE_VALUE, INVALID_HANDLE_VALUE, &state);
         state.last_exit_code = result;
         return result;
     }
     
+    std::string why_not;
+    auto fused = plan_fusion(commands, why_not);
+    if (state.config.profile) {
+        std::string stages;
+        for (const auto& cmd : commands) stages += (stages.empty() ? "" : " | ") + cmd.args[0];
+        const Theme theme;
+        ColorGuard guard(theme.warning_color);
+        if (fused) std::cerr << std::format("[profile] fused {} into one loop\n", stages);
+        else std::cerr << std::format("[profile] threaded {}: {}\n", stages, why_not);
+    }
+    if (fused) {
+        state.last_exit_code = run_fused_pipeline(*fused);
+        return state.last_exit_code;
+    }
+    
     int num_pipes = static_cast<int>(commands.size()) - 1;
     std::vector<ScopedHandle> pipe_read(num_pipes);
     std::vector<ScopedHandle> pipe_write(num_pipes);
+    std::vector<std::unique_ptr<RecordChannel>> channels(num_pipes);
     
-    SECURITY_ATTRIBUTES sa = { sizeof(sa), nullptr, TRUE };
+    std::vector<const Builtin*> stage_builtins(commands.size(), nullptr);
+    for (size_t i = 0; i < commands.size(); ++i) {
+        for (const auto& builtin : builtins) {
+            if (commands[i].args[0] == builtin.name) {
+                stage_builtins[i] = &builtin;
+                break;
+            }
+        }
+        // Stages run side by side and only read ShellState
+        if (stage_builtins[i] && (stage_builtins[i]->flags & CHANGES_STATE)) {
+            const Theme theme;
+            ColorGuard guard(theme.error_color);
+            std::cerr << std::format("jshell: {}: changes shell state, so it cannot run in a pipeline\n",
+                                     commands[i].args[0]);
+            state.last_exit_code = 1;
+            return 1;
+        }
+    }
 
     for (int i = 0; i < num_pipes; ++i) {
+        // Two record builtins in a row pass records; every other boundary is a pipe
+        if (stage_builtins[i] && stage_builtins[i + 1] && (stage_builtins[i]->flags & RECORDS_OUT) &&
+            (stage_builtins[i + 1]->flags & RECORDS_IN)) {
+            channels[i] = std::make_unique<RecordChannel>();
+            continue;
+        }
+        
         HANDLE read_handle, write_handle;
-        if (!CreatePipe(&read_handle, &write_handle, &sa, MAX_PIPE_BUFFER)) {
+        if (!CreatePipe(&read_handle, &write_handle, nullptr, static_cast<DWORD>(state.config.pipe_buffer_size))) {
             const Theme theme;
             ColorGuard guard(theme.error_color);
             std::cerr << "jshell: CreatePipe failed\n";
@@ -2922,30 +8300,58 @@ int execute(ShellState& state, std::vector<Command>& commands) {
 
     std::vector<std::thread> threads;
     std::vector<int> exit_codes(commands.size());
-    std::mutex mtx;
+    std::vector<StageProcess> processes(commands.size());
+    
+    // Once a stage exits, nothing upstream of it has a reader any more.
+    // Builtins notice through downstream_closed() and most programs fail
+    // their next write; with terminate_upstream set, external stages that
+    // keep running are ended too.
+    auto stage_done = [&](size_t i) {
+        if (i > 0) pipe_read[i - 1].reset();
+        if (!state.config.terminate_upstream) return;
+        for (size_t j = 0; j < i; ++j) processes[j].terminate();
+    };
 
+    WORD pipeline_color = console_output.color();
     for (size_t i = 0; i < commands.size(); ++i) {
         threads.emplace_back([&, i]() {
+            pipeline_stage = true;
+            thread_color = pipeline_color;
             HANDLE hInput = (i == 0) ? INVALID_HANDLE_VALUE : pipe_read[i - 1].get();
             HANDLE hOutput = (i == commands.size() - 1) ? INVALID_HANDLE_VALUE : pipe_write[i].get();
             
-            bool is_builtin = false;
-            for (const auto& builtin : builtins) {
-                if (commands[i].args[0] == builtin.name) {
-                    is_builtin = true;
-                    // Note: Builtin redirection in pipelines is complex and not fully supported here.
-                    std::vector<const char*> c_args;
-                    for (const auto& s : commands[i].args) c_args.push_back(s.c_str());
-                    
-                    std::lock_guard<std::mutex> lock(mtx);
-                    exit_codes[i] = builtin.func(state, c_args);
-                    break;
+            // Builtin stages run side by side, each with its own ends of the pipeline
+            if (const Builtin* builtin = stage_builtins[i]) {
+                // Note: Builtin redirection in pipelines is complex and not fully supported here.
+                std::vector<const char*> c_args;
+                for (const auto& s : commands[i].args) c_args.push_back(s.c_str());
+                
+                ConsoleWriter pipe_output;
+                if (hOutput != INVALID_HANDLE_VALUE) {
+                    pipe_output.attach(hOutput);
+                    builtin_stdout = &pipe_output;
                 }
+                builtin_stdin = hInput;
+                record_input = i > 0 ? channels[i - 1].get() : nullptr;
+                record_output = i < channels.size() ? channels[i].get() : nullptr;
+                
+                bool paged = i + 1 == commands.size() && use_auto_pager(state, *builtin);
+                exit_codes[i] = paged ? run_auto_paged(state, *builtin, c_args) : builtin->func(state, c_args);
+                
+                std::cout.flush();
+                builtin_stdout = nullptr;
+                builtin_stdin = INVALID_HANDLE_VALUE;
+                if (record_output) record_output->close();
+                if (record_input) record_input->abandon();  // Unblock a producer the builtin stopped reading
+                record_input = record_output = nullptr;
+                if (i < pipe_write.size()) pipe_write[i].reset();  // Let the next stage see end of input
+            } else if (i + 1 == commands.size() && capture_external(state, commands[i])) {
+                exit_codes[i] = launch_captured(commands[i], hInput, state, &processes[i]);
+            } else {
+                exit_codes[i] = launch_process(commands[i], hInput, hOutput, INVALID_HANDLE_VALUE, nullptr, true, &processes[i]);
+                if (i < pipe_write.size()) pipe_write[i].reset();  // Let the next stage see end of input
             }
-
-            if (!is_builtin) {
-                exit_codes[i] = launch_process(commands[i], hInput, hOutput, INVALID_HANDLE_VALUE, nullptr);
-            }
+            stage_done(i);
         });
     }
 
@@ -2953,19 +8359,476 @@ int execute(ShellState& state, std::vector<Command>& commands) {
         if (t.joinable()) t.join();
     }
     
-    state.last_exit_code = exit_codes.back();
-    return state.last_exit_code;
+    state.last_exit_code = exit_codes.back();
+    return state.last_exit_code;
+}
+
+// --- Registered Command Cache ---
+// Commands registered with --cache are keyed by their expanded stages, the
+// working directory and the content hashes of their input files. A hit
+// restores the declared outputs and replays stdout instead of running the
+// command. Everything lives under <shell_directory>/cache: blobs/<hash> holds
+// file contents by hash and entries/<key> is the manifest of one invocation.
+// Keys and blob names are SHA-256 digests, since a replayed collision would
+// restore the wrong files without a word.
+
+// SHA-256 through BCrypt; hex() is empty if the provider failed
+class Sha256 {
+private:
+    BCRYPT_ALG_HANDLE alg_ = nullptr;
+    BCRYPT_HASH_HANDLE hash_ = nullptr;
+    bool ok_ = false;
+    
+public:
+    Sha256() {
+        ok_ = BCRYPT_SUCCESS(BCryptOpenAlgorithmProvider(&alg_, BCRYPT_SHA256_ALGORITHM, nullptr, 0)) &&
+              BCRYPT_SUCCESS(BCryptCreateHash(alg_, &hash_, nullptr, 0, nullptr, 0, 0));
+    }
+    Sha256(const Sha256&) = delete;
+    Sha256& operator=(const Sha256&) = delete;
+    
+    ~Sha256() {
+        if (hash_) BCryptDestroyHash(hash_);
+        if (alg_) BCryptCloseAlgorithmProvider(alg_, 0);
+    }
+    
+    void update(const void* data, size_t size) {
+        const auto* bytes = static_cast<const unsigned char*>(data);
+        while (ok_ && size > 0) {
+            ULONG chunk = static_cast<ULONG>(std::min<size_t>(size, 1u << 30));
+            ok_ = BCRYPT_SUCCESS(BCryptHashData(hash_, const_cast<PUCHAR>(bytes), chunk, 0));
+            bytes += chunk;
+            size -= chunk;
+        }
+    }
+    void update(std::string_view data) { update(data.data(), data.size()); }
+    
+    std::string hex() {
+        unsigned char digest[32];
+        if (!ok_ || !BCRYPT_SUCCESS(BCryptFinishHash(hash_, digest, sizeof(digest), 0))) return {};
+        ok_ = false;  // A finished hash takes no more data
+        std::string out;
+        for (unsigned char byte : digest) out += std::format("{:02x}", byte);
+        return out;
+    }
+};
+
+std::string sha256_hex(std::string_view data) {
+    Sha256 hash;
+    hash.update(data);
+    return hash.hex();
+}
+
+bool hash_file_contents(const fs::path& path, std::string& hash) {
+    MappedFile file;
+    if (!file.open(path.string())) return false;
+    hash = sha256_hex(file.view());
+    return !hash.empty();
+}
+
+bool store_blob(const fs::path& blob_dir, std::string_view data, std::string& hash) {
+    hash = sha256_hex(data);
+    if (hash.empty()) return false;
+    fs::path blob_path = blob_dir / hash;
+    return fs::exists(blob_path) || replace_file_atomically(blob_path, data);
+}
+
+// Restore outputs and replay stdout of a cached invocation; false on a miss
+bool replay_cache_entry(const fs::path& entry_path, const fs::path& blob_dir) {
+    std::ifstream manifest(entry_path);
+    if (!manifest) return false;
+    
+    std::string stdout_blob;
+    std::vector<std::pair<std::string, std::string>> outputs;  // blob, path
+    std::string line;
+    
+    while (std::getline(manifest, line)) {
+        if (line.starts_with("stdout ")) {
+            stdout_blob = line.substr(7);
+        } else if (line.starts_with("output ") && line.length() > 72) {
+            outputs.emplace_back(line.substr(7, 64), line.substr(72));
+        }
+    }
+    
+    if (stdout_blob.empty() || !fs::exists(blob_dir / stdout_blob)) return false;
+    for (const auto& [blob, path] : outputs) {
+        if (!fs::exists(blob_dir / blob)) return false;
+    }
+    
+    for (const auto& [blob, path] : outputs) {
+        std::string current;
+        if (hash_file_contents(path, current) && current == blob) continue;
+        fs::copy_file(blob_dir / blob, path, fs::copy_options::overwrite_existing);
+    }
+    
+    std::ifstream replay(blob_dir / stdout_blob, std::ios::binary);
+    std::cout << replay.rdbuf();
+    return true;
+}
+
+void store_cache_entry(const fs::path& entry_path, const fs::path& blob_dir, std::string_view stdout_data,
+                       const std::vector<std::string>& outputs) {
+    std::string manifest = "jshell-cache 2\n";
+    std::string hash;
+    
+    if (!store_blob(blob_dir, stdout_data, hash)) return;
+    manifest += std::format("stdout {}\n", hash);
+    
+    for (const auto& output : outputs) {
+        MappedFile file;
+        if (!file.open(output) || !store_blob(blob_dir, file.view(), hash)) return;
+        manifest += std::format("output {} {}\n", hash, output);
+    }
+    
+    replace_file_atomically(entry_path, manifest);
+}
+
+// Run a single-stage invocation of a --cache registered command.
+// Returns nothing when the command is not cached, so the caller runs it normally.
+std::optional<int> run_cached_command(ShellState& state, const Command& command) {
+    sync_registered_commands(state);
+    auto it = state.registered_commands.find(command.args[0]);
+    if (it == state.registered_commands.end() || !it->second.cache || command.background) {
+        return std::nullopt;
+    }
+    
+    // A copy, since expanding the stages below re-syncs the map
+    const RegisteredCommand reg_cmd = it->second;
+    std::vector<std::string> cmd_args(command.args.begin() + 1, command.args.end());
+    TemplateArgs targs = split_template_args(reg_cmd, cmd_args);
+    
+    auto expanded = expand_registered_command(reg_cmd, targs, state);
+    if (expanded.empty()) return 0;
+    apply_user_redirections(expanded, command);
+    
+    // Aliases and registered commands the template calls run as they would
+    // uncached, and the key covers what they expand to. As in execute, only a
+    // single-stage expansion is expanded further.
+    expand_aliases(state, expanded);
+    if (expanded.size() == 1) {
+        expand_registered_stages(state, expanded, reg_cmd.name);
+        if (expanded.empty() || expanded[0].args.empty()) return 0;
+    }
+    
+    auto resolve = [&](const std::vector<TemplateToken>& tokens) {
+        std::vector<std::string> files;
+        for (const auto& token : tokens) {
+            std::string file;
+            append_template_token(file, token, reg_cmd, targs, state);
+            if (!file.empty()) files.push_back(std::move(file));
+        }
+        return files;
+    };
+    std::vector<std::string> inputs = resolve(reg_cmd.cache_inputs);
+    std::vector<std::string> outputs = resolve(reg_cmd.cache_outputs);
+    
+    if (reg_cmd.cache_inputs.empty()) {
+        // Without declared inputs, every argument naming an existing file is one
+        for (const auto& cmd : expanded) {
+            for (size_t i = 1; i < cmd.args.size(); ++i) {
+                const std::string& arg = cmd.args[i];
+                std::error_code ec;
+                if (std::find(outputs.begin(), outputs.end(), arg) == outputs.end() &&
+                    fs::is_regular_file(arg, ec)) {
+                    inputs.push_back(arg);
+                }
+            }
+        }
+    }
+    
+    // Key: working directory, every expanded stage and the input contents
+    std::string key_text = fs::current_path().string();
+    for (const auto& cmd : expanded) {
+        key_text += '\n';
+        for (const auto& arg : cmd.args) {
+            key_text += arg;
+            key_text += '\0';
+        }
+        key_text += std::format("<{}>{}{}2>{}{}", cmd.input_file, cmd.append_output ? ">>" : ">",
+                                cmd.output_file, cmd.append_error ? ">" : "", cmd.error_file);
+    }
+    Sha256 key_hash;
+    key_hash.update(key_text);
+    for (const auto& input : inputs) {
+        std::string content;
+        if (!hash_file_contents(input, content)) return run_pipeline(state, expanded);
+        key_hash.update(input.data(), input.size() + 1);
+        key_hash.update(content);
+    }
+    std::string key = key_hash.hex();
+    if (key.empty()) return run_pipeline(state, expanded);
+    
+    fs::path cache_dir = state.shell_directory / "cache";
+    fs::path blob_dir = cache_dir / "blobs";
+    fs::path entry_path = cache_dir / "entries" / key;
+    
+    try {
+        if (replay_cache_entry(entry_path, blob_dir)) {
+            const Theme theme;
+            ColorGuard guard(theme.success_color);
+            std::cerr << std::format("jshell: {}: up to date (cached)\n", reg_cmd.name);
+            state.last_exit_code = 0;
+            return 0;
+        }
+        fs::create_directories(blob_dir);
+        fs::create_directories(cache_dir / "entries");
+    } catch (const fs::filesystem_error&) {
+        return run_pipeline(state, expanded);
+    }
+    
+    // Miss: run with stdout captured. External stages write to a capture
+    // file, builtin stages to an in-memory stream.
+    fs::path capture_path = cache_dir / std::format("capture-{}.out", GetCurrentProcessId());
+    Command& last = expanded.back();
+    bool capture_file = last.output_file.empty();
+    if (capture_file) last.output_file = capture_path.string();
+    
+    int result;
+    std::string stdout_data;
+    {
+        OutputCapture capture;
+        result = run_pipeline(state, expanded);
+        stdout_data = capture.str();
+    }
+    
+    if (capture_file) {
+        std::ifstream captured(capture_path, std::ios::binary);
+        stdout_data.append(std::istreambuf_iterator<char>(captured), std::istreambuf_iterator<char>());
+        captured.close();
+        DeleteFileA(capture_path.string().c_str());
+    }
+    std::cout << stdout_data;
+    
+    if (result == 0) {
+        try {
+            store_cache_entry(entry_path, blob_dir, stdout_data, outputs);
+        } catch (const fs::filesystem_error&) {
+            // A failed store only costs a rebuild next time
+        }
+    }
+    return result;
+}
+
+// --- Registered Command Fan-Out ---
+// A template using {each} runs once per positional argument, with wildcard
+// arguments expanded to the matching files. Invocations run on a bounded
+// worker pool; the stdout of each one is captured and printed in argument
+// order, while stderr stays live. With 2> the stderr of each one is captured
+// too and written to the file in the same order. The first failing exit code
+// is returned.
+
+struct FanOutResult {
+    std::string output;
+    std::string errors;  // Only when stderr is redirected
+    int exit_code = 0;
+    bool done = false;
+};
+
+std::optional<int> run_fan_out_command(ShellState& state, const Command& command) {
+    sync_registered_commands(state);
+    auto it = state.registered_commands.find(command.args[0]);
+    if (it == state.registered_commands.end() || !it->second.fan_out) {
+        return std::nullopt;
+    }
+    
+    // A copy, since expanding the invocations below re-syncs the map
+    const RegisteredCommand reg_cmd = it->second;
+    std::vector<std::string> cmd_args(command.args.begin() + 1, command.args.end());
+    TemplateArgs targs = split_template_args(reg_cmd, cmd_args);
+    if (targs.positional.empty()) {
+        const Theme theme;
+        ColorGuard guard(theme.error_color);
+        std::cerr << std::format("jshell: Usage: {} <argument|wildcard>...  (runs once per argument)\n", reg_cmd.name);
+        return 1;
+    }
+    
+    std::vector<std::string> items;
+    for (const auto* arg : targs.positional) {
+        auto matches = expand_wildcards(*arg);
+        if (matches.empty()) {
+            const Theme theme;
+            ColorGuard guard(theme.warning_color);
+            std::cerr << std::format("jshell: {}: No files match '{}'\n", reg_cmd.name, *arg);
+        }
+        items.insert(items.end(), std::make_move_iterator(matches.begin()), std::make_move_iterator(matches.end()));
+    }
+    if (items.empty()) return 1;
+    
+    // Expansion reads shell variables and the command map, so it happens
+    // before any worker starts. Aliases and registered commands the template
+    // calls are expanded as in run_cached_command.
+    std::vector<std::vector<Command>> invocations(items.size());
+    for (size_t i = 0; i < items.size(); ++i) {
+        targs.each = &items[i];
+        invocations[i] = expand_registered_command(reg_cmd, targs, state);
+        expand_aliases(state, invocations[i]);
+        if (invocations[i].size() == 1) expand_registered_stages(state, invocations[i], reg_cmd.name);
+        if (!invocations[i].empty() && invocations[i][0].args.empty()) invocations[i].clear();
+        if (!invocations[i].empty() && !command.input_file.empty()) {
+            invocations[i].front().input_file = command.input_file;
+        }
+    }
+    
+    fs::path capture_dir;
+    try {
+        capture_dir = fs::temp_directory_path();
+    } catch (const fs::filesystem_error&) {
+        capture_dir = state.shell_directory;
+    }
+    
+    std::vector<FanOutResult> results(items.size());
+    std::mutex results_mutex;
+    std::condition_variable result_ready;
+    std::mutex output_mutex;  // Held while std::cout is captured or written
+    std::atomic<size_t> next_item{0};
+    
+    auto run_invocation = [&](size_t i) {
+        std::vector<Command>& stages = invocations[i];
+        FanOutResult result;
+        if (stages.empty()) return result;
+        
+        fs::path capture_path = capture_dir / std::format("jshell-fanout-{}-{}.out", GetCurrentProcessId(), i);
+        fs::path error_path = capture_dir / std::format("jshell-fanout-{}-{}.err", GetCurrentProcessId(), i);
+        Command& last = stages.back();
+        bool capture_file = last.output_file.empty();
+        if (capture_file) last.output_file = capture_path.string();
+        bool capture_errors = !command.error_file.empty();
+        if (capture_errors) {
+            last.error_file = error_path.string();
+            last.append_error = false;
+        }
+        
+        bool builtin_stage = std::any_of(stages.begin(), stages.end(), [](const Command& cmd) {
+            return std::any_of(std::begin(builtins), std::end(builtins),
+                               [&](const Builtin& b) { return cmd.args[0] == b.name; });
+        });
+        
+        if (stages.size() == 1 && !builtin_stage) {
+            result.exit_code = launch_process(stages[0], INVALID_HANDLE_VALUE, INVALID_HANDLE_VALUE, INVALID_HANDLE_VALUE);
+        } else {
+            // Builtins write to the shared std::cout, so they run one at a time
+            std::lock_guard<std::mutex> lock(output_mutex);
+            OutputCapture capture;
+            result.exit_code = run_pipeline(state, stages);
+            result.output = capture.str();
+        }
+        
+        auto take_capture = [](const fs::path& path, std::string& into) {
+            std::ifstream captured(path, std::ios::binary);
+            into.append(std::istreambuf_iterator<char>(captured), std::istreambuf_iterator<char>());
+            captured.close();
+            DeleteFileA(path.string().c_str());
+        };
+        if (capture_file) take_capture(capture_path, result.output);
+        if (capture_errors) take_capture(error_path, result.errors);
+        return result;
+    };
+    
+    size_t worker_count = std::min(effective_workers(state.config), items.size());
+    
+    std::vector<std::thread> workers;
+    for (size_t w = 0; w < worker_count; ++w) {
+        workers.emplace_back([&]() {
+            for (size_t i = next_item++; i < items.size(); i = next_item++) {
+                FanOutResult result = run_invocation(i);
+                result.done = true;
+                std::lock_guard<std::mutex> lock(results_mutex);
+                results[i] = std::move(result);
+                result_ready.notify_all();
+            }
+        });
+    }
+    
+    // Print each invocation's output as soon as everything before it is done
+    std::ofstream redirected, redirected_errors;
+    if (!command.output_file.empty()) {
+        redirected.open(command.output_file, std::ios::binary | (command.append_output ? std::ios::app : std::ios::trunc));
+    }
+    if (!command.error_file.empty()) {
+        redirected_errors.open(command.error_file, std::ios::binary | (command.append_error ? std::ios::app : std::ios::trunc));
+    }
+    std::vector<size_t> failed;
+    
+    for (size_t i = 0; i < items.size(); ++i) {
+        std::string output, errors;
+        {
+            std::unique_lock<std::mutex> lock(results_mutex);
+            result_ready.wait(lock, [&]() { return results[i].done; });
+            output = std::move(results[i].output);
+            errors = std::move(results[i].errors);
+        }
+        if (results[i].exit_code != 0) failed.push_back(i);
+        if (redirected_errors.is_open()) redirected_errors << errors;
+        
+        std::lock_guard<std::mutex> lock(output_mutex);
+        if (redirected.is_open()) {
+            redirected << output;
+        } else {
+            std::cout << output << std::flush;
+        }
+    }
+    
+    for (auto& worker : workers) {
+        if (worker.joinable()) worker.join();
+    }
+    
+    if (failed.empty()) {
+        state.last_exit_code = 0;
+        return 0;
+    }
+    
+    const Theme theme;
+    ColorGuard guard(theme.error_color);
+    std::cerr << std::format("jshell: {}: {} of {} invocations failed\n", reg_cmd.name, failed.size(), items.size());
+    for (size_t i : failed) {
+        std::cerr << std::format("  {} (exit {})\n", items[i], results[i].exit_code);
+    }
+    state.last_exit_code = results[failed.front()].exit_code;
+    return state.last_exit_code;
+}
+
+int execute(ShellState& state, std::vector<Command>& commands) {
+    if (commands.empty() || commands[0].args.empty()) {
+        return 0;
+    }
+
+    // Handle aliases first
+    expand_aliases(state, commands);
+    if (commands.empty() || commands[0].args.empty()) {
+        return 0;
+    }
+    
+    // Fan-out and memoized registered commands run through their own paths
+    if (commands.size() == 1) {
+        if (auto fanned = run_fan_out_command(state, commands[0])) {
+            state.last_exit_code = *fanned;
+            return *fanned;
+        }
+        if (auto cached = run_cached_command(state, commands[0])) {
+            state.last_exit_code = *cached;
+            return *cached;
+        }
+    }
+    
+    // Handle registered commands
+    expand_registered_stages(state, commands);
+    if (commands.empty() || commands[0].args.empty()) {
+        return 0;
+    }
+    
+    return run_pipeline(state, commands);
 }
 
-void load_config(ShellState& state) {
-    fs::path config_path = state.shell_directory / "config.ini";
-    
-    if (!fs::exists(config_path)) return;
-    
+// Read config.ini over the defaults; a missing file yields the defaults
+// Invalid values keep their default and are reported with their line number.
+Configuration read_config(const fs::path& config_path) {
+    Configuration config;
     std::ifstream file(config_path);
     std::string line;
+    size_t line_number = 0;
     
     while (std::getline(file, line)) {
+        line_number++;
         if (line.empty() || line.starts_with('#')) continue;
         
         auto eq_pos = line.find('=');
@@ -2974,57 +8837,106 @@ void load_config(ShellState& state) {
         std::string key = line.substr(0, eq_pos);
         std::string value = line.substr(eq_pos + 1);
         
-        if (key == "prompt_format") state.config.prompt_format = value;
-        else if (key == "enable_colors") state.config.enable_colors = (value == "true" || value == "1");
-        else if (key == "auto_complete") state.config.auto_complete = (value == "true" || value == "1");
-        else if (key == "save_history") state.config.save_history = (value == "true" || value == "1");
-        else if (key == "max_history") { try { state.config.max_history = std::stoul(value); } catch (...) {} }
+        auto option = std::find_if(config_options.begin(), config_options.end(),
+                                   [&](const ConfigOption& o) { return key == o.key; });
+        std::string error = option == config_options.end() ? "unknown key" : option->parse(config, value);
+        if (!error.empty()) {
+            const Theme theme;
+            ColorGuard guard(theme.warning_color);
+            std::cerr << std::format("jshell: config.ini:{}: {}: {}\n", line_number, key, error);
+        }
     }
+    
+    return config;
 }
 
-void initialize_shell(ShellState& state) {
-    load_config(state);
-    load_history(state);
-    load_registered_commands(state);
-    
-    // Register some useful default commands
-    state.registered_commands["cpp"] = RegisteredCommand("cpp", 
-        "g++ -std=c++20 -Wall -Wextra {0} -o {1}", 
-        "Compile C++ file with modern standards");
-    
-    state.registered_commands["cpprun"] = RegisteredCommand("cpprun", 
-        "g++ -std=c++20 -Wall -Wextra {0} -o temp_exe && temp_exe && del temp_exe.exe", 
-        "Compile and run C++ file");
-    
-    state.registered_commands["py"] = RegisteredCommand("py", 
-        "python {0}", 
-        "Run Python script");
-    
-    state.registered_commands["node"] = RegisteredCommand("node", 
-        "node {0}", 
-        "Run Node.js script");
+void load_config(ShellState& state) {
+    fs::path config_path = state.shell_directory / "config.ini";
+    get_file_stamp(config_path, state.config_size, state.config_mtime);
+    state.config = read_config(config_path);
+    command_hash.set_ttl(std::chrono::seconds(state.config.command_hash_ttl));
+    console_output.set_colors(state.config.enable_colors);
+}
+
+// Switch to a reloaded configuration, rebuilding only what the changed keys affect
+void apply_config(ShellState& state, const Configuration& next) {
+    Configuration& current = state.config;
+    std::vector<std::string_view> changed;
     
-    state.registered_commands["backup"] = RegisteredCommand("backup", 
-        "cp {0} {0}.bak", 
-        "Create backup of file");
+    for (const auto& option : config_options) {
+        if (option.print(current) != option.print(next)) changed.push_back(option.key);
+    }
     
-    state.registered_commands["restore"] = RegisteredCommand("restore", 
-        "cp {0}.bak {0}", 
-        "Restore file from backup");
+    if (next.max_history != current.max_history) {
+        if (state.history.size() > next.max_history) {
+            state.history.erase(state.history.begin(), state.history.end() - next.max_history);
+        }
+        state.history_index = state.history.size();
+    }
+    if (next.command_hash_ttl != current.command_hash_ttl) {
+        command_hash.set_ttl(std::chrono::seconds(next.command_hash_ttl));
+    }
+    if (next.enable_colors != current.enable_colors) {
+        console_output.set_colors(next.enable_colors);
+    }
+    if (next.command_hash_ttl != current.command_hash_ttl ||
+        next.completion_cache_size != current.completion_cache_size) {
+        state.completion_cache.clear();
+    }
     
-    state.registered_commands["mkexe"] = RegisteredCommand("mkexe", 
-        "chmod +x {0}", 
-        "Make file executable");
+    current = next;
+    if (changed.empty()) return;
     
-    state.registered_commands["webget"] = RegisteredCommand("webget", 
-        "curl -O {0}", 
-        "Download file from URL");
+    std::string keys;
+    for (auto key : changed) {
+        if (!keys.empty()) keys += ", ";
+        keys += key;
+    }
+    const Theme theme;
+    ColorGuard guard(theme.success_color);
+    std::cout << std::format("jshell: config.ini reloaded ({})\n", keys);
+}
+
+// Called between prompts. The notification fires for any file in
+// shell_directory (history, command log, ...), so the stamps of config.ini
+// and .jshellrc decide what is actually reloaded.
+void poll_config_changes(ShellState& state) {
+    if (state.config_watch == INVALID_HANDLE_VALUE ||
+        WaitForSingleObject(state.config_watch, 0) != WAIT_OBJECT_0) {
+        return;
+    }
+    FindNextChangeNotification(state.config_watch);
     
-    state.registered_commands["extract"] = RegisteredCommand("extract", 
-        "tar -xzf {0}", 
-        "Extract tar.gz archive");
+    uint64_t size = 0, mtime = 0;
+    fs::path config_path = state.shell_directory / "config.ini";
+    get_file_stamp(config_path, size, mtime);
+    if (size != state.config_size || mtime != state.config_mtime) {
+        state.config_size = size;
+        state.config_mtime = mtime;
+        apply_config(state, read_config(config_path));
+    }
     
     fs::path rc_file = state.shell_directory / ".jshellrc";
+    if (get_file_stamp(rc_file, size, mtime) && (size != state.rc_size || mtime != state.rc_mtime)) {
+        state.rc_size = size;
+        state.rc_mtime = mtime;
+        std::string rc_path = rc_file.string();
+        std::vector<const char*> source_args = {"source", rc_path.c_str()};
+        source(state, source_args);
+        
+        const Theme theme;
+        ColorGuard guard(theme.success_color);
+        std::cout << "jshell: .jshellrc reloaded\n";
+    }
+}
+
+void initialize_shell(ShellState& state) {
+    load_config(state);
+    load_history(state);
+    fs::path rc_file = state.shell_directory / ".jshellrc";
+    get_file_stamp(rc_file, state.rc_size, state.rc_mtime);
+    state.config_watch = FindFirstChangeNotificationA(state.shell_directory.string().c_str(), FALSE,
+                                                      FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_LAST_WRITE);
     if (fs::exists(rc_file)) {
         std::vector<const char*> source_args = {"source", rc_file.string().c_str()};
         source(state, source_args);
@@ -3058,7 +8970,7 @@ void shell_loop() {
                                
 )" << '\n';
         
-        SetConsoleTextAttribute(GetStdHandle(STD_OUTPUT_HANDLE), theme.default_color);
+        console_output.set_color(theme.default_color);
         std::cout << "        Enhanced C++ Shell for Windows v2.0\n";
         std::cout << "    Built with caffeine & C++ by Camresh - CNJMTechnologies INC\n";
         
@@ -3081,12 +8993,29 @@ void shell_loop() {
 
     while (state.running) {
         try {
+            poll_config_changes(state);
             std::string line = read_line(state);
             if (line.empty()) continue;
             
+            auto start = std::chrono::steady_clock::now();
             auto commands = parse_pipeline(line, state);
             if (!commands.empty()) {
+                // `out` reads the history; recording it would shift what -N means
+                output_history.set_capacity(state.config.output_history_size);
+                if (commands[0].args.empty() || commands[0].args[0] != "out") output_history.begin(line);
+                session_log.configure(state.config.transcript, state.shell_directory / TRANSCRIPT_FILE,
+                                      state.config.transcript_max_size, state.config.transcript_files);
+                session_log.command_started(line);
                 execute(state, commands);
+                output_history.end();
+                session_log.command_finished(state.last_exit_code);
+            }
+            
+            if (state.config.profile) {
+                std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+                const Theme theme;
+                ColorGuard guard(theme.warning_color);
+                std::cerr << std::format("[profile] {:.2f} ms, exit {}\n", elapsed.count(), state.last_exit_code);
             }
         } catch (const std::exception& e) {
             if (state.config.enable_colors) {
@@ -3095,10 +9024,655 @@ void shell_loop() {
             } else {
                 std::cerr << std::format("jshell: Error: {}\n", e.what());
             }
+            output_history.end();
+            session_log.command_finished(1);
         }
     }
     
     save_history(state);
+    session_log.stop();
+}
+
+// --- Server Mode ---
+// jshell --server keeps one initialized shell (config, rc files, registered
+// commands, PATH lookups) waiting on a named pipe; jshell --client runs a
+// command in it. The client sends its arguments, working directory and
+// environment, then both sides exchange frames of [u8 kind][u32 size][data]:
+// 'i' carries the client's stdin (size 0 is end of input), 'o' and 'e' the
+// command's stdout and stderr, and 'x' its exit code, which ends the call.
+// Clients are served one at a time, since the working directory, environment
+// and standard handles belong to the whole process; others wait for the pipe.
+// Only the user running the server may open the pipe, and a client sends
+// nothing until it has checked that the server runs as its own user.
+constexpr std::string_view SERVER_REQUEST_MAGIC = "JSR1";
+
+struct ServerRequest {
+    std::string cwd;
+    std::vector<std::string> args;         // -c <command line>, or a script and its arguments
+    std::vector<std::string> environment;  // NAME=VALUE
+    bool forward_input = false;            // 'i' frames follow
+};
+
+// \\.\pipe\jshell-<user>, or JSHELL_SERVER_PIPE
+std::string server_pipe_name() {
+    char* value = nullptr;
+    size_t len;
+    std::string name;
+    if (_dupenv_s(&value, &len, "JSHELL_SERVER_PIPE") == 0 && value) {
+        name = value;
+        free(value);
+        return name;
+    }
+    if (_dupenv_s(&value, &len, "USERNAME") == 0 && value) {
+        name = value;
+        free(value);
+    }
+    return "\\\\.\\pipe\\jshell-" + name;
+}
+
+// The TOKEN_USER of a process, which holds the SID of the user it runs as
+std::optional<std::vector<BYTE>> process_token_user(HANDLE process) {
+    HANDLE token_handle = nullptr;
+    if (!OpenProcessToken(process, TOKEN_QUERY, &token_handle)) return std::nullopt;
+    ScopedHandle token(token_handle);
+    DWORD size = 0;
+    GetTokenInformation(token.get(), TokenUser, nullptr, 0, &size);
+    std::vector<BYTE> buffer(size);
+    if (size == 0 || !GetTokenInformation(token.get(), TokenUser, buffer.data(), size, &size)) return std::nullopt;
+    return buffer;
+}
+
+PSID token_user_sid(std::vector<BYTE>& token_user) {
+    return reinterpret_cast<TOKEN_USER*>(token_user.data())->User.Sid;
+}
+
+// Security attributes whose DACL grants the current user full access and
+// nobody else any, rather than the default DACL of the process token
+class CurrentUserSecurity {
+private:
+    std::vector<BYTE> user_;
+    std::vector<BYTE> acl_;
+    SECURITY_DESCRIPTOR descriptor_ = {};
+    SECURITY_ATTRIBUTES attributes_ = {};
+    
+public:
+    CurrentUserSecurity() = default;
+    CurrentUserSecurity(const CurrentUserSecurity&) = delete;
+    CurrentUserSecurity& operator=(const CurrentUserSecurity&) = delete;
+    
+    bool build() {
+        auto user = process_token_user(GetCurrentProcess());
+        if (!user) return false;
+        user_ = std::move(*user);
+        PSID sid = token_user_sid(user_);
+        acl_.resize(sizeof(ACL) + sizeof(ACCESS_ALLOWED_ACE) + GetLengthSid(sid));
+        PACL acl = reinterpret_cast<PACL>(acl_.data());
+        if (!InitializeAcl(acl, static_cast<DWORD>(acl_.size()), ACL_REVISION) ||
+            !AddAccessAllowedAce(acl, ACL_REVISION, GENERIC_ALL, sid) ||
+            !InitializeSecurityDescriptor(&descriptor_, SECURITY_DESCRIPTOR_REVISION) ||
+            !SetSecurityDescriptorDacl(&descriptor_, TRUE, acl, FALSE)) {
+            return false;
+        }
+        attributes_ = {sizeof(attributes_), &descriptor_, FALSE};
+        return true;
+    }
+    
+    SECURITY_ATTRIBUTES* attributes() { return &attributes_; }
+};
+
+// True when the process serving the pipe runs as the same user as this one.
+// Anyone may create a pipe under our name before our server does, and such a
+// server would receive the command, the environment and stdin.
+bool server_is_current_user(HANDLE pipe) {
+    ULONG server_id = 0;
+    if (!GetNamedPipeServerProcessId(pipe, &server_id)) return false;
+    ScopedHandle server(OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, server_id));
+    if (!server) return false;
+    auto server_user = process_token_user(server.get());
+    auto own_user = process_token_user(GetCurrentProcess());
+    return server_user && own_user && EqualSid(token_user_sid(*server_user), token_user_sid(*own_user));
+}
+
+bool write_all(HANDLE handle, std::string_view data) {
+    while (!data.empty()) {
+        DWORD written = 0;
+        if (!WriteFile(handle, data.data(), static_cast<DWORD>(data.size()), &written, nullptr) || written == 0) return false;
+        data.remove_prefix(written);
+    }
+    return true;
+}
+
+// Both ends open the pipe for overlapped I/O: on a synchronous handle every
+// call waits for the one before, so a read waiting for stdin frames would
+// hold up the output frames. Each call is still waited for here.
+DWORD pipe_transfer(HANDLE pipe, bool write, char* data, size_t size) {
+    thread_local ScopedHandle event(CreateEventA(nullptr, TRUE, FALSE, nullptr));
+    OVERLAPPED overlapped = {};
+    overlapped.hEvent = event.get();
+    DWORD count = static_cast<DWORD>(std::min<size_t>(size, 1 << 20));
+    BOOL done = write ? WriteFile(pipe, data, count, nullptr, &overlapped) : ReadFile(pipe, data, count, nullptr, &overlapped);
+    DWORD transferred = 0;
+    if ((done || GetLastError() == ERROR_IO_PENDING) && GetOverlappedResult(pipe, &overlapped, &transferred, TRUE)) {
+        return transferred;
+    }
+    return 0;
+}
+
+bool write_frame(HANDLE pipe, char kind, std::string_view data) {
+    std::string frame(1, kind);
+    append_u32(frame, static_cast<uint32_t>(data.size()));
+    frame += data;
+    for (size_t done = 0; done < frame.size();) {
+        DWORD written = pipe_transfer(pipe, true, frame.data() + done, frame.size() - done);
+        if (written == 0) return false;
+        done += written;
+    }
+    return true;
+}
+
+bool read_frame(HANDLE pipe, char& kind, std::string& data) {
+    auto read_exact = [&](char* into, size_t size) {
+        while (size > 0) {
+            DWORD got = pipe_transfer(pipe, false, into, size);
+            if (got == 0) return false;
+            into += got;
+            size -= got;
+        }
+        return true;
+    };
+    
+    char header[5];
+    if (!read_exact(header, sizeof(header))) return false;
+    kind = header[0];
+    data.resize(read_u32(header + 1));
+    return read_exact(data.data(), data.size());
+}
+
+bool send_request(HANDLE pipe, const ServerRequest& request) {
+    std::string message(SERVER_REQUEST_MAGIC);
+    auto add = [&](const std::string& text) {
+        append_u32(message, static_cast<uint32_t>(text.size()));
+        message += text;
+    };
+    add(request.cwd);
+    append_u32(message, static_cast<uint32_t>(request.args.size()));
+    for (const auto& arg : request.args) add(arg);
+    append_u32(message, static_cast<uint32_t>(request.environment.size()));
+    for (const auto& variable : request.environment) add(variable);
+    message += request.forward_input ? '\1' : '\0';
+    return write_frame(pipe, 'r', message);
+}
+
+std::optional<ServerRequest> receive_request(HANDLE pipe) {
+    char kind;
+    std::string message;
+    if (!read_frame(pipe, kind, message) || kind != 'r' || !message.starts_with(SERVER_REQUEST_MAGIC)) return std::nullopt;
+    
+    size_t pos = SERVER_REQUEST_MAGIC.size();
+    auto get_u32 = [&](uint32_t& value) {
+        if (message.size() - pos < 4) return false;
+        value = read_u32(message.data() + pos);
+        pos += 4;
+        return true;
+    };
+    auto get = [&](std::string& text) {
+        uint32_t size;
+        if (!get_u32(size) || message.size() - pos < size) return false;
+        text.assign(message, pos, size);
+        pos += size;
+        return true;
+    };
+    auto get_list = [&](std::vector<std::string>& list) {
+        uint32_t count;
+        if (!get_u32(count)) return false;
+        list.resize(std::min<size_t>(count, message.size()));
+        for (auto& item : list) {
+            if (!get(item)) return false;
+        }
+        return list.size() == count;
+    };
+    
+    ServerRequest request;
+    if (!get(request.cwd) || !get_list(request.args) || !get_list(request.environment) || pos >= message.size()) {
+        return std::nullopt;
+    }
+    request.forward_input = message[pos] != 0;
+    return request;
+}
+
+// NAME=VALUE strings of this process's environment
+std::vector<std::string> current_environment() {
+    std::vector<std::string> variables;
+    char* block = GetEnvironmentStringsA();
+    if (!block) return variables;
+    for (const char* entry = block; *entry; entry += std::strlen(entry) + 1) {
+        if (*entry != '=') variables.emplace_back(entry);  // =C: and the like are per-drive directories
+    }
+    FreeEnvironmentStringsA(block);
+    return variables;
+}
+
+// Make this process's environment exactly the client's. The shell reads
+// variables through the CRT (_dupenv_s) and children get the Win32 block,
+// so both copies are set; _putenv_s with "" would also remove the Win32
+// variable, hence it goes first.
+void apply_environment(const std::vector<std::string>& variables) {
+    auto value_of = [](const char* name) {
+        char* value = nullptr;
+        size_t len;
+        std::string result;
+        if (_dupenv_s(&value, &len, name) == 0 && value) {
+            result = value;
+            free(value);
+        }
+        return result;
+    };
+    std::string path = value_of("PATH");
+    std::string path_extensions = value_of("PATHEXT");
+    
+    std::map<std::string, std::string> wanted;
+    for (const auto& variable : variables) {
+        size_t eq = variable.find('=');
+        if (eq != std::string::npos && eq > 0) wanted[variable.substr(0, eq)] = variable.substr(eq + 1);
+    }
+    
+    std::vector<std::string> present = current_environment();
+    for (char** entry = _environ; entry && *entry; ++entry) {
+        if (**entry != '=') present.emplace_back(*entry);
+    }
+    for (const auto& variable : present) {
+        std::string name = variable.substr(0, variable.find('='));
+        if (wanted.contains(name)) continue;
+        _putenv_s(name.c_str(), "");
+        SetEnvironmentVariableA(name.c_str(), nullptr);
+    }
+    for (const auto& [name, value] : wanted) {
+        _putenv_s(name.c_str(), value.c_str());
+        SetEnvironmentVariableA(name.c_str(), value.c_str());
+    }
+    // PATH lookups stay warm from call to call while the clients' PATH agrees
+    if (value_of("PATH") != path || value_of("PATHEXT") != path_extensions) command_hash.clear();
+}
+
+// Run what a client's arguments ask for; also how a client without a server runs
+int run_invocation(ShellState& state, const std::vector<std::string>& args) {
+    try {
+        if (args.size() >= 2 && args[0] == "-c") {
+            auto commands = parse_pipeline(args[1], state);
+            if (commands.empty()) return 0;
+            return execute(state, commands);
+        }
+        if (!args.empty()) {
+            std::vector<const char*> source_args = {"source"};
+            for (const auto& arg : args) source_args.push_back(arg.c_str());
+            return source(state, source_args);
+        }
+    } catch (const std::exception& e) {
+        const Theme theme;
+        ColorGuard guard(theme.error_color);
+        std::cerr << std::format("jshell: Error: {}\n", e.what());
+        return 1;
+    }
+    
+    const Theme theme;
+    ColorGuard guard(theme.error_color);
+    std::cerr << "jshell: usage: jshell --client -c <command> | jshell --client <script> [args...]\n";
+    return 2;
+}
+
+// The shell state the rc files left, which every call starts from
+struct ServerBaseline {
+    std::map<std::string, std::string> variables;
+    std::map<std::string, Alias> aliases;
+    size_t next_alias_id = 0;
+    std::vector<std::string> history;
+    std::string previous_directory;
+    
+    explicit ServerBaseline(const ShellState& state)
+        : variables(state.variables), aliases(state.aliases), next_alias_id(state.next_alias_id),
+          history(state.history), previous_directory(state.previous_directory) {}
+    
+    void restore(ShellState& state) const {
+        state.variables = variables;
+        state.aliases = aliases;
+        state.next_alias_id = next_alias_id;
+        state.history = history;
+        state.history_index = history.size();
+        state.previous_directory = previous_directory;
+        state.last_exit_code = 0;
+    }
+};
+
+// Background jobs of a call keep running, but the server stops tracking them
+void forget_jobs(ShellState& state) {
+    for (auto& job : state.jobs) CloseHandle(job->process_handle);
+    state.jobs.clear();
+    state.next_job_id = 1;
+}
+
+// One client, from its request to the exit frame. Variables, aliases,
+// history and jobs go back to what the rc files left, so nothing one client
+// does outlives its call.
+void serve_client(ShellState& state, HANDLE pipe, const ServerBaseline& baseline) {
+    auto request = receive_request(pipe);
+    if (!request) return;
+    
+    baseline.restore(state);
+    apply_environment(request->environment);
+    std::error_code ec;
+    fs::current_path(request->cwd, ec);
+    poll_config_changes(state);
+    
+    // The command gets pipes for its standard handles; pumps turn what it
+    // writes into frames, and a reader turns 'i' frames into its input
+    HANDLE read_handle, write_handle;
+    ScopedHandle out_read, out_write, err_read, err_write, in_read, in_write;
+    if (!CreatePipe(&read_handle, &write_handle, nullptr, static_cast<DWORD>(state.config.pipe_buffer_size))) return;
+    out_read.reset(read_handle);
+    out_write.reset(write_handle);
+    if (!CreatePipe(&read_handle, &write_handle, nullptr, static_cast<DWORD>(state.config.pipe_buffer_size))) return;
+    err_read.reset(read_handle);
+    err_write.reset(write_handle);
+    if (request->forward_input) {
+        if (!CreatePipe(&read_handle, &write_handle, nullptr, static_cast<DWORD>(state.config.pipe_buffer_size))) return;
+        in_read.reset(read_handle);
+        in_write.reset(write_handle);
+    } else {
+        in_read.reset(CreateFileA("NUL", GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING,
+                                  FILE_ATTRIBUTE_NORMAL, nullptr));
+    }
+    
+    std::mutex frame_mutex;
+    auto pump = [&](HANDLE source, char kind) {
+        std::vector<char> block(IO_BLOCK_SIZE);
+        DWORD got = 0;
+        while (ReadFile(source, block.data(), static_cast<DWORD>(block.size()), &got, nullptr) && got > 0) {
+            std::lock_guard<std::mutex> lock(frame_mutex);
+            write_frame(pipe, kind, std::string_view(block.data(), got));
+        }
+    };
+    std::thread out_pump(pump, out_read.get(), 'o');
+    std::thread err_pump(pump, err_read.get(), 'e');
+    std::thread input;
+    if (request->forward_input) {
+        input = std::thread([&]() {
+            char kind;
+            std::string data;
+            while (read_frame(pipe, kind, data) && kind == 'i' && !data.empty()) {
+                if (!write_all(in_write.get(), data)) break;
+            }
+            in_write.reset();
+        });
+    }
+    
+    HANDLE saved[3] = { GetStdHandle(STD_INPUT_HANDLE), GetStdHandle(STD_OUTPUT_HANDLE), GetStdHandle(STD_ERROR_HANDLE) };
+    SetStdHandle(STD_INPUT_HANDLE, in_read.get());
+    SetStdHandle(STD_OUTPUT_HANDLE, out_write.get());
+    SetStdHandle(STD_ERROR_HANDLE, err_write.get());
+    console_output.reattach();
+    builtin_stdin = request->forward_input ? in_read.get() : INVALID_HANDLE_VALUE;  // For builtins like grep
+    detach_background_jobs = true;
+    
+    int exit_code = run_invocation(state, request->args);
+    state.running = true;  // exit ends the call, not the server
+    builtin_stdin = INVALID_HANDLE_VALUE;
+    detach_background_jobs = false;
+    forget_jobs(state);
+    
+    std::cout.flush();
+    std::cerr.flush();
+    SetStdHandle(STD_INPUT_HANDLE, saved[0]);
+    SetStdHandle(STD_OUTPUT_HANDLE, saved[1]);
+    SetStdHandle(STD_ERROR_HANDLE, saved[2]);
+    console_output.reattach();
+    
+    out_write.reset();
+    err_write.reset();
+    in_read.reset();  // An input reader still writing now fails instead of blocking
+    out_pump.join();
+    err_pump.join();
+    
+    std::string code;
+    append_u32(code, static_cast<uint32_t>(exit_code));
+    write_frame(pipe, 'x', code);
+    FlushFileBuffers(pipe);      // Until the client has read everything
+    DisconnectNamedPipe(pipe);   // Also ends an input reader waiting for frames
+    if (input.joinable()) input.join();
+}
+
+int run_server() {
+    std::string name = server_pipe_name();
+    ShellState state;
+    initialize_shell(state);
+    const ServerBaseline baseline(state);
+    
+    CurrentUserSecurity security;
+    if (!security.build()) {
+        const Theme theme;
+        ColorGuard guard(theme.error_color);
+        std::cerr << std::format("jshell: --server: cannot restrict {} to the current user: {}\n", name,
+                                 std::system_category().message(GetLastError()));
+        return 1;
+    }
+    ScopedHandle pipe(CreateNamedPipeA(name.c_str(), PIPE_ACCESS_DUPLEX | FILE_FLAG_FIRST_PIPE_INSTANCE | FILE_FLAG_OVERLAPPED,
+                                       PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+                                       1, 64 * 1024, 64 * 1024, 0, security.attributes()));
+    if (!pipe) {
+        const Theme theme;
+        ColorGuard guard(theme.error_color);
+        std::cerr << std::format("jshell: --server: cannot create {}: {}\n", name,
+                                 std::system_category().message(GetLastError()));
+        return 1;
+    }
+    std::cerr << std::format("jshell: serving on {}\n", name);
+    
+    ScopedHandle connected(CreateEventA(nullptr, TRUE, FALSE, nullptr));
+    while (true) {
+        OVERLAPPED overlapped = {};
+        overlapped.hEvent = connected.get();
+        DWORD unused = 0;
+        if (!ConnectNamedPipe(pipe.get(), &overlapped)) {
+            DWORD error = GetLastError();
+            if (error == ERROR_IO_PENDING) {
+                if (!GetOverlappedResult(pipe.get(), &overlapped, &unused, TRUE)) continue;
+            } else if (error != ERROR_PIPE_CONNECTED) {
+                DisconnectNamedPipe(pipe.get());
+                continue;
+            }
+        }
+        serve_client(state, pipe.get(), baseline);
+        DisconnectNamedPipe(pipe.get());
+    }
+}
+
+// jshell --client -c <command> | <script> [args...]: run in the server, or
+// in this process when no server is listening
+int run_client(const std::vector<std::string>& args) {
+    std::string name = server_pipe_name();
+    ScopedHandle pipe;
+    while (true) {
+        // Identification only: a server may learn who we are but never act as us
+        pipe.reset(CreateFileA(name.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_EXISTING,
+                               FILE_FLAG_OVERLAPPED | SECURITY_SQOS_PRESENT | SECURITY_IDENTIFICATION, nullptr));
+        if (pipe || GetLastError() != ERROR_PIPE_BUSY) break;
+        WaitNamedPipeA(name.c_str(), NMPWAIT_WAIT_FOREVER);  // Another client is being served
+    }
+    if (!pipe) {
+        ShellState state;
+        initialize_shell(state);
+        return run_invocation(state, args);
+    }
+    if (!server_is_current_user(pipe.get())) {
+        const Theme theme;
+        ColorGuard guard(theme.error_color);
+        std::cerr << std::format("jshell: --client: {} is not served by the current user; not connecting\n", name);
+        return 1;
+    }
+    
+    ServerRequest request;
+    request.cwd = fs::current_path().string();
+    request.args = args;
+    request.environment = current_environment();
+    HANDLE input = GetStdHandle(STD_INPUT_HANDLE);
+    request.forward_input = input != INVALID_HANDLE_VALUE && input != nullptr && GetFileType(input) != FILE_TYPE_CHAR;
+    if (!send_request(pipe.get(), request)) return 1;
+    
+    // Console input is not forwarded: the read would wait for a key the
+    // command may never want
+    if (request.forward_input) {
+        std::thread([pipe = pipe.get(), input]() {
+            std::vector<char> block(IO_BLOCK_SIZE);
+            DWORD got = 0;
+            while (ReadFile(input, block.data(), static_cast<DWORD>(block.size()), &got, nullptr) && got > 0) {
+                if (!write_frame(pipe, 'i', std::string_view(block.data(), got))) return;
+            }
+            write_frame(pipe, 'i', "");
+        }).detach();
+    }
+    
+    std::cout.flush();
+    HANDLE output = GetStdHandle(STD_OUTPUT_HANDLE);
+    HANDLE errors = GetStdHandle(STD_ERROR_HANDLE);
+    char kind;
+    std::string data;
+    while (read_frame(pipe.get(), kind, data)) {
+        if (kind == 'o') write_all(output, data);
+        else if (kind == 'e') write_all(errors, data);
+        else if (kind == 'x' && data.size() == 4) return static_cast<int>(read_u32(data.data()));
+    }
+    
+    const Theme theme;
+    ColorGuard guard(theme.error_color);
+    std::cerr << "jshell: --client: the server closed the connection\n";
+    return 1;
+}
+
+// --- Output Benchmark ---
+// jshell --bench-output [lines] writes builtin-style formatted lines to the
+// console, a pipe and a file. Each target is written twice: through a
+// ConsoleWriter with the policy it picks for that target, and with a flush
+// after every line, which is what unbuffered line output costs. Results go
+// to stderr so they stay readable when stdout is the console under test.
+int benchmark_output(size_t lines) {
+    struct Target {
+        std::string name;
+        HANDLE handle;
+    };
+    
+    // Pipe target: a reader thread drains and discards
+    HANDLE pipe_read = INVALID_HANDLE_VALUE, pipe_write = INVALID_HANDLE_VALUE;
+    if (!CreatePipe(&pipe_read, &pipe_write, nullptr, 64 * 1024)) {
+        std::cerr << "jshell: --bench-output: CreatePipe failed\n";
+        return 1;
+    }
+    ScopedHandle pipe_in(pipe_read), pipe_out(pipe_write);
+    std::thread drain([&]() {
+        std::vector<char> block(64 * 1024);
+        DWORD got = 0;
+        while (ReadFile(pipe_in.get(), block.data(), static_cast<DWORD>(block.size()), &got, nullptr) && got > 0) {}
+    });
+    
+    std::string file_path = (fs::temp_directory_path() / std::format("jshell-bench-{}.out", GetCurrentProcessId())).string();
+    ScopedHandle file(CreateFileA(file_path.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+                                  FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, nullptr));
+    
+    std::vector<Target> targets;
+    if (stdout_is_console()) targets.push_back({"console", GetStdHandle(STD_OUTPUT_HANDLE)});
+    targets.push_back({"pipe", pipe_out.get()});
+    if (file) targets.push_back({"file", file.get()});
+    
+    std::vector<std::string> results;
+    for (const auto& target : targets) {
+        for (bool per_line : {false, true}) {
+            ConsoleWriter writer;
+            writer.attach(target.handle);
+            std::ostream out(&writer);
+            
+            size_t bytes = 0;
+            auto start = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < lines; ++i) {
+                std::string line = std::format("{:>8}  -rw-r--r--  {:>10}  benchmark-output-line-{}.txt\n", i, i * 37, i);
+                bytes += line.size();
+                out << line;
+                if (per_line) out.flush();
+            }
+            out.flush();
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            
+            double seconds = std::max(elapsed.count(), 1e-9);
+            results.push_back(std::format("{:<8} {:<10} {:>12.0f} lines/s {:>9.1f} MB/s", target.name,
+                                          per_line ? "per-line" : "adaptive", lines / seconds,
+                                          bytes / seconds / (1024 * 1024)));
+        }
+    }
+    
+    pipe_out.reset();  // Ends the drain thread
+    drain.join();
+    
+    std::cerr << std::format("\nOutput benchmark, {} lines per run:\n", lines);
+    for (const auto& result : results) std::cerr << result << '\n';
+    return 0;
+}
+
+// --- Spawn Benchmark ---
+// jshell --bench-spawn [count] times launching `cmd /c exit` through
+// launch_process while the shell's working set grows, 256 MB at a time.
+// CreateProcess builds the child from the image rather than copying the
+// parent, so the times should stay flat; a rising column points at
+// something that scales with the shell, such as inherited handles.
+int benchmark_spawn(size_t count) {
+    if (find_executable("cmd").empty()) {
+        std::cerr << "jshell: --bench-spawn: cmd not found\n";
+        return 1;
+    }
+    Command cmd;
+    cmd.args = {"cmd", "/c", "exit"};
+    
+    struct Result {
+        double working_set_mb;
+        double mean_ms;
+        double worst_ms;
+    };
+    std::vector<Result> results;
+    std::vector<std::unique_ptr<char[]>> ballast;
+    constexpr size_t STEP = 256 << 20;
+    
+    for (int step = 0; step <= 4; ++step) {
+        if (step > 0) {
+            try {
+                ballast.push_back(std::make_unique<char[]>(STEP));
+                std::memset(ballast.back().get(), 1, STEP);  // Touch every page so it is resident
+            } catch (const std::bad_alloc&) {
+                break;
+            }
+        }
+        
+        PROCESS_MEMORY_COUNTERS memory = {};
+        memory.cb = sizeof(memory);
+        GetProcessMemoryInfo(GetCurrentProcess(), &memory, sizeof(memory));
+        
+        double total = 0, worst = 0;
+        for (size_t i = 0; i < count; ++i) {
+            auto start = std::chrono::steady_clock::now();
+            launch_process(cmd, INVALID_HANDLE_VALUE, INVALID_HANDLE_VALUE, INVALID_HANDLE_VALUE);
+            std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+            total += elapsed.count();
+            worst = std::max(worst, elapsed.count());
+        }
+        results.push_back({memory.WorkingSetSize / (1024.0 * 1024.0), total / std::max<size_t>(count, 1), worst});
+    }
+    
+    double longest = 0;
+    for (const auto& result : results) longest = std::max(longest, result.mean_ms);
+    
+    std::cerr << std::format("\nSpawn benchmark, {} launches per row:\n", count);
+    std::cerr << "  shell MB   mean ms   worst ms\n";
+    for (const auto& result : results) {
+        size_t bar = longest > 0 ? static_cast<size_t>(result.mean_ms / longest * 40 + 0.5) : 0;
+        std::cerr << std::format("{:>10.0f} {:>9.2f} {:>10.2f}  {}\n", result.working_set_mb, result.mean_ms,
+                                 result.worst_ms, std::string(bar, '#'));
+    }
+    return 0;
 }
 
 } // namespace jshell
@@ -3190,6 +9764,8 @@ SectionEnd)";
 
 // --- Main Function ---
 int main(int argc, char** argv) {
+   jshell::console_output.install();
+   
    if (argc > 1) {
         std::string arg1 = argv[1];
         if (arg1 == "--generate-nsis") {
@@ -3201,6 +9777,20 @@ int main(int argc, char** argv) {
             jshell::version(dummy_state, {});
             return 0; 
         }
+        if (arg1 == "--bench-output") {
+            size_t lines = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 200000;
+            return jshell::benchmark_output(lines > 0 ? lines : 200000);
+        }
+        if (arg1 == "--bench-spawn") {
+            size_t count = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 50;
+            return jshell::benchmark_spawn(count > 0 ? count : 50);
+        }
+        if (arg1 == "--server") {
+            return jshell::run_server();
+        }
+        if (arg1 == "--client") {
+            return jshell::run_client(std::vector<std::string>(argv + 2, argv + argc));
+        }
     }
 
    try {